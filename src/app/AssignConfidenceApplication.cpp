@@ -9,6 +9,7 @@
 #include "io/MatchCollectionParser.h"
 #include "PosteriorEstimator.h"
 #include "util/FileUtils.h"
+#include "util/Metrics.h"
 #include "util/Params.h"
 #include "util/StringUtils.h"
 
@@ -197,6 +198,7 @@ int AssignConfidenceApplication::main(const vector<string>& input_files) {
     }
 
     carp(CARP_INFO, "Found %d PSMs in %s.", match_collection->getMatchTotal(), target_path.c_str());
+    Metrics::Add("assign-confidence.psms-read", match_collection->getMatchTotal());
 
     // If necessary, automatically identify the score type.
     // The score type that is used is the first one found
@@ -266,6 +268,7 @@ int AssignConfidenceApplication::main(const vector<string>& input_files) {
     if (decoy_path != "") {
       MatchCollection* temp_collection = parser.create(decoy_path, Params::GetString("protein-database"));
       carp(CARP_INFO, "Found %d PSMs in %s.", temp_collection->getMatchTotal(), decoy_path.c_str());
+      Metrics::Add("assign-confidence.psms-read", temp_collection->getMatchTotal());
 
       if (temp_collection->hasDecoyIndexes()) {
         avgTdc = true;
@@ -603,6 +606,7 @@ int AssignConfidenceApplication::main(const vector<string>& input_files) {
   vector<FLOAT_T> target_scores;
 
   // Compute q-values.
+  Metrics::Timer qvalue_timer("assign-confidence.compute-qvalues");
   vector<FLOAT_T> qvalues;
   switch (estimation_method) {
   case TDC_METHOD:
@@ -644,6 +648,8 @@ int AssignConfidenceApplication::main(const vector<string>& input_files) {
       carp(CARP_FATAL, "No estimation method specified.");
   }
 
+  qvalue_timer.Stop();
+
   unsigned int fdr1 = 0;
   unsigned int fdr5 = 0;
   unsigned int fdr10 = 0;
@@ -45,7 +45,8 @@ int CometApplication::main(const vector<string>& input_files) {
     }
   }
 
-  /* Re-route stderr to log file */
+  /* Re-route stderr to log file, after what carp has queued so far */
+  carp_flush();
   CarpStreamBuf buffer;
   streambuf* old = std::cerr.rdbuf();
   std::cerr.rdbuf(&buffer);
@@ -59,6 +60,7 @@ int CometApplication::main(const vector<string>& input_files) {
   bool success = searchManager_.DoSearch();
 
   /* Recover stderr */
+  carp_flush();
   std::cerr.rdbuf(old);
 
   return success ? 0 : 1;
@@ -455,7 +457,8 @@ vector<string> CometApplication::getOptions() const {
     "pm-pair-top-n-frag-peaks",
     "pm-min-common-frag-peaks",
     "pm-max-scan-separation",
-    "pm-min-peak-pairs"
+    "pm-min-peak-pairs",
+    "pm-early-stop"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
 }
@@ -7,13 +7,19 @@
 #include "CruxApplicationList.h"
 #include "io/carp.h"
 #include "util/crux-utils.h"
+#include "util/Metrics.h"
 #include "util/Params.h"
 #include "util/StringUtils.h"
 
 #include <iostream>
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
 
 using namespace std;
 
+string CruxApplicationList::executable_;
+
 /**
  * Creates an application list with a listname
  */
@@ -123,6 +129,7 @@ void CruxApplicationList::usage() {
 
   }
 
+  carp_flush();
   cerr << " Usage: " << list_name_ << " <command> [options] <argument>" << endl;
 
   for (unsigned int i = 0; i < applications_.size(); ++i) {
@@ -207,10 +214,12 @@ int CruxApplicationList::main(int argc, char** argv) {
     return -1;
   }
 
+  executable_ = argv[0];
   string appname = string(argv[1]);
   CruxApplication* crux_application = find(appname);
 
   if (crux_application == NULL) {
+    carp_flush();
     cerr << "Cannot find " << appname << " in available applications" << endl;
     usage();
     return -1;
@@ -219,9 +228,36 @@ int CruxApplicationList::main(int argc, char** argv) {
   crux_application->initialize(argc-1, argv+1);
   int ret = crux_application->main(argc-1, argv+1);
 
+  if (crux_application->needsOutputDirectory()) {
+    string metricsFile = make_file_path(crux_application->getFileStem() + ".metrics.json");
+    string commandLine = argv[0];
+    for (int i = 1; i < argc; i++) {
+      commandLine += ' ';
+      commandLine += argv[i];
+    }
+    if (!Metrics::Write(metricsFile, commandLine)) {
+      carp(CARP_WARNING, "Could not write %s", metricsFile.c_str());
+    }
+  }
   carp(CARP_INFO, "Elapsed time: %.3g s", wall_clock() / 1e6);
   carp(CARP_INFO, "Finished crux %s.", appname.c_str());
   carp(CARP_INFO, "Return Code:%i", ret);
 
   return ret;
 }
+
+/**
+ * \returns the path of the running crux executable, for applications that
+ * run crux commands of their own
+ */
+string CruxApplicationList::getExecutable() {
+#ifdef __linux__
+  // argv[0] may be relative, or only a name found on the PATH
+  char path[4096];
+  ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+  if (length > 0) {
+    return string(path, length);
+  }
+#endif
+  return executable_;
+}
@@ -21,6 +21,7 @@ class CruxApplicationList {
   std::vector<CruxApplication*> applications_; ///< list of applications
   std::map<int, std::string> messages_; ///< messages and their indexes
   std::string list_name_; ///<Name of this list
+  static std::string executable_; ///< argv[0] of the running crux
 
  public:
   /**
@@ -91,6 +92,12 @@ class CruxApplicationList {
    * calls that applications main method with the rest of the parameters.
    */
   int main(int argc, char** argv);
+
+  /**
+   * \returns the path of the running crux executable, for applications that
+   * run crux commands of their own
+   */
+  static std::string getExecutable();
 };
 
 
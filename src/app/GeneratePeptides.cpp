@@ -8,6 +8,23 @@
 
 using namespace std;
 
+namespace {
+
+// Checks candidate decoys against a target set and a decoy set
+class SetPairLookup : public GeneratePeptides::SequenceLookup {
+ public:
+  SetPairLookup(const set<string>& first, const set<string>& second)
+    : first_(first), second_(second) {}
+  virtual bool contains(const string& seq) const {
+    return first_.find(seq) != first_.end() || second_.find(seq) != second_.end();
+  }
+ private:
+  const set<string>& first_;
+  const set<string>& second_;
+};
+
+}
+
 MASS_TYPE_T GeneratePeptides::massType_ = AVERAGE;
 
 GeneratePeptides::GeneratePeptides() {
@@ -408,6 +425,20 @@ bool GeneratePeptides::makeDecoy(
   const set<string>& decoySeqs,  ///< decoys to check against
   bool shuffle, ///< shuffle (if false, reverse)
   string& decoyOut  ///< string to store decoy
+) {
+  SetPairLookup excluded(targetSeqs, decoySeqs);
+  return makeDecoy(seq, &excluded, shuffle, decoyOut);
+}
+
+/**
+ * Makes a decoy from the sequence, rejecting decoys found in excluded.
+ * Returns false on failure, and decoyOut will be the same as seq.
+ */
+bool GeneratePeptides::makeDecoy(
+  const string& seq,  ///< sequence to make decoy from
+  const SequenceLookup* excluded,  ///< sequences to check against, or NULL
+  bool shuffle, ///< shuffle (if false, reverse)
+  string& decoyOut  ///< string to store decoy
 ) {
   const string keepTerminal = Params::GetString("keep-terminal-aminos");
   string decoyPre, decoyPost;
@@ -446,8 +477,7 @@ bool GeneratePeptides::makeDecoy(
       // Re-add n/c
       string decoyCheck = decoyPre + decoyOut + decoyPost;
       // Check in sets
-      if (targetSeqs.find(decoyCheck) == targetSeqs.end() &&
-          decoySeqs.find(decoyCheck) == decoySeqs.end()) {
+      if (!excluded || !excluded->contains(decoyCheck)) {
         decoyOut = decoyCheck;
         return true;
       }
@@ -460,8 +490,7 @@ bool GeneratePeptides::makeDecoy(
     // Re-add n/c
     string decoyCheck = decoyPre + decoyOut + decoyPost;
     // Check in sets
-    if (targetSeqs.find(decoyCheck) == targetSeqs.end() &&
-        decoySeqs.find(decoyCheck) == decoySeqs.end()) {
+    if (!excluded || !excluded->contains(decoyCheck)) {
       decoyOut = decoyCheck;
       return true;
     }
@@ -41,6 +41,15 @@ class GeneratePeptides : public CruxApplication {
     unsigned int position_;
   };
 
+  /**
+   * Set of sequences that a decoy must not collide with
+   */
+  class SequenceLookup {
+   public:
+    virtual ~SequenceLookup() {}
+    virtual bool contains(const std::string& seq) const = 0;
+  };
+
   /**
    * Constructor
    */
@@ -104,6 +113,17 @@ class GeneratePeptides : public CruxApplication {
     std::string& decoyOut ///< string to store decoy
   );
 
+  /**
+   * Makes a decoy from the sequence, rejecting decoys found in excluded.
+   * Returns false on failure, and decoyOut will be the same as seq.
+   */
+  static bool makeDecoy(
+    const std::string& seq, ///< sequence to make decoy from
+    const SequenceLookup* excluded, ///< sequences to check against, or NULL
+    bool shuffle, ///< shuffle (if false, reverse)
+    std::string& decoyOut ///< string to store decoy
+  );
+
   /**
    * Shuffles the peptide sequence.
    * Returns false if no different sequence was generated
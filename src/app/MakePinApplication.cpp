@@ -14,6 +14,23 @@
 
 using namespace std;
 
+PinMatchTable::PinMatchTable() : parser(NULL) {
+}
+
+PinMatchTable::~PinMatchTable() {
+  for (map<string, Crux::Match*>::iterator i = matches.begin(); i != matches.end(); i++) {
+    if (i->second != NULL) {
+      Crux::Match::freeMatch(i->second);
+    }
+  }
+  delete parser;
+}
+
+Crux::Match* PinMatchTable::getMatch(const string& spec_id) const {
+  map<string, Crux::Match*>::const_iterator i = matches.find(spec_id);
+  return i != matches.end() ? i->second : NULL;
+}
+
 /**
  * \returns a blank PercolatorApplication object
  */
@@ -39,8 +56,16 @@ int MakePinApplication::main(int argc, char** argv) {
  * \runs make-pin application
  */
 int MakePinApplication::main(const vector<string>& paths) {
+  return main(paths, NULL, NULL);
+}
+
+int MakePinApplication::main(
+  const vector<string>& paths,
+  ostream* pin_stream,
+  PinMatchTable* table
+) {
   //create MatchColletion 
-  MatchCollectionParser parser;
+  MatchCollectionParser* parser = new MatchCollectionParser();
 
   if (paths.empty()) {
     carp(CARP_FATAL, "No search paths found!");
@@ -56,7 +81,7 @@ int MakePinApplication::main(const vector<string>& paths) {
       SQTReader::readSymbols(*iter);
     }
 
-    MatchCollection* current_collection = parser.create(iter->c_str(), "");
+    MatchCollection* current_collection = parser->create(iter->c_str(), "");
     if (!target_collection->getHasDistinctMatches() && current_collection->getHasDistinctMatches()) {
       target_collection->setHasDistinctMatches(true);
       decoy_collection->setHasDistinctMatches(true);
@@ -97,17 +122,24 @@ int MakePinApplication::main(const vector<string>& paths) {
   }
 
   //prepare output file 
-  string output_filename = Params::GetString("output-file");
-  if (output_filename.empty()) {
-    string fileroot = Params::GetString("fileroot");
-    if (!fileroot.empty()) {
-      fileroot += ".";
+  PinWriter writer;
+  if (pin_stream != NULL) {
+    writer.openStream(pin_stream);
+  } else {
+    string output_filename = Params::GetString("output-file");
+    if (output_filename.empty()) {
+      string fileroot = Params::GetString("fileroot");
+      if (!fileroot.empty()) {
+        fileroot += ".";
+      }
+      output_filename = fileroot + "make-pin.pin";
     }
-    output_filename = fileroot + "make-pin.pin";
+    writer.openFile(output_filename, Params::GetString("output-dir"),
+                    Params::GetBool("overwrite"));
+  }
+  if (table != NULL) {
+    writer.setMatchIdTable(&table->matches);
   }
-  PinWriter writer;
-  writer.openFile(output_filename, Params::GetString("output-dir"),
-                  Params::GetBool("overwrite"));
 
   for (int i = 1; i <= max_charge; i++) {
     writer.setEnabledStatus("Charge" + StringUtils::ToString(i), true);
@@ -141,6 +173,11 @@ int MakePinApplication::main(const vector<string>& paths) {
 
   delete target_collection;
   delete decoy_collection;
+  if (table != NULL) {
+    table->parser = parser;
+  } else {
+    delete parser;
+  }
 
   return 0;
 }
@@ -12,9 +12,36 @@
 #include <string>
 #include <fstream>
 #include <string>
+#include <map>
+#include <vector>
 
 using namespace std;
 
+class MatchCollectionParser;
+namespace Crux {
+  class Match;
+}
+
+/**
+ * Matches behind an in-memory pin, keyed by the SpecId they were written
+ * with. The parser is kept alive with them because it owns the proteins
+ * their peptides point into.
+ */
+class PinMatchTable {
+ public:
+  PinMatchTable();
+  ~PinMatchTable();
+
+  /**
+   * \returns the match written with the given SpecId, or NULL if no single
+   * match was
+   */
+  Crux::Match* getMatch(const std::string& spec_id) const;
+
+  std::map<std::string, Crux::Match*> matches;
+  MatchCollectionParser* parser;
+};
+
 class MakePinApplication: public CruxApplication {
 
  public:
@@ -39,6 +66,16 @@ class MakePinApplication: public CruxApplication {
    */
   static int main(const std::vector<std::string>& paths);
 
+  /**
+   * runs make-pin application, writing the pin to a stream and recording
+   * the matches by SpecId rather than writing a pin file
+   */
+  static int main(
+    const std::vector<std::string>& paths,
+    std::ostream* pin_stream,
+    PinMatchTable* table
+  );
+
   /**
    * \returns the command name for MakePinApplication
    */
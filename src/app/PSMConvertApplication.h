@@ -8,6 +8,7 @@
 #include <iomanip>
 #include <gflags/gflags.h>
 #include <string>
+#include <vector>
 
 using namespace std;
 
@@ -34,6 +35,8 @@ class PSMConvertApplication : public CruxApplication {
    * Perform Convert
    */
   virtual void convertFile(string input_format, string output_format, string input_file, string output_file_base, string database_file, bool distinct_matches);
+
+  virtual void convertFile(string input_format, const vector<string>& output_formats, string input_file, string output_file_base, string database_file, bool distinct_matches);
   
   /**
    * Returns the command name
@@ -9,6 +9,8 @@
 #include <cmath>
 #include <fstream>
 #include <numeric>
+#include "boost/random/uniform_int_distribution.hpp"
+#include "boost/thread.hpp"
 
 using namespace Crux;
 using namespace std;
@@ -36,6 +38,70 @@ const double MIN_SIGMA_TH = 0.00001;
 // we might be looking at profile-mode data
 const double PROPORTION_MASSBINS_MULTIPEAK_PROFILE = 0.5;
 
+// number of spectra handed from the parser to the detectors at a time
+const size_t SPECTRUM_BATCH_SIZE = 1024;
+
+// with pm-early-stop, refit the error distributions every this many batches,
+// and stop once both sigmas have moved by less than the relative tolerance
+// in this many consecutive refits
+const int BATCHES_PER_STABILITY_CHECK = 4;
+const double STABLE_SIGMA_TOLERANCE = 0.01;
+const int STABLE_CHECKS_REQUIRED = 2;
+
+// seed of the generators that sample peak pairs with pm-early-stop; they are
+// private to the sampling, so results do not depend on thread timing
+const unsigned PAIR_SAMPLE_SEED = 1;
+
+// add an item to a uniform sample of at most MAX_PEAKPAIRS items, where
+// numSeen counts all items offered so far, including this one
+template<typename T>
+static void reservoirAdd(vector<T>* reservoir, const T& item, int numSeen,
+                         boost::mt19937* rng) {
+  if (reservoir->size() < MAX_PEAKPAIRS) {
+    reservoir->push_back(item);
+    return;
+  }
+  int slot = boost::random::uniform_int_distribution<>(0, numSeen - 1)(*rng);
+  if (slot < MAX_PEAKPAIRS) {
+    (*reservoir)[slot] = item;
+  }
+}
+
+// append a random share of a reservoir sample to a combined sample
+template<typename T>
+static void appendShare(vector<T>* combined, const vector<T>& reservoir, size_t share,
+                        boost::mt19937* rng) {
+  if (share >= reservoir.size()) {
+    combined->insert(combined->end(), reservoir.begin(), reservoir.end());
+    return;
+  }
+  vector<T> shuffled(reservoir);
+  for (size_t i = 0; i < share; i++) {
+    size_t j = boost::random::uniform_int_distribution<size_t>(i, shuffled.size() - 1)(*rng);
+    swap(shuffled[i], shuffled[j]);
+  }
+  combined->insert(combined->end(), shuffled.begin(), shuffled.begin() + share);
+}
+
+// split MAX_PEAKPAIRS into shares proportional to counts, handing the
+// remainder of the rounded-down shares to the largest fractions
+static vector<size_t> proportionalShares(const vector<int>& counts, int total) {
+  vector<size_t> shares(counts.size());
+  vector< pair<double, size_t> > fractions;
+  size_t assigned = 0;
+  for (size_t i = 0; i < counts.size(); i++) {
+    double exact = (double)MAX_PEAKPAIRS * counts[i] / total;
+    shares[i] = (size_t)exact;
+    assigned += shares[i];
+    fractions.push_back(make_pair(-(exact - shares[i]), i));
+  }
+  stable_sort(fractions.begin(), fractions.end());
+  for (size_t i = 0; assigned < MAX_PEAKPAIRS && i < fractions.size(); i++, assigned++) {
+    shares[fractions[i].second]++;
+  }
+  return shares;
+}
+
 ParamMedicApplication::ParamMedicApplication() {
 }
 
@@ -237,7 +303,9 @@ vector<string> ParamMedicApplication::getOptions() const {
     "pm-pair-top-n-frag-peaks",
     "pm-min-common-frag-peaks",
     "pm-max-scan-separation",
-    "pm-min-peak-pairs"
+    "pm-min-peak-pairs",
+    "pm-early-stop",
+    "num-threads"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
 }
@@ -377,7 +445,7 @@ const vector<Modification>& RunAttributeResult::getMods() const {
 const string RunAttributeResult::ERROR_MESSAGE = "ERROR";
 
 ErrorCalc::ErrorCalc():
-  numTotalSpectra_(0) {
+  numTotalSpectra_(0), samplePairs_(Params::GetBool("pm-early-stop")) {
   vector<string> chargeStrings = StringUtils::Split(Params::GetString("pm-charges"), ',');
   for (vector<string>::const_iterator i = chargeStrings.begin(); i != chargeStrings.end(); i++) {
     int charge = StringUtils::FromString<int>(StringUtils::Trim(*i));
@@ -430,8 +498,8 @@ void ErrorCalc::calcMassErrorDist(
     carp(CARP_INFO, "  charge %d", charge);
     carp(CARP_INFO, "Processed %d qualifying spectra", calc->getNumPassingSpectra());
 
-    size_t precursorPairs = calc->getPairedPrecursorMzs().size();
-    size_t fragmentPairs = calc->getPairedFragmentPeaks().size();
+    int precursorPairs = calc->getNumPairedPrecursorMzs();
+    int fragmentPairs = calc->getNumPairedFragmentPeaks();
     carp(CARP_INFO, "Precursor pairs: %d", precursorPairs);
     carp(CARP_INFO, "Fragment pairs: %d", fragmentPairs);
     if (charge > 0 && precursorPairs > 0) {
@@ -467,32 +535,22 @@ void ErrorCalc::calcMassErrorDist(
   vector< pair<Peak, Peak> > pairedFragmentPeaks;
   if (hasNonZeroChargePairs) {
     carp(CARP_INFO, "Found paired spectra from known charges, so using those.");
-    for (map<int, PerChargeErrorCalc*>::const_iterator i = calcs_.begin(); i != calcs_.end(); i++) {
-      if (i->first < 1) {
-        continue;
-      }
-      const vector< pair<double, double> >& calcPairedPrecursors =
-        i->second->getPairedPrecursorMzs();
-      const vector< pair<Peak, Peak> >& calcPairedFragments =
-        i->second->getPairedFragmentPeaks();
-      pairedPrecursorMzs.insert(pairedPrecursorMzs.end(),
-                                calcPairedPrecursors.begin(), calcPairedPrecursors.end());
-      pairedFragmentPeaks.insert(pairedFragmentPeaks.end(),
-                                 calcPairedFragments.begin(), calcPairedFragments.end());
-    }
   } else {
     carp(CARP_INFO, "Did not find spectra from known charges, so looking for "
                     "unknown-charge spectra.");
-    map<int, PerChargeErrorCalc*>::const_iterator lookup = calcs_.find(0);
-    pairedPrecursorMzs = lookup->second->getPairedPrecursorMzs();
-    pairedFragmentPeaks = lookup->second->getPairedFragmentPeaks();
   }
-
+  int numPrecursorPairs, numFragmentPairs;
+  samplePairs(hasNonZeroChargePairs, &pairedPrecursorMzs, &pairedFragmentPeaks,
+              &numPrecursorPairs, &numFragmentPairs);
   if (pairedPrecursorMzs.size() > MAX_PEAKPAIRS) {
+    // every pair was kept (see samplePairs)
     carp(CARP_INFO, "Reducing %d to %d peak pairs for precursor...",
          pairedPrecursorMzs.size(), MAX_PEAKPAIRS);
     random_shuffle(pairedPrecursorMzs.begin(), pairedPrecursorMzs.end(), myrandom_limit);
     pairedPrecursorMzs.resize(MAX_PEAKPAIRS);
+  } else if (numPrecursorPairs > pairedPrecursorMzs.size()) {
+    carp(CARP_INFO, "Reducing %d to %d peak pairs for precursor...",
+         numPrecursorPairs, pairedPrecursorMzs.size());
   }
 
   vector<double> precursorDistancesPpm;
@@ -568,6 +626,9 @@ void ErrorCalc::calcMassErrorDist(
            pairedFragmentPeaks.size(), MAX_PEAKPAIRS);
       random_shuffle(pairedFragmentPeaks.begin(), pairedFragmentPeaks.end(), myrandom_limit);
       pairedFragmentPeaks.resize(MAX_PEAKPAIRS);
+    } else if (numFragmentPairs > pairedFragmentPeaks.size()) {
+      carp(CARP_DEBUG, "Reducing %d to %d peak pairs for fragment...",
+           numFragmentPairs, pairedFragmentPeaks.size());
     }
     vector<double> fragmentDistancesTh;
     vector<double> fragmentDistancesPpm;
@@ -622,6 +683,89 @@ void ErrorCalc::calcMassErrorDist(
   }
 }
 
+bool ErrorCalc::hasKnownChargePairs() const {
+  for (map<int, PerChargeErrorCalc*>::const_iterator i = calcs_.begin(); i != calcs_.end(); i++) {
+    if (i->first > 0 && i->second->getNumPairedPrecursorMzs() > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ErrorCalc::samplePairs(
+  bool knownCharges,
+  vector< pair<double, double> >* pairedPrecursorMzs,
+  vector< pair<Peak, Peak> >* pairedFragmentPeaks,
+  int* numPrecursorPairs,
+  int* numFragmentPairs
+) const {
+  vector<const PerChargeErrorCalc*> used;
+  for (map<int, PerChargeErrorCalc*>::const_iterator i = calcs_.begin(); i != calcs_.end(); i++) {
+    if (knownCharges ? i->first >= 1 : i->first == 0) {
+      used.push_back(i->second);
+    }
+  }
+  *numPrecursorPairs = *numFragmentPairs = 0;
+  vector<int> precursorCounts, fragmentCounts;
+  for (vector<const PerChargeErrorCalc*>::const_iterator i = used.begin(); i != used.end(); i++) {
+    precursorCounts.push_back((*i)->getNumPairedPrecursorMzs());
+    fragmentCounts.push_back((*i)->getNumPairedFragmentPeaks());
+    *numPrecursorPairs += precursorCounts.back();
+    *numFragmentPairs += fragmentCounts.back();
+  }
+  if (!samplePairs_) {
+    // every pair was kept; the caller samples them as it always has
+    for (vector<const PerChargeErrorCalc*>::const_iterator i = used.begin(); i != used.end(); i++) {
+      const vector< pair<double, double> >& precursors = (*i)->getPairedPrecursorMzs();
+      const vector< pair<Peak, Peak> >& fragments = (*i)->getPairedFragmentPeaks();
+      pairedPrecursorMzs->insert(pairedPrecursorMzs->end(), precursors.begin(), precursors.end());
+      pairedFragmentPeaks->insert(pairedFragmentPeaks->end(), fragments.begin(), fragments.end());
+    }
+    return;
+  }
+  // each charge contributes in proportion to the pairs it has seen
+  vector<size_t> precursorShares = proportionalShares(precursorCounts, *numPrecursorPairs);
+  vector<size_t> fragmentShares = proportionalShares(fragmentCounts, *numFragmentPairs);
+  boost::mt19937 rng(PAIR_SAMPLE_SEED);
+  for (size_t i = 0; i < used.size(); i++) {
+    size_t precursorShare = *numPrecursorPairs <= MAX_PEAKPAIRS
+      ? used[i]->getPairedPrecursorMzs().size() : precursorShares[i];
+    size_t fragmentShare = *numFragmentPairs <= MAX_PEAKPAIRS
+      ? used[i]->getPairedFragmentPeaks().size() : fragmentShares[i];
+    appendShare(pairedPrecursorMzs, used[i]->getPairedPrecursorMzs(), precursorShare, &rng);
+    appendShare(pairedFragmentPeaks, used[i]->getPairedFragmentPeaks(), fragmentShare, &rng);
+  }
+}
+
+bool ErrorCalc::estimateSigmas(double* precursorSigmaPpm, double* fragmentSigmaPpm) const {
+  vector< pair<double, double> > pairedPrecursorMzs;
+  vector< pair<Peak, Peak> > pairedFragmentPeaks;
+  int numPrecursorPairs, numFragmentPairs;
+  samplePairs(hasKnownChargePairs(), &pairedPrecursorMzs, &pairedFragmentPeaks,
+              &numPrecursorPairs, &numFragmentPairs);
+  int minPairs = Params::GetInt("pm-min-peak-pairs");
+  if (pairedPrecursorMzs.size() < minPairs || pairedFragmentPeaks.size() < minPairs) {
+    return false;
+  }
+  vector<double> precursorDistancesPpm;
+  for (vector< pair<double, double> >::const_iterator i = pairedPrecursorMzs.begin();
+       i != pairedPrecursorMzs.end();
+       i++) {
+    precursorDistancesPpm.push_back((i->first - i->second) * MILLION / i->first);
+  }
+  vector<double> fragmentDistancesPpm;
+  for (vector< pair<Peak, Peak> >::const_iterator i = pairedFragmentPeaks.begin();
+       i != pairedFragmentPeaks.end();
+       i++) {
+    double diffTh = i->first.getLocation() - i->second.getLocation();
+    fragmentDistancesPpm.push_back(diffTh * MILLION / i->first.getLocation());
+  }
+  double mu;
+  estimateMuSigma(precursorDistancesPpm, MIN_SIGMA_PPM, &mu, precursorSigmaPpm);
+  estimateMuSigma(fragmentDistancesPpm, MIN_SIGMA_PPM, &mu, fragmentSigmaPpm);
+  return true;
+}
+
 RunAttributeResult ErrorCalc::summarize() const {
   string precursorFailure, fragmentFailure;
   double precursorSigmaPpm, fragmentSigmaPpm, precursorPredictionPpm, fragmentPredictionTh;
@@ -668,7 +812,18 @@ const string ErrorCalc::KEY_FRAGMENT_PREDICTION  = "fragment_prediction_th";
 PerChargeErrorCalc::PerChargeErrorCalc(int charge):
   charge_(charge), chargeForBinSize_(charge > 0 ? charge : 4), numTotalSpectra_(0),
   numPassingSpectra_(0), numSpectraSameBin_(0), numSpectraWithinPpm_(0),
-  numSpectraWithinPpmAndScans_(0), numMultipleFragBins_(0), numSingleFragBins_(0) {
+  numSpectraWithinPpmAndScans_(0), numMultipleFragBins_(0), numSingleFragBins_(0),
+  numPairedFragmentPeaks_(0), numPairedPrecursorMzs_(0),
+  samplePairs_(Params::GetBool("pm-early-stop")), rng_(PAIR_SAMPLE_SEED + charge),
+  minScanFragPeaks_(Params::GetInt("pm-min-scan-frag-peaks")),
+  minPrecursorMz_(Params::GetDouble("pm-min-precursor-mz")),
+  maxPrecursorMz_(Params::GetDouble("pm-max-precursor-mz")),
+  topNFragPeaks_(Params::GetInt("pm-top-n-frag-peaks")),
+  maxPrecursorDeltaPpm_(Params::GetDouble("pm-max-precursor-delta-ppm")),
+  maxScanSeparation_(Params::GetInt("pm-max-scan-separation")),
+  minCommonFragPeaks_(Params::GetInt("pm-min-common-frag-peaks")),
+  pairTopNFragPeaks_(Params::GetInt("pm-pair-top-n-frag-peaks")),
+  minFragMz_(Params::GetDouble("pm-min-frag-mz")) {
   if (!numeric_limits<double>::is_iec559) {
     carp(CARP_FATAL, "Something went wrong.");
   }
@@ -683,7 +838,7 @@ void PerChargeErrorCalc::processSpectrum(
 ) {
   ++numTotalSpectra_;
 
-  if (spectrum->getNumPeaks() < Params::GetInt("pm-min-scan-frag-peaks")) {
+  if (spectrum->getNumPeaks() < minScanFragPeaks_) {
     return;
   }
 
@@ -701,8 +856,7 @@ void PerChargeErrorCalc::processSpectrum(
 
   double precursorMz = getPrecursorMz(spectrum);
   if (std::isnan(precursorMz) ||
-      !(Params::GetDouble("pm-min-precursor-mz") <= precursorMz &&
-        precursorMz <= Params::GetDouble("pm-max-precursor-mz"))) {
+      !(minPrecursorMz_ <= precursorMz && precursorMz <= maxPrecursorMz_)) {
     return;
   }
 
@@ -710,45 +864,58 @@ void PerChargeErrorCalc::processSpectrum(
   // pull out the top fragments by intensity
   vector<Peak> peaks = spectrum->getPeaks();
   std::sort(peaks.begin(), peaks.end(), Peak::compareByIntensity);
-  peaks.resize(Params::GetInt("pm-top-n-frag-peaks"));
+  peaks.resize(topNFragPeaks_);
 
   int precursorBinIndex = getBinIndexPrecursor(precursorMz);
-  map< int, pair< const Spectrum*, vector<Peak> > >::const_iterator prevIter =
-    spectra_.find(precursorBinIndex);
+  map<int, BinSpectrum>::iterator prevIter = spectra_.find(precursorBinIndex);
   if (prevIter != spectra_.end()) {
     // there was a previous spectrum in this bin; check to see if they're a pair
-    const Spectrum* prev = prevIter->second.first;
-    const double precursorMzPrev = getPrecursorMz(prev);
+    const BinSpectrum& prev = prevIter->second;
+    const double precursorMzPrev = prev.precursorMz;
     const double precursorMzDiffPpm = (precursorMz - precursorMzPrev) * MILLION / precursorMz;
     ++numSpectraSameBin_;
     // check precursor
-    if (abs(precursorMzDiffPpm) <= Params::GetDouble("pm-max-precursor-delta-ppm")) {
+    if (abs(precursorMzDiffPpm) <= maxPrecursorDeltaPpm_) {
       // check scan count between the scans
       ++numSpectraWithinPpm_;
-      if (abs(spectrum->getFirstScan() - prev->getFirstScan()) <= Params::GetInt("pm-max-scan-separation")) {
+      if (abs(spectrum->getFirstScan() - prev.scan) <= maxScanSeparation_) {
         // count the fragment peaks in common
         ++numSpectraWithinPpmAndScans_;
-        vector< pair<Peak, Peak> > pairedFragments =
-          pairFragments(prevIter->second.second, peaks);
-        if (pairedFragments.size() >= Params::GetInt("pm-min-common-frag-peaks")) {
+        vector< pair<Peak, Peak> > pairedFragments = pairFragments(prev.peaks, peaks);
+        if (pairedFragments.size() >= minCommonFragPeaks_) {
           // we've got a pair! record everything
           sort(pairedFragments.begin(), pairedFragments.end(), sortPairedFragments);
           vector< pair<Peak, Peak> >::const_iterator stop =
-            pairedFragments.size() >= Params::GetInt("pm-pair-top-n-frag-peaks")
-              ? pairedFragments.begin() + Params::GetInt("pm-pair-top-n-frag-peaks")
+            pairedFragments.size() >= pairTopNFragPeaks_
+              ? pairedFragments.begin() + pairTopNFragPeaks_
               : pairedFragments.end();
           for (vector< pair<Peak, Peak> >::const_iterator i = pairedFragments.begin();
               i != stop;
               i++) {
-            pairedFragmentPeaks_.push_back(make_pair(i->first, i->second));
+            addPair(&pairedFragmentPeaks_, make_pair(i->first, i->second),
+                    ++numPairedFragmentPeaks_);
           }
-          pairedPrecursorMzs_.push_back(make_pair(precursorMzPrev, precursorMz));
+          addPair(&pairedPrecursorMzs_, make_pair(precursorMzPrev, precursorMz),
+                  ++numPairedPrecursorMzs_);
         }
       }
     }
+  } else {
+    prevIter = spectra_.insert(make_pair(precursorBinIndex, BinSpectrum())).first;
   }
   // make the new spectrum its bin's representative
-  spectra_[precursorBinIndex] = make_pair(spectrum, peaks);
+  prevIter->second.precursorMz = precursorMz;
+  prevIter->second.scan = spectrum->getFirstScan();
+  prevIter->second.peaks.swap(peaks);
+}
+
+template<typename T>
+void PerChargeErrorCalc::addPair(vector<T>* pairs, const T& item, int numSeen) {
+  if (samplePairs_) {
+    reservoirAdd(pairs, item, numSeen, &rng_);
+  } else {
+    pairs->push_back(item);
+  }
 }
 
 void PerChargeErrorCalc::clearBins() {
@@ -783,6 +950,14 @@ int PerChargeErrorCalc::getNumSingleFragBins() const {
   return numSingleFragBins_;
 }
 
+int PerChargeErrorCalc::getNumPairedFragmentPeaks() const {
+  return numPairedFragmentPeaks_;
+}
+
+int PerChargeErrorCalc::getNumPairedPrecursorMzs() const {
+  return numPairedPrecursorMzs_;
+}
+
 const vector< pair<Peak, Peak> >& PerChargeErrorCalc::getPairedFragmentPeaks() const {
   return pairedFragmentPeaks_;
 }
@@ -834,7 +1009,7 @@ map<int, Peak> PerChargeErrorCalc::binFragments(const vector<Peak>& peaks) {
   set<int> binsToRemove;
   for (vector<Peak>::const_iterator i = peaks.begin(); i != peaks.end(); i++) {
     FLOAT_T mz = i->getLocation();
-    if (mz < Params::GetDouble("pm-min-frag-mz")) {
+    if (mz < minFragMz_) {
       continue;
     }
     int binIndex = getBinIndexFragment(mz);
@@ -1145,8 +1320,171 @@ vector<double> binSpectrum(const Spectrum* spectrum) {
   return matrix;
 }
 
+// Receives spectra from the parser and runs the detectors on them in
+// batches. Each full batch is binned on several threads and fed to the
+// detectors in file order on a worker thread, while the parser goes on
+// reading the next batch. Spectra are freed once their batch is done.
+class SpectrumBatchProcessor : public SpectrumCollection::SpectrumHandler {
+ public:
+  SpectrumBatchProcessor(
+    const vector<RunAttributeDetector*>& detectors,
+    const ErrorCalc* stabilityCalc,
+    int numThreads):
+    detectors_(detectors), stabilityCalc_(stabilityCalc), numThreads_(numThreads),
+    minScanFragPeaks_(Params::GetInt("pm-min-scan-frag-peaks")),
+    ignoreNoCharge_(Params::GetBool("pm-ignore-no-charge")),
+    worker_(NULL), numProcessed_(0), numBatches_(0), stable_(false), stopRequested_(false),
+    stableChecks_(0),
+    lastPrecursorSigma_(numeric_limits<double>::quiet_NaN()),
+    lastFragmentSigma_(numeric_limits<double>::quiet_NaN()) {
+  }
+
+  ~SpectrumBatchProcessor() {
+    finish();
+  }
+
+  bool handle(Spectrum* spectrum) {
+    if (spectrum->getNumPeaks() < minScanFragPeaks_ ||
+        (ignoreNoCharge_ && spectrum->getChargeStateAssigned())) {
+      delete spectrum;
+      return !stopRequested_;
+    }
+    filling_.push_back(spectrum);
+    if (filling_.size() >= SPECTRUM_BATCH_SIZE) {
+      dispatch();
+    }
+    return !stopRequested_;
+  }
+
+  // process any partial batch and wait for the worker
+  void finish() {
+    if (!filling_.empty()) {
+      dispatch();
+    }
+    join();
+  }
+
+  int getNumProcessed() const {
+    return numProcessed_;
+  }
+
+  // true once pm-early-stop found the error estimates stable
+  bool isStable() const {
+    return stable_;
+  }
+
+ private:
+  void join() {
+    if (worker_ != NULL) {
+      worker_->join();
+      delete worker_;
+      worker_ = NULL;
+    }
+    for (vector<Spectrum*>::iterator i = processing_.begin(); i != processing_.end(); i++) {
+      delete *i;
+    }
+    processing_.clear();
+  }
+
+  // stable_ is written by the worker, so it is only read after a join
+  void dispatch() {
+    join();
+    stopRequested_ = stable_;
+    if (stopRequested_) {
+      for (vector<Spectrum*>::iterator i = filling_.begin(); i != filling_.end(); i++) {
+        delete *i;
+      }
+      filling_.clear();
+      return;
+    }
+    processing_.swap(filling_);
+    worker_ = new boost::thread(boost::bind(&SpectrumBatchProcessor::processBatch, this));
+  }
+
+  void processBatch() {
+    vector< vector<double> > binned(processing_.size());
+    int numThreads = min(numThreads_, (int)processing_.size());
+    if (numThreads <= 1) {
+      binSpectra(&processing_, &binned, 0, 1);
+    } else {
+      boost::thread_group threads;
+      for (int i = 0; i < numThreads; i++) {
+        threads.add_thread(new boost::thread(boost::bind(
+          &SpectrumBatchProcessor::binSpectra, &processing_, &binned, i, numThreads)));
+      }
+      threads.join_all();
+    }
+    // run each of the detectors on the binned peaks
+    for (size_t i = 0; i < processing_.size(); i++) {
+      for (vector<RunAttributeDetector*>::const_iterator j = detectors_.begin();
+           j != detectors_.end();
+           j++) {
+        (*j)->processSpectrum(processing_[i], binned[i]);
+      }
+    }
+    numProcessed_ += processing_.size();
+    if (stabilityCalc_ != NULL && ++numBatches_ % BATCHES_PER_STABILITY_CHECK == 0) {
+      checkStability();
+    }
+  }
+
+  static void binSpectra(
+    const vector<Spectrum*>* spectra,
+    vector< vector<double> >* binned,
+    int threadIdx,
+    int numThreads
+  ) {
+    for (size_t i = threadIdx; i < spectra->size(); i += numThreads) {
+      (*binned)[i] = binSpectrum((*spectra)[i]);
+    }
+  }
+
+  void checkStability() {
+    double precursorSigma, fragmentSigma;
+    if (!stabilityCalc_->estimateSigmas(&precursorSigma, &fragmentSigma)) {
+      return;
+    }
+    if (abs(precursorSigma - lastPrecursorSigma_) <= STABLE_SIGMA_TOLERANCE * lastPrecursorSigma_ &&
+        abs(fragmentSigma - lastFragmentSigma_) <= STABLE_SIGMA_TOLERANCE * lastFragmentSigma_) {
+      stableChecks_++;
+    } else {
+      stableChecks_ = 0;
+    }
+    carp(CARP_DEBUG, "After %d spectra: precursor sigma %f ppm, fragment sigma %f ppm",
+         numProcessed_, precursorSigma, fragmentSigma);
+    lastPrecursorSigma_ = precursorSigma;
+    lastFragmentSigma_ = fragmentSigma;
+    stable_ = stableChecks_ >= STABLE_CHECKS_REQUIRED;
+  }
+
+  const vector<RunAttributeDetector*>& detectors_;
+  const ErrorCalc* stabilityCalc_;
+  int numThreads_;
+  int minScanFragPeaks_;
+  bool ignoreNoCharge_;
+  vector<Spectrum*> filling_;
+  vector<Spectrum*> processing_;
+  boost::thread* worker_;
+  int numProcessed_;
+  int numBatches_;
+  bool stable_;
+  bool stopRequested_;
+  int stableChecks_;
+  double lastPrecursorSigma_;
+  double lastFragmentSigma_;
+};
+
 int processSpectra(const vector<string>& files, vector<RunAttributeDetector*> detectors) {
-  int n = 0;
+  // the first detector is the error calculator, if there is one
+  const ErrorCalc* stabilityCalc = NULL;
+  if (Params::GetBool("pm-early-stop") && !detectors.empty()) {
+    stabilityCalc = dynamic_cast<const ErrorCalc*>(detectors.front());
+  }
+  int numThreads = Params::GetInt("num-threads");
+  if (numThreads < 1) {
+    numThreads = boost::thread::hardware_concurrency();
+  }
+  SpectrumBatchProcessor processor(detectors, stabilityCalc, numThreads);
   for (vector<string>::const_iterator i = files.begin(); i != files.end(); i++) {
     carp(CARP_INFO, "param-medic processing input file %s...", i->c_str());
     if (i > files.begin()) {
@@ -1157,26 +1495,16 @@ int processSpectra(const vector<string>& files, vector<RunAttributeDetector*> de
       }
     }
     SpectrumCollection* collection = SpectrumCollectionFactory::create(*i);
-    collection->parse();
-    bool ignoreNoCharge = Params::GetBool("pm-ignore-no-charge");
-    for (SpectrumIterator j = collection->begin(); j != collection->end(); j++) {
-      if ((*j)->getNumPeaks() < Params::GetInt("pm-min-scan-frag-peaks") ||
-          (ignoreNoCharge && (*j)->getChargeStateAssigned())) {
-        continue;
-      }
-      // bin the spectrum peaks
-      vector<double> binned = ParamMedic::binSpectrum(*j);
-      // run each of the detectors on the binned peaks
-      for (vector<RunAttributeDetector*>::const_iterator k = detectors.begin();
-           k != detectors.end();
-           k++) {
-        (*k)->processSpectrum(*j, binned);
-      }
-      n++;
-    }
+    collection->parseStream(&processor);
+    processor.finish();
     delete collection;
+    if (processor.isStable()) {
+      carp(CARP_INFO, "Error estimates are stable after %d spectra; "
+                      "not reading any further.", processor.getNumProcessed());
+      break;
+    }
   }
-  return n;
+  return processor.getNumProcessed();
 }
 
 int processSpectra(const vector<string>& files, RunAttributeDetector* detector) {
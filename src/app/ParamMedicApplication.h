@@ -1,6 +1,7 @@
 #ifndef PARAM_MEDIC_APPLICATION_H
 #define PARAM_MEDIC_APPLICATION_H
 
+#include "boost/random/mersenne_twister.hpp"
 #include "CruxApplication.h"
 #include "model/Spectrum.h"
 
@@ -103,6 +104,10 @@ class ErrorCalc : public RunAttributeDetector {
 
   void nextFile();
 
+  // fit the precursor and fragment error distributions to the pairs seen so
+  // far, without logging; returns false if there are too few pairs yet
+  bool estimateSigmas(double* precursorSigmaPpm, double* fragmentSigmaPpm) const;
+
   void calcMassErrorDist(
     std::string* precursorFailure,
     std::string* fragmentFailure,
@@ -123,8 +128,24 @@ class ErrorCalc : public RunAttributeDetector {
   static const std::string KEY_FRAGMENT_PREDICTION;
 
  private:
+  // whether any calculator for a known (nonzero) charge has paired spectra
+  bool hasKnownChargePairs() const;
+  // gather the paired values of the known charges (or of charge 0); with
+  // pm-early-stop, sample them keeping each charge's share of the total
+  // proportional to the pairs it has seen
+  void samplePairs(
+    bool knownCharges,
+    std::vector< std::pair<double, double> >* pairedPrecursorMzs,
+    std::vector< std::pair<Peak, Peak> >* pairedFragmentPeaks,
+    int* numPrecursorPairs,
+    int* numFragmentPairs
+  ) const;
+
   std::map<int, PerChargeErrorCalc*> calcs_;
   int numTotalSpectra_;
+  // whether the calculators keep samples of their pairs (pm-early-stop)
+  // rather than every pair
+  bool samplePairs_;
 };
 
 class PerChargeErrorCalc : public RunAttributeDetector {
@@ -144,6 +165,10 @@ class PerChargeErrorCalc : public RunAttributeDetector {
   int getNumSpectraWithinPpmAndScans() const;
   int getNumMultipleFragBins() const;
   int getNumSingleFragBins() const;
+  // number of pairs seen; the vectors below hold them all, or with
+  // pm-early-stop a bounded sample of them
+  int getNumPairedFragmentPeaks() const;
+  int getNumPairedPrecursorMzs() const;
   const std::vector< std::pair<Peak, Peak> >& getPairedFragmentPeaks() const;
   const std::vector< std::pair<double, double> >& getPairedPrecursorMzs() const;
 
@@ -162,6 +187,10 @@ class PerChargeErrorCalc : public RunAttributeDetector {
   // toss them both out - this reduces ambiguity
   std::map<int, Peak> binFragments(const std::vector<Peak>& peaks);
 
+  // record a pair, in the sample of them if there is one
+  template<typename T>
+  void addPair(std::vector<T>* pairs, const T& item, int numSeen);
+
   static bool sortPairedFragments(
     const std::pair<Peak, Peak>& x,
     const std::pair<Peak, Peak>& y
@@ -178,11 +207,33 @@ class PerChargeErrorCalc : public RunAttributeDetector {
   // number and position of bins
   int numMultipleFragBins_;
   int numSingleFragBins_;
+  // what we keep of a bin's current spectrum
+  struct BinSpectrum {
+    double precursorMz;
+    int scan;
+    std::vector<Peak> peaks;
+  };
   // map from bin index to current spectrum
-  std::map< int, std::pair< const Crux::Spectrum*, std::vector<Peak> > > spectra_;
-  // the paired peak values that we'll use to estimate mass error
+  std::map<int, BinSpectrum> spectra_;
+  // the paired peak values that we'll use to estimate mass error; with
+  // pm-early-stop, reservoir samples of at most MAX_PEAKPAIRS out of the
+  // counted pairs, drawn with rng_
   std::vector< std::pair<Peak, Peak> > pairedFragmentPeaks_;
   std::vector< std::pair<double, double> > pairedPrecursorMzs_;
+  int numPairedFragmentPeaks_;
+  int numPairedPrecursorMzs_;
+  bool samplePairs_;
+  boost::mt19937 rng_;
+  // parameter values, looked up once
+  int minScanFragPeaks_;
+  double minPrecursorMz_;
+  double maxPrecursorMz_;
+  int topNFragPeaks_;
+  double maxPrecursorDeltaPpm_;
+  int maxScanSeparation_;
+  int minCommonFragPeaks_;
+  int pairTopNFragPeaks_;
+  double minFragMz_;
 };
 
 class Model {
@@ -153,48 +153,45 @@ void Tmt6vs10Detector::processSpectrum(
     int curBin = int((curMz - AVERAGINE_PEAK_SEPARATION / 2) / AVERAGINE_PEAK_SEPARATION) + 1;
     if (nominalMassMinBinMass_[curBin] < curMz &&
         curMz < nominalMassMinBinMass_[curBin] + TMT610_WINDOW_WIDTH) {
-      map< int, vector<double> >::iterator i = nominalMassAllPeaks_.find(curBin);
+      // count the peak instead of keeping it
+      map<int, WindowCounts>::iterator i = nominalMassAllPeaks_.find(curBin);
       if (i == nominalMassAllPeaks_.end()) {
-        nominalMassAllPeaks_[curBin] = vector<double>(1, curMz);
-      } else  {
-        i->second.push_back(curMz);
+        WindowCounts counts = { 0, 0, 0, curMz, curMz };
+        i = nominalMassAllPeaks_.insert(make_pair(curBin, counts)).first;
       }
+      WindowCounts& counts = i->second;
+      map<int, double>::const_iterator lookup;
+      lookup = nominalMassTmt6Mass_.find(curBin);
+      double peak6Mz = (lookup != nominalMassTmt6Mass_.end()) ?
+        lookup->second : numeric_limits<double>::quiet_NaN();
+      lookup = nominalMassTmt10Mass_.find(curBin);
+      double peak10Mz = (lookup != nominalMassTmt10Mass_.end()) ?
+        lookup->second : numeric_limits<double>::quiet_NaN();
+      if (peak6Mz - TMT610_PEAK_WIDTH_FOR_DETECT / 2 <= curMz &&
+          curMz <= peak6Mz + TMT610_PEAK_WIDTH_FOR_DETECT / 2) {
+        counts.numNearTmt6++;
+      } else if (peak10Mz - TMT610_PEAK_WIDTH_FOR_DETECT / 2 <= curMz &&
+                 curMz <= peak10Mz + TMT610_PEAK_WIDTH_FOR_DETECT / 2) {
+        counts.numNearTmt10++;
+      }
+      counts.numPeaks++;
+      counts.lastMz = curMz;
     }
   }
 }
 
 RunAttributeResult Tmt6vs10Detector::summarize() const {
   int nPeaksWithEnoughTmt10 = 0;
-  for (map< int, vector<double> >::const_iterator i = nominalMassAllPeaks_.begin();
+  for (map<int, WindowCounts>::const_iterator i = nominalMassAllPeaks_.begin();
        i != nominalMassAllPeaks_.end();
        i++) {
-    const vector<double>& curPeaks = i->second;
-    carp(CARP_DEBUG, "nominal mass %d: %d", i->first, curPeaks.size());
-    if (curPeaks.size() >= TMT610_MINPEAKS_FOR_DETECT) {
-      double smallestMzThisBin = i->first * AVERAGINE_PEAK_SEPARATION - AVERAGINE_PEAK_SEPARATION / 2;
-      carp(CARP_DEBUG, "    %f-%f", curPeaks.front(), curPeaks.back());
-      // find the proportion of peaks falling in the expected range for each TMT ion at this nominal mass
-      map<int, double>::const_iterator lookup;
-      lookup = nominalMassTmt6Mass_.find(i->first);
-      double peak6Mz = (lookup != nominalMassTmt6Mass_.end()) ?
-        lookup->second : numeric_limits<double>::quiet_NaN();
-      lookup = nominalMassTmt10Mass_.find(i->first);
-      double peak10Mz = (lookup != nominalMassTmt10Mass_.end()) ?
-        lookup->second : numeric_limits<double>::quiet_NaN();
-      double minMassPeak6 = peak6Mz - TMT610_PEAK_WIDTH_FOR_DETECT / 2;
-      double maxMassPeak6 = peak6Mz + TMT610_PEAK_WIDTH_FOR_DETECT / 2;
-      double minMassPeak10 = peak10Mz - TMT610_PEAK_WIDTH_FOR_DETECT / 2;
-      double maxMassPeak10 = peak10Mz + TMT610_PEAK_WIDTH_FOR_DETECT / 2;
-      int nPeaksNearPeak6 = 0, nPeaksNearPeak10 = 0;
-      for (vector<double>::const_iterator j = curPeaks.begin(); j != curPeaks.end(); j++) {
-        if (minMassPeak6 <= *j && *j <= maxMassPeak6) {
-          nPeaksNearPeak6++;
-        } else if (minMassPeak10 <= *j && *j <= maxMassPeak10) {
-          nPeaksNearPeak10++;
-        }
-      }
-      double proportionNearPeak6 = (double)nPeaksNearPeak6 / curPeaks.size();
-      double proportionNearPeak10 = (double)nPeaksNearPeak10 / curPeaks.size();
+    const WindowCounts& curPeaks = i->second;
+    carp(CARP_DEBUG, "nominal mass %d: %d", i->first, curPeaks.numPeaks);
+    if (curPeaks.numPeaks >= TMT610_MINPEAKS_FOR_DETECT) {
+      carp(CARP_DEBUG, "    %f-%f", curPeaks.firstMz, curPeaks.lastMz);
+      // proportion of peaks falling in the expected range for each TMT ion at this nominal mass
+      double proportionNearPeak6 = (double)curPeaks.numNearTmt6 / curPeaks.numPeaks;
+      double proportionNearPeak10 = (double)curPeaks.numNearTmt10 / curPeaks.numPeaks;
       carp(CARP_DEBUG, "Near 6: %f. Near 10: %f", proportionNearPeak6, proportionNearPeak10);
       if (proportionNearPeak10 > TMT610_MIN_TMT10_PROPORTION_FOR_DECISION) {
         carp(CARP_DEBUG, "Peak %d has TMT10 signal", i->first);
@@ -30,7 +30,15 @@ class Tmt6vs10Detector : public RunAttributeDetector {
     const std::vector<double>& binnedSpectrum);
   RunAttributeResult summarize() const;
  private:
-  std::map< int, std::vector<double> > nominalMassAllPeaks_;
+  // what we keep of the peaks falling in one nominal mass window
+  struct WindowCounts {
+    int numPeaks;
+    int numNearTmt6;
+    int numNearTmt10;
+    double firstMz;
+    double lastMz;
+  };
+  std::map<int, WindowCounts> nominalMassAllPeaks_;
   std::map<int, double> nominalMassTmt6Mass_; // map from nominal mass to precise TMT6 mass
   std::map<int, double> nominalMassTmt10Mass_; // map from nominal mass to precise TMT10 mass
   std::map<int, double> nominalMassMinBinMass_;
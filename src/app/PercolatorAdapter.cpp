@@ -17,7 +17,7 @@ using namespace std;
 /**
  * Constructor for PercolatorAdapter. 
  */
-PercolatorAdapter::PercolatorAdapter() : Caller() {
+PercolatorAdapter::PercolatorAdapter() : Caller(), pin_matches_(NULL) {
   collection_ = new ProteinMatchCollection();
   decoy_collection_ = new ProteinMatchCollection();
 }
@@ -57,6 +57,10 @@ void PercolatorAdapter::deleteCollections() {
   }
 }
 
+void PercolatorAdapter::setPinMatches(const PinMatchTable* table) {
+  pin_matches_ = table;
+}
+
 /**
  * Adds PSM scores from Percolator objects into a ProteinMatchCollection
  */
@@ -95,24 +99,34 @@ void PercolatorAdapter::processPsmScores(Scores& allScores) {
     PSMDescription* psm = score_itr->pPSM;
 
     int psm_file_idx = -1, psm_charge;
-    parsePSMId(psm->id_, psm_file_idx, psm_charge);
-
-    // Try to look up charge state in map
     int charge_state = -1;
-    for (map<int, int>::const_iterator i = chargeStates.begin();
-         i != chargeStates.end();
-         ++i) {
-      if (psm->features[i->first] > 0) {
-        charge_state = i->second;
-        break;
+    Crux::Peptide* peptide = NULL;
+    Crux::Match* pin_match = pin_matches_ != NULL
+      ? pin_matches_->getMatch(psm->id_) : NULL;
+    if (pin_match != NULL) {
+      // The pin was written in-process; take everything from its match
+      psm_file_idx = pin_match->getFileIndex();
+      charge_state = pin_match->getCharge();
+      peptide = new Crux::Peptide(pin_match->getPeptide());
+    } else {
+      parsePSMId(psm->id_, psm_file_idx, psm_charge);
+
+      // Try to look up charge state in map
+      for (map<int, int>::const_iterator i = chargeStates.begin();
+           i != chargeStates.end();
+           ++i) {
+        if (psm->features[i->first] > 0) {
+          charge_state = i->second;
+          break;
+        }
       }
-    }
 
-    if (charge_state == -1) {
-      carp_once(CARP_WARNING, "Could not determine charge state of PSM");
-    }
+      if (charge_state == -1) {
+        carp_once(CARP_WARNING, "Could not determine charge state of PSM");
+      }
 
-    Crux::Peptide* peptide = extractPeptide(psm, charge_state, is_decoy);
+      peptide = extractPeptide(psm, charge_state, is_decoy);
+    }
     if (peptide == NULL) {
       deleteCollections();
       return;
@@ -12,6 +12,7 @@
 #include <vector>
 
 #include "Caller.h"
+#include "MakePinApplication.h"
 #include "model/MatchCollection.h"
 #include "model/PeptideMatch.h"
 #include "model/PostProcessProtein.h"
@@ -46,6 +47,12 @@ class PercolatorAdapter : public Caller {
 
   void deleteCollections();
 
+  /**
+   * Resolves PSMs through the matches an in-memory pin was written from,
+   * keyed by their SpecId, instead of parsing ids and peptides
+   */
+  void setPinMatches(const PinMatchTable* table);
+
   /**
    * Adds PSM scores from Percolator objects into a ProteinMatchCollection
    */
@@ -89,6 +96,7 @@ class PercolatorAdapter : public Caller {
   ProteinMatchCollection* decoy_collection_;  ///< Decoy ProteinMatchCollection
   std::vector<MatchCollection*> match_collections_made_; ///< MatchCollections created
   std::vector<PostProcessProtein*> proteins_made_; ///< Proteins created
+  const PinMatchTable* pin_matches_; ///< Matches by SpecId, if the pin was made in-process
   
   /**
    * Given a Percolator psm_id in the form ".*_([0-9]+)_[^_]*",
@@ -14,6 +14,7 @@
 #include <ios>
 #include "util/CarpStreamBuf.h"
 #include "util/FileUtils.h"
+#include "util/Metrics.h"
 #include "util/Params.h"
 #include "util/StringUtils.h"
 #include "io/MzIdentMLWriter.h"
@@ -99,12 +100,26 @@ int PercolatorApplication::main(int argc, char** argv) {
           }
         }
       }
-    } else {
+    } else if (Params::GetBool("pin-output")) {
       carp(CARP_INFO, "Converting input to pin format.");
+      Metrics::Timer timer("percolator.make-pin");
       if (MakePinApplication::main(result_files) != 0 || !FileUtils::Exists(input_pin)) {
         carp(CARP_FATAL, "make-pin failed. Not running Percolator.");
       }
       carp(CARP_INFO, "File conversion complete.");
+    } else {
+      // Hand the PSMs to percolator in memory; the pin file is only written
+      // when pin-output is set
+      carp(CARP_INFO, "Converting input to pin format.");
+      stringstream pin_stream;
+      PinMatchTable table;
+      Metrics::Timer timer("percolator.make-pin");
+      if (MakePinApplication::main(result_files, &pin_stream, &table) != 0) {
+        carp(CARP_FATAL, "make-pin failed. Not running Percolator.");
+      }
+      timer.Stop();
+      carp(CARP_INFO, "File conversion complete.");
+      return main(&pin_stream, &table);
     }
   }
   return main(input_pin);
@@ -117,6 +132,21 @@ int PercolatorApplication::main(int argc, char** argv) {
 int PercolatorApplication::main(
   const string& input_pin ///< file path of pin to process.
   ) {
+  return runPercolator(input_pin, NULL, NULL);
+}
+
+int PercolatorApplication::main(
+  istream* pin_stream,
+  const PinMatchTable* table
+  ) {
+  return runPercolator("", pin_stream, table);
+}
+
+int PercolatorApplication::runPercolator(
+  const string& input_pin,
+  istream* pin_stream,
+  const PinMatchTable* table
+  ) {
   /* build argument list */
   vector<string> perc_args_vec;
   perc_args_vec.push_back("percolator");
@@ -352,7 +382,11 @@ int PercolatorApplication::main(
     perc_args_vec.push_back("--train-best-positive");
   }
 
-  perc_args_vec.push_back(input_pin);
+  if (pin_stream != NULL) {
+    perc_args_vec.push_back("--stdinput-tab");
+  } else {
+    perc_args_vec.push_back(input_pin);
+  }
 
   /* build argv line */
 
@@ -367,13 +401,22 @@ int PercolatorApplication::main(
 
   carp(CARP_DEBUG, "cmd:%s", perc_cmd.c_str());
   
-  /* Re-route stdeer to log file. */
+  /* Re-route stdeer to log file, after what carp has queued so far. */
+  carp_flush();
   CarpStreamBuf buffer;
   streambuf* old = std::cerr.rdbuf();
   std::cerr.rdbuf(&buffer);
 
+  /* Feed an in-process pin to percolator as its standard input. */
+  streambuf* old_in = std::cin.rdbuf();
+  if (pin_stream != NULL) {
+    std::cin.rdbuf(pin_stream->rdbuf());
+  }
+
   /* Call percolatorMain */
   PercolatorAdapter pCaller;
+  pCaller.setPinMatches(table);
+  Metrics::Timer timer("percolator.percolator");
   try {
     int retVal;
     if (pCaller.parseOptions(perc_args_vec.size(), (char**)&perc_argv.front()) &&
@@ -381,13 +424,18 @@ int PercolatorApplication::main(
       carp(CARP_FATAL, "Error running percolator:%d", retVal);
     }
   } catch (const std::exception& e) {
-    /* Recover stderr */
+    /* Recover stderr and stdin */
+    carp_flush();
     std::cerr.rdbuf(old);
+    std::cin.rdbuf(old_in);
     throw runtime_error(e.what());
   }
 
-  /* Recover stderr */
+  /* Recover stderr and stdin */
+  carp_flush();
   std::cerr.rdbuf(old);
+  std::cin.rdbuf(old_in);
+  timer.Stop();
   
   // get percolator score information into crux objects
   ProteinMatchCollection* target_pmc = pCaller.getProteinMatchCollection();
@@ -534,6 +582,7 @@ vector<string> PercolatorApplication::getOptions() const {
     "pepxml-output",
     "percolator-seed",
     "picked-protein",
+    "pin-output",
     "pout-output",
     "protein",
     "protein-enzyme",
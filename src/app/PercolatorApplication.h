@@ -12,6 +12,7 @@
 #include <string>
 #include <fstream>
 
+class PinMatchTable;
 
 class PercolatorApplication: public CruxApplication {
 
@@ -20,6 +21,16 @@ class PercolatorApplication: public CruxApplication {
   //Calls the main method in Percolator Application
   static int percolatorMain(int argc, char* argv[]);
 
+  /**
+   * Runs percolator on either the pin file at input_pin or, if pin_stream
+   * is set, the pin text in it
+   */
+  int runPercolator(
+    const std::string& input_pin,
+    std::istream* pin_stream,
+    const PinMatchTable* table
+  );
+
 
  public:
 
@@ -77,6 +88,16 @@ class PercolatorApplication: public CruxApplication {
   int main(
     const std::string& input_pinxml ///< file path of spectra to process
   );
+
+  /**
+   * \brief runs percolator on a pin made in-process, read from pin_stream
+   * instead of a file, with PSMs resolved through table by SpecId
+   * \returns whether percolator was successful or not
+   */
+  int main(
+    std::istream* pin_stream, ///< pin text to process
+    const PinMatchTable* table ///< matches the pin was written from
+  );
   
 };
 
@@ -4,8 +4,10 @@
 #include "io/carp.h"
 #include "parameter.h"
 #include "app/tide/records_to_vector-inl.h"
+#include "app/tide/mass_directory.h"
 #include "app/tide/peptide.h"
 #include "util/Params.h"
+#include <limits>
 #include <vector>
 
 using namespace std;
@@ -63,11 +65,28 @@ int ReadTideIndex::main(int argc, char** argv) {
   *output_stream << get_column_header(SEQUENCE_COL) << '\t'
                  << get_column_header(PROTEIN_ID_COL) << endl;
 
+  // Only output peptides in the mass range, if one was given. With a mass
+  // directory, reading can start at the lightest of them.
+  double min_mass = Params::IsDefault("min-mass") ? 0 : Params::GetDouble("min-mass");
+  double max_mass = Params::IsDefault("max-mass") ?
+    numeric_limits<double>::max() : Params::GetDouble("max-mass");
   RecordReader* reader = peptide_reader.Reader();
+  MassDirectory mass_directory;
+  if (min_mass > 0 && mass_directory.Load(peptides_file)) {
+    google::protobuf::uint64 offset = mass_directory.Offset(min_mass);
+    if (offset > reader->Position() && !reader->Seek(offset)) {
+      carp(CARP_FATAL, "Error reading index (%s)", peptides_file.c_str());
+    }
+  }
   while (!reader->Done()) {
     // Read peptide
     pb::Peptide pb_peptide;
     reader->Read(&pb_peptide);
+    if (pb_peptide.mass() < min_mass) {
+      continue;
+    } else if (pb_peptide.mass() > max_mass) {
+      break;
+    }
     if (Params::GetBool("skip-decoys") && pb_peptide.has_decoy_index()) {
       continue;
     }
@@ -112,6 +131,8 @@ vector<string> ReadTideIndex::getArgs() const {
 
 vector<string> ReadTideIndex::getOptions() const {
   string arr[] = {
+    "max-mass",
+    "min-mass",
     "skip-decoys"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
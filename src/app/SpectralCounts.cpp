@@ -6,6 +6,9 @@
 #include "model/Peptide.h"
 #include "model/ProteinPeptideIterator.h"
 #include "io/SpectrumCollectionFactory.h"
+#include <queue>
+#include "boost/functional/hash.hpp"
+#include "boost/thread.hpp"
 
 using namespace std;
 using namespace Crux;
@@ -21,12 +24,7 @@ SpectralCounts::SpectralCounts()
     measure_(MEASURE_SIN),
     bin_width_(0),
     peptide_scores_(Peptide::lessThan),
-    peptide_scores_unique_(Peptide::lessThan),
-    peptide_scores_shared_(Peptide::lessThan),
     protein_scores_(protein_id_less_than),
-    protein_scores_unique_(protein_id_less_than),
-    protein_scores_shared_(protein_id_less_than),
-    protein_supporting_peptides_(protein_id_less_than),
     protein_meta_protein_(protein_id_less_than),
     meta_mapping_(comparePeptideSets),
     meta_protein_scores_(compareMetaProteins),
@@ -68,6 +66,11 @@ int SpectralCounts::main(int argc, char** argv) {
 
   // get a set of peptides
   getPeptideScores();
+  // proteins are mapped from every peptide before the unique mapping drops
+  // shared ones, so that dNSAF sees the shared peptides it distributes
+  if (quantitation_ == PROTEIN_QUANT_LEVEL) {
+    getProteinToPeptides();
+  }
   if (unique_mapping_) {
     makeUniqueMapping();
   }
@@ -90,7 +93,6 @@ int SpectralCounts::main(int argc, char** argv) {
     carp(CARP_INFO, "Number of proteins %i", protein_scores_.size());
         
     if (parsimony_ != PARSIMONY_NONE) { //if parsimony is not none
-      getProteinToPeptides();
       getMetaMapping();
       getProteinToMetaProtein();
       carp(CARP_INFO, "Number of meta proteins %i", meta_mapping_.size());
@@ -135,31 +137,82 @@ void SpectralCounts::getParameterValues() {
 }
 
 /**
- * For every protein that can be mapped from the set of 
- * peptides in PeptideToScore map, enter the protein and
- * the set of identified peptides it maps to, into 
- * ProteinToPeptide
+ * Numbers the peptides in PeptideToScore and every protein they
+ * can be mapped to, and records the peptide-to-protein incidence in
+ * both directions as integer ids.  Proteins that compare equal under
+ * protein_id_less_than share an id, represented by the first one seen.
  */
 void SpectralCounts::getProteinToPeptides() {
+  peptides_.clear();
+  proteins_.clear();
+  peptide_ids_.clear();
+  peptide_protein_offsets_.assign(1, 0);
+  peptide_protein_ids_.clear();
+
+  // peptides in map order, with their sources in source order
+  vector<Protein*> sources;
   for (PeptideToScore::iterator pep_it = peptide_scores_.begin();
        pep_it != peptide_scores_.end(); ++pep_it) {
     Peptide* peptide = pep_it->first;
-    for(PeptideSrcIterator iter = peptide->getPeptideSrcBegin();
-        iter!= peptide->getPeptideSrcEnd();
-        ++iter) {
-      PeptideSrc* peptide_src = *iter; 
-      Protein* protein = peptide_src->getParentProtein();
-      if (protein_supporting_peptides_.find(protein) == 
-          protein_supporting_peptides_.end()) {
-        PeptideSet newset(Peptide::lessThan);
-        protein_supporting_peptides_.insert(make_pair(protein, newset));
+    peptide_ids_[peptide] = peptides_.size();
+    peptides_.push_back(peptide);
+    for (PeptideSrcIterator iter = peptide->getPeptideSrcBegin();
+         iter != peptide->getPeptideSrcEnd();
+         ++iter) {
+      sources.push_back((*iter)->getParentProtein());
+    }
+    peptide_protein_offsets_.push_back(sources.size());
+  }
+
+  // number the distinct proteins
+  vector<Protein*> sorted(sources);
+  stable_sort(sorted.begin(), sorted.end(), protein_id_less_than);
+  boost::unordered_map<Protein*, int> protein_ids;
+  for (size_t idx = 0; idx < sorted.size(); idx++) {
+    if (proteins_.empty() ||
+        protein_id_less_than(proteins_.back(), sorted[idx])) {
+      proteins_.push_back(sorted[idx]);
+    }
+    protein_ids[sorted[idx]] = proteins_.size() - 1;
+  }
+  peptide_protein_ids_.reserve(sources.size());
+  for (size_t idx = 0; idx < sources.size(); idx++) {
+    peptide_protein_ids_.push_back(protein_ids[sources[idx]]);
+  }
+
+  // transpose into protein rows; peptide ids come out in increasing order
+  protein_peptide_offsets_.assign(proteins_.size() + 1, 0);
+  protein_peptide_ids_.clear();
+  vector<int> last_peptide(proteins_.size(), -1);
+  for (int pep = 0; pep < (int)peptides_.size(); pep++) {
+    for (int idx = peptide_protein_offsets_[pep];
+         idx < peptide_protein_offsets_[pep + 1]; idx++) {
+      int prot = peptide_protein_ids_[idx];
+      if (last_peptide[prot] != pep) {
+        last_peptide[prot] = pep;
+        protein_peptide_offsets_[prot + 1]++;
+      }
+    }
+  }
+  for (size_t prot = 0; prot < proteins_.size(); prot++) {
+    protein_peptide_offsets_[prot + 1] += protein_peptide_offsets_[prot];
+  }
+  protein_peptide_ids_.resize(protein_peptide_offsets_.back());
+  vector<int> fill(protein_peptide_offsets_.begin(),
+                   protein_peptide_offsets_.end() - 1);
+  last_peptide.assign(proteins_.size(), -1);
+  for (int pep = 0; pep < (int)peptides_.size(); pep++) {
+    for (int idx = peptide_protein_offsets_[pep];
+         idx < peptide_protein_offsets_[pep + 1]; idx++) {
+      int prot = peptide_protein_ids_[idx];
+      if (last_peptide[prot] != pep) {
+        last_peptide[prot] = pep;
+        protein_peptide_ids_[fill[prot]++] = pep;
       }
-      protein_supporting_peptides_[protein].insert(peptide);
     }
   }
 }
 
-
 /**
  * Enters the mapping of protein to its metaProtein
  * into ProteinToMetaProtein. MetaProteins are retreieved
@@ -188,26 +241,25 @@ void SpectralCounts::getProteinToMetaProtein() {
  * counts that each protein is assigned
  */
 void SpectralCounts::getProteinScoresDNSAF() {
-
-  //calculate unique scores (unique peptides).
-  for (PeptideToScore::iterator pep_it = peptide_scores_unique_.begin();
-    pep_it != peptide_scores_unique_.end();
-    ++pep_it) {
-
-    Peptide* peptide = pep_it->first;
+  vector<FLOAT_T> unique_scores(proteins_.size(), 0);
+  vector<FLOAT_T> shared_scores(proteins_.size(), 0);
+  vector<bool> has_unique(proteins_.size(), false);
+
+  //calculate unique scores (peptides with at most one source).
+  //peptides_ is in peptide_scores_ order, so walk the two together.
+  PeptideToScore::iterator pep_it = peptide_scores_.begin();
+  for (size_t pep = 0; pep < peptides_.size(); pep++, ++pep_it) {
+    int begin = peptide_protein_offsets_[pep];
+    int end = peptide_protein_offsets_[pep + 1];
+    if (end - begin > 1) {
+      continue;
+    }
     FLOAT_T pep_score = pep_it->second;
-    for (PeptideSrcIterator iter = peptide->getPeptideSrcBegin();
-         iter != peptide->getPeptideSrcEnd();
-         ++iter) {
-      PeptideSrc* peptide_src = *iter;
-      Protein* protein = peptide_src->getParentProtein();
-      if (protein_scores_unique_.find(protein) == protein_scores_unique_.end()) {
-        protein_scores_unique_[protein] = 0;
-        protein_scores_shared_[protein] = 0;
-      }
-
-      protein_scores_unique_[protein] += pep_score;
-    }   
+    for (int idx = begin; idx < end; idx++) {
+      int prot = peptide_protein_ids_[idx];
+      has_unique[prot] = true;
+      unique_scores[prot] += pep_score;
+    }
   }
 
   //Handle shared peptides
@@ -219,55 +271,40 @@ void SpectralCounts::getProteinScoresDNSAF() {
   //There is a wierd feature that a protein with no unique peptide will
   //have a dNSAF score of zero... I don't know if we should include the
   //zero score in the list of proteins...
-  for (PeptideToScore::iterator pep_it = peptide_scores_shared_.begin();
-    pep_it != peptide_scores_shared_.end();
-    ++pep_it) {
-    Peptide* peptide = pep_it->first;
+  pep_it = peptide_scores_.begin();
+  for (size_t pep = 0; pep < peptides_.size(); pep++, ++pep_it) {
+    int begin = peptide_protein_offsets_[pep];
+    int end = peptide_protein_offsets_[pep + 1];
+    if (end - begin <= 1) {
+      continue;
+    }
     FLOAT_T shared_pep_score = pep_it->second;
 
     double unique_sum = 0.0;
-   
-    for (PeptideSrcIterator iter = peptide->getPeptideSrcBegin();
-         iter != peptide->getPeptideSrcEnd();
-         ++iter) {
-      PeptideSrc* peptide_src = *iter;
-      
-      Protein* protein = peptide_src->getParentProtein();
-      if (protein_scores_unique_.find(protein) != protein_scores_unique_.end()) {
-        unique_sum += protein_scores_unique_[protein];
+    for (int idx = begin; idx < end; idx++) {
+      int prot = peptide_protein_ids_[idx];
+      if (has_unique[prot]) {
+        unique_sum += unique_scores[prot];
       }
-        
-    }   
-  
+    }
+
     if (unique_sum != 0) {
-      for (PeptideSrcIterator iter = peptide->getPeptideSrcBegin();
-           iter != peptide->getPeptideSrcEnd();
-           ++iter) {
-        PeptideSrc* peptide_src = *iter;
-        Protein* protein = peptide_src->getParentProtein();
-        if (protein_scores_unique_.find(protein) != protein_scores_unique_.end()) {
-          FLOAT_T d_factor = protein_scores_unique_[protein] / unique_sum;
-          protein_scores_shared_[protein] += d_factor * shared_pep_score;
+      for (int idx = begin; idx < end; idx++) {
+        int prot = peptide_protein_ids_[idx];
+        if (has_unique[prot]) {
+          FLOAT_T d_factor = unique_scores[prot] / unique_sum;
+          shared_scores[prot] += d_factor * shared_pep_score;
         }
       }
     }
   }
 
   //add up shared and unique scores to get final score
-  for (ProteinToScore::iterator prot_iter = protein_scores_unique_.begin();
-    prot_iter != protein_scores_unique_.end();
-    ++prot_iter) {
-    Protein* protein = prot_iter->first;
-    FLOAT_T unique_score = prot_iter->second;
-    protein_scores_[protein] = unique_score;
-  }
-
-  for (ProteinToScore::iterator prot_iter = protein_scores_shared_.begin();
-    prot_iter != protein_scores_shared_.end();
-    ++prot_iter) {
-    Protein *protein = prot_iter->first;
-    FLOAT_T shared_score = prot_iter->second;
-    protein_scores_[protein] += shared_score;
+  for (size_t prot = 0; prot < proteins_.size(); prot++) {
+    if (has_unique[prot]) {
+      protein_scores_.insert(protein_scores_.end(),
+        make_pair(proteins_[prot], unique_scores[prot] + shared_scores[prot]));
+    }
   }
 }
 
@@ -282,21 +319,20 @@ void SpectralCounts::getProteinScores() {
   } else {
 
     // iterate through each peptide
-    for (PeptideToScore::iterator pep_it = peptide_scores_.begin();
-         pep_it != peptide_scores_.end(); ++pep_it) {
-      Peptide* peptide = pep_it->first;
+    vector<FLOAT_T> scores(proteins_.size(), 0);
+    PeptideToScore::iterator pep_it = peptide_scores_.begin();
+    for (size_t pep = 0; pep < peptides_.size(); pep++, ++pep_it) {
       FLOAT_T pep_score = pep_it->second;
-      for (PeptideSrcIterator iter = peptide->getPeptideSrcBegin();
-           iter != peptide->getPeptideSrcEnd();
-           ++iter) {
-        PeptideSrc* peptide_src =*iter;
-        Protein* protein = peptide_src->getParentProtein();
-        if (protein_scores_.find(protein) == protein_scores_.end()) {
-          protein_scores_.insert(make_pair(protein, 0.0));
-        }
-        protein_scores_[protein] += pep_score;
+      for (int idx = peptide_protein_offsets_[pep];
+           idx < peptide_protein_offsets_[pep + 1]; idx++) {
+        scores[peptide_protein_ids_[idx]] += pep_score;
       }
     }
+    // proteins_ is already in map order
+    for (size_t prot = 0; prot < proteins_.size(); prot++) {
+      protein_scores_.insert(protein_scores_.end(),
+                             make_pair(proteins_[prot], scores[prot]));
+    }
   }
 }
 
@@ -428,50 +464,125 @@ void SpectralCounts::computeEmpai() {
 }
 
 /**
- * For the spectrum associated with the match, sum the intensities of
- * all b and y ions that are not modified.
- * \return The sum of unmodified b and y ions.
+ * For the spectrum associated with each match, sum the intensities of
+ * all b and y ions that are not modified.  The spectrum file is parsed
+ * once; ion prediction uses shared static state in IonSeries and so
+ * stays on this thread, while the peak lookups run on num-threads
+ * threads.  Each spectrum is handled by exactly one thread, which works
+ * on its own copy so the lazily built peak index is freed right away.
  */
-FLOAT_T SpectralCounts::sumMatchIntensity(Match* match,
-                                        Crux::SpectrumCollection* spectra) {
-  FLOAT_T match_intensity = 0;
-  char* peptide_seq = match->getSequence();
-  MODIFIED_AA_T* modified_sequence = match->getModSequence();
-  int charge = match->getCharge();
-  Spectrum* temp = match->getSpectrum();
-  int scan = temp->getFirstScan();
-
-  Spectrum* spectrum = spectra->getSpectrum(scan);
-
-  if (spectrum == NULL) {
-    carp(CARP_FATAL, "scan: %d doesn't exist or not found!");
-    return 0.0;
+void SpectralCounts::sumMatchIntensities(const vector<Match*>& matches,
+                                         vector<FLOAT_T>& intensities) {
+  Crux::SpectrumCollection* collection =
+    SpectrumCollectionFactory::create(Params::GetString("input-ms2"));
+  collection->parse();
+  map<int, Spectrum*> spectra_by_scan;
+  for (SpectrumIterator iter = collection->begin();
+       iter != collection->end(); ++iter) {
+    spectra_by_scan.insert(make_pair((*iter)->getFirstScan(), *iter));
+  }
+
+  // group the matches by spectrum and predict their ions
+  vector<Spectrum*> spectra;
+  vector<Spectrum*> fetched; // spectra not found by parse()
+  vector< vector<int> > spectrum_matches;
+  map<int, int> scan_index;
+  vector< vector<FLOAT_T> > ion_mzs(matches.size());
+  for (size_t match_idx = 0; match_idx < matches.size(); match_idx++) {
+    Match* match = matches[match_idx];
+    int scan = match->getSpectrum()->getFirstScan();
+    map<int, int>::iterator lookup = scan_index.find(scan);
+    if (lookup == scan_index.end()) {
+      map<int, Spectrum*>::iterator parsed = spectra_by_scan.find(scan);
+      Spectrum* spectrum = (parsed != spectra_by_scan.end())
+        ? parsed->second : collection->getSpectrum(scan);
+      if (spectrum == NULL) {
+        carp(CARP_FATAL, "scan: %d doesn't exist or not found!", scan);
+      } else if (parsed == spectra_by_scan.end()) {
+        fetched.push_back(spectrum);
+      }
+      lookup = scan_index.insert(make_pair(scan, (int)spectra.size())).first;
+      spectra.push_back(spectrum);
+      spectrum_matches.push_back(vector<int>());
+    }
+    spectrum_matches[lookup->second].push_back(match_idx);
+
+    char* peptide_seq = match->getSequence();
+    MODIFIED_AA_T* modified_sequence = match->getModSequence();
+    int charge = match->getCharge();
+    IonConstraint* ion_constraint =
+      IonConstraint::newIonConstraintSmart(XCORR, charge);
+    IonSeries* ion_series = new IonSeries(ion_constraint, charge);
+    ion_series->update(peptide_seq, modified_sequence);
+    ion_series->predictIons();
+    for (IonIterator ion_it = ion_series->begin();
+         ion_it != ion_series->end(); ++ion_it) {
+      Ion* ion = (*ion_it);
+      if ((ion->getType() == B_ION || ion->getType() == Y_ION) &&
+          !ion->isModified()) {
+        ion_mzs[match_idx].push_back(ion->getMassZ());
+      }
+    }
+    delete ion_series;
+    free(peptide_seq);
+  }
+
+  int num_threads = Params::GetInt("num-threads");
+  if (num_threads < 1) {
+    num_threads = boost::thread::hardware_concurrency();
+  }
+  num_threads = max(1, min(num_threads, (int)spectra.size()));
+  intensities.assign(matches.size(), 0);
+  if (num_threads == 1) {
+    sumSpectrumIntensities(&spectra, &spectrum_matches, &ion_mzs, bin_width_,
+                           0, 1, &intensities);
+  } else {
+    boost::thread_group threads;
+    for (int thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+      threads.add_thread(new boost::thread(boost::bind(
+        &SpectralCounts::sumSpectrumIntensities, &spectra, &spectrum_matches,
+        &ion_mzs, bin_width_, thread_idx, num_threads, &intensities)));
+    }
+    threads.join_all();
   }
 
-  Ion* ion;
-  SCORER_TYPE_T score_type = XCORR;
-  IonConstraint* ion_constraint =
-    IonConstraint::newIonConstraintSmart(score_type, charge);
-  IonSeries* ion_series = new IonSeries(ion_constraint, charge);
-  ion_series->update(peptide_seq, modified_sequence);
-  ion_series->predictIons();
-  for (IonIterator ion_it = ion_series->begin();
-       ion_it != ion_series->end(); ++ion_it) {
-    ion = (*ion_it);
-    if (ion -> getType() == B_ION || ion -> getType() == Y_ION) {
-      if (!ion->isModified()) {
-        Peak * peak = spectrum->getNearestPeak(ion->getMassZ(),
-                                                bin_width_);
+  for (size_t idx = 0; idx < fetched.size(); idx++) {
+    delete fetched[idx];
+  }
+  delete collection;
+}
+
+/**
+ * Worker for sumMatchIntensities: handles every num_threads-th spectrum,
+ * starting at thread_idx, and writes the sum of the nearest peaks to the
+ * predicted ions of each of its matches.
+ */
+void SpectralCounts::sumSpectrumIntensities(
+  const vector<Spectrum*>* spectra,
+  const vector< vector<int> >* spectrum_matches,
+  const vector< vector<FLOAT_T> >* ion_mzs,
+  FLOAT_T bin_width,
+  int thread_idx,
+  int num_threads,
+  vector<FLOAT_T>* intensities
+  ) {
+  for (size_t spec_idx = thread_idx; spec_idx < spectra->size();
+       spec_idx += num_threads) {
+    Spectrum spectrum;
+    spectrum.copyFrom((*spectra)[spec_idx]);
+    const vector<int>& match_idxs = (*spectrum_matches)[spec_idx];
+    for (size_t idx = 0; idx < match_idxs.size(); idx++) {
+      const vector<FLOAT_T>& mzs = (*ion_mzs)[match_idxs[idx]];
+      FLOAT_T match_intensity = 0;
+      for (size_t ion = 0; ion < mzs.size(); ion++) {
+        Peak* peak = spectrum.getNearestPeak(mzs[ion], bin_width);
         if (peak != NULL) {
           match_intensity += peak->getIntensity();
         }
       }
+      (*intensities)[match_idxs[idx]] = match_intensity;
     }
   }
-  delete ion_series;
-  free(peptide_seq);
-
-  return match_intensity;
 }
 
 
@@ -488,52 +599,20 @@ FLOAT_T SpectralCounts::sumMatchIntensity(Match* match,
  * observed per protein.
  */
 void SpectralCounts::getPeptideScores() {
-  Crux::SpectrumCollection* spectra = NULL;
-
-  // for SIN, parse out spectrum collection from ms2 fiel
-  if( measure_ == MEASURE_SIN ) {
-    spectra = SpectrumCollectionFactory::create(Params::GetString("input-ms2"));
-  }
-
-  for(set<Match*>::iterator match_it = matches_.begin();
-      match_it != matches_.end(); ++match_it) {
-
-    FLOAT_T match_intensity = 1; // for NSAF just count each for the peptide/
-
-    Match* match = (*match_it);
-    // for sin, calculate total ion intensity for match by
-    // summing up peak intensities
-    if (measure_ == MEASURE_SIN) {
-      match_intensity = sumMatchIntensity(match, spectra);
-    }
-
-    // add ion_intensity to peptide scores
-    Peptide* peptide = match->getPeptide();
-
-    if ( measure_ == MEASURE_DNSAF) {
-      //keep track of unique and shared mappings.
-      if (peptide->getNumPeptideSrc() > 1) {
-        if (peptide_scores_shared_.find(peptide) == peptide_scores_shared_.end()) {
-          peptide_scores_shared_.insert(make_pair(peptide, 0.0));
-        }
-        peptide_scores_shared_[peptide] += match_intensity;
-      } else {
-        if (peptide_scores_unique_.find(peptide) == peptide_scores_unique_.end()) {
-          peptide_scores_unique_.insert(make_pair(peptide, 0.0));
-        }
-        peptide_scores_unique_[peptide] += match_intensity;
-      }
-    }
-
-    if (peptide_scores_.find(peptide) ==  peptide_scores_.end()) {
-      peptide_scores_.insert(make_pair(peptide, 0.0));
-    }
-    peptide_scores_[peptide] += match_intensity;
+  vector<Match*> matches(matches_.begin(), matches_.end());
 
+  // for NSAF just count each for the peptide; for sin, calculate total
+  // ion intensity for each match by summing up peak intensities
+  vector<FLOAT_T> intensities(matches.size(), 1);
+  if (measure_ == MEASURE_SIN) {
+    sumMatchIntensities(matches, intensities);
   }
 
-  if (measure_ == MEASURE_SIN) {
-    delete spectra;
+  // add ion_intensity to peptide scores
+  for (size_t idx = 0; idx < matches.size(); idx++) {
+    Peptide* peptide = matches[idx]->getPeptide();
+    peptide_scores_.insert(make_pair(peptide, 0.0)).first->second +=
+      intensities[idx];
   }
 
   // for emPAI we just need a count of unique peptides
@@ -767,35 +846,31 @@ void SpectralCounts::writeRankedPeptides() {
 
 void SpectralCounts::writeRankedProteins() {
   bool isParsimony = !protein_meta_protein_.empty();
+  // Rank of each protein id, taken from the last meta protein (in
+  // meta_protein_ranks_ order) that contains a protein with that id.
+  boost::unordered_map<string, int> id_ranks;
+  if (isParsimony) {
+    for (MetaToRank::iterator iter = meta_protein_ranks_.begin();
+         iter != meta_protein_ranks_.end(); ++iter) {
+      const MetaProtein& proteins = iter->first;
+      for (MetaProtein::const_iterator protein_it = proteins.begin();
+           protein_it != proteins.end(); ++protein_it) {
+        id_ranks[(*protein_it)->getIdPointer()] = iter->second;
+      }
+    }
+  }
   // reorganize the protein,score pairs to sort by score
   vector<boost::tuple<FLOAT_T, Protein*, int> > proteins;
   for (ProteinToScore::iterator it = protein_scores_.begin(); 
        it != protein_scores_.end(); ++it) {
     int rank = -1;
     if (isParsimony) {
-      /* This find doesn't seem to work for all proteins within a metaprotein, 
-         needs to be debugged
-         if we are going to use it. For now, do a brute force find. (SJM _2018_05_26)   
-      MetaToRank::const_iterator lookup =
-        meta_protein_ranks_.find(protein_meta_protein_[it->first]);
-      if (lookup != meta_protein_ranks_.end()) {
+      boost::unordered_map<string, int>::const_iterator lookup =
+        id_ranks.find(it->first->getIdPointer());
+      if (lookup != id_ranks.end()) {
+        carp(CARP_DEBUG, "Found protein %s", lookup->first.c_str());
         rank = lookup->second;
-      } else {
-      */
-      for (MetaToRank::iterator iter = meta_protein_ranks_.begin();
-        iter != meta_protein_ranks_.end();
-	++iter) {
-	  MetaProtein proteins = iter->first;
-	  for (MetaProtein::iterator protein_it = proteins.begin();
-	       protein_it != proteins.end(); ++protein_it) {
-	    Protein* protein = (*protein_it);
-	    if (protein->getId() == it->first->getId()) {
-	      carp(CARP_DEBUG, "Found protein %s",protein->getId().c_str());
-	      rank = iter->second;
-	    }
-	  }
       }
-      // }
     }
     proteins.push_back(boost::make_tuple(it->second, it->first, rank));
   }
@@ -829,25 +904,43 @@ bool SpectralCounts::sortRankedProteins(
 /**
  * Fills in the MetaMapping with entries of set of 
  * peptides that can be found in every protein in
- * the meta protein
- *
+ * the meta protein.  Proteins are first grouped by hashing their
+ * peptide id rows, so the MetaMapping is only touched once per group.
  */
 void SpectralCounts::getMetaMapping() {
   carp(CARP_DEBUG, "Creating a mapping of meta protein to peptides");
-  int count = 0;
-  for(ProteinToPeptides::iterator prot_it = protein_supporting_peptides_.begin();
-       prot_it != protein_supporting_peptides_.end(); ++prot_it) {
-    Protein* protein = prot_it->first;
-    PeptideSet pep_set = prot_it->second;
-
-    if (meta_mapping_.find(pep_set) == meta_mapping_.end()) {
-      MetaProtein meta_protein(protein_id_less_than);
-      count++;
-      meta_mapping_.insert(make_pair(pep_set, meta_protein));
+  typedef boost::unordered_map<vector<int>, int, boost::hash< vector<int> > >
+    RowToGroup;
+  RowToGroup row_groups;
+  vector< vector<int> > groups;
+  vector<const vector<int>*> group_rows;
+  for (size_t prot = 0; prot < proteins_.size(); prot++) {
+    vector<int> row(protein_peptide_ids_.begin() + protein_peptide_offsets_[prot],
+                    protein_peptide_ids_.begin() + protein_peptide_offsets_[prot + 1]);
+    pair<RowToGroup::iterator, bool> inserted =
+      row_groups.insert(make_pair(row, (int)groups.size()));
+    if (inserted.second) {
+      groups.push_back(vector<int>());
+      group_rows.push_back(&inserted.first->first);
     }
-    meta_mapping_[pep_set].insert(protein);
+    groups[inserted.first->second].push_back(prot);
   }
 
+  for (size_t group = 0; group < groups.size(); group++) {
+    const vector<int>& row = *group_rows[group];
+    PeptideSet pep_set(Peptide::lessThan);
+    for (size_t idx = 0; idx < row.size(); idx++) {
+      pep_set.insert(pep_set.end(), peptides_[row[idx]]);
+    }
+    MetaMapping::iterator meta_it = meta_mapping_.find(pep_set);
+    if (meta_it == meta_mapping_.end()) {
+      meta_it = meta_mapping_.insert(
+        make_pair(pep_set, MetaProtein(protein_id_less_than))).first;
+    }
+    for (size_t idx = 0; idx < groups[group].size(); idx++) {
+      meta_it->second.insert(proteins_[groups[group][idx]]);
+    }
+  }
 }
 
 /**
@@ -919,43 +1012,75 @@ void SpectralCounts::getMetaRanks() {
  * Greedily finds a peptide-to-protein mapping where each
  * peptide is only mapped to a single meta-protein. 
  *
- * Would of been better to implement with priority queue w/
- * adjancency lists: O(n*log(n)) but input size should be
- * small enough that performance should not be an issue.
+ * Meta proteins are picked off in order of the number of peptides they
+ * still claim, using a max-heap whose stale counts are refreshed lazily
+ * and a bitset of the peptides already claimed.  Ties go to the meta
+ * protein that comes later in the MetaMapping.
  */
 void SpectralCounts::performParsimonyAnalysis() {
   carp(CARP_DEBUG, "Performing Greedy Parsimony analysis");
   MetaMapping result(comparePeptideSets);
-  vector< pair<PeptideSet, MetaProtein > > peps_vector;
 
-  // get all meta mappings into a vector 
+  // peptide ids of each meta protein, and the meta proteins of each peptide
+  vector<MetaMapping::iterator> metas;
+  vector<int> meta_offsets(1, 0);
+  vector<int> meta_peptides;
+  vector<int> peptide_offsets(peptides_.size() + 1, 0);
   for (MetaMapping::iterator meta_iter = meta_mapping_.begin();
        meta_iter != meta_mapping_.end(); ++meta_iter) {
-    peps_vector.push_back((*meta_iter));
+    metas.push_back(meta_iter);
+    for (PeptideSet::const_iterator pep_it = meta_iter->first.begin();
+         pep_it != meta_iter->first.end(); ++pep_it) {
+      int pep = peptide_ids_[*pep_it];
+      meta_peptides.push_back(pep);
+      peptide_offsets[pep + 1]++;
+    }
+    meta_offsets.push_back(meta_peptides.size());
+  }
+  for (size_t pep = 0; pep < peptides_.size(); pep++) {
+    peptide_offsets[pep + 1] += peptide_offsets[pep];
+  }
+  vector<int> peptide_metas(meta_peptides.size());
+  vector<int> fill(peptide_offsets.begin(), peptide_offsets.end() - 1);
+  for (size_t meta = 0; meta < metas.size(); meta++) {
+    for (int idx = meta_offsets[meta]; idx < meta_offsets[meta + 1]; idx++) {
+      peptide_metas[fill[meta_peptides[idx]]++] = meta;
+    }
   }
-
 
   // greedy algorithm to pick off the meta proteins with
   // most peptide mappings
-  while (!peps_vector.empty()) {
-    sort(peps_vector.begin(), peps_vector.end(), setsAreEqualSize);
-    pair<PeptideSet, MetaProtein> node = peps_vector.back();
-    peps_vector.pop_back();
-    if (node.first.size() == 0) { break; }// do not enter anything without peptide sizes
-    result.insert(node);
-    PeptideSet cur_peptides = node.first;
-    // update the peptide sets for the rest of meta proteins
-    for (vector< pair<PeptideSet, MetaProtein > >::iterator
-         iter = peps_vector.begin();
-         iter != peps_vector.end(); ++iter) {
-      PeptideSet peptides = (*iter).first;
-      PeptideSet difference(Peptide::lessThan);
-      set_difference(peptides.begin(), peptides.end(),
-                     cur_peptides.begin(), cur_peptides.end(),
-                     inserter(difference, difference.end()),
-                    Peptide::lessThan);
-      (*iter).first = difference;
+  vector<int> remaining(metas.size());
+  priority_queue< pair<int, int> > heap;
+  for (size_t meta = 0; meta < metas.size(); meta++) {
+    remaining[meta] = meta_offsets[meta + 1] - meta_offsets[meta];
+    heap.push(make_pair(remaining[meta], (int)meta));
+  }
+  vector<bool> claimed(peptides_.size(), false);
+  while (!heap.empty()) {
+    pair<int, int> node = heap.top();
+    heap.pop();
+    int meta = node.second;
+    if (node.first != remaining[meta]) {
+      heap.push(make_pair(remaining[meta], meta));
+      continue;
     }
+    if (node.first == 0) { break; }// do not enter anything without peptide sizes
+    PeptideSet cur_peptides(Peptide::lessThan);
+    for (int idx = meta_offsets[meta]; idx < meta_offsets[meta + 1]; idx++) {
+      int pep = meta_peptides[idx];
+      if (claimed[pep]) {
+        continue;
+      }
+      claimed[pep] = true;
+      cur_peptides.insert(cur_peptides.end(), peptides_[pep]);
+      // update the peptide counts for the rest of meta proteins
+      for (int other = peptide_offsets[pep]; other < peptide_offsets[pep + 1];
+           other++) {
+        remaining[peptide_metas[other]]--;
+      }
+    }
+    result.insert(make_pair(cur_peptides, metas[meta]->second));
   }
   meta_mapping_ = result;
 }
@@ -972,13 +1097,19 @@ void SpectralCounts::makeUniqueMapping() {
   carp(CARP_DEBUG, "Filtering peptides that have more"
          "than one protein source");
     for (PeptideToScore::iterator it = peptide_scores_.begin();
-         it != peptide_scores_.end(); ++it) {
+         it != peptide_scores_.end(); ) {
       Peptide* peptide = it->first;
       int num_proteins = peptide->getNumPeptideSrc();
       if (num_proteins > 1) {
-        peptide_scores_.erase(it);
+        peptide_scores_.erase(it++);
+      } else {
+        ++it;
       }
     }
+    // keep the protein mapping in step with the remaining peptides
+    if (!peptides_.empty()) {
+      getProteinToPeptides();
+    }
   }
 }
 
@@ -1079,6 +1210,7 @@ vector<string> SpectralCounts::getOptions() const {
     "custom-threshold-name",
     "custom-threshold-min",
     "mzid-use-pass-threshold",
+    "num-threads",
     "protein-database"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
@@ -1162,16 +1294,6 @@ bool SpectralCounts::compareMetaProteins(MetaProtein set_one,
   return set_one.size() < set_two.size();
 }
 
-/**
- * Compare the size of the PeptideSets in the two given pairs.
- * \returns True if the PeptideSets are the same size, else false.
- */
-bool SpectralCounts::setsAreEqualSize(
-  const pair<PeptideSet, MetaProtein>& peps_one ,
-  const pair<PeptideSet, MetaProtein>& peps_two) {
-  return ((peps_one).first.size() < (peps_two).first.size());
-}
-
 bool SpectralCounts::compareMetaScorePair(
   const std::pair<FLOAT_T, MetaProtein>& x,
   const std::pair<FLOAT_T, MetaProtein>& y) {
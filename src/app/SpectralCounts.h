@@ -20,6 +20,7 @@
 #include "io/OutputFiles.h"
 
 #include "boost/tuple/tuple.hpp"
+#include "boost/unordered_map.hpp"
 
 class SpectralCounts: public CruxApplication { 
 
@@ -51,13 +52,6 @@ class SpectralCounts: public CruxApplication {
    */
   typedef std::map<PeptideSet, MetaProtein, 
               bool(*)(PeptideSet, PeptideSet) > MetaMapping;
-  /**
-   * \typedef ProteinToPeptides
-   * Mapping of Protein objects to a set of peptides that are part
-   * of the protein sequence
-   */
-  typedef std::map<Crux::Protein*, PeptideSet , 
-    bool(*)(Crux::Protein*, Crux::Protein*)> ProteinToPeptides;
   /**
    * \typedef MetaToScore
    * \brief Mapping of MetaProtein to the score assigned to it
@@ -101,8 +95,22 @@ class SpectralCounts: public CruxApplication {
 
   void computeEmpai();
   void makeUniqueMapping();
-  FLOAT_T sumMatchIntensity(Crux::Match* match,
-                          Crux::SpectrumCollection* spectra);
+
+  /**
+   * For the spectrum of each match, sum the intensities of all b and y
+   * ions that are not modified.  Ions are predicted serially; the peak
+   * lookups are spread over num-threads threads, one spectrum per task.
+   */
+  void sumMatchIntensities(const std::vector<Crux::Match*>& matches,
+                           std::vector<FLOAT_T>& intensities);
+  static void sumSpectrumIntensities(
+    const std::vector<Crux::Spectrum*>* spectra,
+    const std::vector< std::vector<int> >* spectrum_matches,
+    const std::vector< std::vector<FLOAT_T> >* ion_mzs,
+    FLOAT_T bin_width,
+    int thread_idx,
+    int num_threads,
+    std::vector<FLOAT_T>* intensities);
   SCORER_TYPE_T get_qval_type(MatchCollection* match_collection);
 
   void writeRankedPeptides();
@@ -162,14 +170,22 @@ class SpectralCounts: public CruxApplication {
   MatchCollectionParser parser_;
 
   PeptideToScore peptide_scores_;
-  PeptideToScore peptide_scores_unique_;
-  PeptideToScore peptide_scores_shared_;
 
   ProteinToScore protein_scores_;
-  ProteinToScore protein_scores_unique_;
-  ProteinToScore protein_scores_shared_;
 
-  ProteinToPeptides protein_supporting_peptides_;
+  // Integer-id view of the peptide/protein incidence built by
+  // getProteinToPeptides().  Peptides are numbered in peptide_scores_
+  // order and proteins in protein_id_less_than order; both directions
+  // are stored in compressed sparse row form.  The peptide rows keep one
+  // entry per PeptideSrc, the protein rows are sorted and unique.
+  std::vector<Crux::Peptide*> peptides_;
+  std::vector<Crux::Protein*> proteins_;
+  boost::unordered_map<Crux::Peptide*, int> peptide_ids_;
+  std::vector<int> peptide_protein_offsets_;
+  std::vector<int> peptide_protein_ids_;
+  std::vector<int> protein_peptide_offsets_;
+  std::vector<int> protein_peptide_ids_;
+
   ProteinToMetaProtein protein_meta_protein_;
   MetaMapping meta_mapping_;
   MetaToScore meta_protein_scores_;
@@ -178,8 +194,6 @@ class SpectralCounts: public CruxApplication {
   // comparison function declarations
   static bool comparePeptideSets(PeptideSet, PeptideSet);
   static bool compareMetaProteins(MetaProtein, MetaProtein);
-  static bool setsAreEqualSize(const std::pair<PeptideSet, MetaProtein>&,
-                               const std::pair<PeptideSet, MetaProtein>&);
   static bool compareMetaScorePair(const std::pair<FLOAT_T, MetaProtein>&,
                                    const std::pair<FLOAT_T, MetaProtein>&);
  
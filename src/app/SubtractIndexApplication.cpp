@@ -12,7 +12,10 @@
 #include "util/FileUtils.h"
 #include "io/carp.h"
 #include "app/tide/abspath.h"
+#include "app/tide/mass_directory.h"
 #include "app/tide/records_to_vector-inl.h"
+#include "boost/unordered_map.hpp"
+#include "boost/unordered_set.hpp"
 
 #define CHECK(x) GOOGLE_CHECK(x)
 
@@ -47,13 +50,12 @@ int SubtractIndexApplication::main(int argc, char** argv) {
   string auxlocs_file1 = index1 + "/auxlocs";
 
   carp(CARP_INFO, "Reading index %s", index1.c_str());
-  ProteinVec proteins1;
-  pb::Header protein_header1;
-  if (!ReadRecordsToVector<pb::Protein, const pb::Protein>(&proteins1,
-    proteins_file1, &protein_header1)) {
+  // Proteins are only looked up by id, so map them rather than parse them
+  ProteinBlob proteins1;
+  if (!proteins1.Load(proteins_file1)) {
     carp(CARP_FATAL, "Error reading index (%s)", proteins_file1.c_str());
   }
-  carp(CARP_DEBUG, "Read %d proteins", proteins1.size());
+  carp(CARP_DEBUG, "Read %d proteins", proteins1.Size());
   
   pb::Header peptides_header1;
   HeadedRecordReader peptide_reader1(peptides_file1, &peptides_header1);
@@ -80,13 +82,11 @@ int SubtractIndexApplication::main(int argc, char** argv) {
   carp(CARP_INFO, "Reading index %s", index2.c_str());
   pb::Header peptides_header2;
   HeadedRecordReader peptide_reader2(peptides_file2, &peptides_header2);
-  ProteinVec proteins2;
-  pb::Header protein_header2;
-  if (!ReadRecordsToVector<pb::Protein, const pb::Protein>(&proteins2,
-    proteins_file2, &protein_header2)) {
+  ProteinBlob proteins2;
+  if (!proteins2.Load(proteins_file2)) {
     carp(CARP_FATAL, "Error reading index (%s)", proteins_file2.c_str());
   }
-  carp(CARP_DEBUG, "Read %d proteins", proteins2.size());
+  carp(CARP_DEBUG, "Read %d proteins", proteins2.Size());
 
   //output files;
   const string index_out = Params::GetString("output index");
@@ -102,7 +102,9 @@ int SubtractIndexApplication::main(int argc, char** argv) {
     if (overwrite) {
       carp(CARP_DEBUG, "Cleaning old index file(s)");
       remove(out_proteins.c_str());
+      remove(ProteinBlob::BlobFilename(out_proteins).c_str());
       remove(out_peptides.c_str());
+      remove(MassDirectory::Filename(out_peptides).c_str());
       remove(out_aux.c_str());
     } else {
       carp(CARP_FATAL, "Index file(s) already exist, use --overwrite T or a "
@@ -122,6 +124,12 @@ int SubtractIndexApplication::main(int argc, char** argv) {
   //copy aux and protein files;
   FileUtils::Copy(auxlocs_file1, out_aux);
   FileUtils::Copy(proteins_file1, out_proteins);
+  // the blob is stamped with the protix it was made from, so write it afresh
+  // for the copy rather than copying it
+  if (!proteins1.Save(out_proteins)) {
+    carp(CARP_WARNING, "Error writing %s",
+         ProteinBlob::BlobFilename(out_proteins).c_str());
+  }
 
   pb::Header new_header;
   CHECK(peptides_header1.file_type() == pb::Header::PEPTIDES);
@@ -132,139 +140,120 @@ int SubtractIndexApplication::main(int argc, char** argv) {
   subheader->set_has_peaks(true);
   pb::Header_Source* source = new_header.add_source();
   source->mutable_header()->CopyFrom(peptides_header1);
-  HeadedRecordWriter writer(out_peptides, new_header);
+  HeadedRecordWriter* writer = new HeadedRecordWriter(out_peptides, new_header);
   CHECK(peptide_reader1.OK());
   CHECK(peptide_reader2.OK());
-  CHECK(writer.OK());
+  CHECK(writer->OK());
+  MassDirectory out_directory;
+  // Index 2 only needs to be read from the mass of the current peptides of
+  // index 1 on
+  MassDirectory directory2;
+  bool has_directory2 = directory2.Load(peptides_file2);
 
   int mass_precision = Params::GetInt("mass-precision");
-  vector< pair<pb::Peptide, bool> > pepList1;
-  vector<pb::Peptide> pepList2;
-  bool done = false;
-  while (!peptide_reader1.Done()) {
-    // populate lists of peptides
-    pb::Peptide pep1;
+  // Both indexes are sorted by mass, so they are merged in a single pass: for
+  // each group of equal-mass peptides of index 1, index 2 is advanced to that
+  // mass and the modified sequences of its targets of the same mass are
+  // hashed for lookup.
+  vector<pb::Peptide> group1;
+  vector<bool> matched;
+  boost::unordered_set<string> targets2;
+  boost::unordered_map<string, size_t> decoyOfTarget;
+  pb::Peptide pep1, pep2;
+  bool has_pep1 = !peptide_reader1.Done();
+  if (has_pep1) {
     peptide_reader1.Read(&pep1);
-    pepList1.push_back(make_pair(pep1, false));
-    while (pepList1.front().first.mass() == pepList1.back().first.mass()) {
-      if (peptide_reader1.Done()) {
-        done = true;
-        break;
+  }
+  bool has_pep2 = false;  // pep2 is the next peptide of index 2
+  while (has_pep1) {
+    double curMass = pep1.mass();
+    group1.clear();
+    while (has_pep1 && pep1.mass() == curMass) {
+      group1.push_back(pb::Peptide());
+      group1.back().Swap(&pep1);
+      has_pep1 = !peptide_reader1.Done();
+      if (has_pep1) {
+        peptide_reader1.Read(&pep1);
       }
-      peptide_reader1.Read(&pep1);
-      pepList1.push_back(make_pair(pep1, false));
-    }
-    if (done) {
-      break;
     }
-    double curMass = pepList1.front().first.mass();
-    if (!pepList2.empty() && pepList2.back().mass() < curMass) {
-      pepList2.clear();
-    }
-    if (pepList2.empty() || pepList2.front().mass() == curMass) {
-      while (!peptide_reader2.Done()) {
-        pb::Peptide pep2;
+
+    if (!has_pep2 || pep2.mass() < curMass) {
+      RecordReader* reader2 = peptide_reader2.Reader();
+      google::protobuf::uint64 offset2 = has_directory2 ? directory2.Offset(curMass) : 0;
+      if (offset2 > reader2->Position()) {
+        CHECK(reader2->Seek(offset2));
+        has_pep2 = false;
+      }
+      while ((!has_pep2 || pep2.mass() < curMass) && !peptide_reader2.Done()) {
         peptide_reader2.Read(&pep2);
-        if (pep2.mass() < curMass) {
-          continue;
-        }
-        pepList2.push_back(pep2);
-        if (pep2.mass() > curMass) {
-          break;
-        }
+        has_pep2 = true;
       }
     }
-
-    // match targets to decoys
-    map<vector< pair<pb::Peptide, bool> >::iterator, vector< pair<pb::Peptide, bool> >::iterator> targetToDecoy;
-    for (vector< pair<pb::Peptide, bool> >::iterator i = pepList1.begin(); i != pepList1.end(); i++) {
-      if (i->first.has_decoy_index()) {
-        continue;
+    targets2.clear();
+    while (has_pep2 && pep2.mass() == curMass) {
+      if (!pep2.has_decoy_index()) {
+        targets2.insert(getModifiedPeptideSeq(&pep2, proteins2));
       }
-      Peptide iPep(i->first, proteins1);
-      for (vector< pair<pb::Peptide, bool> >::iterator j = pepList1.begin(); j != pepList1.end(); j++) {
-        if (!j->first.has_decoy_index()) {
-          continue;
-        }
-        Peptide jPep(j->first, proteins1);
-        const pb::Protein* jProtein = proteins1[jPep.FirstLocProteinId()];
-        const string& residues = jProtein->residues();
-        const string originalTarget = residues.substr(residues.length() - jPep.Len());
-        if (iPep.Seq() == originalTarget) {
-          targetToDecoy[i] = j;
-          break;
-        }
+      has_pep2 = !peptide_reader2.Done();
+      if (has_pep2) {
+        peptide_reader2.Read(&pep2);
       }
     }
 
-    // match peptides in lists
-    for (vector< pair<pb::Peptide, bool> >::iterator i = pepList1.begin(); i != pepList1.end(); i++) {
-      if (i->first.mass() > curMass) {
-        break;
-      } else if (i->first.has_decoy_index()) {
-        continue; // don't match decoys
+    // match peptides; a decoy is removed with the first target of its group
+    // that it was made from, which is the last residues of its protein
+    matched.assign(group1.size(), false);
+    if (!targets2.empty()) {
+      decoyOfTarget.clear();
+      for (size_t i = 0; i < group1.size(); i++) {
+        if (group1[i].has_decoy_index()) {
+          ProteinBlob::Protein protein = proteins1[group1[i].first_location().protein_id()];
+          int length = group1[i].length();
+          decoyOfTarget.insert(make_pair(string(
+            protein.residues() + protein.residues_length() - length, length), i));
+        }
       }
-      string pepStr1 = getModifiedPeptideSeq(&i->first, &proteins1);
-      for (vector<pb::Peptide>::const_iterator j = pepList2.begin(); j != pepList2.end(); j++) {
-        if (j->mass() > curMass) {
-          break;
-        } else if (j->has_decoy_index()) {
+      for (size_t i = 0; i < group1.size(); i++) {
+        if (group1[i].has_decoy_index() ||
+            targets2.find(getModifiedPeptideSeq(&group1[i], proteins1)) == targets2.end()) {
           continue;
         }
-        string pepStr2 = getModifiedPeptideSeq(&*j, &proteins2);
-        if (pepStr1 == pepStr2) {
-          i->second = true;
-          map<vector< pair<pb::Peptide, bool> >::iterator, vector< pair<pb::Peptide, bool> >::iterator>::iterator lookup = targetToDecoy.find(i);
-          if (lookup != targetToDecoy.end()) {
-            lookup->second->second = true; // mark decoy as matched
-          }
-          break;
+        matched[i] = true;
+        const pb::Location& location = group1[i].first_location();
+        boost::unordered_map<string, size_t>::const_iterator decoy = decoyOfTarget.find(
+          string(proteins1[location.protein_id()].residues() + location.pos(),
+                 group1[i].length()));
+        if (decoy != decoyOfTarget.end()) {
+          matched[decoy->second] = true;
         }
       }
     }
 
     // write peptides
-    for (vector< pair<pb::Peptide, bool> >::iterator i = pepList1.begin(); i != pepList1.end(); i++) {
-      if (i->first.mass() > curMass) {
-        break;
-      } else if (!i->second) {
-        CHECK(writer.Write(&i->first));
-        if (write_peptides) {
-          string pepStr = getModifiedPeptideSeq(&i->first, &proteins1);
-          double mass = i->first.mass();
-          if (!i->first.has_decoy_index()) {
-            if (out_target_list) {
-              *out_target_list << pepStr << '\t'
-                               << StringUtils::ToString(mass, mass_precision)
-                               << endl;
-            }
-          } else {
-            if (out_decoy_list) {
-              *out_decoy_list << pepStr << '\t'
-                              << StringUtils::ToString(mass, mass_precision)
-                              << endl;
-            }
-          }
-        }
+    for (size_t i = 0; i < group1.size(); i++) {
+      if (matched[i]) {
+        continue;
       }
-    }
-
-    // clean up peptide lists
-    if (!pepList1.empty()) {
-      if (pepList1.back().first.mass() == curMass) {
-        pepList1.clear();
-      } else {
-        pepList1.erase(pepList1.begin(), pepList1.end() - 1);
+      if (out_directory.StartsBlock(writer->Position())) {
+        out_directory.Add(group1[i].mass(), writer->Position());
       }
-    }
-    if (!pepList2.empty()) {
-      if (pepList2.back().mass() == curMass) {
-        pepList2.clear();
-      } else {
-        pepList2.erase(pepList2.begin(), pepList2.end() - 1);
+      CHECK(writer->Write(&group1[i]));
+      if (write_peptides) {
+        string pepStr = getModifiedPeptideSeq(&group1[i], proteins1);
+        ofstream* out_list = group1[i].has_decoy_index() ? out_decoy_list : out_target_list;
+        if (out_list) {
+          *out_list << pepStr << '\t'
+                    << StringUtils::ToString(curMass, mass_precision)
+                    << endl;
+        }
       }
     }
   }
+  delete writer;  // the directory is made from the finished file
+  if (!out_directory.Write(out_peptides)) {
+    carp(CARP_WARNING, "Error writing %s",
+         MassDirectory::Filename(out_peptides).c_str());
+  }
 
   return 0;
 }
@@ -1,14 +1,21 @@
 #include <cstdio>
+#include <cstdlib>
 #include <fstream>
+#include <set>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
 #include "io/carp.h"
 #include "util/CarpStreamBuf.h"
 #include "util/AminoAcidUtil.h"
 #include "util/Params.h"
 #include "util/FileUtils.h"
+#include "util/Metrics.h"
 #include "util/StringUtils.h"
+#include "util/mass.h"
 #include "GeneratePeptides.h"
 #include "TideIndexApplication.h"
 #include "TideMatchSet.h"
+#include "app/tide/mass_directory.h"
 #include "app/tide/modifications.h"
 #include "app/tide/records_to_vector-inl.h"
 #include "ParamMedicApplication.h"
@@ -19,7 +26,8 @@
 
 extern void AddTheoreticalPeaks(const vector<const pb::Protein*>& proteins,
                                 const string& input_filename,
-                                const string& output_filename);
+                                const string& output_filename,
+                                bool compact);
 extern void AddMods(HeadedRecordReader* reader,
                     string out_file,
                     string tmpDir,                    
@@ -30,6 +38,18 @@ DECLARE_int32(max_mods);
 DECLARE_int32(min_mods);
 DECLARE_int32(modsoutputter_file_threshold);
 
+// Proteins read and digested together when building the index
+static const size_t DIGEST_BATCH_SIZE = 4096;
+// Target peptides whose decoys are generated together
+// Independently locked parts of the target peptide set
+static const size_t TARGET_SET_SHARDS = 64;
+// Size of the blocks holding copied residues of peptides being sorted
+static const size_t SORTER_BLOCK_SIZE = 1 << 20;
+// Stream buffer for each sorted run of peptides being written or read
+static const size_t SORTER_RUN_BUFFER_SIZE = 1 << 18;
+// Most sorted runs of peptides merged at once
+static const size_t SORTER_MAX_OPEN_RUNS = 64;
+
 TideIndexApplication::TideIndexApplication() {
 }
 
@@ -53,7 +73,8 @@ int TideIndexApplication::main(
     cmd_line = "crux tide-index " + fasta + " " + index;
   }
 
-  // Reroute stderr
+  // Reroute stderr, after what carp has queued so far
+  carp_flush();
   CarpStreamBuf buffer;
   streambuf* old = cerr.rdbuf();
   cerr.rdbuf(&buffer);
@@ -154,7 +175,9 @@ int TideIndexApplication::main(
     if (overwrite) {
       carp(CARP_DEBUG, "Cleaning old index file(s)");
       FileUtils::Remove(out_proteins);
+      FileUtils::Remove(ProteinBlob::BlobFilename(out_proteins));
       FileUtils::Remove(out_peptides);
+      FileUtils::Remove(MassDirectory::Filename(out_peptides));
       FileUtils::Remove(out_aux);
       FileUtils::Remove(modless_peptides);
       FileUtils::Remove(peakless_peptides);
@@ -168,11 +191,14 @@ int TideIndexApplication::main(
   carp(CARP_INFO, "Reading %s and computing unmodified peptides...",
        fasta.c_str());
   pb::Header proteinPbHeader;
-  vector<TideIndexPeptide> peptideHeap;
+  PeptideSorter peptides(Params::GetString("temp-dir"),
+                         (size_t)Params::GetInt("max-index-memory") << 20);
   vector<string*> proteinSequences;
+  Metrics::Timer digest_timer("tide-index.digest");
   fastaToPb(cmd_line, enzyme_t, digestion, missed_cleavages, min_mass, max_mass,
             min_length, max_length, allowDups, mass_type, decoy_type, fasta, out_proteins,
-            proteinPbHeader, peptideHeap, proteinSequences, out_decoy_fasta);
+            proteinPbHeader, peptides, proteinSequences, out_decoy_fasta);
+  digest_timer.Stop();
 
   pb::Header header_with_mods;
 
@@ -232,21 +258,27 @@ int TideIndexApplication::main(
 
   string basic_peptides = need_mods ? modless_peptides : peakless_peptides;
 
-  writePeptidesAndAuxLocs(peptideHeap, basic_peptides, out_aux, header_no_mods);
+  Metrics::Timer write_timer("tide-index.sort-and-write-peptides");
+  writePeptidesAndAuxLocs(peptides, basic_peptides, out_aux, header_no_mods);
+  write_timer.Stop();
   // Do some clean up
   for (vector<string*>::iterator i = proteinSequences.begin();
        i != proteinSequences.end();
        ++i) {
     delete *i;
   }
-  vector<TideIndexPeptide>().swap(peptideHeap);
   ProteinVec proteins;
   if (!ReadRecordsToVector<pb::Protein>(&proteins, out_proteins)) {
     carp(CARP_FATAL, "Error reading proteins file");
   }
+  if (!ProteinBlob::Write(out_proteins, proteins)) {
+    carp(CARP_WARNING, "Error writing %s; tide-search will read %s instead",
+         ProteinBlob::BlobFilename(out_proteins).c_str(), out_proteins.c_str());
+  }
 
   if (need_mods) {
     carp(CARP_INFO, "Computing modified peptides...");
+    Metrics::Timer mods_timer("tide-index.add-mods");
     HeadedRecordReader reader(modless_peptides, NULL, 1024 << 10); // 1024kb buffer
     AddMods(&reader, peakless_peptides, Params::GetString("temp-dir"), header_with_mods, proteins, &var_mod_table);
   }
@@ -322,7 +354,10 @@ int TideIndexApplication::main(
   }
 
   carp(CARP_INFO, "Precomputing theoretical spectra...");
-  AddTheoreticalPeaks(proteins, peakless_peptides, out_peptides);
+  Metrics::Timer peaks_timer("tide-index.add-theoretical-peaks");
+  AddTheoreticalPeaks(proteins, peakless_peptides, out_peptides,
+                      Params::GetBool("compact-index"));
+  peaks_timer.Stop();
 
   // Clean up
   for (vector<const pb::Protein*>::iterator i = proteins.begin();
@@ -337,6 +372,7 @@ int TideIndexApplication::main(
   }
 
   // Recover stderr
+  carp_flush();
   cerr.rdbuf(old);
   FileUtils::Remove(modless_peptides);
   FileUtils::Remove(peakless_peptides);
@@ -383,6 +419,7 @@ vector<string> TideIndexApplication::getOptions() const {
   string arr[] = {
     "allow-dups",
     "clip-nterm-methionine",
+    "compact-index",
     "cterm-peptide-mods-spec",
     "cterm-protein-mods-spec",
     "custom-enzyme",
@@ -393,6 +430,7 @@ vector<string> TideIndexApplication::getOptions() const {
     "isotopic-mass",
     "keep-terminal-aminos",
     "mass-precision",
+    "max-index-memory",
     "max-length",
     "max-mass",
     "max-mods",
@@ -407,6 +445,7 @@ vector<string> TideIndexApplication::getOptions() const {
     "auto-modifications",
     "auto-modifications-spectra",
     "num-decoys-per-target",
+    "num-threads",
     "output-dir",
     "overwrite",
     "parameter-file",
@@ -456,7 +495,7 @@ void TideIndexApplication::fastaToPb(
   const string& fasta,
   const string& proteinPbFile,
   pb::Header& outProteinPbHeader,
-  vector<TideIndexPeptide>& outPeptideHeap,
+  PeptideSorter& outPeptides,
   vector<string*>& outProteinSequences,
   ofstream* decoyFasta
 ) {
@@ -472,59 +511,97 @@ void TideIndexApplication::fastaToPb(
   unsigned int invalidPepCnt = 0;
   unsigned int failedDecoyCnt = 0;
 
-  outPeptideHeap.clear();
   outProteinSequences.clear();
 
   HeadedRecordWriter proteinWriter(proteinPbFile, outProteinPbHeader);
   ifstream fastaStream(fasta.c_str(), ifstream::in);
   string proteinName;
-  string* proteinSequence = new string;
   int curProtein = -1;
   vector< pair< ProteinInfo, vector<PeptideInfo> > > cleavedPeptideInfo;
-  set<string> setTargets, setDecoys;
-  map<const string*, TargetInfo> targetInfo;
 
-  // Iterate over all proteins in FASTA file
+  int numThreads = Params::GetInt("num-threads");
+  if (numThreads < 1) {
+    numThreads = boost::thread::hardware_concurrency();
+  }
+  // Amino acid masses are initialized on first use; do it before the
+  // digestion threads start.
+  get_mass_amino_acid('A', massType);
+
+  DigestSettings settings;
+  settings.enzyme = enzyme;
+  settings.digestion = digestion;
+  settings.missedCleavages = missedCleavages;
+  settings.minLength = minLength;
+  settings.maxLength = maxLength;
+  settings.minMass = minMass;
+  settings.maxMass = maxMass;
+  settings.massType = massType;
+  TargetSet targets(outProteinSequences);
+  TargetSet* trackTargets =
+    (!allowDups && decoyType != NO_DECOYS) ? &targets : NULL;
+  // The target peptides of each protein are only needed again to make
+  // decoys when duplicates are allowed, and to write the decoy fasta
+  bool keepPeptides = decoyType != PROTEIN_REVERSE_DECOYS &&
+                      (allowDups || decoyFasta);
+
+  // Read proteins from the FASTA file in batches, digest each batch in
+  // parallel, then add the peptides to the heap in FASTA order
   unsigned int targetsGenerated = 0, decoysGenerated = 0;
-  while (GeneratePeptides::getNextProtein(fastaStream, &proteinName, proteinSequence)) {
-    outProteinSequences.push_back(proteinSequence);
-    cleavedPeptideInfo.push_back(make_pair(
-      ProteinInfo(proteinName, proteinSequence), vector<PeptideInfo>()));
-    const ProteinInfo& proteinInfo = cleavedPeptideInfo.back().first;
-    vector<PeptideInfo>& cleavedPeptides = cleavedPeptideInfo.back().second;
-    // Write pb::Protein
-    writePbProtein(proteinWriter, ++curProtein, proteinName, *proteinSequence);
-    cleavedPeptides = GeneratePeptides::cleaveProtein(
-      *proteinSequence, enzyme, digestion, missedCleavages, minLength, maxLength);
-    // Iterate over all generated peptides for this protein
-    for (vector<PeptideInfo>::iterator i = cleavedPeptides.begin();
-         i != cleavedPeptides.end(); ) {
-      FLOAT_T pepMass = calcPepMassTide(i->Sequence(), massType);
-      if (pepMass < 0.0) {
+  vector<string> batchNames;
+  vector<DigestedProtein> digested;
+  for (bool moreProteins = true; moreProteins; ) {
+    size_t batchStart = outProteinSequences.size();
+    batchNames.clear();
+    while (batchNames.size() < DIGEST_BATCH_SIZE) {
+      string* proteinSequence = new string;
+      if (!GeneratePeptides::getNextProtein(fastaStream, &proteinName, proteinSequence)) {
+        delete proteinSequence;
+        moreProteins = false;
+        break;
+      }
+      outProteinSequences.push_back(proteinSequence);
+      batchNames.push_back(proteinName);
+    }
+    digested.clear();
+    digested.resize(batchNames.size());
+    parallelFor(batchNames.size(), numThreads, boost::bind(
+      &TideIndexApplication::digestTargetProtein, _1, &outProteinSequences,
+      batchStart, &settings, trackTargets, &digested));
+
+    for (size_t i = 0; i < batchNames.size(); i++) {
+      const string* proteinSequence = outProteinSequences[batchStart + i];
+      DigestedProtein& protein = digested[i];
+      // Write pb::Protein
+      writePbProtein(proteinWriter, ++curProtein, batchNames[i], *proteinSequence);
+      for (vector<string>::const_iterator j = protein.invalid.begin();
+           j != protein.invalid.end();
+           ++j) {
         // Sequence contained some invalid character
-        carp(CARP_DEBUG, "Ignoring invalid sequence <%s>", i->Sequence().c_str());
+        carp(CARP_DEBUG, "Ignoring invalid sequence <%s>", j->c_str());
         ++invalidPepCnt;
-        i = cleavedPeptides.erase(i);
-        continue;
-      } else if (pepMass < minMass || pepMass > maxMass) {
-        // Skip to next peptide if not in mass range
-        ++i;
-        continue;
       }
-      // Add target to heap
-      TideIndexPeptide pepTarget(pepMass, i->Length(), proteinSequence, curProtein, i->Position());
-      outPeptideHeap.push_back(pepTarget);
-      push_heap(outPeptideHeap.begin(), outPeptideHeap.end(), greater<TideIndexPeptide>());
-      if (!allowDups && decoyType != NO_DECOYS) {
-        const string* setTarget = &*(setTargets.insert(i->Sequence()).first);
-        targetInfo.insert(make_pair(setTarget, TargetInfo(proteinInfo, i->Position(), pepMass)));
+      // Iterate over all generated peptides for this protein
+      for (size_t j = 0; j < protein.peptides.size(); j++) {
+        FLOAT_T pepMass = protein.masses[j];
+        if (pepMass < minMass || pepMass > maxMass) {
+          // Skip to next peptide if not in mass range
+          continue;
+        }
+        // Add target to sorter
+        const PeptideInfo& peptide = protein.peptides[j];
+        TideIndexPeptide pepTarget(pepMass, peptide.Length(), outProteinSequences[batchStart + i],
+                                   curProtein, peptide.Position());
+        outPeptides.push(pepTarget);
+        ++targetsGenerated;
+      }
+      cleavedPeptideInfo.push_back(make_pair(
+        ProteinInfo(batchNames[i], proteinSequence), vector<PeptideInfo>()));
+      if (keepPeptides) {
+        cleavedPeptideInfo.back().second.swap(protein.peptides);
       }
-      ++targetsGenerated;
-      ++i;
     }
-    proteinSequence = new string;
   }
-  delete proteinSequence;
+  vector<DigestedProtein>().swap(digested);
   if (targetsGenerated == 0) {
     carp(CARP_FATAL, "No target sequences generated.  Is \'%s\' a FASTA file?",
          fasta.c_str());
@@ -533,73 +610,97 @@ void TideIndexApplication::fastaToPb(
     carp(CARP_INFO, "Ignoring %d peptide sequences containing unrecognized characters.", invalidPepCnt);
   }
   carp(CARP_INFO, "Generated %d targets, including duplicates.", targetsGenerated);
+  Metrics::Add("tide-index.targets-generated", targetsGenerated);
 
   // Generate decoys
-  map< const string, vector<const string*> > targetToDecoy;
+  map< const string, vector<string> > targetToDecoy;
+  map< const string, vector<string> >* decoyFastaMap =
+    decoyFasta ? &targetToDecoy : NULL;
   int numDecoys = Params::GetInt("num-decoys-per-target");
   if (decoyType == PROTEIN_REVERSE_DECOYS) {
     if (decoyFasta) {
       carp(CARP_INFO, "Writing reverse-protein fasta and decoys...");
     }
-    for (vector< pair< ProteinInfo, vector<PeptideInfo> > >::const_iterator i =
-         cleavedPeptideInfo.begin(); i != cleavedPeptideInfo.end(); ++i) {
-      string decoyProtein = *(i->first.sequence);
-      reverse(decoyProtein.begin(), decoyProtein.end());
-      if (decoyFasta) {
-        (*decoyFasta) << ">"<< decoyPrefix << i->first.name << endl
-                      << decoyProtein << endl;
+    vector<const string*> batchSequences;
+    for (size_t batchStart = 0; batchStart < cleavedPeptideInfo.size();
+         batchStart += DIGEST_BATCH_SIZE) {
+      size_t batchEnd = min(batchStart + DIGEST_BATCH_SIZE, cleavedPeptideInfo.size());
+      batchSequences.clear();
+      for (size_t i = batchStart; i < batchEnd; i++) {
+        batchSequences.push_back(cleavedPeptideInfo[i].first.sequence);
       }
-      vector<PeptideInfo> cleavedReverse = GeneratePeptides::cleaveProtein(
-        decoyProtein, enzyme, digestion, missedCleavages, minLength, maxLength);
-      // Iterate over all generated peptides for this protein
-      for (vector<PeptideInfo>::iterator j = cleavedReverse.begin();
-           j != cleavedReverse.end();
-           ++j) {
-        FLOAT_T pepMass = calcPepMassTide(j->Sequence(), massType);
-        if (pepMass < 0.0) {
+      digested.clear();
+      digested.resize(batchSequences.size());
+      parallelFor(batchSequences.size(), numThreads, boost::bind(
+        &TideIndexApplication::digestReversedProtein, _1, &batchSequences,
+        &settings, &digested));
+
+      for (size_t i = 0; i < batchSequences.size(); i++) {
+        const ProteinInfo& targetInfo = cleavedPeptideInfo[batchStart + i].first;
+        DigestedProtein& protein = digested[i];
+        const string& decoyProtein = protein.sequence;
+        if (decoyFasta) {
+          (*decoyFasta) << ">"<< decoyPrefix << targetInfo.name << endl
+                        << decoyProtein << endl;
+        }
+        for (vector<string>::const_iterator j = protein.invalid.begin();
+             j != protein.invalid.end();
+             ++j) {
           // Sequence contained some invalid character
           carp(CARP_DEBUG, "Ignoring invalid sequence in decoy fasta <%s>",
-               j->Sequence().c_str());
+               j->c_str());
           ++invalidPepCnt;
-          continue;
-        } else if (pepMass < minMass || pepMass > maxMass) {
-          // Skip to next peptide if not in mass range
-          continue;
-        } else if (!allowDups && setTargets.find(j->Sequence()) != setTargets.end()) {
-          // Sequence already exists as a target
-          continue;
         }
-        string* decoySequence = new string(j->Sequence());
-        outProteinSequences.push_back(decoySequence);
-
-        // Write pb::Protein
-        writeDecoyPbProtein(++curProtein, ProteinInfo(i->first.name, &decoyProtein),
-                            *decoySequence, j->Position(), proteinWriter);
-        // Add decoy to heap
-        TideIndexPeptide pepDecoy(pepMass, j->Length(), decoySequence,
-          curProtein, (j->Position() > 0) ? 1 : 0, 0);
-        outPeptideHeap.push_back(pepDecoy);
-        push_heap(outPeptideHeap.begin(), outPeptideHeap.end(),
-          greater<TideIndexPeptide>());
-        ++decoysGenerated;
+        // Iterate over all generated peptides for this protein
+        for (size_t j = 0; j < protein.peptides.size(); j++) {
+          const PeptideInfo& peptide = protein.peptides[j];
+          FLOAT_T pepMass = protein.masses[j];
+          if (pepMass < minMass || pepMass > maxMass) {
+            // Skip to next peptide if not in mass range
+            continue;
+          } else if (!allowDups && targets.contains(peptide.Sequence())) {
+            // Sequence already exists as a target
+            continue;
+          }
+          string decoySequence = peptide.Sequence();
+
+          // Write pb::Protein
+          writeDecoyPbProtein(++curProtein, ProteinInfo(targetInfo.name, &decoyProtein),
+                              decoySequence, peptide.Position(), proteinWriter);
+          // Add decoy to sorter
+          TideIndexPeptide pepDecoy(pepMass, peptide.Length(), &decoySequence,
+            curProtein, (peptide.Position() > 0) ? 1 : 0, 0);
+          outPeptides.pushCopy(pepDecoy);
+          ++decoysGenerated;
+        }
       }
     }
+    vector<DigestedProtein>().swap(digested);
   } else if (!allowDups) {
-    for (set<string>::const_iterator i = setTargets.begin();
-         i != setTargets.end();
+    // Shuffles draw from the global generator, so decoys are made one target
+    // at a time and in sequence order, as with the set of targets before
+    vector<TargetSet::Location> uniqueTargets;
+    targets.getSorted(&uniqueTargets);
+    vector<string> decoys;
+    for (vector<TargetSet::Location>::const_iterator i = uniqueTargets.begin();
+         i != uniqueTargets.end();
          ++i) {
-      const string* setTarget = &*i;
-      const map<const string*, TargetInfo>::iterator targetLookup =
-        targetInfo.find(setTarget);
-      const ProteinInfo& proteinInfo = (targetLookup->second.proteinInfo);
-      const int startLoc = targetLookup->second.start;
-      FLOAT_T pepMass = targetLookup->second.mass;
-      generateDecoys(numDecoys, *setTarget, targetToDecoy, &setTargets, &setDecoys, decoyType, allowDups,
-                     failedDecoyCnt, decoysGenerated, curProtein, proteinInfo, startLoc, proteinWriter,
-                     pepMass, outPeptideHeap, outProteinSequences);
+      const string setTarget(targets.residues(*i), i->length);
+      if (!makeDecoys(numDecoys, setTarget, decoyType, &targets, &decoys)) {
+        carp(CARP_DEBUG, "Failed to generate decoys for sequence %s", setTarget.c_str());
+        ++failedDecoyCnt;
+        continue;
+      }
+      FLOAT_T pepMass = calcPepMassTide(setTarget, massType);
+      addDecoys(decoys, setTarget, decoysGenerated, curProtein,
+                cleavedPeptideInfo[i->protein].first, i->pos,
+                proteinWriter, pepMass, outPeptides, decoyFastaMap);
     }
   } else { // allow dups
-    for (vector<pair<ProteinInfo, vector<PeptideInfo> > >::const_iterator i = cleavedPeptideInfo.begin();
+    // A repeated target reuses the decoys made for its first occurrence
+    map< const string, vector<string> > madeDecoys;
+    vector<string> decoys;
+    for (vector< pair< ProteinInfo, vector<PeptideInfo> > >::const_iterator i = cleavedPeptideInfo.begin();
          i != cleavedPeptideInfo.end();
          ++i) {
       const ProteinInfo& proteinInfo = i->first;
@@ -607,11 +708,19 @@ void TideIndexApplication::fastaToPb(
            j != i->second.end();
            ++j) {
         const string setTarget = j->Sequence();
-        const int startLoc = j->Position();
+        map< const string, vector<string> >::const_iterator made = madeDecoys.find(setTarget);
+        if (made != madeDecoys.end()) {
+          decoys = made->second;
+        } else if (makeDecoys(numDecoys, setTarget, decoyType, NULL, &decoys)) {
+          madeDecoys.insert(make_pair(setTarget, decoys));
+        } else {
+          carp(CARP_DEBUG, "Failed to generate decoys for sequence %s", setTarget.c_str());
+          ++failedDecoyCnt;
+          continue;
+        }
         FLOAT_T pepMass = calcPepMassTide(setTarget, massType);
-        generateDecoys(numDecoys, setTarget, targetToDecoy, NULL, NULL, decoyType, allowDups, failedDecoyCnt,
-                       decoysGenerated, curProtein, proteinInfo, startLoc, proteinWriter,
-                       pepMass, outPeptideHeap, outProteinSequences);
+        addDecoys(decoys, setTarget, decoysGenerated, curProtein, proteinInfo,
+                  j->Position(), proteinWriter, pepMass, outPeptides, decoyFastaMap);
       }
     }
   }
@@ -619,6 +728,7 @@ void TideIndexApplication::fastaToPb(
     carp(CARP_INFO, "Failed to generate decoys for %d low complexity peptides.", failedDecoyCnt);
   }
   carp(CARP_INFO, "Generated %d decoys.", decoysGenerated);
+  Metrics::Add("tide-index.decoys-generated", decoysGenerated);
 
   // Write to decoy fasta if necessary (if protein-reverse, we already wrote it)
   if (decoyFasta && decoyType != PROTEIN_REVERSE_DECOYS) {
@@ -633,9 +743,9 @@ void TideIndexApplication::fastaToPb(
            ++j) {
         // In the protein sequence, replace the target peptide with its decoy
         const string setTarget = j->Sequence();
-        const map< const string, vector<const string*> >::const_iterator decoyCheck = targetToDecoy.find(setTarget);
+        const map< const string, vector<string> >::const_iterator decoyCheck = targetToDecoy.find(setTarget);
         if (decoyCheck != targetToDecoy.end() && !decoyCheck->second.empty()) {
-          decoyProtein.replace(j->Position(), j->Length(), *(decoyCheck->second.front()));
+          decoyProtein.replace(j->Position(), j->Length(), decoyCheck->second.front());
         }
       }
       // Write out the final protein
@@ -646,7 +756,7 @@ void TideIndexApplication::fastaToPb(
 }
 
 void TideIndexApplication::writePeptidesAndAuxLocs(
-  vector<TideIndexPeptide>& peptideHeap,
+  PeptideSorter& peptides,
   const string& peptidePbFile,
   const string& auxLocsPbFile,
   pb::Header& pbHeader
@@ -708,29 +818,33 @@ void TideIndexApplication::writePeptidesAndAuxLocs(
   pb::Peptide pbPeptide;
   pb::AuxLocation pbAuxLoc;
   int auxLocIdx = -1;
-  carp(CARP_DETAILED_INFO, "%d peptides in heap", peptideHeap.size());
+  carp(CARP_DETAILED_INFO, "%lu peptides to sort", (unsigned long)peptides.size());
   int count = 0;
   int numTargets = 0;
   int numDecoys = 0;
   int numDuplicateTargets = 0;
   int numDuplicateDecoys = 0;
-  sort_heap(peptideHeap.begin(), peptideHeap.end(),
-            greater<TideIndexPeptide>());
-  while (!peptideHeap.empty()) {
-    TideIndexPeptide curPeptide(peptideHeap.back());
-    peptideHeap.pop_back();
+  peptides.finish();
+  // The sorter only keeps a peptide's residues until it is popped
+  string curResidues;
+  const TideIndexPeptide* next = peptides.peek();
+  while (next != NULL) {
+    TideIndexPeptide curPeptide(*next);
+    curResidues.assign(next->getResidues(), next->getLength());
+    curPeptide.setResidues(curResidues.data());
+    peptides.pop();
     // For duplicate peptides we only record the location
-    while (!peptideHeap.empty() && peptideHeap.back() == curPeptide) {
-      if (peptideHeap.back().isDecoy()) {
+    while ((next = peptides.peek()) != NULL && *next == curPeptide) {
+      if (next->isDecoy()) {
         numDuplicateDecoys++;
       } else {
         numDuplicateTargets++;
       }        
       carp(CARP_DEBUG, "Skipping duplicate %s.", curPeptide.getSequence().c_str());
       pb::Location* location = pbAuxLoc.add_location();
-      location->set_protein_id(peptideHeap.back().getProteinId());
-      location->set_pos(peptideHeap.back().getProteinPos());
-      peptideHeap.pop_back();
+      location->set_protein_id(next->getProteinId());
+      location->set_pos(next->getProteinPos());
+      peptides.pop();
     }
     getPbPeptide(count, curPeptide, pbPeptide);
     // Not all peptides have aux locations associated with them. Check to see
@@ -758,6 +872,9 @@ void TideIndexApplication::writePeptidesAndAuxLocs(
   carp(CARP_INFO, "Skipped %d duplicate targets and %d duplicate decoys.",
        numDuplicateTargets, numDuplicateDecoys);
   carp(CARP_INFO, "Wrote %d targets and %d decoys.", numTargets, numDecoys);
+  Metrics::Add("tide-index.targets-written", numTargets);
+  Metrics::Add("tide-index.decoys-written", numDecoys);
+  Metrics::Add("tide-index.duplicates-skipped", numDuplicateTargets + numDuplicateDecoys);
 }
 
 FLOAT_T TideIndexApplication::calcPepMassTide(
@@ -955,15 +1072,11 @@ void TideIndexApplication::processParams() {
 }
 
 
-string getModifiedPeptideSeq(const pb::Peptide* peptide,
-  const ProteinVec* proteins) {
+// Inserts the modifications of peptide into pep_str, its unmodified sequence
+static string addModificationsToSeq(const pb::Peptide* peptide, string pep_str) {
   int mod_index;
   double mod_delta;
   stringstream mod_stream;
-  const pb::Location& location = peptide->first_location();
-  const pb::Protein* protein = proteins->at(location.protein_id());
-  // Get peptide sequence without mods
-  string pep_str = protein->residues().substr(location.pos(), peptide->length());
 
   // Store all mod indices/deltas
   map<int, double> mod_map;
@@ -987,94 +1100,600 @@ string getModifiedPeptideSeq(const pb::Peptide* peptide,
   return pep_str;
 }
 
-void TideIndexApplication::generateDecoys(
+string getModifiedPeptideSeq(const pb::Peptide* peptide,
+  const ProteinVec* proteins) {
+  const pb::Location& location = peptide->first_location();
+  const pb::Protein* protein = proteins->at(location.protein_id());
+  // Get peptide sequence without mods
+  return addModificationsToSeq(peptide,
+    protein->residues().substr(location.pos(), peptide->length()));
+}
+
+string getModifiedPeptideSeq(const pb::Peptide* peptide,
+  const ProteinBlob& proteins) {
+  const pb::Location& location = peptide->first_location();
+  ProteinBlob::Protein protein = proteins[location.protein_id()];
+  return addModificationsToSeq(peptide,
+    string(protein.residues() + location.pos(), peptide->length()));
+}
+
+void TideIndexApplication::digestProtein(
+  const string& sequence,
+  int proteinIndex,
+  const DigestSettings& settings,
+  TargetSet* targets,
+  DigestedProtein* out
+) {
+  out->peptides = GeneratePeptides::cleaveProtein(
+    sequence, settings.enzyme, settings.digestion, settings.missedCleavages,
+    settings.minLength, settings.maxLength);
+  out->masses.clear();
+  out->masses.reserve(out->peptides.size());
+  for (vector<GeneratePeptides::CleavedPeptide>::iterator i = out->peptides.begin();
+       i != out->peptides.end(); ) {
+    FLOAT_T pepMass = calcPepMassTide(i->Sequence(), settings.massType);
+    if (pepMass < 0.0) {
+      out->invalid.push_back(i->Sequence());
+      i = out->peptides.erase(i);
+      continue;
+    }
+    out->masses.push_back(pepMass);
+    if (targets && pepMass >= settings.minMass && pepMass <= settings.maxMass) {
+      targets->insert(proteinIndex, i->Position(), i->Length());
+    }
+    ++i;
+  }
+}
+
+void TideIndexApplication::digestTargetProtein(
+  size_t i,
+  const vector<string*>* proteinSequences,
+  size_t batchStart,
+  const DigestSettings* settings,
+  TargetSet* targets,
+  vector<DigestedProtein>* out
+) {
+  digestProtein(*(*proteinSequences)[batchStart + i], batchStart + i,
+                *settings, targets, &(*out)[i]);
+}
+
+void TideIndexApplication::digestReversedProtein(
+  size_t i,
+  const vector<const string*>* proteinSequences,
+  const DigestSettings* settings,
+  vector<DigestedProtein>* out
+) {
+  DigestedProtein& protein = (*out)[i];
+  protein.sequence = *(*proteinSequences)[i];
+  reverse(protein.sequence.begin(), protein.sequence.end());
+  digestProtein(protein.sequence, -1, *settings, NULL, &protein);
+}
+
+bool TideIndexApplication::makeDecoys(
   int numDecoys,
-  const string& setTarget,
-  std::map< const string, vector<const string*> >& targetToDecoy,
-  set<string>* setTargets,
-  set<string>* setDecoys,
+  const string& target,
   DECOY_TYPE_T decoyType,
-  bool allowDups,
-  unsigned int& failedDecoyCnt,
+  const GeneratePeptides::SequenceLookup* excluded,
+  vector<string>* outDecoys
+) {
+  int generateAttemptsMax = 6;
+  bool shuffle = decoyType == PEPTIDE_SHUFFLE_DECOYS;
+  if (!shuffle) {
+    numDecoys = 1;
+    generateAttemptsMax = 1;
+  }
+  outDecoys->clear();
+  for (int i = 0; i < numDecoys; i++) {
+    string decoy;
+    bool success = false;
+    for (int j = 0; j < generateAttemptsMax; j++) {
+      success = GeneratePeptides::makeDecoy(target, excluded, shuffle, decoy);
+      if (success) {
+        break;
+      }
+    }
+    if (!success) {
+      outDecoys->clear();
+      return false;
+    }
+    outDecoys->push_back(decoy);
+  }
+  return true;
+}
+
+void TideIndexApplication::addDecoys(
+  const vector<string>& decoys,
+  const string& target,
   unsigned int& decoysGenerated,
   int& curProtein,
   const ProteinInfo& proteinInfo,
   const int startLoc,
   HeadedRecordWriter& proteinWriter,
   FLOAT_T pepMass,
-  vector<TideIndexPeptide>& outPeptideHeap,
-  vector<string*>& outProteinSequences
+  PeptideSorter& outPeptides,
+  map< const string, vector<string> >* targetToDecoy
 ) {
-  vector<string*> decoySequences;
-  int generateAttemptsMax = 6;
-  const map< const string, vector<const string*> >::const_iterator decoyCheck = targetToDecoy.find(setTarget);
-  if (decoyCheck != targetToDecoy.end()) {
-    // Decoys already generated for this sequence
-    decoySequences = vector<string*>(decoyCheck->second.size(), NULL);
-    for (size_t i = 0; i < decoyCheck->second.size(); i++) {
-      decoySequences[i] = new string(*(decoyCheck->second[i]));
+  vector<string>* decoyList = NULL;
+  if (targetToDecoy) {
+    pair<map< const string, vector<string> >::iterator, bool> inserted =
+      targetToDecoy->insert(make_pair(target, vector<string>()));
+    if (inserted.second) {
+      decoyList = &inserted.first->second;
     }
-  } else {
-    // Try to generate decoys
-    bool shuffle = decoyType == PEPTIDE_SHUFFLE_DECOYS;
-    if (!shuffle) {
-      numDecoys = 1;
-      generateAttemptsMax = 1;
+  }
+  for (size_t i = 0; i < decoys.size(); i++) {
+    const string* seq = &decoys[i];
+    carp(CARP_DETAILED_DEBUG, "Got decoy sequence %d: %s.", i, seq->c_str());
+    if (decoyList) {
+      decoyList->push_back(*seq);
     }
-    set<string> targets, decoys;
-    if (allowDups) {
-      setTargets = &targets;
-      setDecoys = &decoys;
+    // Write pb::Protein In this subroutine, the startLoc is used to
+    // construct a longer sequence containing N- and C-term residues,
+    // plus the target.
+    writeDecoyPbProtein(++curProtein, proteinInfo, *seq, startLoc, proteinWriter);
+    // Add decoy to sorter
+    TideIndexPeptide pepDecoy(pepMass, target.length(), seq, curProtein, (startLoc > 0) ? 1 : 0, i);
+    outPeptides.pushCopy(pepDecoy);
+  }
+  decoysGenerated += decoys.size();
+}
+
+void TideIndexApplication::parallelFor(
+  size_t n,
+  int numThreads,
+  const boost::function<void(size_t)>& f
+) {
+  if (numThreads <= 1 || n <= 1) {
+    for (size_t i = 0; i < n; i++) {
+      f(i);
     }
-    set<string> generatedDecoys;
-    set<string> dummy;
-    for (int i = 0; i < numDecoys; i++) {
-      string* outSeq = new string;
-      bool success = false;
-      for (int j = 0; j < generateAttemptsMax; j++) {
-        success = GeneratePeptides::makeDecoy(setTarget, *setTargets, dummy, shuffle, *outSeq);
-        if (success) {
-          break;
-        }
-      }
-      if (!success) {
-        carp(CARP_DEBUG, "Failed to generate decoys for sequence %s", setTarget.c_str());
-        delete outSeq;
-        ++failedDecoyCnt;
-        return;
+    return;
+  }
+  boost::thread_group threads;
+  for (int t = 1; t < numThreads && (size_t)t < n; t++) {
+    threads.add_thread(new boost::thread(boost::bind(
+      &TideIndexApplication::parallelForStride, t, numThreads, n, boost::cref(f))));
+  }
+  parallelForStride(0, numThreads, n, f);
+  threads.join_all();
+}
+
+void TideIndexApplication::parallelForStride(
+  size_t first,
+  size_t stride,
+  size_t n,
+  const boost::function<void(size_t)>& f
+) {
+  for (size_t i = first; i < n; i += stride) {
+    f(i);
+  }
+}
+
+TideIndexApplication::TargetSet::TargetSet(const vector<string*>& proteinSequences)
+  : proteinSequences_(proteinSequences), shards_(TARGET_SET_SHARDS) {
+  for (size_t i = 0; i < shards_.size(); i++) {
+    shards_[i] = new Shard;
+    shards_[i]->slots.resize(1024);
+    shards_[i]->count = 0;
+  }
+}
+
+TideIndexApplication::TargetSet::~TargetSet() {
+  for (size_t i = 0; i < shards_.size(); i++) {
+    delete shards_[i];
+  }
+}
+
+/**
+ * FNV-1a over the residues, finished with a 64-bit mix so that the high bits
+ * used to pick a shard are as well distributed as the low ones. Never 0.
+ */
+uint64_t TideIndexApplication::TargetSet::fingerprint(const char* residues, size_t length) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    h ^= (unsigned char)residues[i];
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h != 0 ? h : 1;
+}
+
+TideIndexApplication::TargetSet::Slot* TideIndexApplication::TargetSet::find(
+  Shard& shard, uint64_t fp, const char* residues, size_t length
+) const {
+  size_t mask = shard.slots.size() - 1;
+  for (size_t i = fp & mask; ; i = (i + 1) & mask) {
+    Slot& slot = shard.slots[i];
+    if (slot.fingerprint == 0 ||
+        (slot.fingerprint == fp && slot.location.length == (int)length &&
+         memcmp(this->residues(slot.location), residues, length) == 0)) {
+      return &slot;
+    }
+  }
+}
+
+void TideIndexApplication::TargetSet::grow(Shard& shard) {
+  vector<Slot> old(shard.slots.size() * 2);
+  old.swap(shard.slots);
+  size_t mask = shard.slots.size() - 1;
+  for (vector<Slot>::const_iterator i = old.begin(); i != old.end(); ++i) {
+    if (i->fingerprint != 0) {
+      size_t j = i->fingerprint & mask;
+      while (shard.slots[j].fingerprint != 0) {
+        j = (j + 1) & mask;
       }
-      decoySequences.push_back(outSeq);
+      shard.slots[j] = *i;
     }
-    map< const string, vector<const string*> >::iterator i =
-      targetToDecoy.insert(make_pair(setTarget, vector<const string*>())).first;
-    if (!allowDups) {
-      for (vector<string*>::const_iterator j = decoySequences.begin(); j != decoySequences.end(); j++) {
-        set<string>::iterator k = setDecoys->insert(**j).first;
-        i->second.push_back(&*k);
+  }
+}
+
+void TideIndexApplication::TargetSet::insert(int protein, int pos, int length) {
+  const char* seq = proteinSequences_[protein]->data() + pos;
+  uint64_t fp = fingerprint(seq, length);
+  Shard& shard = *shards_[(fp >> 32) % shards_.size()];
+  boost::mutex::scoped_lock lock(shard.mutex);
+  if ((shard.count + 1) * 4 > shard.slots.size() * 3) {
+    grow(shard);
+  }
+  Slot* slot = find(shard, fp, seq, length);
+  if (slot->fingerprint == 0) {
+    slot->fingerprint = fp;
+    slot->location.protein = protein;
+    slot->location.pos = pos;
+    slot->location.length = length;
+    ++shard.count;
+  } else if (protein < slot->location.protein ||
+             (protein == slot->location.protein && pos < slot->location.pos)) {
+    slot->location.protein = protein;
+    slot->location.pos = pos;
+  }
+}
+
+bool TideIndexApplication::TargetSet::contains(const string& seq) const {
+  uint64_t fp = fingerprint(seq.data(), seq.length());
+  Shard& shard = *shards_[(fp >> 32) % shards_.size()];
+  boost::mutex::scoped_lock lock(shard.mutex);
+  return find(shard, fp, seq.data(), seq.length())->fingerprint != 0;
+}
+
+size_t TideIndexApplication::TargetSet::size() const {
+  size_t total = 0;
+  for (size_t i = 0; i < shards_.size(); i++) {
+    total += shards_[i]->count;
+  }
+  return total;
+}
+
+/**
+ * Orders target locations as std::string orders their sequences
+ */
+class TideIndexApplication::TargetSet::LocationLess {
+ public:
+  explicit LocationLess(const TargetSet* targets) : targets_(targets) {}
+  bool operator()(const Location& lhs, const Location& rhs) const {
+    int cmp = memcmp(targets_->residues(lhs), targets_->residues(rhs),
+                     min(lhs.length, rhs.length));
+    return cmp != 0 ? cmp < 0 : lhs.length < rhs.length;
+  }
+ private:
+  const TargetSet* targets_;
+};
+
+void TideIndexApplication::TargetSet::getSorted(vector<Location>* out) const {
+  out->clear();
+  out->reserve(size());
+  for (size_t i = 0; i < shards_.size(); i++) {
+    const vector<Slot>& slots = shards_[i]->slots;
+    for (vector<Slot>::const_iterator j = slots.begin(); j != slots.end(); ++j) {
+      if (j->fingerprint != 0) {
+        out->push_back(j->location);
       }
+    }
+  }
+  sort(out->begin(), out->end(), LocationLess(this));
+}
+
+class TideIndexApplication::PeptideSorter::PeptideLess {
+ public:
+  // Index order, as given by operator>, with ties broken by location so that
+  // the order does not depend on how the peptides were split into runs
+  bool operator()(const TideIndexPeptide& lhs, const TideIndexPeptide& rhs) const {
+    if (rhs > lhs) {
+      return true;
+    } else if (lhs > rhs) {
+      return false;
+    } else if (lhs.getProteinId() != rhs.getProteinId()) {
+      return lhs.getProteinId() < rhs.getProteinId();
+    }
+    return lhs.getProteinPos() < rhs.getProteinPos();
+  }
+};
+
+class TideIndexApplication::PeptideSorter::RunReader {
+ public:
+  explicit RunReader(const string& file)
+    : file_(file), buffer_(SORTER_RUN_BUFFER_SIZE) {
+    stream_.rdbuf()->pubsetbuf(&buffer_[0], buffer_.size());
+    stream_.open(file.c_str(), ios::in | ios::binary);
+    if (!stream_.is_open()) {
+      carp(CARP_FATAL, "Error opening %s", file.c_str());
+    }
+  }
+
+  /**
+   * Reads the next peptide of the run; returns false at the end of the run
+   */
+  bool next() {
+    double mass;
+    int32_t fields[4];  // length, protein id, protein position, decoy index
+    if (!stream_.read((char*)&mass, sizeof(mass))) {
+      return false;
+    } else if (!stream_.read((char*)fields, sizeof(fields))) {
+      carp(CARP_FATAL, "Error reading %s", file_.c_str());
+    }
+    residues_.resize(fields[0]);
+    if (fields[0] > 0 && !stream_.read(&residues_[0], fields[0])) {
+      carp(CARP_FATAL, "Error reading %s", file_.c_str());
+    }
+    peptide_ = TideIndexPeptide(mass, fields[0], &residues_, fields[1], fields[2], fields[3]);
+    peptide_.setResidues(residues_.data());
+    return true;
+  }
+
+  const TideIndexPeptide& peptide() const { return peptide_; }
+
+ private:
+  string file_;
+  vector<char> buffer_;
+  ifstream stream_;
+  TideIndexPeptide peptide_;
+  string residues_;
+};
+
+class TideIndexApplication::PeptideSorter::RunReaderGreater {
+ public:
+  bool operator()(const RunReader* lhs, const RunReader* rhs) const {
+    return PeptideLess()(rhs->peptide(), lhs->peptide());
+  }
+};
+
+// Sorted runs that have not been removed yet. CARP_FATAL exits without
+// unwinding the stack, so the sorters' destructors cannot be relied on to
+// remove them; whatever is left here is removed at exit.
+static set<string> liveSorterRuns;
+
+static void removeLiveSorterRuns() {
+  for (set<string>::const_iterator i = liveSorterRuns.begin(); i != liveSorterRuns.end(); ++i) {
+    remove(i->c_str());
+  }
+  liveSorterRuns.clear();
+}
+
+static void addSorterRun(const string& file) {
+  static bool registered = false;
+  if (!registered) {
+    atexit(removeLiveSorterRuns);
+    registered = true;
+  }
+  liveSorterRuns.insert(file);
+}
+
+static void removeSorterRun(const string& file) {
+  FileUtils::Remove(file);
+  liveSorterRuns.erase(file);
+}
+
+TideIndexApplication::PeptideSorter::PeptideSorter(
+  const string& tempDir,
+  size_t memoryLimit
+) : tempDir_(tempDir), memoryLimit_(memoryLimit), numPeptides_(0),
+    finished_(false), next_(0), residueBlockUsed_(SORTER_BLOCK_SIZE) {
+}
+
+TideIndexApplication::PeptideSorter::~PeptideSorter() {
+  for (vector<RunReader*>::iterator i = readers_.begin(); i != readers_.end(); ++i) {
+    delete *i;
+  }
+  freeResidues();
+  for (vector<string>::const_iterator i = runs_.begin(); i != runs_.end(); ++i) {
+    removeSorterRun(*i);
+  }
+}
+
+void TideIndexApplication::PeptideSorter::push(const TideIndexPeptide& peptide) {
+  reserve(0);
+  buffer_.push_back(peptide);
+  ++numPeptides_;
+}
+
+void TideIndexApplication::PeptideSorter::pushCopy(const TideIndexPeptide& peptide) {
+  size_t length = peptide.getLength();
+  reserve(length);
+  if (residueBlockUsed_ + length > SORTER_BLOCK_SIZE) {
+    residueBlocks_.push_back(new char[max(SORTER_BLOCK_SIZE, length)]);
+    residueBlockUsed_ = 0;
+  }
+  char* residues = residueBlocks_.back() + residueBlockUsed_;
+  memcpy(residues, peptide.getResidues(), length);
+  residueBlockUsed_ += length;
+  buffer_.push_back(peptide);
+  buffer_.back().setResidues(residues);
+  ++numPeptides_;
+}
+
+void TideIndexApplication::PeptideSorter::reserve(size_t residueBytes) {
+  if (finished_) {
+    carp(CARP_FATAL, "Peptides cannot be added once sorting has finished");
+  } else if (memoryLimit_ == 0) {
+    return;
+  }
+  // Half of the limit is for the peptides, half for their copied residues
+  size_t maxPeptides = max(memoryLimit_ / 2 / sizeof(TideIndexPeptide), (size_t)1);
+  bool newBlock = residueBytes > 0 &&
+                  residueBlockUsed_ + residueBytes > SORTER_BLOCK_SIZE;
+  if (!buffer_.empty() &&
+      (buffer_.size() >= maxPeptides ||
+       (newBlock && (residueBlocks_.size() + 1) * SORTER_BLOCK_SIZE > memoryLimit_ / 2))) {
+    spill();
+  }
+  // Grow the buffer ourselves so that it never exceeds its share of the limit
+  if (buffer_.size() == buffer_.capacity()) {
+    buffer_.reserve(min(max(2 * buffer_.capacity(), (size_t)1024), maxPeptides));
+  }
+}
+
+void TideIndexApplication::PeptideSorter::freeResidues() {
+  for (vector<char*>::iterator i = residueBlocks_.begin(); i != residueBlocks_.end(); ++i) {
+    delete [] *i;
+  }
+  residueBlocks_.clear();
+  residueBlockUsed_ = SORTER_BLOCK_SIZE;
+}
+
+void TideIndexApplication::PeptideSorter::spill() {
+  if (buffer_.empty()) {
+    return;
+  }
+  sort(buffer_.begin(), buffer_.end(), PeptideLess());
+  string file = newRunFile();
+  runs_.push_back(file);
+  addSorterRun(file);
+  vector<char> streamBuffer(SORTER_RUN_BUFFER_SIZE);
+  ofstream out;
+  out.rdbuf()->pubsetbuf(&streamBuffer[0], streamBuffer.size());
+  out.open(file.c_str(), ios::out | ios::binary | ios::trunc);
+  if (!out.is_open()) {
+    carp(CARP_FATAL, "Error creating temporary file %s", file.c_str());
+  }
+  for (vector<TideIndexPeptide>::const_iterator i = buffer_.begin(); i != buffer_.end(); ++i) {
+    writePeptide(out, *i);
+  }
+  out.close();
+  if (out.fail()) {
+    carp(CARP_FATAL, "Error writing temporary file %s", file.c_str());
+  }
+  carp(CARP_DEBUG, "Wrote %lu sorted peptides to %s",
+       (unsigned long)buffer_.size(), file.c_str());
+  buffer_.clear();
+  freeResidues();
+}
+
+void TideIndexApplication::PeptideSorter::writePeptide(
+  ostream& out,
+  const TideIndexPeptide& peptide
+) {
+  double mass = peptide.getMass();
+  int32_t fields[4] = { peptide.getLength(), peptide.getProteinId(),
+                        peptide.getProteinPos(), peptide.decoyIdx() };
+  out.write((const char*)&mass, sizeof(mass));
+  out.write((const char*)fields, sizeof(fields));
+  out.write(peptide.getResidues(), peptide.getLength());
+}
+
+string TideIndexApplication::PeptideSorter::newRunFile() const {
+  boost::filesystem::path dir = tempDir_.empty()
+    ? boost::filesystem::temp_directory_path()
+    : boost::filesystem::path(tempDir_);
+  return (dir / boost::filesystem::unique_path(
+    "tide-index-peptides-%%%%-%%%%-%%%%-%%%%.tmp")).string();
+}
+
+void TideIndexApplication::PeptideSorter::openRuns(const vector<string>& files) {
+  for (vector<string>::const_iterator i = files.begin(); i != files.end(); ++i) {
+    RunReader* reader = new RunReader(*i);
+    if (reader->next()) {
+      readers_.push_back(reader);
+      push_heap(readers_.begin(), readers_.end(), RunReaderGreater());
     } else {
-      for (vector<string*>::const_iterator j = decoySequences.begin(); j != decoySequences.end(); j++) {
-        i->second.push_back(*j);
-      }
+      delete reader;
     }
   }
+}
 
-  for (int i = 0; i < numDecoys; i++) {
-    string* seq = decoySequences[i];
-    carp(CARP_DETAILED_DEBUG, "Got decoy sequence %d: %s.", i, seq->c_str());
-    outProteinSequences.push_back(seq);
-    // Write pb::Protein In this subroutine, the startLoc is used to
-    // construct a longer sequence containing N- and C-term residues,
-    // plus the target.
-    writeDecoyPbProtein(++curProtein, proteinInfo, *seq, startLoc, proteinWriter);
-    // Add decoy to heap
-    TideIndexPeptide pepDecoy(pepMass, setTarget.length(), seq, curProtein, (startLoc > 0) ? 1 : 0, i);
-    outPeptideHeap.push_back(pepDecoy);
-    push_heap(outPeptideHeap.begin(), outPeptideHeap.end(), greater<TideIndexPeptide>());
+void TideIndexApplication::PeptideSorter::mergeRuns(
+  const vector<string>& files,
+  const string& outFile
+) {
+  openRuns(files);
+  vector<char> streamBuffer(SORTER_RUN_BUFFER_SIZE);
+  ofstream out;
+  out.rdbuf()->pubsetbuf(&streamBuffer[0], streamBuffer.size());
+  out.open(outFile.c_str(), ios::out | ios::binary | ios::trunc);
+  if (!out.is_open()) {
+    carp(CARP_FATAL, "Error creating temporary file %s", outFile.c_str());
+  }
+  for (const TideIndexPeptide* peptide = peek(); peptide != NULL; peptide = peek()) {
+    writePeptide(out, *peptide);
+    pop();
+  }
+  out.close();
+  if (out.fail()) {
+    carp(CARP_FATAL, "Error writing temporary file %s", outFile.c_str());
   }
-  decoysGenerated += decoySequences.size();
- }
+}
 
+void TideIndexApplication::PeptideSorter::finish() {
+  if (finished_) {
+    return;
+  }
+  finished_ = true;
+  if (runs_.empty()) {
+    // Everything fit in memory
+    sort(buffer_.begin(), buffer_.end(), PeptideLess());
+    next_ = 0;
+    return;
+  }
+  spill();
+  vector<TideIndexPeptide>().swap(buffer_);
+  carp(CARP_INFO, "Merging %lu sorted runs of peptides...", (unsigned long)runs_.size());
+  // Merge groups of runs until few enough are left to read all at once
+  while (runs_.size() > SORTER_MAX_OPEN_RUNS) {
+    vector<string> group(runs_.begin(), runs_.begin() + SORTER_MAX_OPEN_RUNS);
+    string merged = newRunFile();
+    runs_.push_back(merged);
+    addSorterRun(merged);
+    mergeRuns(group, merged);
+    for (vector<string>::const_iterator i = group.begin(); i != group.end(); ++i) {
+      removeSorterRun(*i);
+    }
+    runs_.erase(runs_.begin(), runs_.begin() + SORTER_MAX_OPEN_RUNS);
+  }
+  openRuns(runs_);
+}
+
+const TideIndexApplication::TideIndexPeptide* TideIndexApplication::PeptideSorter::peek() const {
+  if (!finished_) {
+    carp(CARP_FATAL, "Peptides cannot be read before sorting has finished");
+  } else if (!runs_.empty()) {
+    return !readers_.empty() ? &readers_.front()->peptide() : NULL;
+  }
+  return next_ < buffer_.size() ? &buffer_[next_] : NULL;
+}
+
+void TideIndexApplication::PeptideSorter::pop() {
+  if (!runs_.empty()) {
+    if (readers_.empty()) {
+      return;
+    }
+    pop_heap(readers_.begin(), readers_.end(), RunReaderGreater());
+    RunReader* reader = readers_.back();
+    if (reader->next()) {
+      push_heap(readers_.begin(), readers_.end(), RunReaderGreater());
+    } else {
+      delete reader;
+      readers_.pop_back();
+    }
+  } else if (next_ < buffer_.size() && ++next_ == buffer_.size()) {
+    // Release the memory as soon as the last peptide is read
+    vector<TideIndexPeptide>().swap(buffer_);
+    freeResidues();
+    next_ = 0;
+  }
+}
 
 /*
 * Local Variables:
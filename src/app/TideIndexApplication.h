@@ -9,18 +9,22 @@
 #include <unistd.h>
 #endif
 #include <errno.h>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
 #include <gflags/gflags.h>
 #include "header.pb.h"
 #include "tide/records.h"
 #include "tide/peptide.h"
 #include "tide/theoretical_peak_set.h"
 #include "tide/abspath.h"
+#include "GeneratePeptides.h"
 #include "TideSearchApplication.h"
 #include "util/crux-utils.h"
 
 using namespace std;
 
 std::string getModifiedPeptideSeq(const pb::Peptide* peptide, const ProteinVec* proteins);
+std::string getModifiedPeptideSeq(const pb::Peptide* peptide, const ProteinBlob& proteins);
 
 class TideIndexApplication : public CruxApplication {
 
@@ -89,7 +93,7 @@ class TideIndexApplication : public CruxApplication {
     int decoyIdx_; // -1 if not a decoy
    public:
     TideIndexPeptide() {}
-    TideIndexPeptide(double mass, int length, string* proteinSeq,
+    TideIndexPeptide(double mass, int length, const string* proteinSeq,
                      int proteinId, int proteinPos, int decoyIdx = -1) {
       mass_ = mass;
       length_ = length;
@@ -117,6 +121,8 @@ class TideIndexApplication : public CruxApplication {
     string getSequence() const { return string(residues_, length_); }
     bool isDecoy() const { return decoyIdx_ >= 0; }
     int decoyIdx() const { return decoyIdx_; }
+    const char* getResidues() const { return residues_; }
+    void setResidues(const char* residues) { residues_ = residues; }
 
     friend bool operator >(
       const TideIndexPeptide& lhs, const TideIndexPeptide& rhs) {
@@ -145,6 +151,78 @@ class TideIndexApplication : public CruxApplication {
     }
   };
 
+  /**
+   * Sorts TideIndexPeptides into index order within a memory limit. Peptides
+   * are buffered in memory; whenever the buffer reaches the limit it is
+   * sorted and written to a run file in the temporary directory. When all
+   * peptides have been added, the runs are merged, so the peptides come back
+   * in order without all of them being in memory at once.
+   */
+  class PeptideSorter {
+   public:
+    /**
+     * memoryLimit is in bytes; 0 keeps all peptides in memory
+     */
+    PeptideSorter(const string& tempDir, size_t memoryLimit);
+    ~PeptideSorter();
+
+    /**
+     * Adds a peptide whose residues remain valid until the sorter is done
+     */
+    void push(const TideIndexPeptide& peptide);
+
+    /**
+     * Adds a peptide, copying its residues
+     */
+    void pushCopy(const TideIndexPeptide& peptide);
+
+    /**
+     * Number of peptides added
+     */
+    size_t size() const { return numPeptides_; }
+
+    /**
+     * Prepares to return the peptides in order; call after the last push
+     */
+    void finish();
+
+    /**
+     * The smallest remaining peptide, or NULL when there are none left. It is
+     * valid until the next call to pop().
+     */
+    const TideIndexPeptide* peek() const;
+    void pop();
+
+   private:
+    class RunReader;
+    class RunReaderGreater;
+    class PeptideLess;
+
+    void reserve(size_t residueBytes);
+    void freeResidues();
+    void spill();
+    void openRuns(const vector<string>& files);
+    void mergeRuns(const vector<string>& files, const string& outFile);
+    string newRunFile() const;
+    static void writePeptide(ostream& out, const TideIndexPeptide& peptide);
+
+    string tempDir_;
+    size_t memoryLimit_;
+    size_t numPeptides_;
+    bool finished_;
+
+    vector<TideIndexPeptide> buffer_;
+    size_t next_;  ///< next peptide of buffer_ to return, if there are no runs
+    vector<char*> residueBlocks_;  ///< copied residues of buffered peptides
+    size_t residueBlockUsed_;
+
+    vector<string> runs_;
+    vector<RunReader*> readers_;  ///< min-heap of readers with peptides left
+
+    PeptideSorter(const PeptideSorter&);
+    PeptideSorter& operator=(const PeptideSorter&);
+  };
+
   struct ProteinInfo {
     string name;
     const string* sequence;
@@ -152,12 +230,81 @@ class TideIndexApplication : public CruxApplication {
       : name(proteinName), sequence(proteinSequence) {}
   };
 
-  struct TargetInfo {
-    ProteinInfo proteinInfo;
-    int start;
-    FLOAT_T mass;
-    TargetInfo(const ProteinInfo& protein, int startLoc, FLOAT_T pepMass)
-      : proteinInfo(protein), start(startLoc), mass(pepMass) {}
+  /**
+   * Set of unique target peptides, stored as locations within the protein
+   * sequences. It is an open-addressing hash table keyed by a 64-bit
+   * fingerprint of the residues, split into shards with one lock each so
+   * that digestion threads can insert at the same time. Each peptide keeps its first occurrence (lowest protein, then
+   * lowest position), so the contents do not depend on thread scheduling.
+   */
+  class TargetSet : public GeneratePeptides::SequenceLookup {
+   public:
+    struct Location {
+      int protein;  ///< index into the protein sequences
+      int pos;
+      int length;
+    };
+
+    explicit TargetSet(const vector<string*>& proteinSequences);
+    ~TargetSet();
+
+    void insert(int protein, int pos, int length);
+    virtual bool contains(const string& seq) const;
+    size_t size() const;
+
+    /**
+     * Gets all targets in lexicographic order of their sequences
+     */
+    void getSorted(vector<Location>* out) const;
+
+    const char* residues(const Location& location) const {
+      return proteinSequences_[location.protein]->data() + location.pos;
+    }
+
+    static uint64_t fingerprint(const char* residues, size_t length);
+
+   private:
+    struct Slot {
+      uint64_t fingerprint;  ///< 0 if the slot is empty
+      Location location;
+    };
+    struct Shard {
+      boost::mutex mutex;
+      vector<Slot> slots;  ///< size is a power of two
+      size_t count;
+    };
+
+    class LocationLess;
+
+    Slot* find(Shard& shard, uint64_t fp, const char* residues, size_t length) const;
+    void grow(Shard& shard);
+
+    const vector<string*>& proteinSequences_;
+    vector<Shard*> shards_;
+  };
+
+  /**
+   * Settings for digesting proteins
+   */
+  struct DigestSettings {
+    ENZYME_T enzyme;
+    DIGEST_T digestion;
+    int missedCleavages;
+    int minLength;
+    int maxLength;
+    FLOAT_T minMass;
+    FLOAT_T maxMass;
+    MASS_TYPE_T massType;
+  };
+
+  /**
+   * Result of digesting one protein
+   */
+  struct DigestedProtein {
+    string sequence;  ///< digested sequence, if not the target protein itself
+    vector<GeneratePeptides::CleavedPeptide> peptides;  ///< valid peptides
+    vector<FLOAT_T> masses;  ///< Tide mass of each valid peptide
+    vector<string> invalid;  ///< sequences with unrecognized characters
   };
 
   static void fastaToPb(
@@ -175,13 +322,13 @@ class TideIndexApplication : public CruxApplication {
     const std::string& fasta,
     const std::string& proteinPbFile,
     pb::Header& outProteinPbHeader,
-    std::vector<TideIndexPeptide>& outPeptideHeap,
+    PeptideSorter& outPeptides,
     std::vector<string*>& outProteinSequences,
     std::ofstream* decoyFasta
   );
 
   static void writePeptidesAndAuxLocs(
-    std::vector<TideIndexPeptide>& peptideHeap, // will be destroyed.
+    PeptideSorter& peptides, // will be emptied.
     const std::string& peptidePbFile,
     const std::string& auxLocsPbFile,
     pb::Header& pbHeader
@@ -221,26 +368,84 @@ class TideIndexApplication : public CruxApplication {
   );
 
   /**
-   * Generates decoy for the target peptide, writes the decoy protein to pbProtein
-   * and adds decoy to the heap.
+   * Cleaves a protein and computes the Tide mass of each peptide. If targets
+   * is given, peptides within the mass range are added to it as occurring
+   * in protein proteinIndex. Thread safe.
    */
-  static void generateDecoys(
+  static void digestProtein(
+    const string& sequence,
+    int proteinIndex,
+    const DigestSettings& settings,
+    TargetSet* targets,
+    DigestedProtein* out
+  );
+
+  /**
+   * Digests target protein batchStart + i for parallelFor
+   */
+  static void digestTargetProtein(
+    size_t i,
+    const vector<string*>* proteinSequences,
+    size_t batchStart,
+    const DigestSettings* settings,
+    TargetSet* targets,
+    vector<DigestedProtein>* out
+  );
+
+  /**
+   * Reverses and digests protein i of a batch for parallelFor
+   */
+  static void digestReversedProtein(
+    size_t i,
+    const vector<const string*>* proteinSequences,
+    const DigestSettings* settings,
+    vector<DigestedProtein>* out
+  );
+
+  /**
+   * Generates the decoys for a target peptide, shuffling with the global
+   * generator. Returns false, leaving outDecoys empty, if decoys could not
+   * be generated.
+   */
+  static bool makeDecoys(
     int numDecoys,
-    const string& setTarget,
-    std::map< const string, std::vector<const string*> >& targetToDecoy,
-    set<string>* setTargets,
-    set<string>* setDecoys,
+    const string& target,
     DECOY_TYPE_T decoyType,
-    bool allowDups,
-    unsigned int& failedDecoyCnt,
+    const GeneratePeptides::SequenceLookup* excluded,
+    vector<string>* outDecoys
+  );
+
+  /**
+   * Writes the decoy proteins for a target peptide to pbProtein and adds the
+   * decoys to the sorter.
+   */
+  static void addDecoys(
+    const vector<string>& decoys,
+    const string& target,
     unsigned int& decoysGenerated,
     int& curProtein,
     const ProteinInfo& proteinInfo,
     const int startLoc,
     HeadedRecordWriter& proteinWriter,
     FLOAT_T pepMass,
-    vector<TideIndexPeptide>& outPeptideHeap,
-    vector<string*>& outProteinSequences
+    PeptideSorter& outPeptides,
+    std::map< const string, std::vector<string> >* targetToDecoy
+  );
+
+  /**
+   * Calls f(i) for each i in [0, n), spread over numThreads threads
+   */
+  static void parallelFor(
+    size_t n,
+    int numThreads,
+    const boost::function<void(size_t)>& f
+  );
+
+  static void parallelForStride(
+    size_t first,
+    size_t stride,
+    size_t n,
+    const boost::function<void(size_t)>& f
   );
 
   virtual void processParams();
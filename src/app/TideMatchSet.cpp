@@ -13,6 +13,7 @@
 #include "TideIndexApplication.h"
 #include "TideMatchSet.h"
 #include "TideSearchApplication.h"
+#include "util/Metrics.h"
 #include "util/Params.h"
 #include "util/StringUtils.h"
 
@@ -40,7 +41,7 @@ void TideMatchSet::report(
   ofstream* decoy_file, ///< decoy file to write to
   int top_matches,
   const ActivePeptideQueue* peptides, ///< peptide queue
-  const ProteinVec& proteins, ///< proteins corresponding with peptides
+  const ProteinBlob& proteins, ///< proteins corresponding with peptides
   const vector<const pb::AuxLocation*>& locations,  ///< auxiliary locations
   bool compute_sp ///< whether to compute sp or not
 ) {
@@ -130,8 +131,7 @@ void TideMatchSet::report(
     for (int cnt = 0; cnt < top_matches; ++cnt) {
       SpScorer sp_scorer(proteins, *peptide_->spectrum_matches_array[cnt].spectrum_,
                          peptide_->spectrum_matches_array[cnt].charge_, max_mz_);
-      pb::Peptide* pb_peptide = getPbPeptide(*peptide_);
-      sp_scorer.Score(*pb_peptide, peptide_->spectrum_matches_array[cnt].spData_);
+      sp_scorer.Score(*peptide_, peptide_->spectrum_matches_array[cnt].spData_);
       spScoreRank.push_back(make_pair(-1*peptide_->spectrum_matches_array[cnt].spData_.sp_score, cnt));
     }
     sort(spScoreRank.begin(), spScoreRank.end());
@@ -151,7 +151,7 @@ void TideMatchSet::report(
 void TideMatchSet::writeToFile(
   ofstream* file,
   const ActivePeptideQueue* peptides,
-  const ProteinVec& proteins,
+  const ProteinBlob& proteins,
   const vector<const pb::AuxLocation*>& locations,
   bool compute_sp ///< whether to compute sp or not
 ) {
@@ -161,10 +161,10 @@ void TideMatchSet::writeToFile(
   int cur = 0;
 
   const Peptide* peptide = peptides->GetPeptide(0);
-  const pb::Protein* protein = proteins[peptide->FirstLocProteinId()];
+  ProteinBlob::Protein protein = proteins[peptide->FirstLocProteinId()];
   int pos = peptide->FirstLocPos();
-  string proteinNames = getProteinName(*protein,
-      (!protein->has_target_pos()) ? pos : protein->target_pos());
+  string proteinNames = getProteinName(protein,
+      (!protein.has_target_pos()) ? pos : protein.target_pos());
   string flankingAAs, n_term, c_term;
   getFlankingAAs(peptide, protein, pos, &n_term, &c_term);
   flankingAAs = n_term + c_term;
@@ -178,8 +178,8 @@ void TideMatchSet::writeToFile(
       const pb::Location& location = aux->location(i);
       protein = proteins[location.protein_id()];
       pos = location.pos();
-      proteinNames += "," + getProteinName(*protein,
-          (!protein->has_target_pos()) ? pos : protein->target_pos());
+      proteinNames += "," + getProteinName(protein,
+          (!protein.has_target_pos()) ? pos : protein.target_pos());
       getFlankingAAs(peptide, protein, pos, &n_term, &c_term);
       flankingAAs += "," + n_term + c_term;
       }
@@ -236,9 +236,9 @@ void TideMatchSet::writeToFile(
           << cruxPep.getDecoyType();
     if (peptide->IsDecoy() && !TideSearchApplication::proteinLevelDecoys()) {
       // write target sequence
-      const string& residues = protein->residues();
-      *file << '\t'
-            << residues.substr(residues.length() - peptide->Len());
+      *file << '\t';
+      file->write(protein.residues() + protein.residues_length() - peptide->Len(),
+                  peptide->Len());
     } else if (Params::GetBool("concat") && !TideSearchApplication::proteinLevelDecoys()) {
       *file << '\t'
             << cruxPep.getUnshuffledSequence();
@@ -260,7 +260,7 @@ void TideMatchSet::report(
   const Spectrum* spectrum, ///< spectrum for matches
   int charge, ///< charge for matches
   const ActivePeptideQueue* peptides, ///< peptide queue
-  const ProteinVec& proteins,  ///< proteins corresponding with peptides
+  const ProteinBlob& proteins,  ///< proteins corresponding with peptides
   const vector<const pb::AuxLocation*>& locations,  ///< auxiliary locations
   bool compute_sp, ///< whether to compute sp or not
   bool highScoreBest, //< indicates semantics of score magnitude
@@ -276,23 +276,19 @@ void TideMatchSet::report(
   vector<Arr::iterator> targets, decoys;
   gatherTargetsAndDecoys(peptides, proteins, targets, decoys, top_n, decoys_per_target, highScoreBest);
 
-  map<Arr::iterator, FLOAT_T> delta_cn_map;
-  map<Arr::iterator, FLOAT_T> delta_lcn_map;
-  computeDeltaCns(targets, &delta_cn_map, &delta_lcn_map);
-  computeDeltaCns(decoys, &delta_cn_map, &delta_lcn_map);
+  ReportScores target_scores, decoy_scores;
+  computeDeltaCns(targets, &target_scores);
+  computeDeltaCns(decoys, &decoy_scores);
 
-  map<Arr::iterator, pair<const SpScorer::SpScoreData, int> > sp_map;
   if (compute_sp) {
     SpScorer sp_scorer(proteins, *spectrum, charge, max_mz_);
-    computeSpData(targets, &sp_map, &sp_scorer, peptides);
-    computeSpData(decoys, &sp_map, &sp_scorer, peptides);
+    computeSpData(targets, &target_scores, &sp_scorer, peptides);
+    computeSpData(decoys, &decoy_scores, &sp_scorer, peptides);
   }
   writeToFile(target_file, top_n, decoys_per_target, targets, spectrum_filename, spectrum, charge,
-              peptides, proteins, locations, delta_cn_map, delta_lcn_map,
-              compute_sp ? &sp_map : NULL, rwlock);
+              peptides, proteins, locations, target_scores, compute_sp, rwlock);
   writeToFile(decoy_file, top_n, decoys_per_target, decoys, spectrum_filename, spectrum, charge,
-              peptides, proteins, locations, delta_cn_map, delta_lcn_map,
-              compute_sp ? &sp_map : NULL, rwlock);
+              peptides, proteins, locations, decoy_scores, compute_sp, rwlock);
 }
 
 /**
@@ -307,11 +303,10 @@ void TideMatchSet::writeToFile(
   const Spectrum* spectrum,
   int charge,
   const ActivePeptideQueue* peptides,
-  const ProteinVec& proteins,
+  const ProteinBlob& proteins,
   const vector<const pb::AuxLocation*>& locations,
-  const map<Arr::iterator, FLOAT_T>& delta_cn_map,
-  const map<Arr::iterator, FLOAT_T>& delta_lcn_map,
-  const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map,
+  const ReportScores& scores,
+  bool compute_sp,
   boost::mutex * rwlock
 ) {
   if (!file || vec.empty()) {
@@ -323,7 +318,7 @@ void TideMatchSet::writeToFile(
 
   const bool concat = Params::GetBool("concat");
   const int concatDistinctMatches = peptides->ActiveTargets() + peptides->ActiveDecoys();
-  map<int, int> decoyWriteCount;
+  vector<int> decoyWriteCount; // by decoy index
 
   for (size_t idx = 0; idx < vec.size(); idx++) {
     const Arr::iterator& i = vec[idx];
@@ -338,19 +333,18 @@ void TideMatchSet::writeToFile(
     } else {
       // not concat, decoy file with multiple decoys per target
       int decoyIdx = peptide->DecoyIdx();
-      map<int, int>::iterator j = decoyWriteCount.find(decoyIdx);
-      if (j == decoyWriteCount.end()) {
-        j = decoyWriteCount.insert(make_pair(decoyIdx, 0)).first;
+      if (decoyIdx >= decoyWriteCount.size()) {
+        decoyWriteCount.resize(decoyIdx + 1, 0);
       }
-      if (j->second >= top_n) {
+      if (decoyWriteCount[decoyIdx] >= top_n) {
         continue;
       }
-      rank = ++(j->second);
+      rank = ++decoyWriteCount[decoyIdx];
     }
-    const pb::Protein* protein = proteins[peptide->FirstLocProteinId()];
+    ProteinBlob::Protein protein = proteins[peptide->FirstLocProteinId()];
     int pos = peptide->FirstLocPos();
-    string proteinNames = getProteinName(*protein,
-      (!protein->has_target_pos()) ? pos : protein->target_pos());
+    string proteinNames = getProteinName(protein,
+      (!protein.has_target_pos()) ? pos : protein.target_pos());
     string flankingAAs, n_term, c_term;
     getFlankingAAs(peptide, protein, pos, &n_term, &c_term);
     flankingAAs = n_term + c_term;
@@ -362,17 +356,23 @@ void TideMatchSet::writeToFile(
         const pb::Location& location = aux->location(j);
         protein = proteins[location.protein_id()];
         pos = location.pos();
-        proteinNames += "," + getProteinName(*protein,
-          (!protein->has_target_pos()) ? pos : protein->target_pos());
+        proteinNames += "," + getProteinName(protein,
+          (!protein.has_target_pos()) ? pos : protein.target_pos());
         getFlankingAAs(peptide, protein, pos, &n_term, &c_term);
         flankingAAs += "," + n_term + c_term;
       }
     }
 
     Crux::Peptide cruxPep = getCruxPeptide(peptide);
-    const SpScorer::SpScoreData* sp_data = sp_map ? &(sp_map->at(i).first) : NULL;
+    const SpScorer::SpScoreData* sp_data = compute_sp ? &scores.sp_data[idx] : NULL;
 
-    rwlock->lock();
+    if (!rwlock->try_lock()) {
+      // only contended waits are timed
+      double wait_start = Metrics::Now();
+      rwlock->lock();
+      Metrics::AddTime("tide-search.results-lock-wait", Metrics::Now() - wait_start);
+    }
+    *file << sort_key_;
     if (Params::GetBool("file-column")) {
       *file << spectrum_filename << '\t';
     }
@@ -381,11 +381,11 @@ void TideMatchSet::writeToFile(
           << StringUtils::ToString(spectrum->PrecursorMZ(), massPrecision) << '\t'
           << StringUtils::ToString((spectrum->PrecursorMZ() - MASS_PROTON) * charge, massPrecision) << '\t'
           << StringUtils::ToString(cruxPep.calcModifiedMass(), massPrecision) << '\t'
-          << delta_cn_map.at(i) << '\t'
-          << delta_lcn_map.at(i) << '\t';
-    if (sp_map) {
+          << scores.delta_cn[idx] << '\t'
+          << scores.delta_lcn[idx] << '\t';
+    if (compute_sp) {
       *file << StringUtils::ToString(sp_data->sp_score, precision) << '\t'
-            << sp_map->at(i).second << '\t';
+            << scores.sp_rank[idx] << '\t';
     }
 
     // Use scientific notation for exact p-value, but not refactored XCorr.
@@ -417,7 +417,7 @@ void TideMatchSet::writeToFile(
     }
 
     *file << rank << '\t';
-    if (sp_map) {
+    if (compute_sp) {
       *file << sp_data->matched_ions << '\t'
             << sp_data->total_ions << '\t';
     }
@@ -440,9 +440,9 @@ void TideMatchSet::writeToFile(
     }
     if (peptide->IsDecoy() && !TideSearchApplication::proteinLevelDecoys()) {
       // write target sequence
-      const string& residues = protein->residues();
-      *file << '\t'
-            << residues.substr(residues.length() - peptide->Len());
+      *file << '\t';
+      file->write(protein.residues() + protein.residues_length() - peptide->Len(),
+                  peptide->Len());
     } else if (Params::GetBool("concat") && !TideSearchApplication::proteinLevelDecoys()) {
       *file << '\t'
             << cruxPep.getUnshuffledSequence();
@@ -589,7 +589,7 @@ vector<Crux::Modification> TideMatchSet::getMods(const Peptide* peptide) {
 
 void TideMatchSet::gatherTargetsAndDecoys(
   const ActivePeptideQueue* peptides,
-  const ProteinVec& proteins,
+  const ProteinBlob& proteins,
   vector<Arr::iterator>& targetsOut,
   vector<Arr::iterator>& decoysOut,
   int top_n,
@@ -616,12 +616,19 @@ void TideMatchSet::gatherTargetsAndDecoys(
     break;
   }
 
-  map<int, int> decoyWriteCount;
+  // Matches are popped off the heap best first, and only until every list
+  // that is gathered is full, rather than sorting all of them.
+  vector<int> decoyWriteCount; // by decoy index
+  int fullDecoyLists = 0;
   const bool concat = Params::GetBool("concat");
   const int gatherSize = top_n + 1;
 
   // decoys but not concat, populate targets and decoys
   for (Arr::iterator i = matches_->end(); i != matches_->begin(); ) {
+    if (targetsOut.size() >= gatherSize &&
+        (concat || (numDecoys > 0 && fullDecoyLists >= numDecoys))) {
+      break;
+    }
     switch (cur_score_function_) {
     case XCORR_SCORE:
       if (exact_pval_search_) {
@@ -648,51 +655,26 @@ void TideMatchSet::gatherTargetsAndDecoys(
       }
     } else {
       int idx = peptide.DecoyIdx();
-      map<int, int>::iterator j = decoyWriteCount.find(idx);
-      if (j == decoyWriteCount.end()) {
-        j = decoyWriteCount.insert(make_pair(idx, 0)).first;
+      if (idx >= decoyWriteCount.size()) {
+        decoyWriteCount.resize(idx + 1, 0);
       }
-      if (j->second < gatherSize) {
-        j->second++;
+      if (decoyWriteCount[idx] < gatherSize) {
+        if (++decoyWriteCount[idx] == gatherSize) {
+          ++fullDecoyLists;
+        }
         decoysOut.push_back(i);
       }
     }
   }
 }
 
-/**
- * Create a pb peptide from Tide peptide
- */
-pb::Peptide* TideMatchSet::getPbPeptide(const Peptide& peptide) {
-  pb::Peptide* pb_peptide = new pb::Peptide();
-  pb_peptide->set_id(peptide.Id());
-  pb_peptide->set_mass(peptide.Mass());
-  pb_peptide->set_length(peptide.Len());
-  if (peptide.HasAuxLocationsIndex()) {
-    pb_peptide->set_aux_locations_index(peptide.AuxLocationsIndex());
-  }
-
-  // Copy over all the modifications for this Peptide
-  const ModCoder::Mod* mods;
-  int pep_mods = peptide.Mods(&mods);
-  for (int i = 0; i < pep_mods; ++i) {
-    pb_peptide->add_modifications(mods[i]);
-  }
-
-  // Copy over the Peptide's first location within the first protein
-  pb::Location* first_location = pb_peptide->mutable_first_location();
-  first_location->set_protein_id(peptide.FirstLocProteinId());
-  first_location->set_pos(peptide.FirstLocPos());
-
-  return pb_peptide;
-}
-
 /**
  * Gets the protein name with the index appended.
  */
-string TideMatchSet::getProteinName(const pb::Protein& protein, int pos) {
+string TideMatchSet::getProteinName(const ProteinBlob::Protein& protein, int pos) {
   stringstream proteinNameStream;
-  proteinNameStream << protein.name() << '(' << pos + 1 << ')';
+  proteinNameStream.write(protein.name(), protein.name_length());
+  proteinNameStream << '(' << pos + 1 << ')';
   return proteinNameStream.str();
 }
 
@@ -701,59 +683,60 @@ string TideMatchSet::getProteinName(const pb::Protein& protein, int pos) {
  */
 void TideMatchSet::getFlankingAAs(
   const Peptide* peptide, ///< Tide peptide to get flanking AAs for
-  const pb::Protein* protein, ///< Tide protein for the peptide
+  const ProteinBlob::Protein& protein, ///< Tide protein for the peptide
   int pos,  ///< location of peptide within protein
   string* out_n,  ///< out parameter for n flank
   string* out_c ///< out parameter for c flank
 ) {
   int idx_n = pos - 1;
   int idx_c = pos + peptide->Len();
-  const string& seq = protein->residues();
+  const char* seq = protein.residues();
 
-  *out_n = (idx_n >= 0) ? seq.substr(idx_n, 1) : "-";
-  *out_c = (idx_c < seq.length()) ? seq.substr(idx_c, 1) : "-";
+  *out_n = (idx_n >= 0) ? string(1, seq[idx_n]) : "-";
+  *out_c = (idx_c < protein.residues_length()) ? string(1, seq[idx_c]) : "-";
 }
 
 void TideMatchSet::computeDeltaCns(
   const vector<Arr::iterator>& vec, // xcorr*100000000.0, high to low
-  map<Arr::iterator, FLOAT_T>* delta_cn_map, // map to add delta cn scores to
-  map<Arr::iterator, FLOAT_T>* delta_lcn_map // map to add delta cn scores to
+  ReportScores* scores // delta cn scores are set, by index in vec
 ) {
-  vector<FLOAT_T> scores;
+  const bool exact_pval = Params::GetBool("exact-p-value");
+  vector<FLOAT_T> xcorrs;
+  xcorrs.reserve(vec.size());
   for (vector<Arr::iterator>::const_iterator i = vec.begin(); i != vec.end(); i++) {
-    if (Params::GetBool("exact-p-value")) {
-      scores.push_back((*i)->xcorr_pval);
-    } else {
-      scores.push_back((*i)->xcorr_score);
-    }
+    xcorrs.push_back(exact_pval ? (*i)->xcorr_pval : (*i)->xcorr_score);
   }
   vector< pair<FLOAT_T, FLOAT_T> > deltaCns = MatchCollection::calculateDeltaCns(
-    scores, !Params::GetBool("exact-p-value") ? XCORR : TIDE_SEARCH_EXACT_PVAL);
+    xcorrs, !exact_pval ? XCORR : TIDE_SEARCH_EXACT_PVAL);
+  scores->delta_cn.resize(vec.size());
+  scores->delta_lcn.resize(vec.size());
   for (int i = 0; i < vec.size(); i++) {
-    delta_cn_map->insert(make_pair(vec[i], deltaCns[i].first));
-    delta_lcn_map->insert(make_pair(vec[i], deltaCns[i].second));
+    scores->delta_cn[i] = deltaCns[i].first;
+    scores->delta_lcn[i] = deltaCns[i].second;
   }
 }
 
 void TideMatchSet::computeSpData(
   const vector<Arr::iterator>& vec,
-  map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_rank_map,
+  ReportScores* scores, // sp data and ranks are set, by index in vec
   SpScorer* sp_scorer,
   const ActivePeptideQueue* peptides
 ) {
-  vector< pair<Arr::iterator, SpScorer::SpScoreData> > spData;
+  // Scored from the peptides already decoded in the queue
+  vector< pair<int, SpScorer::SpScoreData> > spData;
   spData.reserve(vec.size());
-  for (vector<Arr::iterator>::const_iterator i = vec.begin(); i != vec.end(); ++i) {
-    spData.push_back(make_pair(*i, SpScorer::SpScoreData()));
-    const Peptide& peptide = *(peptides->GetPeptide((*i)->rank));
-    pb::Peptide* pb_peptide = getPbPeptide(peptide);
-    sp_scorer->Score(*pb_peptide, spData.back().second);
-    delete pb_peptide;
+  for (int i = 0; i < vec.size(); ++i) {
+    spData.push_back(make_pair(i, SpScorer::SpScoreData()));
+    sp_scorer->Score(*(peptides->GetPeptide(vec[i]->rank)), spData.back().second);
+  }
+  scores->sp_data.resize(vec.size());
+  scores->sp_rank.resize(vec.size());
+  for (size_t i = 0; i < spData.size(); ++i) {
+    scores->sp_data[i] = spData[i].second;
   }
   sort(spData.begin(), spData.end(), spGreater());
   for (size_t i = 0; i < spData.size(); ++i) {
-    sp_rank_map->insert(make_pair(
-      spData[i].first, make_pair(spData[i].second, i + 1)));
+    scores->sp_rank[spData[i].first] = i + 1;
   }
 }
 
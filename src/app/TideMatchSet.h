@@ -9,6 +9,7 @@
 #include "tide/active_peptide_queue.h"  // no include guard
 #include "tide/fixed_cap_array.h"
 #include "tide/peptide.h"
+#include "tide/protein_blob.h"
 #include "tide/sp_scorer.h"
 #include "tide/spectrum_collection.h"
 
@@ -25,6 +26,9 @@ class TideMatchSet {
   bool exact_pval_search_;
   int elution_window_;
   SCORE_FUNCTION_T cur_score_function_;
+  // Written at the start of every spectrum-centric result line; used by
+  // sharded tide-search to restore the single-process order when merging.
+  string sort_key_;
 
   typedef pair<int, int> Pair2;
   typedef FixedCapacityArray<Pair2> Arr2;
@@ -65,7 +69,7 @@ class TideMatchSet {
     ofstream* decoy_file, ///< decoy file to write to
     int top_matches,
     const ActivePeptideQueue* peptides, ///< peptide queue
-    const ProteinVec& proteins, ///< proteins corresponding with peptides
+    const ProteinBlob& proteins, ///< proteins corresponding with peptides
     const vector<const pb::AuxLocation*>& locations,  ///< auxiliary locations
     bool compute_sp ///< whether to compute sp or not
   );
@@ -82,7 +86,7 @@ class TideMatchSet {
     const Spectrum* spectrum, ///< spectrum for matches
     int charge, ///< charge for matches
     const ActivePeptideQueue* peptides, ///< peptide queue
-    const ProteinVec& proteins, ///< proteins corresponding with peptides
+    const ProteinBlob& proteins, ///< proteins corresponding with peptides
     const vector<const pb::AuxLocation*>& locations,  ///< auxiliary locations
     bool compute_sp, ///< whether to compute sp or not
     bool highScoreBest, //< indicates semantics of score magnitude
@@ -102,6 +106,15 @@ class TideMatchSet {
   static string CleavageType;
 
  protected:
+  // Scores derived for the reported matches of one spectrum, in parallel
+  // arrays indexed like the targets or decoys vector they were computed from.
+  struct ReportScores {
+    vector<FLOAT_T> delta_cn;
+    vector<FLOAT_T> delta_lcn;
+    vector<SpScorer::SpScoreData> sp_data;
+    vector<int> sp_rank;
+  };
+
   Arr* matches_;
   Arr2* matches2_;
   Peptide* peptide_;
@@ -157,7 +170,7 @@ class TideMatchSet {
   void writeToFile(
     ofstream* file,
     const ActivePeptideQueue* peptides,
-    const ProteinVec& proteins,
+    const ProteinBlob& proteins,
     const vector<const pb::AuxLocation*>& locations,
     bool compute_sp ///< whether to compute sp or not
   );
@@ -174,11 +187,10 @@ class TideMatchSet {
     const Spectrum* spectrum,
     int charge,
     const ActivePeptideQueue* peptides,
-    const ProteinVec& proteins,
+    const ProteinBlob& proteins,
     const vector<const pb::AuxLocation*>& locations,
-    const map<Arr::iterator, FLOAT_T>& delta_cn_map,
-    const map<Arr::iterator, FLOAT_T>& delta_lcn_map,
-    const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map,
+    const ReportScores& scores,
+    bool compute_sp,
     boost::mutex * rwlock
   );
 
@@ -186,7 +198,7 @@ class TideMatchSet {
 
   void gatherTargetsAndDecoys(
     const ActivePeptideQueue* peptides,
-    const ProteinVec& proteins,
+    const ProteinBlob& proteins,
     vector<Arr::iterator>& targetsOut,
     vector<Arr::iterator>& decoysOut,
     int top_n,
@@ -194,18 +206,11 @@ class TideMatchSet {
     bool highScoreBest // indicates semantics of score magnitude
   );
 
-  /**
-   * Create a pb peptide from Tide peptide
-   */
-  static pb::Peptide* getPbPeptide(
-    const Peptide& peptide
-  );
-
   /**
    * Gets the protein name with the index appended.
    */
   static string getProteinName(
-    const pb::Protein& protein,
+    const ProteinBlob::Protein& protein,
     int pos
   );
 
@@ -214,7 +219,7 @@ class TideMatchSet {
    */
   static void getFlankingAAs(
     const Peptide* peptide, ///< Tide peptide to get flanking AAs for
-    const pb::Protein* protein, ///< Tide protein for the peptide
+    const ProteinBlob::Protein& protein, ///< Tide protein for the peptide
     int pos,  ///< location of peptide within protein
     string* out_n,  ///< out parameter for n flank
     string* out_c ///< out parameter for c flank
@@ -222,20 +227,19 @@ class TideMatchSet {
 
   static void computeDeltaCns(
     const vector<Arr::iterator>& vec, // xcorr*100000000.0, high to low
-    map<Arr::iterator, FLOAT_T>* delta_cn_map, // map to add delta cn scores to
-    map<Arr::iterator, FLOAT_T>* delta_lcn_map
+    ReportScores* scores // delta cn scores are set, by index in vec
   );
 
   static void computeSpData(
     const vector<Arr::iterator>& vec,
-    map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_rank_map,
+    ReportScores* scores, // sp data and ranks are set, by index in vec
     SpScorer* sp_scorer,
     const ActivePeptideQueue* peptides
   );
 
   struct spGreater {
-    inline bool operator() (const pair<Arr::iterator, SpScorer::SpScoreData>& lhs,
-                            const pair<Arr::iterator, SpScorer::SpScoreData>& rhs) {
+    inline bool operator() (const pair<int, SpScorer::SpScoreData>& lhs,
+                            const pair<int, SpScorer::SpScoreData>& rhs) {
       return lhs.second.sp_score > rhs.second.sp_score;
     }
   };
@@ -5,14 +5,18 @@
 #include "io/carp.h"
 #include "parameter.h"
 #include "io/SpectrumRecordWriter.h"
+#include "CruxApplicationList.h"
 #include "TideIndexApplication.h"
 #include "TideSearchApplication.h"
 #include "ParamMedicApplication.h"
 #include "PSMConvertApplication.h"
 #include "tide/mass_constants.h"
+#include "tide/mass_directory.h"
+#include "tide/spectrum_batch.h"
 #include "TideMatchSet.h"
 #include "util/Params.h"
 #include "util/FileUtils.h"
+#include "util/Metrics.h"
 #include "util/StringUtils.h"
 #include <math.h> //Added by Andy Lin
 #include <map> //Added by Andy Lin
@@ -36,7 +40,8 @@ const double TideSearchApplication::XCORR_SCALING = 100000000.0;
 const double TideSearchApplication::RESCALE_FACTOR = 20.0;
 
 TideSearchApplication::TideSearchApplication():
-  exact_pval_search_(false), remove_index_(""), spectrum_flag_(NULL) {
+  exact_pval_search_(false), remove_index_(""), spectrum_flag_(NULL),
+  shard_(-1), num_shards_(1), shard_file_(0), shard_offset_(0) {
 }
 
 TideSearchApplication::~TideSearchApplication() {
@@ -47,6 +52,23 @@ TideSearchApplication::~TideSearchApplication() {
 }
 
 int TideSearchApplication::main(int argc, char** argv) {
+  num_shards_ = Params::GetInt("num-shards");
+  int shard = Params::GetInt("shard");
+  if (shard >= num_shards_) {
+    carp(CARP_FATAL, "shard must be less than num-shards (%d)", num_shards_);
+  }
+  if (num_shards_ > 1 || shard >= 0) {
+    if (Params::GetBool("peptide-centric-search")) {
+      carp(CARP_FATAL, "num-shards is not supported with peptide-centric-search");
+    }
+    if (!Params::GetString("store-spectra").empty()) {
+      carp(CARP_FATAL, "num-shards is not supported with store-spectra");
+    }
+  }
+  if (num_shards_ > 1 && shard < 0) {
+    return runShards(argc, argv);
+  }
+  shard_ = shard;
   return main(Params::GetStrings("tide spectra file"));
 }
 int TideSearchApplication::main(const vector<string>& input_files) {
@@ -152,17 +174,17 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
 
   vector<int> negative_isotope_errors = getNegativeIsotopeErrors();
 
-  ProteinVec proteins;
   carp(CARP_INFO, "Reading index %s", index.c_str());
-  // Read proteins index file
-  pb::Header protein_header;
-  if (!ReadRecordsToVector<pb::Protein, const pb::Protein>(&proteins,
-      proteins_file, &protein_header)) {
+  Metrics::Timer read_index_timer("tide-search.read-index");
+  // Map the proteins shared by all search threads; falls back to reading the
+  // proteins index file for indexes without a protein blob
+  ProteinBlob proteins;
+  if (!proteins.Load(proteins_file)) {
     carp(CARP_FATAL, "Error reading index (%s)", proteins_file.c_str());
   }
   int64_t targetProteinCount = 0;
-  for (ProteinVec::const_iterator i = proteins.begin(); i != proteins.end(); i++) {
-    if (!(*i)->has_target_pos()) {
+  for (int i = 0; i < proteins.Size(); i++) {
+    if (!proteins[i].has_target_pos()) {
       ++targetProteinCount;
     }
   }
@@ -249,6 +271,21 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
       !peptides_header.has_peptides_header()) {
     carp(CARP_FATAL, "Error reading index (%s)", peptides_file.c_str());
   }
+  // Lets the peptide queues skip the part of the index lighter than the
+  // spectra; older indexes have no directory and are read from the start
+  MassDirectory mass_directory;
+  if (!mass_directory.Load(peptides_file)) {
+    string directory_file = MassDirectory::Filename(peptides_file);
+    if (FileUtils::Exists(directory_file)) {
+      carp(CARP_WARNING, "Ignoring stale or invalid mass directory %s; "
+           "reading %s from the start", directory_file.c_str(),
+           peptides_file.c_str());
+    } else {
+      carp(CARP_DEBUG, "No mass directory for %s", peptides_file.c_str());
+    }
+  }
+
+  read_index_timer.Stop();
 
   const pb::Header::PeptidesHeader& pepHeader = peptides_header.peptides_header();
   DECOY_TYPE_T headerDecoyType = (DECOY_TYPE_T)pepHeader.decoys();
@@ -275,15 +312,15 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
   ss << Params::GetString("enzyme") << '-' << Params::GetString("digestion");
   TideMatchSet::CleavageType = ss.str();
   if (!Params::GetBool("concat")) {
-    string target_file_name = make_file_path("tide-search.target.txt");
+    string target_file_name = make_file_path(getFileStem() + ".target.txt");
     target_file = create_stream_in_path(target_file_name.c_str(), NULL, overwrite);
     output_file_name_ = target_file_name;
     if (HAS_DECOYS) {
-      string decoy_file_name = make_file_path("tide-search.decoy.txt");
+      string decoy_file_name = make_file_path(getFileStem() + ".decoy.txt");
       decoy_file = create_stream_in_path(decoy_file_name.c_str(), NULL, overwrite);
     }
   } else {
-    string concat_file_name = make_file_path("tide-search.txt");
+    string concat_file_name = make_file_path(getFileStem() + ".txt");
     target_file = create_stream_in_path(concat_file_name.c_str(), NULL, overwrite);
     output_file_name_ = concat_file_name;
   }
@@ -293,7 +330,9 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
     TideMatchSet::writeHeaders(decoy_file, true, decoysPerTarget > 1, compute_sp);
   }
 
+  Metrics::Timer convert_spectra_timer("tide-search.convert-spectra");
   vector<InputFile> sr = getInputFiles(input_files);
+  convert_spectra_timer.Stop();
 
   // Loop through spectrum files
   for (vector<InputFile>::const_iterator f = sr.begin(); f != sr.end(); f++) {
@@ -307,6 +346,12 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
     for (int i = 0; i < NUM_THREADS; i++) {
       active_peptide_queue.push_back(new ActivePeptideQueue(peptide_reader[i]->Reader(), proteins));
       active_peptide_queue[i]->SetBinSize(bin_width_, bin_offset_);
+      if (mass_directory.Size() > 0) {
+        active_peptide_queue[i]->SetMassDirectory(&mass_directory);
+      }
+      if (Params::GetInt("peptide-prefetch") > 0) {
+        active_peptide_queue[i]->SetPrefetch(Params::GetInt("peptide-prefetch"));
+      }
     }
 
     string spectra_file = f->SpectrumRecords;
@@ -314,7 +359,8 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
     map<string, SpectrumCollection*>::iterator spectraIter = spectra_.find(spectra_file);
     if (spectraIter == spectra_.end()) {
       carp(CARP_INFO, "Reading spectrum file %s.", spectra_file.c_str());
-      spectra = loadSpectra(spectra_file);
+      Metrics::Timer read_spectra_timer("tide-search.read-spectra");
+      spectra = loadSpectra(spectra_file, NUM_THREADS);
       carp(CARP_INFO, "Read %d spectra.", spectra->Size());
     } else {
       spectra = spectraIter->second;
@@ -333,7 +379,22 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
     if (spectrum_flag_ == NULL) {
       resetMods();
     }
-    search(f->OriginalName, spectra->SpecCharges(), active_peptide_queue, proteins,
+    // A shard worker searches only its slice of the spectrum-charges, which
+    // are sorted by precursor mass
+    const vector<SpectrumCollection::SpecCharge>* spec_charges = spectra->SpecCharges();
+    vector<SpectrumCollection::SpecCharge> shard_spec_charges;
+    if (shard_ >= 0) {
+      size_t begin = (uint64_t)spec_charges->size() * shard_ / num_shards_;
+      size_t end = (uint64_t)spec_charges->size() * (shard_ + 1) / num_shards_;
+      shard_spec_charges.assign(spec_charges->begin() + begin, spec_charges->begin() + end);
+      spec_charges = &shard_spec_charges;
+      shard_file_ = f - sr.begin();
+      shard_offset_ = begin;
+      carp(CARP_INFO, "Shard %d of %d: searching %d of %d spectrum-charge combinations.",
+           shard_, num_shards_, (int)(end - begin), (int)spectra->SpecCharges()->size());
+    }
+    Metrics::Timer search_timer("tide-search.search");
+    search(f->OriginalName, spec_charges, active_peptide_queue, proteins,
            locations, Params::GetDouble("precursor-window"),
            string_to_window_type(Params::GetString("precursor-window-type")),
            Params::GetDouble("spectrum-min-mz"), Params::GetDouble("spectrum-max-mz"),
@@ -344,12 +405,18 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
            nAARes, dAAFreqN, dAAFreqI, dAAFreqC, dAAMass,
            pepHeader.mods(), pepHeader.nterm_mods(), pepHeader.cterm_mods(),
            decoysPerTarget, &negative_isotope_errors);
+    search_timer.Stop();
+    Metrics::Add("tide-search.spectrum-charges", spec_charges->size());
 
     if (spectraIter == spectra_.end()) {
       delete spectra;
     }
-    // convert tab delimited to other file formats.
-    convertResults();
+    // convert tab delimited to other file formats; for shards this is done
+    // after merging
+    if (shard_ < 0) {
+      Metrics::Timer convert_results_timer("tide-search.convert-results");
+      convertResults();
+    }
 
     // Delete temporary spectrumrecords file
     if (!f->Keep) {
@@ -359,22 +426,33 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
 
     // Clean up
     for (int i = 0; i < NUM_THREADS; i++) {
+      Metrics::Add("tide-search.peptides-decoded", active_peptide_queue[i]->PeptidesDecoded());
+      Metrics::Add("tide-search.programs-compiled", active_peptide_queue[i]->ProgramsCompiled());
+      Metrics::Add("tide-search.peptides-skipped", active_peptide_queue[i]->PeptidesSkipped());
+      // Deleting the queue stops its prefetch thread, if any, which reads
+      // from the same reader.
       delete active_peptide_queue[i];
+      Metrics::Add("tide-search.index-bytes-read", peptide_reader[i]->Reader()->BytesRead());
       delete peptide_reader[i];
       peptide_reader[i] = NULL;
     }
 
   } // End of spectrum file loop
 
-  for (ProteinVec::iterator i = proteins.begin(); i != proteins.end(); ++i) {
-    delete *i;
-  }
   if (target_file) {
+    Metrics::Add("tide-search.bytes-written", target_file->tellp());
     delete target_file;
     if (decoy_file) {
+      Metrics::Add("tide-search.bytes-written", decoy_file->tellp());
       delete decoy_file;
     }
   }
+  if (shard_ >= 0) {
+    sortShardFile(output_file_name_);
+    if (decoy_file) {
+      sortShardFile(make_file_path(getFileStem() + ".decoy.txt"));
+    }
+  }
   delete[] aaFreqN;
   delete[] aaFreqI;
   delete[] aaFreqC;
@@ -415,21 +493,36 @@ vector<int> TideSearchApplication::getNegativeIsotopeErrors() const {
 vector<TideSearchApplication::InputFile> TideSearchApplication::getInputFiles(
   const vector<string>& filepaths
 ) const {
+  // Shard workers run by runShards() are given the files it converted
+  string shard_spectrumrecords = Params::GetString("shard-spectrumrecords");
+  vector<string> converted;
+  if (!shard_spectrumrecords.empty()) {
+    converted = StringUtils::Split(shard_spectrumrecords, ',');
+  }
+  if (!converted.empty() && converted.size() != filepaths.size()) {
+    carp(CARP_FATAL, "shard-spectrumrecords must name one file per spectrum file");
+  }
   // Try to read all spectrum files as spectrumrecords, convert those that fail
   vector<InputFile> input_sr;
   for (vector<string>::const_iterator f = filepaths.begin(); f != filepaths.end(); f++) {
+    if (!converted.empty()) {
+      input_sr.push_back(InputFile(*f, converted[f - filepaths.begin()], true));
+      continue;
+    }
     SpectrumCollection spectra;
     pb::Header spectrum_header;
     string spectrumrecords = *f;
     bool keepSpectrumrecords = true;
-    if (!spectra.ReadSpectrumRecords(spectrumrecords, &spectrum_header)) {
+    if (!spectra.ReadSpectrumRecords(spectrumrecords, &spectrum_header, NUM_THREADS)) {
       // Failed, try converting to spectrumrecords file
       carp(CARP_INFO, "Converting %s to spectrumrecords format", f->c_str());
       carp(CARP_INFO, "Elapsed time starting conversion: %.3g s", wall_clock() / 1e6);
       spectrumrecords = Params::GetString("store-spectra");
       keepSpectrumrecords = !spectrumrecords.empty();
       if (!keepSpectrumrecords) {
-        spectrumrecords = make_file_path(FileUtils::BaseName(*f) + ".spectrumrecords.tmp");
+        // Shard workers convert concurrently, so each needs its own copy
+        string shard = shard_ >= 0 ? ".shard-" + StringUtils::ToString(shard_) : "";
+        spectrumrecords = make_file_path(FileUtils::BaseName(*f) + shard + ".spectrumrecords.tmp");
       } else if (filepaths.size() > 1) {
         carp(CARP_FATAL, "Cannot use store-spectra option with multiple input "
                          "spectrum files");
@@ -440,7 +533,7 @@ vector<TideSearchApplication::InputFile> TideSearchApplication::getInputFiles(
       }
       carp(CARP_DEBUG, "Reading converted spectrum file %s", spectrumrecords.c_str());
       // Re-read converted file as spectrumrecords file
-      if (!spectra.ReadSpectrumRecords(spectrumrecords, &spectrum_header)) {
+      if (!spectra.ReadSpectrumRecords(spectrumrecords, &spectrum_header, NUM_THREADS)) {
         carp(CARP_DEBUG, "Deleting %s", spectrumrecords.c_str());
         FileUtils::Remove(spectrumrecords);
         carp(CARP_FATAL, "Error reading spectra file %s", spectrumrecords.c_str());
@@ -451,10 +544,10 @@ vector<TideSearchApplication::InputFile> TideSearchApplication::getInputFiles(
   return input_sr;
 }
 
-SpectrumCollection* TideSearchApplication::loadSpectra(const string& file) {
+SpectrumCollection* TideSearchApplication::loadSpectra(const string& file, int num_threads) {
   SpectrumCollection* spectra = new SpectrumCollection();
   pb::Header header;
-  if (!spectra->ReadSpectrumRecords(file, &header)) {
+  if (!spectra->ReadSpectrumRecords(file, &header, num_threads)) {
     carp(CARP_FATAL, "Error reading spectrum file %s", file.c_str());
   }
   if (string_to_window_type(Params::GetString("precursor-window-type")) != WINDOW_MZ) {
@@ -471,7 +564,7 @@ void TideSearchApplication::search(void* threadarg) {
   const string& spectrum_filename = my_data->spectrum_filename;
   const vector<SpectrumCollection::SpecCharge>* spec_charges = my_data->spec_charges;
   ActivePeptideQueue* active_peptide_queue = my_data->active_peptide_queue;
-  ProteinVec& proteins = my_data->proteins;
+  const ProteinBlob& proteins = *my_data->proteins;
   vector<const pb::AuxLocation*>& locations = my_data->locations;
   double precursor_window = my_data->precursor_window;
   WINDOW_TYPE_T window_type = my_data->window_type;
@@ -533,19 +626,31 @@ void TideSearchApplication::search(void* threadarg) {
   long int num_precursors_skipped = 0;
   long int num_isotopes_skipped = 0;
   long int num_retained = 0;
+  int64_t num_searched = 0;
 
   // cycle through spectrum-charge pairs, sorted by neutral mass
   FLOAT_T sc_total = (FLOAT_T)spec_charges->size();
   int print_interval = Params::GetInt("print-search-progress");
 
+  // Consecutive spectra may be scored in batches against the peptides of all
+  // their windows; see scoreSpectrumBatch().
+  SpectrumBatch* batch = NULL;
+  vector<batched_spectrum> pending;
+  int batch_size = Params::GetInt("spectrum-batch-size");
+  if (batch_size > 1 && curScoreFunction == XCORR_SCORE && !exact_pval_search_ &&
+      !peptide_centric) {
+    batch = new SpectrumBatch(batch_size);
+    active_peptide_queue->SetKeepPeakCodes(true);
+  }
+
   for (vector<SpectrumCollection::SpecCharge>::const_iterator sc = spec_charges->begin()+thread_num;
        sc < spec_charges->begin() + (spec_charges->size());
        sc = sc + num_threads) {
     locks_array[LOCK_REPORTING]->lock();
     ++(*sc_index);
     if (print_interval > 0 && *sc_index > 0 && *sc_index % print_interval == 0) {
-      carp(CARP_INFO, "%d spectrum-charge combinations searched, %.0f%% complete",
-           *sc_index, *sc_index / sc_total * 100);
+      carp_every(1.0, CARP_INFO, "%d spectrum-charge combinations searched, %.0f%% complete",
+                 *sc_index, *sc_index / sc_total * 100);
     }
     locks_array[LOCK_REPORTING]->unlock();
 
@@ -572,11 +677,11 @@ void TideSearchApplication::search(void* threadarg) {
         (search_charge != 0 && charge != search_charge) || charge > max_charge) {
       continue;
     }
+    ++num_searched;
     // The active peptide queue holds the candidate peptides for spectrum.
     // Calculate and set the window, depending on the window type.
     vector<double>* min_mass = new vector<double>();
     vector<double>* max_mass = new vector<double>();
-    vector<bool>* candidatePeptideStatus = new vector<bool>();
     double min_range, max_range;
     computeWindow(*sc, window_type, precursor_window, max_charge,
                   negative_isotope_errors, min_mass, max_mass, &min_range, &max_range);
@@ -590,8 +695,18 @@ void TideSearchApplication::search(void* threadarg) {
       observed.PreprocessSpectrum(*spectrum, charge, &num_range_skipped,
                                   &num_precursors_skipped,
                                   &num_isotopes_skipped, &num_retained);
+      if (batch != NULL) {
+        // pending takes over min_mass and max_mass.
+        batch->Add(observed, charge);
+        batched_spectrum deferred = { sc, min_mass, max_mass, min_range, max_range };
+        pending.push_back(deferred);
+        if (batch->Full()) {
+          scoreSpectrumBatch(my_data, batch, &pending);
+        }
+        continue;
+      }
       int nCandPeptide = active_peptide_queue->SetActiveRange(
-        min_mass, max_mass, min_range, max_range, candidatePeptideStatus);
+        min_mass, max_mass, min_range, max_range);
       if (nCandPeptide == 0) {
         continue;
       }
@@ -599,45 +714,43 @@ void TideSearchApplication::search(void* threadarg) {
       *total_candidate_peptides += nCandPeptide;
       locks_array[LOCK_CANDIDATES]->unlock();
 
-      int candidatePeptideStatusSize = candidatePeptideStatus->size();
-      TideMatchSet::Arr2 match_arr2(candidatePeptideStatusSize); // Scored peptides will go here.
+      int activeQueueSize = active_peptide_queue->end_ - active_peptide_queue->iter_;
+      TideMatchSet::Arr2 match_arr2(nCandPeptide); // Scored peptides will go here.
 
       // Programs for taking the dot-product with the observed spectrum are laid
       // out in memory managed by the active_peptide_queue, one program for each
-      // candidate peptide. The programs will store the results directly into
-      // match_arr. We now pass control to those programs.
+      // peptide. The programs of the candidates will store the results directly
+      // into match_arr. We now pass control to those programs.
       collectScoresCompiled(active_peptide_queue, spectrum, observed, &match_arr2,
-                            candidatePeptideStatusSize, charge);
+                            activeQueueSize, charge);
 
       // matches will arrange the results in a heap by score, return the top
       // few, and recover the association between counter and peptide. We output
       // the top matches.
       if (peptide_centric) {
-        deque<Peptide*>::const_iterator iter_ = active_peptide_queue->iter_;
-        TideMatchSet::Arr2::iterator it = match_arr2.begin();
-        for (; it != match_arr2.end(); ++iter_, ++it) {
-          int peptide_idx = candidatePeptideStatusSize - (it->second);
-          if ((*candidatePeptideStatus)[peptide_idx]) {
-            (*iter_)->AddHit(spectrum, it->first, 0.0, it->second, charge);
-          }
+        for (TideMatchSet::Arr2::iterator it = match_arr2.begin();
+             it != match_arr2.end();
+             ++it) {
+          Peptide* peptide = *(active_peptide_queue->end_ - it->second);
+          peptide->AddHit(spectrum, it->first, 0.0, it->second, charge);
         }
       } else {  //spectrum centric match report.
         TideMatchSet::Arr match_arr(nCandPeptide);
         for (TideMatchSet::Arr2::iterator it = match_arr2.begin();
              it != match_arr2.end();
              ++it) {
-          int peptide_idx = candidatePeptideStatusSize - (it->second);
-          if ((*candidatePeptideStatus)[peptide_idx]) {
-            TideMatchSet::Scores curScore;
-            curScore.xcorr_score = (double)(it->first / XCORR_SCALING);
-            curScore.rank = it->second;
-            match_arr.push_back(curScore);
-          }
+          TideMatchSet::Scores curScore;
+          curScore.xcorr_score = (double)(it->first / XCORR_SCALING);
+          curScore.rank = it->second;
+          match_arr.push_back(curScore);
         }
 
         TideMatchSet matches(&match_arr, highest_mz);
         matches.exact_pval_search_ = exact_pval_search;
         matches.cur_score_function_ = curScoreFunction;
+        if (shard_ >= 0) {
+          matches.sort_key_ = shardSortKey(spec_charges, sc);
+        }
 
         matches.report(target_file, decoy_file, top_matches, numDecoys, spectrum_filename,
                        spectrum, charge, active_peptide_queue, proteins,
@@ -645,8 +758,9 @@ void TideSearchApplication::search(void* threadarg) {
       }  //end peptide_centric == false
     } else { //This runs curScoreFunction=BOTH_SCORE, curScoreFunction=RESIUDUE_EVIDENCE_MATRIX, and xcorr p-val
 
-      int nCandPeptide = active_peptide_queue->SetActiveRangeBIons(min_mass, max_mass, min_range, max_range, candidatePeptideStatus);
-      int candidatePeptideStatusSize = candidatePeptideStatus->size();
+      int nCandPeptide = active_peptide_queue->SetActiveRangeBIons(min_mass, max_mass, min_range, max_range);
+      int activeQueueSize = active_peptide_queue->end_ - active_peptide_queue->iter_;
+      const vector<pair<int, int> >& candidateRanges = active_peptide_queue->CandidateRanges();
       if (nCandPeptide == 0) {
         continue;
       }
@@ -684,7 +798,7 @@ void TideSearchApplication::search(void* threadarg) {
 
       // iterators needed at multiple places in following code
       deque<Peptide*>::const_iterator iter_ = active_peptide_queue->iter_;
-      deque<TheoreticalPeakSetBIons>::const_iterator iter1_ = active_peptide_queue->iter1_;
+      deque<BIonPeakSpan>::const_iterator iter1_ = active_peptide_queue->iter1_;
 
       //************************************************************************
       /* For one observed spectrum, calculates:
@@ -710,7 +824,7 @@ void TideSearchApplication::search(void* threadarg) {
       //For each candidate peptide, determine which discretized mass bin it is in
       //pepMassInt contains the corresponding mass bin for each candidate peptide
       //pepMassIntUnique contains the unique set of mass bins that candidate peptides fall in
-      getMassBin(pepMassInt, pepMassIntUnique, active_peptide_queue, candidatePeptideStatus);
+      getMassBin(pepMassInt, pepMassIntUnique, active_peptide_queue);
       int nPepMassIntUniq = (int)pepMassIntUnique.size();
 
       //XCORR
@@ -809,8 +923,12 @@ void TideSearchApplication::search(void* threadarg) {
       vector<int> resEvScores;
       vector<int> xcorrScores;
       pe = 0;
-      for (peidx = 0; peidx < candidatePeptideStatusSize; peidx++) {
-        if ((*candidatePeptideStatus)[peidx]) {
+      for (vector<pair<int, int> >::const_iterator range = candidateRanges.begin();
+           range != candidateRanges.end();
+           ++range) {
+        iter_ = active_peptide_queue->iter_ + range->first;
+        iter1_ = active_peptide_queue->iter1_ + range->first;
+        for (peidx = range->first; peidx < range->second; peidx++, ++iter_, ++iter1_) {
           int pepMassIntIdx = 0;
           int curPepMassInt;
           for (ma = 0; ma < nPepMassIntUniq; ma++ ) { //TODO should probably use iterator instead
@@ -828,8 +946,8 @@ void TideSearchApplication::search(void* threadarg) {
               intensArrayTheor[ma] = 0;
             }
 
-            for (vector<unsigned int>::const_iterator iter_uint = iter1_->unordered_peak_list_.begin();
-                 iter_uint != iter1_->unordered_peak_list_.end();
+            for (const unsigned int* iter_uint = iter1_->begin();
+                 iter_uint != iter1_->end();
                  iter_uint++) {
               intensArrayTheor[*iter_uint] = 1;
             }
@@ -844,17 +962,10 @@ void TideSearchApplication::search(void* threadarg) {
 
           //RES-EV
           if (curScoreFunction != XCORR_SCORE) {
-            vector<vector<double> > curResidueEvidenceMatrix = residueEvidenceMatrix[pepMassIntIdx];
+            const vector<vector<double> >& curResidueEvidenceMatrix = residueEvidenceMatrix[pepMassIntIdx];
             Peptide* curPeptide = (*iter_);
 
-            vector<unsigned int> intensArrayTheorResEv;
-            for (vector<unsigned int>::const_iterator iter_uint = iter1_->unordered_peak_list_.begin();
-                 iter_uint != iter1_->unordered_peak_list_.end();
-                 iter_uint++) {
-              intensArrayTheorResEv.push_back(*iter_uint);
-            }
-
-            scoreResidueEvidence = calcResEvScore(curResidueEvidenceMatrix,intensArrayTheorResEv,aaMassDouble,curPeptide);
+            scoreResidueEvidence = calcResEvScore(curResidueEvidenceMatrix,*iter1_,aaMassDouble,curPeptide);
             resEvScores.push_back(scoreResidueEvidence);
 
             if (scoreResidueEvidence > 0) { // if > 0, set bool to true to create DP matrix
@@ -864,8 +975,6 @@ void TideSearchApplication::search(void* threadarg) {
           //END RES-EV
           pe++;
         }
-        ++iter_;
-        ++iter1_;
       }
 
       if (curScoreFunction == RESIDUE_EVIDENCE_MATRIX || curScoreFunction == BOTH_SCORE) {
@@ -963,15 +1072,17 @@ void TideSearchApplication::search(void* threadarg) {
       //END RES-EV
 
       /************ calculate p-values for PSMs using residue evidence matrix ****************/
-      iter_ = active_peptide_queue->iter_;
-      iter1_ = active_peptide_queue->iter1_;
       int curPepMassInt;
       double pValue_xcorr;
       double pValue_resEv;
       double pValue_both;
       pe = 0;
-      for (peidx = 0; peidx < candidatePeptideStatusSize; peidx++) {
-        if ((*candidatePeptideStatus)[peidx]) {
+      for (vector<pair<int, int> >::const_iterator range = candidateRanges.begin();
+           range != candidateRanges.end();
+           ++range) {
+        iter_ = active_peptide_queue->iter_ + range->first;
+        iter1_ = active_peptide_queue->iter1_ + range->first;
+        for (peidx = range->first; peidx < range->second; peidx++, ++iter_, ++iter1_) {
           int pepMassIntIdx = 0;
 
           for (ma = 0; ma < nPepMassIntUniq; ma++ ) { //TODO should probably use iterator instead
@@ -1030,13 +1141,11 @@ void TideSearchApplication::search(void* threadarg) {
             curScore.resEv_score = scoreResidueEvidence;
             curScore.combinedPval = pValue_both;
             //TODO ugly hack to conform with the way these indices are generated in standard tide-search
-            curScore.rank = candidatePeptideStatusSize - peidx;
+            curScore.rank = activeQueueSize - peidx;
             match_arr.push_back(curScore);
           }
           pe++;
         }
-        ++iter_;
-        ++iter1_;
       }
 
       //clean up
@@ -1057,6 +1166,9 @@ void TideSearchApplication::search(void* threadarg) {
         TideMatchSet matches(&match_arr, highest_mz);
         matches.exact_pval_search_ = exact_pval_search_;
         matches.cur_score_function_ = curScoreFunction;
+        if (shard_ >= 0) {
+          matches.sort_key_ = shardSortKey(spec_charges, sc);
+        }
 
         if (curScoreFunction == RESIDUE_EVIDENCE_MATRIX && exact_pval_search_ == false) {
           matches.report(target_file, decoy_file, top_matches, numDecoys, spectrum_filename,
@@ -1071,8 +1183,12 @@ void TideSearchApplication::search(void* threadarg) {
     }
     delete min_mass;
     delete max_mass;
-    delete candidatePeptideStatus;
   }
+  if (batch != NULL) {
+    scoreSpectrumBatch(my_data, batch, &pending);
+    delete batch;
+  }
+  Metrics::Add("tide-search.spectra-preprocessed", num_searched);
 
   if (!Params::GetBool("skip-preprocessing")) {
     locks_array[LOCK_REPORTING]->lock();
@@ -1105,7 +1221,7 @@ void TideSearchApplication::search(
   const string& spectrum_filename,
   const vector<SpectrumCollection::SpecCharge>* spec_charges,
   vector<ActivePeptideQueue*> active_peptide_queue,
-  ProteinVec& proteins,
+  const ProteinBlob& proteins,
   vector<const pb::AuxLocation*>& locations,
   double precursor_window,
   WINDOW_TYPE_T window_type,
@@ -1182,7 +1298,7 @@ void TideSearchApplication::search(
   vector<thread_data> thread_data_array;
   for (int i= 0; i < NUM_THREADS; i++) {
       thread_data_array.push_back(thread_data(spectrum_filename, spec_charges, active_peptide_queue[i],
-      proteins, locations, precursor_window, window_type, spectrum_min_mz,
+      &proteins, locations, precursor_window, window_type, spectrum_min_mz,
       spectrum_max_mz, min_scan, max_scan, min_peaks, search_charge, top_matches,
       highest_mz, target_file, decoy_file, compute_sp,
       i, NUM_THREADS, nAA, aaFreqN, aaFreqI, aaFreqC, aaMass,
@@ -1208,6 +1324,7 @@ void TideSearchApplication::search(
   carp(CARP_INFO, "Time per spectrum-charge combination: %lf s.", wall_clock() / (1e6*sc_total));
   carp(CARP_INFO, "Average number of candidates per spectrum-charge combination: %lf ",
                   (*total_candidate_peptides) / sc_total);
+  Metrics::Add("tide-search.candidates-scored", *total_candidate_peptides);
   for (int i = 0; i < NUMBER_LOCK_TYPES; i++) {
     delete locks_array[i];
   }
@@ -1230,9 +1347,6 @@ void TideSearchApplication::collectScoresCompiled(
   if (!active_peptide_queue->HasNext()) {
     return;
   }
-  // prog gets the address of the dot-product program for the first peptide
-  // in the active queue.
-  const void* prog = active_peptide_queue->NextPeptide()->Prog(charge);
   const int* cache = observed.GetCache();
   // results will get (score, counter) pairs, where score is the dot product
   // of the observed peak set with a candidate peptide. The candidate
@@ -1241,6 +1355,112 @@ void TideSearchApplication::collectScoresCompiled(
   // simplifies the generated programs, which now simply dump the counter.
   pair<int, int>* results = match_arr->data();
 
+  // The program of each peptide runs on into that of the next one in the
+  // queue, so each run of candidates is scored by calling the program of its
+  // first peptide with the counter set to the length of the run. The
+  // programs count down from there; the counters are then shifted to count
+  // from the back of the whole queue. Peptides between the isotope windows
+  // are not scored at all.
+  const vector<pair<int, int> >& ranges = active_peptide_queue->CandidateRanges();
+  for (vector<pair<int, int> >::const_iterator range = ranges.begin();
+       range != ranges.end();
+       ++range) {
+    const void* prog = (*(active_peptide_queue->iter_ + range->first))->Prog(charge);
+    int count = range->second - range->first;
+    runCompiledPrograms(prog, cache, count, results);
+    int counter_offset = queue_size - range->second;
+    for (int i = 0; i < count; ++i) {
+      results[i].second += counter_offset;
+    }
+    results += count;
+  }
+
+  // match_arr is filled by the compiled programs, not by calls to
+  // push_back(). We have to set the final size explicitly.
+  match_arr->set_size(results - match_arr->data());
+}
+
+void TideSearchApplication::scoreSpectrumBatch(
+  thread_data* my_data,
+  SpectrumBatch* batch,
+  vector<batched_spectrum>* pending
+) {
+  if (pending->empty()) {
+    return;
+  }
+  ActivePeptideQueue* active_peptide_queue = my_data->active_peptide_queue;
+
+  // Activate the peptides of all the windows of the batch at once, and score
+  // each of them against every spectrum in one pass.
+  vector<double> min_mass(1, pending->front().min_mass->front());
+  vector<double> max_mass(1, pending->front().max_mass->back());
+  double min_range = pending->front().min_range;
+  double max_range = pending->front().max_range;
+  for (vector<batched_spectrum>::const_iterator i = pending->begin();
+       i != pending->end();
+       ++i) {
+    min_mass[0] = min(min_mass[0], i->min_mass->front());
+    max_mass[0] = max(max_mass[0], i->max_mass->back());
+    min_range = min(min_range, i->min_range);
+    max_range = max(max_range, i->max_range);
+  }
+  active_peptide_queue->SetActiveRange(&min_mass, &max_mass, min_range, max_range);
+  deque<Peptide*>::const_iterator batch_begin = active_peptide_queue->iter_;
+  vector<int> scores;
+  batch->Score(batch_begin, active_peptide_queue->end_, &scores);
+  int batch_size = batch->Size();
+
+  // Then narrow the queue to the windows of each spectrum in turn, so that
+  // its matches are counted and reported as if it had been searched alone.
+  for (int b = 0; b < pending->size(); ++b) {
+    const batched_spectrum& spec = (*pending)[b];
+    int nCandPeptide = active_peptide_queue->SetCandidateRanges(spec.min_mass, spec.max_mass);
+    if (nCandPeptide > 0) {
+      my_data->locks_array[LOCK_CANDIDATES]->lock();
+      *(my_data->total_candidate_peptides) += nCandPeptide;
+      my_data->locks_array[LOCK_CANDIDATES]->unlock();
+
+      int offset = active_peptide_queue->iter_ - batch_begin;
+      int activeQueueSize = active_peptide_queue->end_ - active_peptide_queue->iter_;
+      TideMatchSet::Arr match_arr(nCandPeptide);
+      const vector<pair<int, int> >& ranges = active_peptide_queue->CandidateRanges();
+      for (vector<pair<int, int> >::const_iterator range = ranges.begin();
+           range != ranges.end();
+           ++range) {
+        for (int i = range->first; i < range->second; ++i) {
+          TideMatchSet::Scores curScore;
+          curScore.xcorr_score = (double)(scores[(offset + i) * batch_size + b] / XCORR_SCALING);
+          curScore.rank = activeQueueSize - i;
+          match_arr.push_back(curScore);
+        }
+      }
+
+      TideMatchSet matches(&match_arr, my_data->highest_mz);
+      matches.exact_pval_search_ = false;
+      matches.cur_score_function_ = XCORR_SCORE;
+      if (shard_ >= 0) {
+        matches.sort_key_ = shardSortKey(my_data->spec_charges, spec.sc);
+      }
+
+      matches.report(my_data->target_file, my_data->decoy_file, my_data->top_matches,
+                     my_data->decoysPerTarget, my_data->spectrum_filename,
+                     spec.sc->spectrum, spec.sc->charge, active_peptide_queue,
+                     *(my_data->proteins), my_data->locations, my_data->compute_sp,
+                     true, my_data->locks_array[LOCK_RESULTS]);
+    }
+    delete spec.min_mass;
+    delete spec.max_mass;
+  }
+  pending->clear();
+  batch->Clear();
+}
+
+void TideSearchApplication::runCompiledPrograms(
+  const void* prog,
+  const int* cache,
+  int count,
+  pair<int, int>* results
+) {
   // See compiler.h for a description of the programs beginning at prog and
   // how they are generated. Here we initialize certain registers to the
   // values expected by the programs and call the first one (*prog).
@@ -1249,7 +1469,7 @@ void TideSearchApplication::collectScoresCompiled(
   // to set these registers:
   // edx/rdx points to the cache.
   // eax/rax points to the first program.
-  // ecx/rcx is the counter and gets the size of the active queue.
+  // ecx/rcx is the counter and gets the number of programs to run.
   // edi/rdi points to the results buffer.
   //
   // The push and pop operations are a workaround for a compiler that
@@ -1270,7 +1490,7 @@ void TideSearchApplication::collectScoresCompiled(
 
     context.Rdx = (DWORD64)cache;
     context.Rax = (DWORD64)prog;
-    context.Rcx = (DWORD64)queue_size;
+    context.Rcx = (DWORD64)count;
     context.Rdi = (DWORD64)results;
 
     restored = true;
@@ -1295,7 +1515,7 @@ void TideSearchApplication::collectScoresCompiled(
     push edi
     mov edx, cache
     mov eax, prog
-    mov ecx, queue_size
+    mov ecx, count
     mov edi, results
     call eax
     pop edi
@@ -1317,71 +1537,308 @@ void TideSearchApplication::collectScoresCompiled(
                        "pop %%edi\n"
                        "pop %%ecx\n"
 #endif
-                       : // no outputs
+                       : "+a" (prog) // the programs sum into eax
                        : "d" (cache),
-                         "a" (prog),
-                         "c" (queue_size),
+                         "c" (count),
                          "D" (results)
+                       : "memory", "cc"
   );
 #endif
-
-  // match_arr is filled by the compiled programs, not by calls to
-  // push_back(). We have to set the final size explicitly.
-  match_arr->set_size(queue_size);
 }
 #ifdef _WIN64
 #pragma optimize( "g", on )
 #endif
 
 void TideSearchApplication::convertResults() const {
+  // Each results file is read once and written in all requested formats.
+  vector<string> formats;
+  if (Params::GetBool("pin-output")) {
+    formats.push_back("pin");
+  }
+  if (Params::GetBool("pepxml-output")) {
+    formats.push_back("pepxml");
+  }
+  if (Params::GetBool("mzid-output")) {
+    formats.push_back("mzidentml");
+  }
+  if (Params::GetBool("sqt-output")) {
+    formats.push_back("sqt");
+  }
+  if (formats.empty()) {
+    return;
+  }
+
   PSMConvertApplication converter;
+  string database = Params::GetString("protein-database");
   if (!Params::GetBool("concat")) {
     string target_file_name = make_file_path("tide-search.target.txt");
-    if (Params::GetBool("pin-output")) {
-      converter.convertFile("tsv", "pin", target_file_name, "tide-search.target.", Params::GetString("protein-database"), true);
+    converter.convertFile("tsv", formats, target_file_name, "tide-search.target.", database, true);
+
+    if (HAS_DECOYS) {
+      string decoy_file_name = make_file_path("tide-search.decoy.txt");
+      converter.convertFile("tsv", formats, decoy_file_name, "tide-search.decoy.", database, true);
+    }
+  } else {
+    string concat_file_name = make_file_path("tide-search.txt");
+    converter.convertFile("tsv", formats, concat_file_name, "tide-search.", database, true);
+  }
+}
+
+namespace {
+
+// Quotes an argument of a command run with system()
+string quoteArgument(const string& arg) {
+#ifdef _WIN32
+  string quoted = "\"";
+  for (string::const_iterator i = arg.begin(); i != arg.end(); i++) {
+    if (*i == '"') {
+      quoted += '\\';
     }
-    if (Params::GetBool("pepxml-output")) {
-      converter.convertFile("tsv", "pepxml", target_file_name, "tide-search.target.", Params::GetString("protein-database"), true);
+    quoted += *i;
+  }
+  return quoted + '"';
+#else
+  string quoted = "'";
+  for (string::const_iterator i = arg.begin(); i != arg.end(); i++) {
+    if (*i == '\'') {
+      quoted += "'\\''";
+    } else {
+      quoted += *i;
+    }
+  }
+  return quoted + '\'';
+#endif
+}
+
+// Formats a double so that it parses back to the same value
+string exactDouble(double x) {
+  ostringstream out;
+  out << setprecision(17) << x;
+  return out.str();
+}
+
+// A result line written by a shard worker, split into its sort key and the
+// line of the single-process output
+struct ShardLine {
+  int file;
+  long sc;
+  size_t start;
+  string text;
+
+  bool read(istream& in, const string& filename) {
+    if (!getline(in, text)) {
+      return false;
     }
-    if (Params::GetBool("mzid-output")) {
-      converter.convertFile("tsv", "mzidentml", target_file_name, "tide-search.target.", Params::GetString("protein-database"), true);
+    const char* begin = text.c_str();
+    char* end;
+    file = strtol(begin, &end, 10);
+    if (*end == '\t') {
+      sc = strtol(end + 1, &end, 10);
     }
-    if (Params::GetBool("sqt-output")) {
-      converter.convertFile("tsv", "sqt", target_file_name, "tide-search.target.", Params::GetString("protein-database"), true);
+    if (end == begin || *end != '\t') {
+      carp(CARP_FATAL, "Malformed shard result line in %s", filename.c_str());
     }
+    start = end + 1 - begin;
+    return true;
+  }
 
-    if (HAS_DECOYS) {
-      string decoy_file_name = make_file_path("tide-search.decoy.txt");
-      if (Params::GetBool("pin-output")) {
-        converter.convertFile("tsv", "pin", decoy_file_name, "tide-search.decoy.", Params::GetString("protein-database"), true);
-      }
-      if (Params::GetBool("pepxml-output")) {
-        converter.convertFile("tsv", "pepxml", decoy_file_name, "tide-search.decoy.", Params::GetString("protein-database"), true);
+  bool operator<(const ShardLine& other) const {
+    return file < other.file || (file == other.file && sc < other.sc);
+  }
+};
+
+}
+
+/**
+ * Runs num-shards tide-search worker processes, each with its share of
+ * num-threads, and merges their results into tide-search.*. With
+ * merge-shards, only merges the results of workers that have already run.
+ */
+int TideSearchApplication::runShards(int argc, char** argv) {
+  bool concat = Params::GetBool("concat");
+  bool overwrite = Params::GetBool("overwrite");
+  // Fail before searching if the results could not be written
+  output_file_name_ = make_file_path(concat ? "tide-search.txt" : "tide-search.target.txt");
+  ofstream* target_file = create_stream_in_path(output_file_name_.c_str(), NULL, overwrite);
+
+  if (!Params::GetBool("merge-shards")) {
+    int num_threads = Params::GetInt("num-threads");
+    if (num_threads < 1) {
+      num_threads = boost::thread::hardware_concurrency();
+    }
+    int worker_threads = max(1, num_threads / num_shards_);
+
+    // Workers get the options of this command, plus the index made by
+    // processParams() if given a FASTA file, the settings param-medic chose
+    // and the spectrum files converted here, so that they neither repeat that
+    // work nor disagree about it.
+    string command = quoteArgument(CruxApplicationList::getExecutable()) + ' ' +
+      quoteArgument(argv[0]);
+    for (int i = 1; i + 1 < argc; i++) {
+      if (StringUtils::StartsWith(argv[i], "--")) {
+        command += ' ' + quoteArgument(argv[i]) + ' ' + quoteArgument(argv[i + 1]);
+        i++;
       }
-      if (Params::GetBool("mzid-output")) {
-        converter.convertFile("tsv", "mzidentml", decoy_file_name, "tide-search.decoy.", Params::GetString("protein-database"), true);
+    }
+    NUM_THREADS = num_threads;
+    Metrics::Timer convert_spectra_timer("tide-search.convert-spectra");
+    vector<InputFile> spectra = getInputFiles(Params::GetStrings("tide spectra file"));
+    convert_spectra_timer.Stop();
+    vector<string> spectrumrecords;
+    for (vector<InputFile>::const_iterator i = spectra.begin(); i != spectra.end(); i++) {
+      command += ' ' + quoteArgument(i->OriginalName);
+      spectrumrecords.push_back(i->SpectrumRecords);
+    }
+    command += ' ' + quoteArgument(Params::GetString("tide database")) +
+      " --auto-precursor-window false --auto-mz-bin-width false" +
+      " --precursor-window " + exactDouble(Params::GetDouble("precursor-window")) +
+      " --mz-bin-width " + exactDouble(Params::GetDouble("mz-bin-width")) +
+      " --shard-spectrumrecords " + quoteArgument(StringUtils::Join(spectrumrecords, ',')) +
+      " --overwrite T";
+    carp(CARP_INFO, "Running %d shards with %d threads each.", num_shards_, worker_threads);
+
+    vector<int> status(num_shards_, 0);
+    boost::thread_group workers;
+    for (int i = 0; i < num_shards_; i++) {
+      string shard_command = command +
+        " --shard " + StringUtils::ToString(i) +
+        " --num-threads " + StringUtils::ToString(worker_threads);
+      carp(CARP_DEBUG, "Running %s", shard_command.c_str());
+      workers.add_thread(new boost::thread(boost::bind(
+        &TideSearchApplication::runShardCommand, shard_command, &status[i])));
+    }
+    workers.join_all();
+    for (vector<InputFile>::const_iterator i = spectra.begin(); i != spectra.end(); i++) {
+      if (!i->Keep) {
+        carp(CARP_DEBUG, "Deleting %s", i->SpectrumRecords.c_str());
+        remove(i->SpectrumRecords.c_str());
       }
-      if (Params::GetBool("sqt-output")) {
-        converter.convertFile("tsv", "sqt", decoy_file_name, "tide-search.decoy.", Params::GetString("protein-database"), true);
+    }
+    for (int i = 0; i < num_shards_; i++) {
+      if (status[i] != 0) {
+        carp(CARP_FATAL, "Shard %d failed (status %d), see %s", i, status[i],
+             shardFileName(i, ".log.txt").c_str());
       }
     }
+  }
+
+  carp(CARP_INFO, "Merging results of %d shards.", num_shards_);
+  HAS_DECOYS = false;
+  if (!concat) {
+    mergeShardFiles(".target.txt", target_file);
+    if (FileUtils::Exists(shardFileName(0, ".decoy.txt"))) {
+      HAS_DECOYS = true;
+      string decoy_file_name = make_file_path("tide-search.decoy.txt");
+      ofstream* decoy_file = create_stream_in_path(decoy_file_name.c_str(), NULL, overwrite);
+      mergeShardFiles(".decoy.txt", decoy_file);
+      delete decoy_file;
+    }
   } else {
-    string concat_file_name = make_file_path("tide-search.txt");
-    if (Params::GetBool("pin-output")) {
-      converter.convertFile("tsv", "pin", concat_file_name, "tide-search.", Params::GetString("protein-database"), true);
+    mergeShardFiles(".txt", target_file);
+  }
+  delete target_file;
+
+  convertResults();
+  return 0;
+}
+
+void TideSearchApplication::runShardCommand(const string& command, int* status) {
+#ifdef _WIN32
+  // cmd.exe strips the outermost quotes of the command line
+  *status = system(("\"" + command + "\"").c_str());
+#else
+  *status = system(command.c_str());
+#endif
+}
+
+/**
+ * Writes the result lines of every shard's <stem>.shard-<n><suffix>, each
+ * sorted by sortShardFile(), to out in order of spectrum file and
+ * spectrum-charge, which is the order of a single-threaded search, without
+ * their sort keys; then removes the shard files.
+ */
+void TideSearchApplication::mergeShardFiles(const string& suffix, ofstream* out) const {
+  vector<string> filenames;
+  vector<ifstream*> shards;
+  vector<ShardLine> lines(num_shards_);
+  vector<bool> active(num_shards_, false);
+  for (int i = 0; i < num_shards_; i++) {
+    filenames.push_back(shardFileName(i, suffix));
+    shards.push_back(new ifstream(filenames[i].c_str()));
+    string header;
+    if (!shards[i]->good() || !getline(*shards[i], header)) {
+      carp(CARP_FATAL, "Could not read results of shard %d (%s)", i, filenames[i].c_str());
     }
-    if (Params::GetBool("pepxml-output")) {
-      converter.convertFile("tsv", "pepxml", concat_file_name, "tide-search.", Params::GetString("protein-database"), true);
+    if (i == 0) {
+      *out << header << endl;
     }
-    if (Params::GetBool("mzid-output")) {
-      converter.convertFile("tsv", "mzidentml", concat_file_name, "tide-search.", Params::GetString("protein-database"), true);
+    active[i] = lines[i].read(*shards[i], filenames[i]);
+  }
+  // The shards hold contiguous ranges of spectrum-charges, so for a small
+  // number of shards a linear scan for the next line is enough
+  while (true) {
+    int next = -1;
+    for (int i = 0; i < num_shards_; i++) {
+      if (active[i] && (next < 0 || lines[i] < lines[next])) {
+        next = i;
+      }
     }
-    if (Params::GetBool("sqt-output")) {
-      converter.convertFile("tsv", "sqt", concat_file_name, "tide-search.", Params::GetString("protein-database"), true);
+    if (next < 0) {
+      break;
     }
+    out->write(lines[next].text.data() + lines[next].start,
+               lines[next].text.length() - lines[next].start);
+    *out << '\n';
+    active[next] = lines[next].read(*shards[next], filenames[next]);
+  }
+  out->flush();
+  for (int i = 0; i < num_shards_; i++) {
+    delete shards[i];
+    carp(CARP_DEBUG, "Deleting %s", filenames[i].c_str());
+    FileUtils::Remove(filenames[i]);
   }
 }
 
+/**
+ * Sorts the result lines of a shard worker's file by their sort keys, keeping
+ * the order of lines with the same key (the matches of one spectrum-charge).
+ */
+void TideSearchApplication::sortShardFile(const string& file) {
+  ifstream in(file.c_str());
+  string header;
+  if (!getline(in, header)) {
+    carp(CARP_FATAL, "Could not read %s", file.c_str());
+  }
+  vector<ShardLine> lines;
+  ShardLine line;
+  while (line.read(in, file)) {
+    lines.push_back(line);
+  }
+  in.close();
+  stable_sort(lines.begin(), lines.end());
+
+  ofstream out(file.c_str(), ios::out | ios::trunc);
+  out << header << '\n';
+  for (vector<ShardLine>::const_iterator i = lines.begin(); i != lines.end(); i++) {
+    out << i->text << '\n';
+  }
+  if (!out.good()) {
+    carp(CARP_FATAL, "Error writing %s", file.c_str());
+  }
+}
+
+string TideSearchApplication::shardFileName(int shard, const string& suffix) const {
+  return make_file_path(getName() + ".shard-" + StringUtils::ToString(shard) + suffix);
+}
+
+string TideSearchApplication::shardSortKey(
+  const vector<SpectrumCollection::SpecCharge>* spec_charges,
+  vector<SpectrumCollection::SpecCharge>::const_iterator sc
+) const {
+  return StringUtils::ToString(shard_file_) + '\t' +
+         StringUtils::ToString(shard_offset_ + (sc - spec_charges->begin())) + '\t';
+}
+
 void TideSearchApplication::computeWindow(
   const SpectrumCollection::SpecCharge& sc,
   WINDOW_TYPE_T window_type,
@@ -1495,22 +1952,27 @@ vector<string> TideSearchApplication::getOptions() const {
     "isotope-error",
     "mass-precision",
     "max-precursor-charge",
+    "merge-shards",
     "min-peaks",
     "mod-precision",
     "mz-bin-offset",
     "mz-bin-width",
     "mzid-output",
+    "num-shards",
     "num-threads",
     "output-dir",
     "overwrite",
     "parameter-file",
     "peptide-centric-search",
+    "peptide-prefetch",
     "score-function",
+    "spectrum-batch-size",
     "fragment-tolerance",
     "evidence-granularity",
     "pepxml-output",
     "pin-output",
     "pm-charges",
+    "pm-early-stop",
     "pm-max-frag-mz",
     "pm-max-precursor-delta-ppm",
     "pm-max-precursor-mz",
@@ -1529,6 +1991,8 @@ vector<string> TideSearchApplication::getOptions() const {
     "remove-precursor-peak",
     "remove-precursor-tolerance",
     "scan-number",
+    "shard",
+    "shard-spectrumrecords",
     "skip-preprocessing",
     "spectrum-charge",
     "spectrum-max-mz",
@@ -1569,6 +2033,11 @@ bool TideSearchApplication::needsOutputDirectory() const {
   return true;
 }
 
+string TideSearchApplication::getFileStem() const {
+  int shard = Params::GetInt("shard");
+  return shard < 0 ? getName() : getName() + ".shard-" + StringUtils::ToString(shard);
+}
+
 COMMAND_T TideSearchApplication::getCommand() const {
   return TIDE_SEARCH_COMMAND;
 }
@@ -1967,23 +2436,22 @@ string TideSearchApplication::getOutputFileName() {
 void TideSearchApplication::getMassBin(
   vector<int>& pepMassInt,
   vector<int>& pepMassIntUnique,
-  ActivePeptideQueue* active_peptide_queue,
-  vector<bool>* candidatePeptideStatus
+  ActivePeptideQueue* active_peptide_queue
 ) {
   int pe = 0;
-  int peidx = 0;
-
-  deque<Peptide*>::const_iterator iter_ = active_peptide_queue->iter_;
+  const vector<pair<int, int> >& candidateRanges = active_peptide_queue->CandidateRanges();
 
-  for (iter_ = active_peptide_queue->iter_; iter_ != active_peptide_queue->end_; ++iter_) {
-    if ((*candidatePeptideStatus)[peidx]) {
+  for (vector<pair<int, int> >::const_iterator range = candidateRanges.begin();
+       range != candidateRanges.end();
+       ++range) {
+    deque<Peptide*>::const_iterator iter_ = active_peptide_queue->iter_ + range->first;
+    for (int peidx = range->first; peidx < range->second; peidx++, ++iter_) {
       double pepMass = (*iter_)->Mass();
       int pepMaInt = MassConstants::mass2bin(pepMass);
       pepMassInt[pe] = pepMaInt;
       pepMassIntUnique.push_back(pepMaInt);
       pe++;
     }
-    peidx++;
   }
 
   //For pepMassIntUnique vector
@@ -2027,7 +2495,7 @@ int TideSearchApplication::getMaxColEvidence(
 //residue evidence matrix and a theoretical spectrum
 int TideSearchApplication::calcResEvScore(
   const vector<vector<double> >& curResidueEvidenceMatrix,
-  const vector<unsigned int>& intensArrayTheor,
+  const BIonPeakSpan& intensArrayTheor,
   const vector<double>& aaMassDouble,
   Peptide* curPeptide
 ) {
@@ -2037,10 +2505,11 @@ int TideSearchApplication::calcResEvScore(
 
   int scoreResidueEvidence = 0;
   double* residueMasses = curPeptide->getAAMasses(); //retrieves the amino acid masses, modifications included
+  const unsigned int* peaks = intensArrayTheor.begin();
   for (int res = 0; res < pepLen - 1; res++) {
     double tmpAAMass = residueMasses[res];
     int tmpAA = find(aaMassDouble.begin(),aaMassDouble.end(),tmpAAMass) - aaMassDouble.begin();
-    scoreResidueEvidence += curResidueEvidenceMatrix[tmpAA][intensArrayTheor[res]-1];
+    scoreResidueEvidence += curResidueEvidenceMatrix[tmpAA][peaks[res]-1];
   }
   delete residueMasses;
   return scoreResidueEvidence;
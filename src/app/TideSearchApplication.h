@@ -29,6 +29,8 @@ enum _tide_search_lock {
 
 typedef enum _tide_search_lock TIDE_SEARCH_LOCK_T;
 
+class SpectrumBatch;
+
 class TideSearchApplication : public CruxApplication {
 private:
   //Added by Andy Lin in Feb 2016
@@ -36,8 +38,7 @@ private:
   void getMassBin (
     vector<int>& pepMassInt,
     vector<int>& pepMassIntUnique,
-    ActivePeptideQueue* active_peptide_queue,
-    vector<bool>* candidatePeptideStatus
+    ActivePeptideQueue* active_peptide_queue
   );
 
   //Added by Andy Lin in March 2016
@@ -55,7 +56,7 @@ private:
   //residue evidence matrix and a theoretical spectrum
   int calcResEvScore(
     const vector<vector<double> >& curResidueEvidenceMatrix,
-    const vector<unsigned int>& intensArrayTheor,
+    const BIonPeakSpan& intensArrayTheor,
     const vector<double>& aaMassDouble,
     Peptide* curPeptide
   );
@@ -89,9 +90,29 @@ private:
   static bool HAS_DECOYS;
   static bool PROTEIN_LEVEL_DECOYS;
 
+  /**
+   * Sharded search (num-shards > 1). A worker searches the spectrum-charges
+   * [shard_offset_, shard_offset_ + slice size) of spectrum file shard_file_
+   * and prefixes each result line with "<file index>\t<spectrum-charge index>\t"
+   * so that mergeShards() can put the lines back into single-process order.
+   * shard_ is -1 when this process is not a worker.
+   */
+  int shard_;
+  int num_shards_;
+  int shard_file_;
+  size_t shard_offset_;
+
+  int runShards(int argc, char** argv);
+  void mergeShardFiles(const string& suffix, ofstream* out) const;
+  string shardFileName(int shard, const string& suffix) const;
+  string shardSortKey(const vector<SpectrumCollection::SpecCharge>* spec_charges,
+                      vector<SpectrumCollection::SpecCharge>::const_iterator sc) const;
+  static void sortShardFile(const string& file);
+  static void runShardCommand(const string& command, int* status);
+
   vector<int> getNegativeIsotopeErrors() const;
   vector<InputFile> getInputFiles(const vector<string>& filepaths) const;
-  static SpectrumCollection* loadSpectra(const std::string& file);
+  static SpectrumCollection* loadSpectra(const std::string& file, int num_threads);
 
   /**
    * Function that contains the search algorithm and performs the search
@@ -114,7 +135,7 @@ private:
     const string& spectrum_filename,
     const vector<SpectrumCollection::SpecCharge>* spec_charges,
     vector<ActivePeptideQueue*> active_peptide_queue,
-    ProteinVec& proteins,
+    const ProteinBlob& proteins,
     vector<const pb::AuxLocation*>& locations,
     double precursor_window,
     WINDOW_TYPE_T window_type,
@@ -155,6 +176,15 @@ private:
     int charge
   );
 
+  // Runs count chained dot-product programs starting at prog; see
+  // collectScoresCompiled().
+  static void runCompiledPrograms(
+    const void* prog,
+    const int* cache,
+    int count,
+    pair<int, int>* results
+  );
+
   void convertResults() const;
 
   void computeWindow(
@@ -249,6 +279,12 @@ private:
    */
   virtual bool needsOutputDirectory() const;
 
+  /**
+   * Returns the file stem; shard workers get their own, so that their logs,
+   * parameters and partial results do not collide
+   */
+  virtual string getFileStem() const;
+
   virtual COMMAND_T getCommand() const;
 
   /**
@@ -259,7 +295,7 @@ private:
     string spectrum_filename;
     const vector<SpectrumCollection::SpecCharge>* spec_charges;
     ActivePeptideQueue* active_peptide_queue;
-    ProteinVec proteins;
+    const ProteinBlob* proteins;
     vector<const pb::AuxLocation*> locations;
     double precursor_window;
     WINDOW_TYPE_T window_type;
@@ -300,7 +336,7 @@ private:
     vector<int>* negative_isotope_errors;
 
     thread_data (const string& spectrum_filename_, const vector<SpectrumCollection::SpecCharge>* spec_charges_,
-            ActivePeptideQueue* active_peptide_queue_, ProteinVec proteins_,
+            ActivePeptideQueue* active_peptide_queue_, const ProteinBlob* proteins_,
             vector<const pb::AuxLocation*> locations_, double precursor_window_,
             WINDOW_TYPE_T window_type_, double spectrum_min_mz_, double spectrum_max_mz_,
             int min_scan_, int max_scan_, int min_peaks_, int search_charge_, int top_matches_,
@@ -325,6 +361,29 @@ private:
             spectrum_flag(spectrum_flag_), sc_index(sc_index_), total_candidate_peptides(total_candidate_peptides_), negative_isotope_errors(negative_isotope_errors_) {}
   };
 
+  /**
+   * A spectrum-charge preprocessed into a SpectrumBatch and not yet scored,
+   * with its precursor windows (owned).
+   */
+  struct batched_spectrum {
+    vector<SpectrumCollection::SpecCharge>::const_iterator sc;
+    vector<double>* min_mass;
+    vector<double>* max_mass;
+    double min_range;
+    double max_range;
+  };
+
+  /**
+   * Scores the spectra of batch against one active range spanning all their
+   * windows, reports the matches of each within its own windows, and empties
+   * batch and pending.
+   */
+  void scoreSpectrumBatch(
+    thread_data* my_data,
+    SpectrumBatch* batch,
+    vector<batched_spectrum>* pending
+  );
+
   int calcScoreCount(
     int numelEvidenceObs,
     int* evidenceObs,
@@ -3,8 +3,15 @@
 #include "model/Peptide.h"
 #include "app/ComputeQValues.h"
 #include "util/Params.h"
+#include "boost/bind.hpp"
+#include "boost/thread.hpp"
+#include "boost/random/uniform_int_distribution.hpp"
 
 using namespace std; 
+
+// fewer psms than this per thread are not worth a thread in score_psms
+static const int kMinPsmsPerThread = 20000;
+
 double Barista :: check_gradients_hinge_one_net(int protind, int label){
   int num_pep = d.protind2num_pep(protind);
   int *pepinds = d.protind2pepinds(protind);
@@ -206,64 +213,64 @@ double Barista :: check_gradients_hinge_one_net(int protind, int label){
   return err;
 }
 
-double Barista :: check_gradients_hinge_clones(int protind, int label)
+double Barista :: check_gradients_hinge_clones(BaristaTrainState &s, int protind, int label)
 {
-  double sm = get_protein_score(protind);
-  net.clear_gradients();
-  calc_gradients(protind,label);
+  double sm = get_protein_score(s, protind);
+  s.net.clear_gradients();
+  calc_gradients(s,protind,label);
 
   double h = 0.0000001;
   double diff = -(1-sm*label);
   double err = 0.0;
-  double *w = net.get_weights(1);
-  double *dw = net.get_dweights(1);
+  double *w = s.net.get_weights(1);
+  double *dw = s.net.get_dweights(1);
   for (int k = 0; k < d.get_num_features(); k++)
     {
       w[k] += h;
-      double sm1 = get_protein_score(protind);
+      double sm1 = get_protein_score(s, protind);
       diff += (1-sm1*label);
       err += dw[k]-diff/h;
       w[k]-=h;
       diff -= (1-sm1*label);
     }
   
-  double *bias = net.get_bias(1);
-  double *dbias = net.get_dbias(1);
+  double *bias = s.net.get_bias(1);
+  double *dbias = s.net.get_dbias(1);
   for (int k = 0; k < num_hu; k++)
     {
       bias[k] += h;
-      double sm1 = get_protein_score(protind);
+      double sm1 = get_protein_score(s, protind);
       diff += 1-sm1*label;
       err += dbias[k]-diff/h;
       bias[k]-=h;
       diff -= 1-sm1*label;
     }
   
-  w = net.get_weights(2);
-  dw = net.get_dweights(2);
+  w = s.net.get_weights(2);
+  dw = s.net.get_dweights(2);
   for (int k = 0; k < num_hu; k++)
     {
       w[k] += h;
-      double sm1 = get_protein_score(protind);
+      double sm1 = get_protein_score(s, protind);
       diff += 1-sm1*label;
       err += dw[k]-diff/h;
       w[k]-=h;
       diff -= 1-sm1*label;
     }
 
-  bias = net.get_bias(2);
-  dbias = net.get_dbias(2);
+  bias = s.net.get_bias(2);
+  dbias = s.net.get_dbias(2);
   for (int k = 0; k < 1; k++)
     {
       bias[k] += h;
-      double sm1 = get_protein_score(protind);
+      double sm1 = get_protein_score(s, protind);
       diff += 1-sm1*label;
       err += dbias[k]-diff/h;
       bias[k]-=h;
       diff -= 1-sm1*label;
     }
   
-  net.update(mu);
+  s.net.update(s.mu);
 
   return err;
 }
@@ -271,19 +278,23 @@ double Barista :: check_gradients_hinge_clones(int protind, int label)
 /**********************************************************/
 int Barista :: getOverFDRPSM(PSMScores &s, NeuralNet &n,double fdr)
 {
-  double* featVec;
+  score_psms(n, scores_buf);
+  return getOverFDRPSM(s, fdr, scores_buf);
+}
+
+/*
+ * reads the psm scores from a buffer already filled by score_psms
+ */
+int Barista :: getOverFDRPSM(PSMScores &s, double fdr, BaristaScoreBuffer &buf, ostream &out)
+{
   for(int i = 0; i < s.size(); i++)
-    {
-      featVec = d.psmind2features(s[i].psmind);
-      double *r = n.fprop(featVec);
-      s[i].score = r[0];
-    }
+    s[i].score = buf.psm_scores[s[i].psmind];
 
   int overFDR = s.calcOverFDR(fdr);
  
   if(verbose > 1)
     {
-      cout << "psm over fdr: num psms " << overFDR << endl;
+      out << "psm over fdr: num psms " << overFDR << endl;
       int cn = 0;
       set<int> peptides;
       for(int i = 0; i < s.size(); i++)
@@ -294,44 +305,86 @@ int Barista :: getOverFDRPSM(PSMScores &s, NeuralNet &n,double fdr)
 	  if(cn >= overFDR)
 	    break;
 	}
-      cout << "psm over fdr: num peptides " << peptides.size() << endl;
+      out << "psm over fdr: num peptides " << peptides.size() << endl;
     }
   return overFDR;
 }
 
-double Barista :: get_peptide_score(int pepind, NeuralNet &n)
+/*
+ * scores every psm once with a batched fprop over the feature matrix and
+ * reduces the peptide max-scores from it; the protein, peptide and psm
+ * level evaluations all read from the buffer instead of re-running fprop
+ * for every protein that shares a peptide
+ */
+void Barista :: score_psms(NeuralNet &n, BaristaScoreBuffer &buf)
 {
-  int num_psm = d.pepind2num_psm(pepind);
-  int *psminds = d.pepind2psminds(pepind);
-  double max_sc = -100000000.0;
-  int max_ind = 0;
-  for(int i = 0; i < num_psm; i++)
-    {
-      int psmind = psminds[i];
-      double *feat = d.psmind2features(psmind);
-      double *sc = n.fprop(feat);
-      if(max_sc < sc[0])
+  int num_psms = d.get_num_psms();
+  int num_pep = d.get_num_peptides();
+  buf.psm_scores.resize(num_psms);
+  buf.pep_scores.resize(num_pep);
+  buf.pep_max_psminds.resize(num_pep);
+  // a linear net scores every psm on its own, so the rows are split among
+  // the threads; the scores do not depend on how they are split
+  int parts = 1;
+  if(n.get_num_layers() == 1)
+    parts = max(1, min(num_threads, num_psms/kMinPsmsPerThread));
+  boost::thread_group threadgroup;
+  for(int t = 1; t < parts; t++)
+    {
+      int begin = (int)((long long)num_psms*t/parts);
+      int end = (int)((long long)num_psms*(t+1)/parts);
+      threadgroup.add_thread(new boost::thread(
+	boost::bind(&NeuralNet::fprop_batch, &n, d.psmind2features(begin),
+		    end-begin, &buf.psm_scores[begin])));
+    }
+  if(num_psms > 0)
+    n.fprop_batch(d.psmind2features(0), num_psms/parts, &buf.psm_scores[0]);
+  threadgroup.join_all();
+
+  for(int pepind = 0; pepind < num_pep; pepind++)
+    {
+      int num_psm = d.pepind2num_psm(pepind);
+      int *psminds = d.pepind2psminds(pepind);
+      double max_sc = -100000000.0;
+      int max_ind = 0;
+      for(int i = 0; i < num_psm; i++)
 	{
-	  max_sc = sc[0];
-	  max_ind = i;
+	  double sc = buf.psm_scores[psminds[i]];
+	  if(max_sc < sc)
+	    {
+	      max_sc = sc;
+	      max_ind = i;
+	    }
 	}
+      buf.pep_scores[pepind] = max_sc;
+      buf.pep_max_psminds[pepind] = (num_psm > 0) ? psminds[max_ind] : -1;
     }
-  if((int)pepind_to_max_psmind.size() == d.get_num_peptides())
-    pepind_to_max_psmind[pepind] = psminds[max_ind];
-  return max_sc;
 }
 
 
 int Barista :: getOverFDRPep(PepScores &s, NeuralNet &n,double fdr)
 {
-  int pepind = 0;
-  int label = 0;
-  for(int i = 0; i < s.size(); i++)
+  score_psms(n, scores_buf);
+  int overFDR = getOverFDRPep(s, fdr, scores_buf);
+  if((int)pepind_to_max_psmind.size() == d.get_num_peptides())
     {
-      pepind = s[i].pepind;
-      double sc = get_peptide_score(pepind,n);
-      s[i].score = sc;
+      for(int i = 0; i < s.size(); i++)
+	{
+	  int pepind = s[i].pepind;
+	  pepind_to_max_psmind[pepind] = scores_buf.pep_max_psminds[pepind];
+	}
     }
+  return overFDR;
+}
+
+/*
+ * reads the peptide scores from a buffer already filled by score_psms
+ */
+int Barista :: getOverFDRPep(PepScores &s, double fdr, BaristaScoreBuffer &buf, ostream &out)
+{
+  int label = 0;
+  for(int i = 0; i < s.size(); i++)
+    s[i].score = buf.pep_scores[s[i].pepind];
 
   int overFDR = s.calcOverFDR(fdr);
 
@@ -366,8 +419,8 @@ int Barista :: getOverFDRPep(PepScores &s, NeuralNet &n,double fdr)
 	  if(cn >= overFDR)
 	    break;
 	}
-      cout << "over FDR peptides:\n";
-      cout << "num pos proteins  " << proteins_pos.size() << " num neg proteins " << proteins_neg.size() << " num pos peptides " << pep_pos << " num neg peptides " << pep_neg  << endl;
+      out << "over FDR peptides:\n";
+      out << "num pos proteins  " << proteins_pos.size() << " num neg proteins " << proteins_neg.size() << " num pos peptides " << pep_pos << " num neg peptides " << pep_neg  << endl;
 
     }
   return overFDR;
@@ -382,7 +435,6 @@ void Barista :: clear()
   peptestset.clear();
   psmtrainset.clear();
   psmtestset.clear();
-  delete[] net_clones; net_clones = 0;
   max_psm_inds.clear();
   max_psm_scores.clear();
   used_peptides.clear();
@@ -394,7 +446,7 @@ void Barista :: clear()
 }
 
 
-double Barista :: get_protein_score_parsimonious(int protind, NeuralNet &n)
+double Barista :: get_protein_score_parsimonious(int protind, BaristaScoreBuffer &buf)
 {
   int num_pep = d.protind2num_pep(protind);
   int num_all_pep = d.protind2num_all_pep(protind);
@@ -409,20 +461,7 @@ double Barista :: get_protein_score_parsimonious(int protind, NeuralNet &n)
       if(used_peptides[pepind] == 0)
 	{
 	  used_peptides[pepind] = 1;
-	  int num_psms = d.pepind2num_psm(pepind);
-	  int *psminds = d.pepind2psminds(pepind);
-	  double max_sc = -1000000.0;
-
-	  for (int j = 0; j < num_psms; j++)
-	    {
-	      double *feat = d.psmind2features(psminds[j]);
-	      double *sc = n.fprop(feat);
-	      if(sc[0] > max_sc)
-		{
-		  max_sc = sc[0];
-		}
-	    }
-	  sm += max_sc;
+	  sm += max(buf.pep_scores[pepind], -1000000.0);
 	}
     }
   
@@ -436,11 +475,12 @@ int Barista :: getOverFDRProtParsimonious(ProtScores &set, NeuralNet &n, double
   int total_num_pep = d.get_num_peptides();
   used_peptides.clear();
   used_peptides.resize(total_num_pep,0);
+  score_psms(n, scores_buf);
   double r = 0.0;
   for(int i = 0; i < set.size(); i++)
     {
       int protind = set[i].protind;
-      r = get_protein_score_parsimonious(protind,n);
+      r = get_protein_score_parsimonious(protind,scores_buf);
       set[i].score = r;
     }
   return set.calcOverFDR(fdr);
@@ -2014,7 +2054,7 @@ void Barista :: report_all_fdr_counts()
 
 
 /*******************************************************************************/
-double Barista :: get_protein_score(int protind, NeuralNet &n)
+double Barista :: get_protein_score(int protind, BaristaScoreBuffer &buf)
 {
   int num_pep = d.protind2num_pep(protind);
   int num_all_pep = d.protind2num_all_pep(protind);
@@ -2023,59 +2063,40 @@ double Barista :: get_protein_score(int protind, NeuralNet &n)
   double div = pow(num_all_pep,alpha);
 
   for (int i = 0; i < num_pep; i++)
-    {
-      int pepind = pepinds[i];
-      int num_psms = d.pepind2num_psm(pepind);
-      int *psminds = d.pepind2psminds(pepind);
-      double max_sc = -1000000.0;
-
-      for (int j = 0; j < num_psms; j++)
-	{
-	  double *feat = d.psmind2features(psminds[j]);
-	  double *sc = n.fprop(feat);
-	  if(sc[0] > max_sc)
-	    {
-	      max_sc = sc[0];
-
-	    }
-	}
-      sm += max_sc;
-    }
+    sm += max(buf.pep_scores[pepinds[i]], -1000000.0);
   sm /= div;
   return sm;
 }
 
 int Barista :: getOverFDRProt(ProtScores &set, NeuralNet &n, double fdr)
 {
-  double r = 0.0;
-  for(int i = 0; i < set.size(); i++)
-    {
-      int protind = set[i].protind;
-      r = get_protein_score(protind,n);
-      set[i].score = r;
-    }
-  return set.calcOverFDR(fdr);
-  
+  score_psms(n, scores_buf);
+  return getOverFDRProt(set, fdr, scores_buf);
 }
 
-int Barista :: getOverFDRProt(ProtScores &set, double fdr)
+/*
+ * reads the peptide scores from a buffer already filled by score_psms
+ */
+int Barista :: getOverFDRProt(ProtScores &set, double fdr, BaristaScoreBuffer &buf)
 {
   double r = 0.0;
   for(int i = 0; i < set.size(); i++)
     {
       int protind = set[i].protind;
-      r = get_protein_score(protind);
+      r = get_protein_score(protind,buf);
       set[i].score = r;
     }
   return set.calcOverFDR(fdr);
   
 }
 
-double Barista :: get_protein_score(int protind)
+double Barista :: get_protein_score(BaristaTrainState &s, int protind)
 {
   int num_pep = d.protind2num_pep(protind);
   int num_all_pep = d.protind2num_all_pep(protind);
   int *pepinds = d.protind2pepinds(protind);
+  vector<int> &max_psm_inds = s.max_psm_inds;
+  vector<double> &max_psm_scores = s.max_psm_scores;
   max_psm_inds.erase(max_psm_inds.begin(),max_psm_inds.end());
   max_psm_scores.erase(max_psm_scores.begin(),max_psm_scores.end());
   int psm_count = 0;
@@ -2089,7 +2110,7 @@ double Barista :: get_protein_score(int protind)
       for (int j = 0; j < num_psms; j++)
 	{
 	  double *feat = d.psmind2features(psminds[j]);
-	  double *sc = net_clones[psm_count].fprop(feat);
+	  double *sc = s.net_clones[psm_count].fprop(feat);
 	  if(sc[0] > max_sc)
 	    {
 	      max_sc = sc[0];
@@ -2111,7 +2132,7 @@ double Barista :: get_protein_score(int protind)
   return sm;
 }
 
-void Barista :: calc_gradients(int protind, int label)
+void Barista :: calc_gradients(BaristaTrainState &s, int protind, int label)
 {
   int num_pep = d.protind2num_pep(protind);
   int num_all_pep = d.protind2num_all_pep(protind);
@@ -2125,197 +2146,223 @@ void Barista :: calc_gradients(int protind, int label)
     {
       int pepind = pepinds[i];
       int num_psms = d.pepind2num_psm(pepind);
-      int clone_ind = psm_count+max_psm_inds[i];
-      net_clones[clone_ind].bprop(gc);
+      int clone_ind = psm_count+s.max_psm_inds[i];
+      s.net_clones[clone_ind].bprop(gc);
       psm_count += num_psms;
     }
   delete[] gc;
 }
 
-double Barista :: train_hinge(int protind, int label)
+double Barista :: train_hinge(BaristaTrainState &s, int protind, int label)
 {
-  double sm = get_protein_score(protind);
+  double sm = get_protein_score(s, protind);
     
   double err = max(0.0,1.0-sm*label);
 
   if(sm*label < 1)
     {
-      net.clear_gradients();
-      calc_gradients(protind,label);
-      net.update(mu);
+      s.net.clear_gradients();
+      calc_gradients(s,protind,label);
+      s.net.update(s.mu);
     }
   return err;
 }
 
 
-double Barista :: train_hinge_psm(int psmind, int label)
+double Barista :: train_hinge_psm(BaristaTrainState &s, int psmind, int label)
 {
   double *x = d.psmind2features(psmind);
-  double *c = net.fprop(x);
+  double *c = s.net.fprop(x);
   double err = 1.0-c[0]*label;
 
   if(c[0]*label < 1)
     {
       double *gc = new double[1];
       gc[0] = -1*label;
-      net.clear_gradients();
-      net.bprop(gc);
-      net.update(mu);
+      s.net.clear_gradients();
+      s.net.bprop(gc);
+      s.net.update(s.mu);
       delete[] gc;
     }
   return err;
 }
 
-void Barista :: train_net(double selectionfdr)
+/*
+ * draws from the try's own generator, so concurrent tries neither race on
+ * nor perturb the global one
+ */
+static int try_random_limit(BaristaTrainState &s, int max)
+{
+  boost::random::uniform_int_distribution<> dist(0, UNIFORM_INT_DISTRIBUTION_MAX);
+  return dist(s.rng) % max;
+}
+
+void Barista :: train_net(BaristaTrainState &s, double selectionfdr)
 {
   for (int k = 0; k < nepochs; k++)
     {
     if(verbose > 0)
-	cout << "epoch " << k << endl;
+	*s.out << "epoch " << k << endl;
       double err_sum = 0.0;
-      for(int i = 0; i < trainset.size(); i++)
+      for(int i = 0; i < s.trainset.size(); i++)
 	{
-	  int ind = myrandom_limit(trainset.size());
-	  int protind = trainset[ind].protind;
-	  int label = trainset[ind].label;
-	  err_sum += train_hinge(protind,label);
+	  int ind = try_random_limit(s, s.trainset.size());
+	  int protind = s.trainset[ind].protind;
+	  int label = s.trainset[ind].label;
+	  err_sum += train_hinge(s, protind,label);
 	}      
-      int fdr_trn = getOverFDRProt(trainset,selectionfdr);
+      // s.net does not change until the next epoch, so its scores are
+      // computed once for the protein, psm and peptide evaluations below
+      score_psms(s.net, s.buf);
+      int fdr_trn = getOverFDRProt(s.trainset, selectionfdr, s.buf);
       
       if(verbose > 0)
 	{
-	  cout << "err " << err_sum << "  ";
-	  cout << selectionfdr << " " << fdr_trn;
-	  if(testset.size() > 0)
-	    cout << " " << getOverFDRProt(testset,net,selectionfdr);
-	  cout << endl;
+	  *s.out << "err " << err_sum << "  ";
+	  *s.out << selectionfdr << " " << fdr_trn;
+	  if(s.testset.size() > 0)
+	    *s.out << " " << getOverFDRProt(s.testset, selectionfdr, s.buf);
+	  *s.out << endl;
 	}
-	if(fdr_trn > max_fdr)
+	if(fdr_trn > s.max_fdr)
 	{
-	  max_net_prot = net;
-	  max_fdr = fdr_trn;
+	  s.max_net_prot = s.net;
+	  s.max_fdr = fdr_trn;
 	  if(verbose == 0)
 	    {
 
-	      if(testset.size() > 0)
+	      if(s.testset.size() > 0)
 		carp(CARP_INFO, "q<%.2f: max non-parsimonious so far %d %d",
-		     selectionfdr, max_fdr,
-		     getOverFDRProt(testset,max_net_prot,selectionfdr));
+		     selectionfdr, s.max_fdr,
+		     getOverFDRProt(s.testset, selectionfdr, s.buf));
 	      else
 		carp(CARP_INFO, "q<%.2f: max non-parsimonious so far %d",
-		     selectionfdr, max_fdr);
+		     selectionfdr, s.max_fdr);
 	    }
 	}
       if(verbose > 0)
 	{
-	  cout << "q< " << selectionfdr << ": max non-parsimonious so far " << max_fdr;
-	  if(testset.size() > 0)
-	    cout << " " << getOverFDRProt(testset,max_net_prot,selectionfdr);
-	  cout << endl;
+	  *s.out << "q< " << selectionfdr << ": max non-parsimonious so far " << s.max_fdr;
+	  if(s.testset.size() > 0)
+	    {
+	      BaristaScoreBuffer max_buf;
+	      score_psms(s.max_net_prot, max_buf);
+	      *s.out << " " << getOverFDRProt(s.testset, selectionfdr, max_buf);
+	    }
+	  *s.out << endl;
 	}
       if(1)
 	{
-	  int fdr_trn_psm = getOverFDRPSM(psmtrainset, net, selectionfdr); 
-	  if(fdr_trn_psm > max_fdr_psm)
+	  int fdr_trn_psm = getOverFDRPSM(s.psmtrainset, selectionfdr, s.buf, *s.out); 
+	  if(fdr_trn_psm > s.max_fdr_psm)
 	    {
-	      max_net_psm = net;
-	      max_fdr_psm = fdr_trn_psm;
+	      s.max_net_psm = s.net;
+	      s.max_fdr_psm = fdr_trn_psm;
 	    }
 	}
       if(1)
 	{
-	  int fdr_trn_pep = getOverFDRPep(peptrainset, net, selectionfdr); 
-	  if(fdr_trn_pep > max_fdr_pep)
+	  int fdr_trn_pep = getOverFDRPep(s.peptrainset, selectionfdr, s.buf, *s.out); 
+	  if(fdr_trn_pep > s.max_fdr_pep)
 	    {
-	      max_net_pep = net;
-	      max_fdr_pep = fdr_trn_pep;
+	      s.max_net_pep = s.net;
+	      s.max_fdr_pep = fdr_trn_pep;
 	    }
 	}
     }
   if(verbose > 0)
     {
-      cout << "max peptides so far at q< " << selectionfdr << ": " << getOverFDRPep(peptrainset, max_net_psm, selectionfdr) << endl;
-      cout << "max psms so far at q<" << selectionfdr << ": " << max_fdr_psm << endl;
+      score_psms(s.max_net_psm, s.buf);
+      *s.out << "max peptides so far at q< " << selectionfdr << ": " << getOverFDRPep(s.peptrainset, selectionfdr, s.buf, *s.out) << endl;
+      *s.out << "max psms so far at q<" << selectionfdr << ": " << s.max_fdr_psm << endl;
     }
 }
 
 
 
-void Barista :: train_net_multi_task(double selectionfdr, int interval)
+void Barista :: train_net_multi_task(BaristaTrainState &s, double selectionfdr, int interval)
 {
   for (int k = 0; k < nepochs; k++)
     {
     if(verbose > 0)
-	cout << "epoch " << k << endl;
+	*s.out << "epoch " << k << endl;
       double err_sum = 0.0;
-      for(int i = 0; i < trainset.size(); i++)
+      for(int i = 0; i < s.trainset.size(); i++)
 	{
-	  int ind = myrandom_limit(trainset.size());
-	  int protind = trainset[ind].protind;
-	  int label = trainset[ind].label;
-	  err_sum += train_hinge(protind,label);
-
-	  ind = myrandom_limit(interval);
-	  int psmind = psmtrainset[ind].psmind;
-	  label = psmtrainset[ind].label;
-	  train_hinge_psm(psmind,label);	
+	  int ind = try_random_limit(s, s.trainset.size());
+	  int protind = s.trainset[ind].protind;
+	  int label = s.trainset[ind].label;
+	  err_sum += train_hinge(s, protind,label);
+
+	  ind = try_random_limit(s, interval);
+	  int psmind = s.psmtrainset[ind].psmind;
+	  label = s.psmtrainset[ind].label;
+	  train_hinge_psm(s, psmind,label);	
 	}      
-      int fdr_trn = getOverFDRProt(trainset,selectionfdr);
+      // s.net does not change until the next epoch, so its scores are
+      // computed once for the protein, psm and peptide evaluations below
+      score_psms(s.net, s.buf);
+      int fdr_trn = getOverFDRProt(s.trainset, selectionfdr, s.buf);
       
       if(verbose > 0)
 	{
-	  if(interval == trainset.size())
-	    cout << "err " << err_sum << "  ";
-	  cout << selectionfdr << " " << fdr_trn;
-	  if(testset.size() > 0)
-	    cout << " " << getOverFDRProt(testset,net,selectionfdr);
-	  cout << endl;
+	  if(interval == s.trainset.size())
+	    *s.out << "err " << err_sum << "  ";
+	  *s.out << selectionfdr << " " << fdr_trn;
+	  if(s.testset.size() > 0)
+	    *s.out << " " << getOverFDRProt(s.testset, selectionfdr, s.buf);
+	  *s.out << endl;
 	}
-	if(fdr_trn > max_fdr)
+	if(fdr_trn > s.max_fdr)
 	{
-	  max_net_prot = net;
-	  max_fdr = fdr_trn;
+	  s.max_net_prot = s.net;
+	  s.max_fdr = fdr_trn;
 	  if(verbose == 0)
 	    {
-	      if(testset.size() > 0)
+	      if(s.testset.size() > 0)
 		carp(CARP_INFO, "q<%.2f: max non-parsimonious so far %d %d",
-		     selectionfdr, max_fdr,
-		     getOverFDRProt(testset,max_net_prot,selectionfdr));
+		     selectionfdr, s.max_fdr,
+		     getOverFDRProt(s.testset, selectionfdr, s.buf));
 	      else
 		carp(CARP_INFO, "q<%.2f: max non-parsimonious so far %d",
-		     selectionfdr, max_fdr);
+		     selectionfdr, s.max_fdr);
 	    }
 	}
       if(verbose > 0)
 	{
-	  cout << "q< " << selectionfdr << ": max non-parsimonious so far " << max_fdr;
-	  if(testset.size() > 0)
-	    cout << " " << getOverFDRProt(testset,max_net_prot,selectionfdr);
-	  cout << endl;
+	  *s.out << "q< " << selectionfdr << ": max non-parsimonious so far " << s.max_fdr;
+	  if(s.testset.size() > 0)
+	    {
+	      BaristaScoreBuffer max_buf;
+	      score_psms(s.max_net_prot, max_buf);
+	      *s.out << " " << getOverFDRProt(s.testset, selectionfdr, max_buf);
+	    }
+	  *s.out << endl;
 	}
       if(1)
 	{
-	  int fdr_trn_psm = getOverFDRPSM(psmtrainset, net, selectionfdr); 
-	  if(fdr_trn_psm > max_fdr_psm)
+	  int fdr_trn_psm = getOverFDRPSM(s.psmtrainset, selectionfdr, s.buf, *s.out); 
+	  if(fdr_trn_psm > s.max_fdr_psm)
 	    {
-	      max_net_psm = net;
-	      max_fdr_psm = fdr_trn_psm;
+	      s.max_net_psm = s.net;
+	      s.max_fdr_psm = fdr_trn_psm;
 	    }
 	}
       if(1)
 	{
-	  int fdr_trn_pep = getOverFDRPep(peptrainset, net, selectionfdr); 
-	  if(fdr_trn_pep > max_fdr_pep)
+	  int fdr_trn_pep = getOverFDRPep(s.peptrainset, selectionfdr, s.buf, *s.out); 
+	  if(fdr_trn_pep > s.max_fdr_pep)
 	    {
-	      max_net_pep = net;
-	      max_fdr_pep = fdr_trn_pep;
+	      s.max_net_pep = s.net;
+	      s.max_fdr_pep = fdr_trn_pep;
 	    }
 	}
     }
   if(verbose > 0)
     {
-      cout << "max peptides so far at q< " << selectionfdr << ": " << getOverFDRPep(peptrainset, max_net_psm, selectionfdr) << endl;
-      cout << "max psms so far at q<" << selectionfdr << ": " << max_fdr_psm << endl;
+      score_psms(s.max_net_psm, s.buf);
+      *s.out << "max peptides so far at q< " << selectionfdr << ": " << getOverFDRPep(s.peptrainset, selectionfdr, s.buf, *s.out) << endl;
+      *s.out << "max psms so far at q<" << selectionfdr << ": " << s.max_fdr_psm << endl;
     }
 }
 
@@ -2392,19 +2439,71 @@ void Barista :: setup_for_training(int trn_to_tst)
     }
   max_psm_inds.reserve(max_peptides);
   max_psm_scores.reserve(max_peptides);
- 
-  //create the net clones
-  net_clones = new NeuralNet[max_psms_in_prot];
+}
+
+/*
+ * gives a try its own copy of the net, the net clones sharing its weights
+ * and the score sets it sorts while training
+ */
+void Barista :: init_train_state(BaristaTrainState &s)
+{
+  s.net = net;
+  s.max_net_prot = net;
+  s.max_net_psm = net;
+  s.max_net_pep = net;
+  s.max_fdr = max_fdr;
+  s.max_fdr_psm = max_fdr_psm;
+  s.max_fdr_pep = max_fdr_pep;
+
+  s.trainset = trainset;
+  s.testset = testset;
+  s.psmtrainset = psmtrainset;
+  s.peptrainset = peptrainset;
+
+  s.max_psm_inds.reserve(max_peptides);
+  s.max_psm_scores.reserve(max_peptides);
+  s.net_clones = new NeuralNet[max_psms_in_prot];
   for (int i = 0; i < max_psms_in_prot;i++)
-    net_clones[i].clone(net);
+    s.net_clones[i].clone(s.net);
+
+  // a try draws from a copy of the global generator, exactly as it would
+  // have drawn from the generator itself
+  s.rng = get_mt19937();
 }
 
+/*
+ * merges the best nets of a finished try, in try order, so that ties are
+ * resolved exactly as when the tries ran one after another
+ */
+void Barista :: keep_best_nets(BaristaTrainState &s)
+{
+  if(s.max_fdr > max_fdr)
+    {
+      max_net_prot = s.max_net_prot;
+      max_fdr = s.max_fdr;
+    }
+  if(s.max_fdr_psm > max_fdr_psm)
+    {
+      max_net_psm = s.max_net_psm;
+      max_fdr_psm = s.max_fdr_psm;
+    }
+  if(s.max_fdr_pep > max_fdr_pep)
+    {
+      max_net_pep = s.max_net_pep;
+      max_fdr_pep = s.max_fdr_pep;
+    }
+}
 
 int Barista :: run()
 {
   setup_for_training(0);
   
-  train_net(selectionfdr);
+  BaristaTrainState s;
+  s.mu = mu;
+  init_train_state(s);
+  train_net(s, selectionfdr);
+  get_mt19937() = s.rng;
+  keep_best_nets(s);
   
   return 0;
 
@@ -2421,13 +2520,25 @@ int Barista :: run_tries()
   mu_choices[0] = 0.005;
   mu_choices[1] = 0.01;
   mu_choices[2] = 0.05;
+
+  // each try starts from the order the previous one sorted the score
+  // sets into, and from the generator as it left it, so the tries run one
+  // after another; num-threads instead splits the scoring in score_psms
   for(int k = 0; k < tries; k++)
     {
-      mu = mu_choices[k];
+      BaristaTrainState s;
+      s.mu = mu_choices[k];
       net.make_random();
-      train_net(selectionfdr);
+      init_train_state(s);
+      train_net(s, selectionfdr);
+      get_mt19937() = s.rng;
+      keep_best_nets(s);
+      trainset = s.trainset;
+      testset = s.testset;
+      psmtrainset = s.psmtrainset;
+      peptrainset = s.peptrainset;
     }
-  
+
   report_all_results_xml_tab();
 
   return 0;
@@ -2446,19 +2557,28 @@ int Barista :: run_tries_multi_task()
   mu_choices[0] = 0.005;
   mu_choices[1] = 0.01;
   mu_choices[2] = 0.05;
+  // the final pass continues from the last try's net, so these tries stay
+  // sequential on a single training state
+  BaristaTrainState s;
+  init_train_state(s);
   for(int k = 1; k < tries; k++)
     {
-      mu = mu_choices[k];
-      net.make_random();
-      train_net_multi_task(selectionfdr, psmtrainset.size());
+      s.mu = mu_choices[k];
+      get_mt19937() = s.rng;
+      s.net.make_random();
+      s.rng = get_mt19937();
+      train_net_multi_task(s, selectionfdr, s.psmtrainset.size());
     }
 
-  int interval= getOverFDRPSM(psmtrainset,max_net_psm,0.01)*2;
-  if(interval > psmtrainset.size())
-    interval = psmtrainset.size()/4;
+  score_psms(s.max_net_psm, s.buf);
+  int interval= getOverFDRPSM(s.psmtrainset,0.01,s.buf)*2;
+  if(interval > s.psmtrainset.size())
+    interval = s.psmtrainset.size()/4;
   if(interval < 50)
-    interval = psmtrainset.size()/4;
-  train_net_multi_task(selectionfdr, interval);
+    interval = s.psmtrainset.size()/4;
+  train_net_multi_task(s, selectionfdr, interval);
+  get_mt19937() = s.rng;
+  keep_best_nets(s);
 
   report_all_results_xml_tab();
   return 0;
@@ -2512,6 +2632,10 @@ int Barista :: crux_set_command_line_options(int argc, char *argv[])
 
   opt_type = Params::GetString("optimization");
 
+  num_threads = Params::GetInt("num-threads");
+  if(num_threads < 1)
+    num_threads = boost::thread::hardware_concurrency();
+
   fileroot = Params::GetString("fileroot");
   if(!fileroot.empty()) {
     fileroot.append(".");
@@ -2772,7 +2896,8 @@ vector<string> Barista::getOptions() const {
     "list-of-files",
     "feature-file-out",
     "optimization",
-    "spectrum-parser"
+    "spectrum-parser",
+    "num-threads"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
 }
@@ -27,9 +27,51 @@
 #include "CruxParser.h"
 #include "QRanker.h"
 #include "PepRanker.h"
+#include "boost/random/mersenne_twister.hpp"
 using namespace std;
 #include "util/mass.h"
 
+/**
+ * Scores of every PSM under one net, computed once per evaluation, with
+ * the per-peptide maxima reduced from them.
+ */
+struct BaristaScoreBuffer
+{
+  vector<double> psm_scores;
+  vector<double> pep_scores;
+  vector<int> pep_max_psminds;
+};
+
+/**
+ * Everything one protein-level training try mutates, kept apart from the
+ * Barista members so that the best nets of a try can be merged afterwards.
+ */
+struct BaristaTrainState
+{
+  BaristaTrainState() : mu(0.0), net_clones(0), max_fdr(0), max_fdr_psm(0),
+    max_fdr_pep(0), out(&cout) {}
+  ~BaristaTrainState() {delete[] net_clones;}
+
+  double mu;
+  NeuralNet net;
+  NeuralNet *net_clones;
+  vector<int> max_psm_inds;
+  vector<double> max_psm_scores;
+  BaristaScoreBuffer buf;
+
+  ProtScores trainset, testset;
+  PSMScores psmtrainset;
+  PepScores peptrainset;
+
+  NeuralNet max_net_prot, max_net_psm, max_net_pep;
+  int max_fdr, max_fdr_psm, max_fdr_pep;
+
+  boost::mt19937 rng;
+
+  // verbose progress goes to out
+  ostream *out;
+};
+
 class Barista : public CruxApplication
 {
  public:
@@ -51,11 +93,11 @@ class Barista : public CruxApplication
     weightDecay(0.0), 
     alpha(0.3),
     max_psms_in_prot(0),
-    net_clones(0),
     max_fdr(0),
     max_peptides(0),   
     max_fdr_psm(0),
     max_fdr_pep(0),
+    num_threads(1),
     parser(NULL){}
   ~Barista(){clear();}
   void clear();
@@ -68,19 +110,22 @@ class Barista : public CruxApplication
 
   int run_tries();
   int run_tries_multi_task();
-  double train_hinge(int protind, int label);
-  double train_hinge_psm(int psmind, int label);
-  void train_net(double selectionfdr);
-  void train_net_multi_task(double selectionfdr, int interval);
+  void init_train_state(BaristaTrainState &s);
+  void keep_best_nets(BaristaTrainState &s);
+  double train_hinge(BaristaTrainState &s, int protind, int label);
+  double train_hinge_psm(BaristaTrainState &s, int psmind, int label);
+  void train_net(BaristaTrainState &s, double selectionfdr);
+  void train_net_multi_task(BaristaTrainState &s, double selectionfdr, int interval);
 
-  void calc_gradients(int protind, int label);
+  void calc_gradients(BaristaTrainState &s, int protind, int label);
 
+  void score_psms(NeuralNet &n, BaristaScoreBuffer &buf);
   int getOverFDRProt(ProtScores &set, NeuralNet &n, double fdr);
-  int getOverFDRProt(ProtScores &set, double fdr);
+  int getOverFDRProt(ProtScores &set, double fdr, BaristaScoreBuffer &buf);
 
-  double get_protein_score(int protind);
-  double get_protein_score(int protind, NeuralNet &n);
-  double get_protein_score_parsimonious(int protind, NeuralNet &n);
+  double get_protein_score(BaristaTrainState &s, int protind);
+  double get_protein_score(int protind, BaristaScoreBuffer &buf);
+  double get_protein_score_parsimonious(int protind, BaristaScoreBuffer &buf);
   int getOverFDRProtParsimonious(ProtScores &set, NeuralNet &n, double fdr);
   void computePEP();
   int computeNSAF();
@@ -115,8 +160,9 @@ class Barista : public CruxApplication
   void print_protein_ids(vector<string> &proteins,ofstream &os,int psmind);  
 
   int getOverFDRPSM(PSMScores &set, NeuralNet &n, double fdr);
-  double get_peptide_score(int pepind, NeuralNet &n);
+  int getOverFDRPSM(PSMScores &set, double fdr, BaristaScoreBuffer &buf, ostream &out = cout);
   int getOverFDRPep(PepScores &set, NeuralNet &n, double fdr);
+  int getOverFDRPep(PepScores &set, double fdr, BaristaScoreBuffer &buf, ostream &out = cout);
 
   inline void set_input_dir(string input_dir) {in_dir = input_dir; d.set_input_dir(input_dir);}
   inline void set_output_dir(string output_dir){out_dir = output_dir;}
@@ -133,7 +179,7 @@ class Barista : public CruxApplication
 
 
   double check_gradients_hinge_one_net(int protind, int label);
-  double check_gradients_hinge_clones(int protind, int label);
+  double check_gradients_hinge_clones(BaristaTrainState &s, int protind, int label);
 
   FILE_FORMAT_T check_file_format(string filename);
   string file_extension(string str); 
@@ -166,7 +212,6 @@ class Barista : public CruxApplication
 
 
   int max_psms_in_prot;
-  NeuralNet *net_clones;
   NeuralNet max_net_prot;
   int max_fdr;
   ProtScores trainset, thresholdset, testset;
@@ -191,6 +236,8 @@ class Barista : public CruxApplication
   ofstream fdebug;
 
   string opt_type;
+  int num_threads;
+  BaristaScoreBuffer scores_buf;
   QRanker qr;
   PepRanker pr;
 
@@ -158,6 +158,26 @@ void Linear :: fprop(State &down, State &up)
     }
 }
 
+/*
+ * scores a row-major matrix of num_examples feature vectors against the
+ * first neuron; the arithmetic is the same as fprop, so the scores are
+ * identical to those of calling fprop one example at a time
+ */
+void Linear :: fprop_batch(double *x, int num_examples, double *scores)
+{
+  double b = has_bias ? bias[0] : 0.0;
+  for(int i = 0; i < num_examples; i++)
+    {
+      double *row = x+num_features*i;
+      double d = 0.0;
+      for(int j = 0; j < num_features; j++)
+	d += w[j]*row[j];
+      if(has_bias)
+	d += b;
+      scores[i] = d;
+    }
+}
+
 
 void Linear :: bprop(State &down, State &up)
 {
@@ -307,6 +327,18 @@ double* NeuralNet :: fprop(double *x)
 
 }
 
+void NeuralNet :: fprop_batch(double *x, int num_examples, double *scores)
+{
+  if(is_linear)
+    lin1.fprop_batch(x, num_examples, scores);
+  else
+    {
+      int num_features = lin1.get_num_features();
+      for(int i = 0; i < num_examples; i++)
+	scores[i] = fprop(x+num_features*i)[0];
+    }
+}
+
 
 void NeuralNet :: clear_gradients()
 {
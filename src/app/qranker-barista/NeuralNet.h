@@ -91,6 +91,7 @@ class Linear
   void read_from_file(ifstream &infile);
  
   void fprop(State &down, State &up);
+  void fprop_batch(double *x, int num_examples, double *scores);
   void bprop(State &down, State &up);
   void clear_gradients();
   void update(double mu, double weight_decay=0.0);
@@ -123,6 +124,7 @@ class NeuralNet {
   void make_random();
 
   double* fprop(double *down);
+  void fprop_batch(double *x, int num_examples, double *scores);
   void clear_gradients();
   double* bprop(double *up);
   void update(double mu, double weight_decay=0.0);
@@ -84,6 +84,7 @@ void QRanker :: getMultiFDRXCorr(PSMScores &set, vector<double> &qvalues)
 void QRanker :: printNetResults(vector<int> &scores)
 {
   double qv; int fdr;
+  carp_flush();
   cerr << "QVALS SCORES:: ";
   for(unsigned int count = 0; count < qvals.size();count++)
     {  
@@ -1,5 +1,7 @@
 // original author: Benjamin Diament
 // subsequently modified by Attila Kertesz-Farkas, Jeff Howbert
+#include <algorithm>
+#include <cstring>
 #include <deque>
 #include <gflags/gflags.h>
 #include "records.h"
@@ -16,13 +18,16 @@
 DEFINE_int32(fifo_page_size, 1, "Page size for FIFO allocator, in megs");
 
 ActivePeptideQueue::ActivePeptideQueue(RecordReader* reader,
-                                       const vector<const pb::Protein*>&
-                                       proteins)
+                                       const ProteinBlob& proteins)
   : reader_(reader),
+    mass_directory_(NULL),
+    prefetcher_(NULL),
+    keep_peak_codes_(false),
     proteins_(proteins),
     theoretical_peak_set_(2000),   // probably overkill, but no harm
     theoretical_b_peak_set_(200),  // probably overkill, but no harm
     active_targets_(0), active_decoys_(0),
+    peptides_decoded_(0), programs_compiled_(0),
     fifo_alloc_peptides_(FLAGS_fifo_page_size << 20),
     fifo_alloc_prog1_(FLAGS_fifo_page_size << 20),
     fifo_alloc_prog2_(FLAGS_fifo_page_size << 20) {
@@ -34,6 +39,7 @@ ActivePeptideQueue::ActivePeptideQueue(RecordReader* reader,
 }
 
 ActivePeptideQueue::~ActivePeptideQueue() {
+  delete prefetcher_;
   deque<Peptide*>::iterator i = queue_.begin();
   // for (; i != queue_.end(); ++i)
   //   delete (*i)->PB();
@@ -52,27 +58,107 @@ void ActivePeptideQueue::ComputeTheoreticalPeaksBack() {
   Peptide* peptide = queue_.back();
   peptide->ComputeTheoreticalPeaks(&theoretical_peak_set_, current_pb_peptide_,
                                    compiler_prog1_, compiler_prog2_);
+  if (keep_peak_codes_) {
+    peptide->KeepPeakCodes(theoretical_peak_set_.GetPeaks(), &fifo_alloc_peptides_);
+  }
+  ++programs_compiled_;
+}
+
+// Called when no peptides are queued: rather than reading and discarding
+// every peptide lighter than min_range, seek to the block of the index in
+// which they end, if the index has a mass directory.
+void ActivePeptideQueue::SkipLighterThan(double min_range) {
+  if (mass_directory_ == NULL || prefetcher_ != NULL) {
+    return;
+  }
+  google::protobuf::uint64 offset = mass_directory_->Offset(min_range);
+  if (offset > reader_->Position()) {
+    CHECK(reader_->Seek(offset));
+  }
+}
+
+void ActivePeptideQueue::SetPrefetch(int capacity) {
+  delete prefetcher_;
+  prefetcher_ = new PeptidePrefetcher(reader_, mass_directory_, capacity);
+}
+
+// With a prefetcher, peptides come from its buffer rather than straight from
+// the reader, which then belongs to the prefetch thread.
+bool ActivePeptideQueue::PeptidesDone() {
+  return prefetcher_ != NULL ? prefetcher_->Done() : reader_->Done();
+}
+
+void ActivePeptideQueue::ReadPeptide() {
+  if (prefetcher_ != NULL) {
+    prefetcher_->Read(&current_pb_peptide_);
+  } else {
+    reader_->Read(&current_pb_peptide_);
+  }
+}
+
+static bool PeptideLighterThan(const Peptide* peptide, double mass) {
+  return peptide->Mass() < mass;
 }
 
-bool ActivePeptideQueue::isWithinIsotope(vector<double>* min_mass, vector<double>* max_mass, double mass, int* isotope_idx) {
-  for (int i = *isotope_idx; i < min_mass->size(); ++i) {
-    if (mass >= (*min_mass)[i] && mass <= (*max_mass)[i]) {
-      if (i > *isotope_idx) {
-        *isotope_idx = i;
+static bool MassLighterThan(double mass, const Peptide* peptide) {
+  return mass < peptide->Mass();
+}
+
+// Sets iter_ and end_ to the queued peptides with masses in
+// [min_mass->front(), max_mass->back()), and candidate_ranges_ to the runs of
+// those within [(*min_mass)[i], (*max_mass)[i]] for some isotope error i. The
+// windows are in increasing order. Returns the number of candidates.
+int ActivePeptideQueue::SetCandidateRanges(const vector<double>* min_mass,
+                                           const vector<double>* max_mass) {
+  const deque<Peptide*>& queue = queue_;
+  iter_ = lower_bound(queue.begin(), queue.end(), min_mass->front(),
+                      PeptideLighterThan);
+  end_ = lower_bound(iter_, queue.end(), max_mass->back(), PeptideLighterThan);
+  candidate_ranges_.clear();
+  for (size_t i = 0; i < min_mass->size(); ++i) {
+    deque<Peptide*>::const_iterator first =
+      lower_bound(iter_, end_, (*min_mass)[i], PeptideLighterThan);
+    deque<Peptide*>::const_iterator last =
+      upper_bound(first, end_, (*max_mass)[i], MassLighterThan);
+    int first_idx = first - iter_;
+    int last_idx = last - iter_;
+    if (!candidate_ranges_.empty() && first_idx <= candidate_ranges_.back().second) {
+      // overlaps or adjoins the window of the previous isotope error
+      candidate_ranges_.back().second = max(candidate_ranges_.back().second, last_idx);
+    } else if (first_idx < last_idx) {
+      candidate_ranges_.push_back(make_pair(first_idx, last_idx));
+    }
+  }
+
+  int active = 0;
+  active_targets_ = active_decoys_ = 0;
+  for (vector<pair<int, int> >::const_iterator range = candidate_ranges_.begin();
+       range != candidate_ranges_.end();
+       ++range) {
+    active += range->second - range->first;
+    for (deque<Peptide*>::const_iterator i = iter_ + range->first;
+         i != iter_ + range->second;
+         ++i) {
+      if (!(*i)->IsDecoy()) {
+        ++active_targets_;
+      } else {
+        ++active_decoys_;
       }
-      return true;
     }
   }
-  return false;
+  return active;
 }
 
-int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range, vector<bool>* candidatePeptideStatus) {
+int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range) {
   //min_range and max_range have been introduced to fix a bug
   //introduced by m/z selection. see #222 in sourceforge
   //this has to be true:
   // min_range <= min_mass <= max_mass <= max_range
 
   // queue front() is lightest; back() is heaviest
+  if (prefetcher_ != NULL) {
+    prefetcher_->SkipLighterThan(min_range);
+  }
 
   // delete anything already loaded that falls below min_range
   while (!queue_.empty() && queue_.front()->Mass() < min_range) {
@@ -90,6 +176,7 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
     fifo_alloc_peptides_.ReleaseAll();
     fifo_alloc_prog1_.ReleaseAll();
     fifo_alloc_prog2_.ReleaseAll();
+    SkipLighterThan(min_range);
     //cerr << "Prog1: ";
     //fifo_alloc_prog1_.Show();
     //cerr << "Prog2: ";
@@ -110,15 +197,16 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
     if (!queue_.empty()) {
       ComputeTheoreticalPeaksBack();
     }
-    while (!(done = reader_->Done())) {
+    while (!(done = PeptidesDone())) {
       // read all peptides lighter than max_range
-      reader_->Read(&current_pb_peptide_);
+      ReadPeptide();
       if (current_pb_peptide_.mass() < min_range) {
         // we would delete current_pb_peptide_;
         continue; // skip peptides that fall below min_range
       }
       Peptide* peptide = new(&fifo_alloc_peptides_)
         Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
+      ++peptides_decoded_;
       queue_.push_back(peptide);
       if (peptide->Mass() > max_range) {
         break;
@@ -131,55 +219,39 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
   assert(!queue_.empty() || done);
 
   // Set up iterator for use with HasNext(),
-  // GetPeptide(), and NextPeptide(). Return the number of enqueued peptides.
-  if (queue_.empty()) {
-    return 0;
-  }
-
-  iter_ = queue_.begin();
-  while (iter_ != queue_.end() && (*iter_)->Mass() < min_mass->front()) {
-    ++iter_;
-  }
-
-  int* isotope_idx = new int(0);
-  end_ = iter_;
-  int active = 0;
-  active_targets_ = active_decoys_ = 0;
-  while (end_ != queue_.end() && (*end_)->Mass() < max_mass->back() ){
-    if (isWithinIsotope(min_mass, max_mass, (*end_)->Mass(), isotope_idx)) {
-      ++active;
-      candidatePeptideStatus->push_back(true);
-      if (!(*end_)->IsDecoy()) {
-        ++active_targets_;
-      } else {
-        ++active_decoys_;
-      }
-    } else {
-      candidatePeptideStatus->push_back(false);
-    }
-    ++end_;
-  }
-  delete isotope_idx;
-  if (active == 0) {
-    return 0;
-  }
-
-  return active;
-
+  // GetPeptide(), and NextPeptide(). Return the number of candidates.
+  return SetCandidateRanges(min_mass, max_mass);
 }
 
 // Compute the b ion only theoretical peaks of the peptide in the "back" of the queue
-// (i.e. the one most recently read from disk -- the heaviest).
+// (i.e. the one most recently read from disk -- the heaviest). The peaks are
+// copied into fifo_alloc_peptides_ after the peptide, so releasing the peptide
+// releases them too.
 void ActivePeptideQueue::ComputeBTheoreticalPeaksBack() {
   theoretical_b_peak_set_.Clear();
   Peptide* peptide = queue_.back();
   peptide->ComputeBTheoreticalPeaks(&theoretical_b_peak_set_);
-  b_ion_queue_.push_back(theoretical_b_peak_set_);
+  const vector<unsigned int>& peaks = theoretical_b_peak_set_.unordered_peak_list_;
+  BIonPeakSpan span;
+  span.size_ = peaks.size();
+  span.peaks_ = NULL;
+  if (span.size_ > 0) {
+    // Rounded up so that the next Peptide stays as aligned as it would be.
+    size_t bytes = (span.size_ * sizeof(unsigned int) + sizeof(double) - 1)
+      & ~(sizeof(double) - 1);
+    unsigned int* copy = (unsigned int*)fifo_alloc_peptides_.New(bytes);
+    memcpy(copy, &peaks[0], span.size_ * sizeof(unsigned int));
+    span.peaks_ = copy;
+  }
+  b_ion_queue_.push_back(span);
 }
 
-int ActivePeptideQueue::SetActiveRangeBIons(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range, vector<bool>* candidatePeptideStatus) {
+int ActivePeptideQueue::SetActiveRangeBIons(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range) {
     exact_pval_search_ = true;
   // queue front() is lightest; back() is heaviest
+  if (prefetcher_ != NULL) {
+    prefetcher_->SkipLighterThan(min_range);
+  }
 
   // delete anything already loaded that falls below min_range
   while (!queue_.empty() && queue_.front()->Mass() < min_range) {
@@ -194,6 +266,7 @@ int ActivePeptideQueue::SetActiveRangeBIons(vector<double>* min_mass, vector<dou
   }
   if (queue_.empty()) {
     fifo_alloc_peptides_.ReleaseAll();
+    SkipLighterThan(min_range);
   } else {
     Peptide* peptide = queue_.front();
     // Free all peptides up to, but not including peptide.
@@ -206,15 +279,16 @@ int ActivePeptideQueue::SetActiveRangeBIons(vector<double>* min_mass, vector<dou
   // fifo_alloc_peptides_.
   bool done;
   if (queue_.empty() || queue_.back()->Mass() <= max_range) {
-    while (!(done = reader_->Done())) {
+    while (!(done = PeptidesDone())) {
       // read all peptides lighter than max_range
-      reader_->Read(&current_pb_peptide_);
+      ReadPeptide();
       if (current_pb_peptide_.mass() < min_range) {
         // we would delete current_pb_peptide_;
         continue; // skip peptides that fall below min_range
       }
       Peptide* peptide = new(&fifo_alloc_peptides_)
         Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
+      ++peptides_decoded_;
       queue_.push_back(peptide);
       ComputeBTheoreticalPeaksBack();
       if (peptide->Mass() > max_range) {
@@ -226,38 +300,9 @@ int ActivePeptideQueue::SetActiveRangeBIons(vector<double>* min_mass, vector<dou
   // peptide is too heavy
   assert(!queue_.empty() || done);
 
-  iter1_ = b_ion_queue_.begin();
-  iter_ = queue_.begin();
-  while (iter_ != queue_.end() && (*iter_)->Mass() < min_mass->front() ){
-    ++iter_;
-    ++iter1_;
-  }
-
-  int* isotope_idx = new int(0);
-  end_ = iter_;
-  end1_ = iter1_;
-  int active = 0;
-  active_targets_ = active_decoys_ = 0;
-  while (end_ != queue_.end() && (*end_)->Mass() < max_mass->back() ){
-    if (isWithinIsotope(min_mass, max_mass, (*end_)->Mass(), isotope_idx)) {
-      ++active;
-      candidatePeptideStatus->push_back(true);
-      if (!(*end_)->IsDecoy()) {
-        ++active_targets_;
-      } else {
-        ++active_decoys_;
-      }
-    } else {
-      candidatePeptideStatus->push_back(false);
-    }
-    ++end_;
-    ++end1_;
-  }
-  delete isotope_idx;
-  if (active == 0) {
-    return 0;
-  }
-
+  int active = SetCandidateRanges(min_mass, max_mass);
+  iter1_ = b_ion_queue_.begin() + (iter_ - queue_.begin());
+  end1_ = b_ion_queue_.begin() + (end_ - queue_.begin());
   return active;
 }
 
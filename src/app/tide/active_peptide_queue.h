@@ -13,12 +13,18 @@
 // SetActiveRange() the client may use the iterator interface HasNext() and
 // NextPeptide() to iterate over the window. The client may also use
 // GetPeptide() to get a specific peptide in the window.
+//
+// With isotope errors the window spans several mass ranges, one per isotope
+// error. CandidateRanges() gives the runs of peptides in the window that fall
+// within one of them; only those are candidates.
 
 #include <deque>
 #include "peptides.pb.h"
 #include "peptide.h"
 #include "theoretical_peak_set.h"
 #include "fifo_alloc.h"
+#include "mass_directory.h"
+#include "peptide_prefetcher.h"
 #include "spectrum_collection.h"
 #include "io/OutputFiles.h"
 
@@ -31,15 +37,27 @@ class TheoreticalPeakCompiler;
 class ActivePeptideQueue {
  public:
   ActivePeptideQueue(RecordReader* reader,
-            const vector<const pb::Protein*>& proteins);
+            const ProteinBlob& proteins);
 
   ~ActivePeptideQueue();
 
-  bool isWithinIsotope(vector<double>* min_mass, vector<double>* max_mass, double mass, int* isotope_idx);
-  
-  // See above for usage and .cc for implementation details.
-  int SetActiveRange(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range, vector<bool>* candidatePeptideStatus);
-  int SetActiveRangeBIons(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range, vector<bool>* candidatePeptideStatus);
+  // See above for usage and .cc for implementation details. Both return the
+  // number of candidates.
+  int SetActiveRange(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range);
+  int SetActiveRangeBIons(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range);
+
+  // Sets iter_, end_ and CandidateRanges() to the peptides within the given
+  // windows, which must lie within those of the last SetActiveRange(), and
+  // returns the number of candidates. Lets several spectra whose windows fall
+  // within one active range take turns without changing the queue.
+  int SetCandidateRanges(const vector<double>* min_mass,
+                         const vector<double>* max_mass);
+
+  // Disjoint index intervals [first, second) into the window [iter_, end_),
+  // in increasing order, of the candidates of the last SetActiveRange().
+  const vector<pair<int, int> >& CandidateRanges() const {
+    return candidate_ranges_;
+  }
 
   bool HasNext() const { return iter_ != end_; }
   Peptide* NextPeptide() { return *iter_; }
@@ -50,9 +68,23 @@ class ActivePeptideQueue {
     theoretical_b_peak_set_.binWidth_ = binWidth;
     theoretical_b_peak_set_.binOffset_ = binOffset;
   }
+  // With a directory of the peptides file, SetActiveRange() seeks past
+  // peptides lighter than the range instead of reading them.
+  void SetMassDirectory(const MassDirectory* mass_directory) {
+    mass_directory_ = mass_directory;
+  }
+  // Reads and parses up to capacity peptides ahead on a thread of its own.
+  // Call after SetMassDirectory(), if at all, and before SetActiveRange().
+  void SetPrefetch(int capacity);
+  // Keeps the peak codes of each peptide next to it (see
+  // Peptide::KeepPeakCodes()). Call before SetActiveRange().
+  void SetKeepPeakCodes(bool keep_peak_codes) {
+    keep_peak_codes_ = keep_peak_codes;
+  }
 
-  deque<TheoreticalPeakSetBIons> b_ion_queue_;
-  deque<TheoreticalPeakSetBIons>::const_iterator iter1_, end1_;
+  // b ion peaks of the peptides in queue_, in the same order
+  deque<BIonPeakSpan> b_ion_queue_;
+  deque<BIonPeakSpan>::const_iterator iter1_, end1_;
  
   int CountAAFrequency(double binWidth, double binOffset, double** dAAFreqN,
                        double** dAAFreqI, double** dAAFreqC, int** dAAMass);
@@ -63,6 +95,15 @@ class ActivePeptideQueue {
   int ActiveTargets() const { return active_targets_; }
   int ActiveDecoys() const { return active_decoys_; }
 
+  // Number of peptides read into the queue and of dot-product programs
+  // compiled for them, for metrics
+  int64_t PeptidesDecoded() const { return peptides_decoded_; }
+  int64_t ProgramsCompiled() const { return programs_compiled_; }
+  // Number of peptides the prefetch thread discarded unparsed
+  int64_t PeptidesSkipped() {
+    return prefetcher_ == NULL ? 0 : prefetcher_->Skipped();
+  }
+
   void ReportPeptideHits(Peptide* peptide);
   void SetOutputs(OutputFiles* output_files, const vector<const pb::AuxLocation*>* locations, int top_matches,
                   bool compute_sp, ofstream* target_file, ofstream* decoy_file, double highest_mz) {
@@ -107,12 +148,18 @@ class ActivePeptideQueue {
   // See .cc file.
   void ComputeTheoreticalPeaksBack();
   void ComputeBTheoreticalPeaksBack();
+  void SkipLighterThan(double min_range);
+  bool PeptidesDone();
+  void ReadPeptide();
 
   RecordReader* reader_;
+  const MassDirectory* mass_directory_;
+  PeptidePrefetcher* prefetcher_;
+  bool keep_peak_codes_;
   pb::Peptide current_pb_peptide_;
 
   // All amino acid sequences from which the peptides are drawn.
-  const vector<const pb::Protein*>& proteins_; 
+  const ProteinBlob& proteins_;
 
   // Workspace for computing theoretical peaks for a single peptide.
   // Gets reused for each new peptide.
@@ -143,8 +190,13 @@ class ActivePeptideQueue {
   TheoreticalPeakCompiler* compiler_prog1_;
   TheoreticalPeakCompiler* compiler_prog2_;
 
+  // Set by SetCandidateRanges()
+  vector<pair<int, int> > candidate_ranges_;
+
   // Number of targets and decoys in active range
   int active_targets_, active_decoys_;
+
+  int64_t peptides_decoded_, programs_compiled_;
 };
 
 /*
@@ -28,6 +28,7 @@
 #include<stdlib.h>
 #include<assert.h>
 #include<iostream>
+#include "io/carp.h"
 #include "fifo_alloc.h"
 
 using namespace std;
@@ -58,6 +59,7 @@ void* FifoPage::GetPage(size_t size) {
   void* p = mmap(0, size_with_sentinels, mmap_prot_mode, 
                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
   if (p == NULL) {
+    carp_flush();
     cerr << "Failed to allocate FifoPage of size " << size << ". Aborting\n";
     abort();
   }
@@ -65,6 +67,7 @@ void* FifoPage::GetPage(size_t size) {
   FillSentinel((char *) p + size + SENTINEL_DATA_SIZE, SENTINEL_DATA_SIZE);
   void* tmp = (char *) p + SENTINEL_DATA_SIZE;
   // return (char *) p + SENTINEL_DATA_SIZE;
+  carp_flush();
   cerr << "mmap'ed page at " << tmp << endl;
   return tmp;
 }
@@ -72,6 +75,7 @@ void* FifoPage::GetPage(size_t size) {
 void FifoPage::DeletePage(void* page, size_t size) {
   CheckSentinel((char *) page - SENTINEL_DATA_SIZE, SENTINEL_DATA_SIZE);
   CheckSentinel((char *) page + size, SENTINEL_DATA_SIZE);
+  carp_flush();
   cerr << "munmap'ed " << page << endl;
   munmap((char *) page - SENTINEL_DATA_SIZE, size + 2 * SENTINEL_DATA_SIZE);
 }
@@ -81,6 +85,7 @@ void* FifoPage::GetPage(size_t size) {
   int mmap_prot_mode = PROT_READ | PROT_WRITE | PROT_EXEC;
   void* p = mmap(0, size, mmap_prot_mode, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
   if (p == NULL) {
+    carp_flush();
     cerr << "Failed to allocate FifoPage of size " << size << ". Aborting\n";
     abort();
   }
@@ -105,6 +110,7 @@ void* FifoAllocator::FallbackNew(size_t amount) {
   assert(current_page_->Empty());
 
   if (amount > page_size_) { // CONSIDER: eliminate this restriction.
+    carp_flush();
     cerr << "Requested " << amount << " bytes from FifoAllocator, "
 	 << "but page size is " << page_size_ << ". Aborting\n";
     abort();
@@ -125,6 +131,7 @@ void FifoAllocator::Release(void* first_used) {
 	return;
       }
       // Show();
+      carp_flush();
       cerr << "Attempted release of address not in FifoAllocator range.\n";
       abort();
     }
@@ -156,6 +163,7 @@ FifoAllocator::~FifoAllocator() {
 }
 
 void FifoAllocator::Show() {
+  carp_flush();
   FifoPage* page = first_page_;
   while(true) {
     page->Show();
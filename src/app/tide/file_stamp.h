@@ -0,0 +1,66 @@
+// FileStamp identifies the contents of an index file cheaply, so that a cache
+// made from it (protix.blob, pepix.massdir) can tell whether the file has
+// been replaced since. It records the size of the file and a checksum of its
+// first and last kStampBytes bytes, which for records files covers the header
+// record and the last records written. The modification time is left out, so
+// an index that is copied or moved keeps its caches.
+//
+// Example usage:
+// FileStamp stamp;
+// if (!stamp.Read(peptides_file)) { ... }
+// header.source = stamp;
+// ...
+// if (!current.Read(peptides_file) || !(current == header.source)) { stale }
+
+#ifndef FILE_STAMP_H
+#define FILE_STAMP_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <vector>
+
+struct FileStamp {
+  enum { kStampBytes = 1 << 16 };
+
+  uint64_t size;
+  uint64_t checksum;
+
+  // Fills in the stamp of filename. Returns false if it cannot be read.
+  bool Read(const std::string& filename) {
+    struct stat info;
+    if (stat(filename.c_str(), &info) != 0) {
+      return false;
+    }
+    size = info.st_size;
+    checksum = 14695981039346656037ULL;  // FNV-1a 64-bit offset basis
+    std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+    int64_t head = std::min((int64_t)size, (int64_t)kStampBytes);
+    int64_t tail = std::min((int64_t)size - head, (int64_t)kStampBytes);
+    return Hash(&in, 0, head) && Hash(&in, size - tail, tail);
+  }
+
+  bool operator==(const FileStamp& other) const {
+    return size == other.size && checksum == other.checksum;
+  }
+
+ private:
+  bool Hash(std::ifstream* in, int64_t offset, int64_t length) {
+    if (length <= 0) {
+      return true;
+    }
+    std::vector<char> buf(length);
+    if (!in->seekg(offset) || !in->read(&buf[0], length)) {
+      return false;
+    }
+    for (int64_t i = 0; i < length; ++i) {
+      checksum = (checksum ^ (uint8_t)buf[i]) * 1099511628211ULL;
+    }
+    return true;
+  }
+};
+
+#endif // FILE_STAMP_H
@@ -136,6 +136,7 @@ class Peptide {
 
   void Print() {
     // Debugging
+    carp_flush();
     cerr << mass_ << "\t  len:" << length_ << "\t  prot:" 
       << protein_id_ << "\t  pos:" << pos_ << "\n";
   }
@@ -418,6 +419,7 @@ class PeptideHeap {
 
 void PeptideHeap::PrintHeap(const string& name, PepIter iter, PepIter end) {
   // Debugging
+  carp_flush();
   cerr << "=========  " << name << "  =========\n";
   for (; iter != end; ++iter) {
     cerr << "     ";
@@ -480,6 +482,7 @@ void PeptideHeap::MakePeptides(const vector<const pb::Protein*>& proteins,
   CHECK(peptide_writer->OK());
   CHECK(aux_loc_writer->OK());
 
+  carp_flush();
   cerr << "Creating Peptide Array" << endl;
   vector<const pb::Protein*>::const_iterator i = proteins.begin();
   for (; i != proteins.end(); ++i) {
@@ -671,6 +674,7 @@ class PartiallyEnzymaticAllowMissedCleavagesPeptideHeap
 
 #define CHECK_SETTINGS(x) do { \
   if (!(x)) { \
+    carp_flush(); \
     fprintf(stderr, "SETTINGS CHECK FAILED: %s\n", #x); \
     return false; \
   } \
@@ -690,6 +694,7 @@ bool MakePeptides(pb::Header* header, const string& peptides_file,
   string proteins_filename = source.filename();
   vector<const pb::Protein*> proteins;
   pb::Header prot_header;
+  carp_flush();
   cerr << "Reading Proteins" << endl;
   CHECK_SETTINGS(ReadRecordsToVector<pb::Protein>(&proteins, proteins_filename,
                                                   &prot_header));
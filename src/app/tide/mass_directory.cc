@@ -0,0 +1,103 @@
+// This file contains implementations for classes defined in mass_directory.h.
+// Please see the header file for details.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include "mass_directory.h"
+
+using namespace std;
+
+namespace {
+
+const char kMagic[8] = "TIDEMDR";
+const uint32_t kVersion = 3;
+
+// Returns the size of a file in bytes, or -1 if it cannot be stat'ed.
+int64_t FileSize(const string& filename) {
+  struct stat info;
+  if (stat(filename.c_str(), &info) != 0) {
+    return -1;
+  }
+  return info.st_size;
+}
+
+}
+
+MassDirectory::MassDirectory(uint32_t block_size)
+  : block_size_(block_size), next_block_(0) {
+}
+
+void MassDirectory::Add(double mass, uint64_t offset) {
+  Entry entry;
+  entry.mass = mass;
+  entry.offset = offset;
+  entries_.push_back(entry);
+  next_block_ = (offset / block_size_ + 1) * block_size_;
+}
+
+bool MassDirectory::Write(const string& peptides_file) const {
+  FileStamp source;
+  if (!source.Read(peptides_file)) {
+    return false;
+  }
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.block_size = block_size_;
+  header.num_entries = entries_.size();
+  header.source = source;
+  ofstream out(Filename(peptides_file).c_str(),
+               ios::out | ios::binary | ios::trunc);
+  out.write((const char*)&header, sizeof(header));
+  if (!entries_.empty()) {
+    out.write((const char*)&entries_[0], entries_.size() * sizeof(Entry));
+  }
+  return out.good();
+}
+
+bool MassDirectory::Load(const string& peptides_file) {
+  entries_.clear();
+  next_block_ = 0;
+  string filename = Filename(peptides_file);
+  FileStamp source;
+  int64_t size = FileSize(filename);
+  if (size < (int64_t)sizeof(Header) || !source.Read(peptides_file)) {
+    return false;
+  }
+  ifstream in(filename.c_str(), ios::in | ios::binary);
+  Header header;
+  if (!in.read((char*)&header, sizeof(header)) ||
+      memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.version != kVersion ||
+      !(header.source == source) ||
+      (uint64_t)size != sizeof(Header) + header.num_entries * sizeof(Entry)) {
+    return false;
+  }
+  entries_.resize(header.num_entries);
+  if (!entries_.empty() &&
+      !in.read((char*)&entries_[0], entries_.size() * sizeof(Entry))) {
+    entries_.clear();
+    return false;
+  }
+  block_size_ = header.block_size;
+  return true;
+}
+
+uint64_t MassDirectory::Offset(double min_mass) const {
+  // First entry of mass >= min_mass; records lighter than min_mass may still
+  // follow the entry before it.
+  size_t lo = 0, hi = entries_.size();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (entries_[mid].mass < min_mass) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo > 0 ? entries_[lo - 1].offset : 0;
+}
@@ -0,0 +1,92 @@
+// A MassDirectory is a sidecar to a file of peptide records (pepix) that
+// lets a reader start at any mass instead of reading every lighter peptide.
+//
+// The records file is divided into fixed-size blocks of bytes. For each block
+// the directory holds the mass and the file offset of the first record that
+// starts in it. Since peptides are stored in order of non-decreasing mass, all
+// records before the directory entry preceding the first entry of mass
+// >= m are lighter than m, and a reader wanting peptides of mass >= m can seek
+// straight to that entry with RecordReader::Seek().
+//
+// Layout of the directory file (native byte order; like protix.blob it is a
+// cache, and pepix remains the canonical record of the peptides):
+//
+//   Header   magic, version, block size, number of entries, stamp (size and
+//            checksum) of the pepix file the directory was made from
+//   Entry[n] mass and offset of the first record in each block
+//
+// Writers of pepix build the directory as they go:
+// MassDirectory directory;
+// ...
+// if (directory.StartsBlock(writer.Position())) {
+//   directory.Add(peptide.mass(), writer.Position());
+// }
+// writer.Write(&peptide);
+// ...  // close the writer, then
+// directory.Write(peptides_file);
+//
+// Readers:
+// MassDirectory directory;
+// if (directory.Load(peptides_file)) {
+//   reader->Seek(directory.Offset(min_mass));
+// }
+
+#ifndef MASS_DIRECTORY_H
+#define MASS_DIRECTORY_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "file_stamp.h"
+
+class MassDirectory {
+ public:
+  static const uint32_t kDefaultBlockSize = 1 << 16;
+
+  explicit MassDirectory(uint32_t block_size = kDefaultBlockSize);
+
+  // Whether a record written at offset would be the first in its block, and
+  // so should be added.
+  bool StartsBlock(uint64_t offset) const { return offset >= next_block_; }
+
+  // Adds the record of mass mass written at offset.
+  void Add(double mass, uint64_t offset);
+
+  // Writes the directory for peptides_file, which must be complete, to
+  // Filename(peptides_file).
+  bool Write(const std::string& peptides_file) const;
+
+  // Reads Filename(peptides_file). Returns false if it is missing, malformed,
+  // or was not made from peptides_file as it is now.
+  bool Load(const std::string& peptides_file);
+
+  // Offset of the record from which to read peptides of mass >= min_mass, or
+  // 0 if there is nothing to skip.
+  uint64_t Offset(double min_mass) const;
+
+  size_t Size() const { return entries_.size(); }
+
+  static std::string Filename(const std::string& peptides_file) {
+    return peptides_file + ".massdir";
+  }
+
+ private:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t num_entries;
+    FileStamp source;
+  };
+
+  struct Entry {
+    double mass;
+    uint64_t offset;
+  };
+
+  uint32_t block_size_;
+  uint64_t next_block_;
+  std::vector<Entry> entries_;
+};
+
+#endif // MASS_DIRECTORY_H
@@ -339,6 +339,7 @@ class VariableModTable {
   int Unique_delta_size() { return unique_delta_.size(); }
  private:
   bool Error(const char* spec_text, int err_pos, const char* msg) {
+    carp_flush();
     cerr << "Error: couldn't parse modification specification:\n" << spec_text
          << "\n" << string(err_pos, ' ') << "^\n" << msg << "\n";
     pb_mod_table_.Clear();
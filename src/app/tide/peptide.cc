@@ -204,6 +204,30 @@ void Peptide::Compile(const TheoreticalPeakArr* peaks,
 //	exit(1);  
 }
 
+void Peptide::KeepPeakCodes(const TheoreticalPeakArr* peaks,
+                            FifoAllocator* fifo_alloc) {
+  // Same peaks as Compile() puts in the programs.
+  int end = MaxBin::Global().CacheBinEnd() * NUM_PEAK_TYPES;
+  int size = peaks[0].size() + peaks[1].size();
+  // Rounded up so that the next Peptide stays as aligned as it would be.
+  size_t bytes = (size * sizeof(int) + sizeof(double) - 1) & ~(sizeof(double) - 1);
+  int* codes = (int*) fifo_alloc->New(bytes == 0 ? sizeof(double) : bytes);
+  int n = 0;
+  for (int i = 0; i < peaks[0].size(); ++i) {
+    if (peaks[0][i].Code() < end) {
+      codes[n++] = peaks[0][i].Code();
+    }
+  }
+  num_peak_codes1_ = n;
+  for (int i = 0; i < peaks[1].size(); ++i) {
+    if (peaks[1][i].Code() < end) {
+      codes[n++] = peaks[1][i].Code();
+    }
+  }
+  num_peak_codes2_ = n;
+  peak_codes_ = codes;
+}
+
 void Peptide::ComputeTheoreticalPeaks(TheoreticalPeakSet* workspace) const {
   AddIons<TheoreticalPeakSet>(workspace);   // Generic workspace
 #ifdef DEBUG
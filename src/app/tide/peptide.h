@@ -31,6 +31,7 @@
 #include "fifo_alloc.h"
 #include "mod_coder.h"
 #include "sp_scorer.h"
+#include "protein_blob.h"
 
 #include "spectrum_collection.h"
 //#include "TideMatchSet.h"
@@ -76,20 +77,28 @@ class Peptide {
     has_aux_locations_index_(peptide.has_aux_locations_index()),
     aux_locations_index_(peptide.aux_locations_index()),
     mods_(NULL), num_mods_(0), decoyIdx_(peptide.has_decoy_index() ? peptide.decoy_index() : -1),
-    prog1_(NULL), prog2_(NULL) {
+    prog1_(NULL), prog2_(NULL),
+    peak_codes_(NULL), num_peak_codes1_(0), num_peak_codes2_(0) {
     // Set residues_ by pointing to the first occurrence in proteins.
     residues_ = proteins[first_loc_protein_id_]->residues().data() 
                     + first_loc_pos_;
-    if (peptide.modifications_size() > 0) {
-      num_mods_ = peptide.modifications_size();
-      if (fifo_alloc) {
-        mods_ = (ModCoder::Mod*) fifo_alloc->New(sizeof(mods_[0]) * num_mods_);
-      } else {
-        mods_ = new ModCoder::Mod[num_mods_];
-      }
-      for (int i = 0; i < num_mods_; ++i)
-        mods_[i] = ModCoder::Mod(peptide.modifications(i));
-    }
+    InitMods(peptide, fifo_alloc);
+  }
+
+  // As above, but residues_ points into the search-time protein blob.
+  Peptide(const pb::Peptide& peptide,
+          const ProteinBlob& proteins,
+          FifoAllocator* fifo_alloc = NULL)
+    : len_(peptide.length()), mass_(peptide.mass()), id_(peptide.id()),
+    first_loc_protein_id_(peptide.first_location().protein_id()),
+    first_loc_pos_(peptide.first_location().pos()), 
+    has_aux_locations_index_(peptide.has_aux_locations_index()),
+    aux_locations_index_(peptide.aux_locations_index()),
+    mods_(NULL), num_mods_(0), decoyIdx_(peptide.has_decoy_index() ? peptide.decoy_index() : -1),
+    prog1_(NULL), prog2_(NULL),
+    peak_codes_(NULL), num_peak_codes1_(0), num_peak_codes2_(0) {
+    residues_ = proteins[first_loc_protein_id_].residues() + first_loc_pos_;
+    InitMods(peptide, fifo_alloc);
   }
   class spectrum_matches {
    public:
@@ -156,6 +165,7 @@ class Peptide {
   }
 
   string Seq() const { return string(residues_, Len()); } // For display
+  const char* Residues() const { return residues_; } // Len() of them
 
   string SeqWithMods() const;
 
@@ -183,6 +193,18 @@ class Peptide {
     return max_charge <= 2 ? prog1_ : prog2_;
   }
 
+  // Copies the peak codes that the programs add up, those of peaks[0]
+  // followed by those of peaks[1], into fifo_alloc. Used for scoring several
+  // spectra at once without running the programs (see SpectrumBatch).
+  void KeepPeakCodes(const TheoreticalPeakArr* peaks, FifoAllocator* fifo_alloc);
+
+  // The codes kept by KeepPeakCodes(); Prog(max_charge) adds up the first
+  // NumPeakCodes(max_charge) of them.
+  const int* PeakCodes() const { return peak_codes_; }
+  int NumPeakCodes(int max_charge) const {
+    return max_charge <= 2 ? num_peak_codes1_ : num_peak_codes2_;
+  }
+
   void ReleaseFifo(FifoAllocator* fifo_alloc_prog1,
        FifoAllocator* fifo_alloc_prog2) {
     // TODO 258: this code should probably move to ActivePeptideQueue
@@ -215,6 +237,19 @@ class Peptide {
   double* getAAMasses();
 
  private:
+  void InitMods(const pb::Peptide& peptide, FifoAllocator* fifo_alloc) {
+    if (peptide.modifications_size() > 0) {
+      num_mods_ = peptide.modifications_size();
+      if (fifo_alloc) {
+        mods_ = (ModCoder::Mod*) fifo_alloc->New(sizeof(mods_[0]) * num_mods_);
+      } else {
+        mods_ = new ModCoder::Mod[num_mods_];
+      }
+      for (int i = 0; i < num_mods_; ++i)
+        mods_[i] = ModCoder::Mod(peptide.modifications(i));
+    }
+  }
+
   template<class W> void AddIons(W* workspace) const;
   template<class W> void AddBIonsOnly(W* workspace) const;
 
@@ -240,6 +275,10 @@ class Peptide {
 
   void* prog1_;
   void* prog2_;
+
+  const int* peak_codes_;
+  int num_peak_codes1_;
+  int num_peak_codes2_;
 };
 
 #endif // PEPTIDE_H
@@ -0,0 +1,214 @@
+// This file contains implementations for classes defined in peptide_codec.h.
+// Please see the header file for details.
+
+#include <string.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+#include "peptide_codec.h"
+#include "io/carp.h"
+
+using namespace std;
+using google::protobuf::int32;
+using google::protobuf::int64;
+using google::protobuf::uint32;
+using google::protobuf::uint64;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::internal::WireFormatLite;
+
+namespace {
+
+void AppendVarint(uint64 value, string* out) {
+  while (value >= 0x80) {
+    out->push_back(char(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(char(value));
+}
+
+void AppendRepeated(const google::protobuf::RepeatedField<int32>& values,
+                    string* out) {
+  AppendVarint(values.size(), out);
+  for (int i = 0; i < values.size(); ++i) {
+    AppendVarint(uint32(values.Get(i)), out);
+  }
+}
+
+bool ReadRepeated(CodedInputStream* in,
+                  google::protobuf::RepeatedField<int32>* values) {
+  uint32 size, value;
+  if (!in->ReadVarint32(&size)) {
+    return false;
+  }
+  values->Reserve(size);
+  for (uint32 i = 0; i < size; ++i) {
+    if (!in->ReadVarint32(&value)) {
+      return false;
+    }
+    values->Add(int32(value));
+  }
+  return true;
+}
+
+uint64 MassBits(double mass) {
+  uint64 bits;
+  memcpy(&bits, &mass, sizeof(bits));
+  return bits;
+}
+
+}
+
+PeptideCodec::PeptideCodec()
+  : id_(0), mass_bits_(0), flags_(0), rest_(0), need_key_(true) {
+}
+
+void PeptideCodec::Encode(const pb::Peptide& peptide, uint64_t position,
+                          string* record) {
+  uint32 flags = 0;
+  if (blocks_.StartsBlock(position)) {
+    blocks_.Add(peptide.mass(), position);
+    flags |= kKey;
+  }
+  bool has_peaks = peptide.peak1_size() > 0 || peptide.peak2_size() > 0 ||
+    peptide.neg_peak1_size() > 0 || peptide.neg_peak2_size() > 0;
+  flags |= (peptide.has_id() ? kId : 0) |
+    (peptide.has_mass() ? kMass : 0) |
+    (peptide.has_length() ? kLength : 0) |
+    (peptide.has_first_location() ? kLocation : 0) |
+    (peptide.modifications_size() > 0 ? kMods : 0) |
+    (has_peaks ? kPeaks : 0) |
+    (peptide.has_aux_locations_index() ? kAuxLocations : 0) |
+    (peptide.has_decoy_index() ? kDecoy : 0);
+
+  record->clear();
+  AppendVarint(flags, record);
+  if (flags & kId) {
+    int64 id = peptide.id();
+    AppendVarint((flags & kKey) ? uint64(id) : WireFormatLite::ZigZagEncode64(id - id_),
+                 record);
+    id_ = id;
+  }
+  if (flags & kMass) {
+    uint64 bits = MassBits(peptide.mass());
+    if (flags & kKey) {
+      for (int i = 0; i < 8; ++i) {
+        record->push_back(char(bits >> (8 * i)));
+      }
+    } else {
+      AppendVarint(WireFormatLite::ZigZagEncode64(int64(bits - mass_bits_)), record);
+    }
+    mass_bits_ = bits;
+  }
+  if (flags & kLength) {
+    AppendVarint(uint32(peptide.length()), record);
+  }
+  if (flags & kLocation) {
+    AppendVarint(uint32(peptide.first_location().protein_id()), record);
+    AppendVarint(uint32(peptide.first_location().pos()), record);
+  }
+  if (flags & kMods) {
+    AppendRepeated(peptide.modifications(), record);
+  }
+  if (flags & kPeaks) {
+    AppendRepeated(peptide.peak1(), record);
+    AppendRepeated(peptide.peak2(), record);
+    AppendRepeated(peptide.neg_peak1(), record);
+    AppendRepeated(peptide.neg_peak2(), record);
+  }
+  if (flags & kAuxLocations) {
+    AppendVarint(uint32(peptide.aux_locations_index()), record);
+  }
+  if (flags & kDecoy) {
+    AppendVarint(uint32(peptide.decoy_index()), record);
+  }
+}
+
+bool PeptideCodec::Next(const string& record, double* mass) {
+  CodedInputStream in((const google::protobuf::uint8*)record.data(), record.size());
+  if (!in.ReadVarint32(&flags_)) {
+    return false;
+  }
+  bool key = flags_ & kKey;
+  if (need_key_ && !key) {
+    carp(CARP_FATAL, "Encoded peptides were read from an offset that does not "
+         "start a block; the index's mass directory does not match its "
+         "peptides. Remove pepix.massdir and search again.");
+  }
+  need_key_ = false;
+  if (flags_ & kId) {
+    uint64 value;
+    if (!in.ReadVarint64(&value)) {
+      return false;
+    }
+    id_ = key ? int64(value) : id_ + WireFormatLite::ZigZagDecode64(value);
+  }
+  if (flags_ & kMass) {
+    uint64 value;
+    if (key) {
+      if (!in.ReadLittleEndian64(&value)) {
+        return false;
+      }
+      mass_bits_ = value;
+    } else {
+      if (!in.ReadVarint64(&value)) {
+        return false;
+      }
+      mass_bits_ += uint64(WireFormatLite::ZigZagDecode64(value));
+    }
+  }
+  memcpy(mass, &mass_bits_, sizeof(*mass));
+  rest_ = in.CurrentPosition();
+  return true;
+}
+
+bool PeptideCodec::Decode(const string& record, pb::Peptide* peptide) {
+  peptide->Clear();
+  if (flags_ & kId) {
+    peptide->set_id(id_);
+  }
+  if (flags_ & kMass) {
+    double mass;
+    memcpy(&mass, &mass_bits_, sizeof(mass));
+    peptide->set_mass(mass);
+  }
+  CodedInputStream in((const google::protobuf::uint8*)record.data() + rest_,
+                      record.size() - rest_);
+  uint32 value;
+  if (flags_ & kLength) {
+    if (!in.ReadVarint32(&value)) {
+      return false;
+    }
+    peptide->set_length(int32(value));
+  }
+  if (flags_ & kLocation) {
+    uint32 pos;
+    if (!in.ReadVarint32(&value) || !in.ReadVarint32(&pos)) {
+      return false;
+    }
+    pb::Location* location = peptide->mutable_first_location();
+    location->set_protein_id(int32(value));
+    location->set_pos(int32(pos));
+  }
+  if ((flags_ & kMods) && !ReadRepeated(&in, peptide->mutable_modifications())) {
+    return false;
+  }
+  if ((flags_ & kPeaks) &&
+      (!ReadRepeated(&in, peptide->mutable_peak1()) ||
+       !ReadRepeated(&in, peptide->mutable_peak2()) ||
+       !ReadRepeated(&in, peptide->mutable_neg_peak1()) ||
+       !ReadRepeated(&in, peptide->mutable_neg_peak2()))) {
+    return false;
+  }
+  if (flags_ & kAuxLocations) {
+    if (!in.ReadVarint32(&value)) {
+      return false;
+    }
+    peptide->set_aux_locations_index(int32(value));
+  }
+  if (flags_ & kDecoy) {
+    if (!in.ReadVarint32(&value)) {
+      return false;
+    }
+    peptide->set_decoy_index(int32(value));
+  }
+  return in.CurrentPosition() == int(record.size()) - rest_;
+}
@@ -0,0 +1,103 @@
+// A PeptideCodec encodes the records of a peptides file (pepix) more
+// compactly than serialized pb::Peptide messages, and decodes them again.
+//
+// Most of a serialized pb::Peptide is field tags, a full double for the mass
+// and a large id, while in a file sorted by mass consecutive peptides have
+// nearly the same mass and consecutive ids. An encoded record holds (all
+// integers as varints):
+//
+//   flags        kKey, and which of the fields below are present
+//   id, mass     in a key record, the id and the bits of the mass (8 bytes);
+//                otherwise their zigzag-encoded differences from those of the
+//                previous record. The bits of non-negative doubles order as
+//                the doubles do, so the difference of the masses is small.
+//   length
+//   first_location     protein_id, then pos
+//   modifications      count, then the ModCoder codes, which already pack the
+//                      residue and the mod into one small number
+//   peak1, peak2, neg_peak1, neg_peak2     count, then values, for each
+//   aux_locations_index
+//   decoy_index
+//
+// Records keep their length prefix (see records.h), so they are read,
+// skipped and copied as before. A record is a key, decodable on its own,
+// whenever it starts a block of a MassDirectory of the default block size,
+// so a reader may seek to any offset given by the directory of the file.
+//
+// Peptides files whose header has peptide_encoding set are encoded.
+// HeadedRecordWriter and HeadedRecordReader then encode and decode pb::Peptide
+// messages themselves, so their clients need not know. Clients that read
+// records raw decode them with RecordReader::Codec():
+// PeptideCodec* codec = reader->Codec();
+// reader->ReadRaw(&record);
+// codec->Next(record, &mass);  // for every record, in order
+// codec->Decode(record, &peptide);  // optional
+
+#ifndef PEPTIDE_CODEC_H
+#define PEPTIDE_CODEC_H
+
+#include <string>
+#include "header.pb.h"
+#include "peptides.pb.h"
+#include "mass_directory.h"
+
+class PeptideCodec {
+ public:
+  // Version of the encoding, written as peptide_encoding
+  static const int kVersion = 1;
+
+  PeptideCodec();
+
+  // Whether the peptides of a file with this header are encoded.
+  static bool Encoded(const pb::Header& header) {
+    return header.file_type() == pb::Header::PEPTIDES &&
+      header.peptides_header().peptide_encoding() != 0;
+  }
+
+  // Encodes peptide into record, to be written at offset position of the
+  // file. Peptides must be encoded in the order they are written.
+  void Encode(const pb::Peptide& peptide, uint64_t position,
+              std::string* record);
+
+  // Decodes the mass of the next record read. Every record must be passed to
+  // Next(), in file order, unless the reader seeks.
+  bool Next(const std::string& record, double* mass);
+
+  // Tells the codec that the reader has sought, so the next record passed to
+  // Next() must be a key record; it is a fatal error if it is not, since the
+  // offset cannot then have come from the file's MassDirectory.
+  void Seeked() { need_key_ = true; }
+
+  // Decodes the record last passed to Next().
+  bool Decode(const std::string& record, pb::Peptide* peptide);
+
+ private:
+  enum {
+    kKey = 1 << 0,
+    kId = 1 << 1,
+    kMass = 1 << 2,
+    kLength = 1 << 3,
+    kLocation = 1 << 4,
+    kMods = 1 << 5,
+    kPeaks = 1 << 6,
+    kAuxLocations = 1 << 7,
+    kDecoy = 1 << 8
+  };
+
+  // Blocks of the writer's file, for choosing key records
+  MassDirectory blocks_;
+
+  // Id and mass of the last record encoded or passed to Next()
+  google::protobuf::int64 id_;
+  google::protobuf::uint64 mass_bits_;
+
+  // Of the record last passed to Next(): its flags and where the fields
+  // after the mass begin
+  google::protobuf::uint32 flags_;
+  int rest_;
+
+  // Whether the next record passed to Next() must be a key record
+  bool need_key_;
+};
+
+#endif // PEPTIDE_CODEC_H
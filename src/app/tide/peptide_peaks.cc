@@ -16,6 +16,10 @@
 // TODO 248: We're only doing this to guarantee the exact same results as Crux
 // used to return, but perhaps the diffs don't really add useful info, in which 
 // case we could eliminate them.
+//
+// Peaks are currently computed at search time instead, so this pass only
+// writes the new header and copies the peptide records through unchanged,
+// along with the MassDirectory (q.v.) of the output.
 
 #include <stdio.h>
 #include <iostream>
@@ -25,10 +29,14 @@
 #include "peptide.h"
 #include "theoretical_peak_set.h"
 #include "abspath.h"
+#include "mass_directory.h"
 
 using namespace std;
 
 #define CHECK(x) GOOGLE_CHECK(x)
+
+// Buffer size for copying the peptide records
+static const int kCopyBufferSize = 1 << 20;
 /*
 static void AddPeaksToPB(pb::Peptide* peptide, const TheoreticalPeakArr* peaks,
 			 int charge, bool neg) {
@@ -56,9 +64,10 @@ static void AddPeaksToPB(pb::Peptide* peptide, const TheoreticalPeakArr* peaks,
 
 void AddTheoreticalPeaks(const vector<const pb::Protein*>& proteins,
 			 const string& input_filename,
-			 const string& output_filename) {
+			 const string& output_filename,
+			 bool compact) {
   pb::Header orig_header, new_header;
-  HeadedRecordReader reader(input_filename, &orig_header);
+  HeadedRecordReader reader(input_filename, &orig_header, kCopyBufferSize);
   CHECK(orig_header.file_type() == pb::Header::PEPTIDES);
   CHECK(orig_header.has_peptides_header());
 //  MassConstants::Init(&orig_header.peptides_header().mods());
@@ -66,32 +75,46 @@ void AddTheoreticalPeaks(const vector<const pb::Protein*>& proteins,
   pb::Header_PeptidesHeader* subheader = new_header.mutable_peptides_header();
   subheader->CopyFrom(orig_header.peptides_header());
   subheader->set_has_peaks(true);
+  if (compact) {
+    subheader->set_peptide_encoding(PeptideCodec::kVersion);
+  }
   pb::Header_Source* source = new_header.add_source();
   source->mutable_header()->CopyFrom(orig_header);
   source->set_filename(AbsPath(input_filename));
-  HeadedRecordWriter writer(output_filename, new_header);
+  HeadedRecordWriter* writer =
+    new HeadedRecordWriter(output_filename, new_header, kCopyBufferSize);
   CHECK(reader.OK());
-  CHECK(writer.OK());
+  CHECK(writer->OK());
+  MassDirectory directory;
 
+  string record;
   pb::Peptide pb_peptide;
-//  const int workspace_size = 2000; // More than sufficient for theor. peaks.
-//  TheoreticalPeakSetDiff workspace(workspace_size);
-  while (!reader.Done()) {
-    reader.Read(&pb_peptide);
-/*    Peptide peptide(pb_peptide, proteins);
-    workspace.Clear();
-    peptide.ComputeTheoreticalPeaks(&workspace);
-    TheoreticalPeakArr peaks_charge_1(2000);
-    TheoreticalPeakArr peaks_charge_2(2000);
-    TheoreticalPeakArr negs_charge_1(2000);
-    TheoreticalPeakArr negs_charge_2(2000);
-    workspace.GetPeaks(&peaks_charge_1, &negs_charge_1,
-		       &peaks_charge_2, &negs_charge_2, NULL);
-    AddPeaksToPB(&pb_peptide, &peaks_charge_1, 1, false);
-    AddPeaksToPB(&pb_peptide, &peaks_charge_2, 2, false);
-    AddPeaksToPB(&pb_peptide, &negs_charge_1, 1, true);
-    AddPeaksToPB(&pb_peptide, &negs_charge_2, 2, true);
-*/    CHECK(writer.Write(&pb_peptide));
+  if (PeptideCodec::Encoded(new_header)) {
+    // Encoded records are written from the parsed peptides.
+    while (!reader.Done()) {
+      CHECK(reader.Read(&pb_peptide));
+      if (directory.StartsBlock(writer->Position())) {
+        directory.Add(pb_peptide.mass(), writer->Position());
+      }
+      CHECK(writer->Write(&pb_peptide));
+    }
+  } else {
+    // The records are copied as serialized bytes, without parsing them into
+    // pb::Peptide and serializing them again.
+    while (!reader.Done()) {
+      CHECK(reader.ReadRaw(&record));
+      if (directory.StartsBlock(writer->Position())) {
+        // Only the first peptide of each block is parsed, for its mass
+        CHECK(pb_peptide.ParseFromString(record));
+        directory.Add(pb_peptide.mass(), writer->Position());
+      }
+      CHECK(writer->WriteRaw(record));
+    }
   }
   CHECK(reader.OK());
+  delete writer;  // the directory is made from the finished file
+  if (!directory.Write(output_filename)) {
+    carp(CARP_WARNING, "Error writing %s",
+         MassDirectory::Filename(output_filename).c_str());
+  }
 }
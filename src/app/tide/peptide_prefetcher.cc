@@ -0,0 +1,201 @@
+// This file contains implementations for classes defined in
+// peptide_prefetcher.h. Please see the header file for details.
+
+#include <limits>
+#include <boost/bind.hpp>
+#include "peptide_prefetcher.h"
+
+using namespace std;
+
+#define CHECK(x) GOOGLE_CHECK((x))
+
+namespace {
+
+// Number of records the reading thread reads between taking the lock.
+const size_t kBatchSize = 64;
+
+void DeleteAll(deque<pb::Peptide*>* peptides) {
+  for (deque<pb::Peptide*>::iterator i = peptides->begin(); i != peptides->end(); ++i) {
+    delete *i;
+  }
+  peptides->clear();
+}
+
+void DeleteAll(vector<pb::Peptide*>* peptides) {
+  for (vector<pb::Peptide*>::iterator i = peptides->begin(); i != peptides->end(); ++i) {
+    delete *i;
+  }
+  peptides->clear();
+}
+
+}
+
+PeptidePrefetcher::PeptidePrefetcher(RecordReader* reader,
+                                     const MassDirectory* mass_directory,
+                                     int capacity)
+  : reader_(reader), mass_directory_(mass_directory),
+    capacity_(max(capacity, (int)kBatchSize)),
+    min_mass_(-numeric_limits<double>::infinity()),
+    done_(false), stop_(false), skipped_(0) {
+  CHECK(reader_->OK());
+  thread_ = boost::thread(boost::bind(&PeptidePrefetcher::Run, this));
+}
+
+PeptidePrefetcher::~PeptidePrefetcher() {
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stop_ = true;
+  }
+  not_full_.notify_all();
+  thread_.join();
+  DeleteAll(&ready_);
+  DeleteAll(&free_);
+  DeleteAll(&taken_);
+  DeleteAll(&recycled_);
+  DeleteAll(&spare_);
+}
+
+bool PeptidePrefetcher::Done() {
+  if (!taken_.empty()) {
+    return false;
+  }
+  boost::mutex::scoped_lock lock(mutex_);
+  free_.insert(free_.end(), recycled_.begin(), recycled_.end());
+  recycled_.clear();
+  while (true) {
+    // The reading thread may have parsed these before it saw min_mass_.
+    while (!ready_.empty() && ready_.front()->mass() < min_mass_) {
+      free_.push_back(ready_.front());
+      ready_.pop_front();
+    }
+    if (!ready_.empty() || done_) {
+      break;
+    }
+    not_full_.notify_one();
+    not_empty_.wait(lock);
+  }
+  taken_.swap(ready_);
+  not_full_.notify_one();
+  return taken_.empty();
+}
+
+void PeptidePrefetcher::Read(pb::Peptide* peptide) {
+  pb::Peptide* next = taken_.front();
+  taken_.pop_front();
+  peptide->Swap(next);
+  recycled_.push_back(next);
+}
+
+void PeptidePrefetcher::SkipLighterThan(double min_mass) {
+  while (!taken_.empty() && taken_.front()->mass() < min_mass) {
+    recycled_.push_back(taken_.front());
+    taken_.pop_front();
+  }
+  boost::mutex::scoped_lock lock(mutex_);
+  min_mass_ = max(min_mass_, min_mass);
+}
+
+int64_t PeptidePrefetcher::Skipped() {
+  boost::mutex::scoped_lock lock(mutex_);
+  return skipped_;
+}
+
+bool PeptidePrefetcher::PeekMass(const string& record, double* mass) {
+  // Wire format tags of pb::Peptide's id (field 1, varint) and mass (field 2,
+  // fixed64).
+  const google::protobuf::uint32 kIdTag = (1 << 3) | 0;
+  const google::protobuf::uint32 kMassTag = (2 << 3) | 1;
+  google::protobuf::io::CodedInputStream in(
+    (const google::protobuf::uint8*)record.data(), record.size());
+  google::protobuf::uint32 tag = in.ReadTag();
+  if (tag == kIdTag) {
+    google::protobuf::uint64 id;
+    if (!in.ReadVarint64(&id)) {
+      return false;
+    }
+    tag = in.ReadTag();
+  }
+  google::protobuf::uint64 bits;
+  if (tag != kMassTag || !in.ReadLittleEndian64(&bits)) {
+    return false;
+  }
+  memcpy(mass, &bits, sizeof(*mass));
+  return true;
+}
+
+void PeptidePrefetcher::Run() {
+  PeptideCodec* codec = reader_->Codec();
+  string record;
+  vector<pb::Peptide*> batch;
+  double min_mass = -numeric_limits<double>::infinity();
+  double seek_mass = min_mass;
+  int64_t skipped = 0;
+  bool done = false;
+  while (true) {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (!batch.empty()) {
+        ready_.insert(ready_.end(), batch.begin(), batch.end());
+        batch.clear();
+      }
+      skipped_ += skipped;
+      skipped = 0;
+      if (done) {
+        done_ = true;
+        not_empty_.notify_one();
+        return;
+      }
+      if (!ready_.empty()) {
+        not_empty_.notify_one();
+      }
+      while (!stop_ && ready_.size() >= capacity_) {
+        not_full_.wait(lock);
+      }
+      if (stop_) {
+        return;
+      }
+      min_mass = min_mass_;
+      while (spare_.size() < kBatchSize && !free_.empty()) {
+        spare_.push_back(free_.back());
+        free_.pop_back();
+      }
+    }
+
+    // All records before the directory's offset for min_mass are lighter than
+    // min_mass, so they need not be read at all.
+    if (mass_directory_ != NULL && min_mass > seek_mass) {
+      seek_mass = min_mass;
+      google::protobuf::uint64 offset = mass_directory_->Offset(min_mass);
+      if (offset > reader_->Position()) {
+        CHECK(reader_->Seek(offset));
+      }
+    }
+
+    while (batch.size() < kBatchSize) {
+      if (reader_->Done()) {
+        done = true;
+        break;
+      }
+      CHECK(reader_->ReadRaw(&record));
+      double mass;
+      bool has_mass = codec != NULL ? codec->Next(record, &mass) : PeekMass(record, &mass);
+      if (has_mass && mass < min_mass) {
+        ++skipped;
+        continue;
+      }
+      pb::Peptide* peptide;
+      if (spare_.empty()) {
+        peptide = new pb::Peptide;
+      } else {
+        peptide = spare_.back();
+        spare_.pop_back();
+      }
+      if (codec != NULL) {
+        CHECK(codec->Decode(record, peptide));
+      } else {
+        CHECK(peptide->ParseFromString(record));
+      }
+      batch.push_back(peptide);
+    }
+  }
+}
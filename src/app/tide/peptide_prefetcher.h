@@ -0,0 +1,92 @@
+// A PeptidePrefetcher reads the records of a peptide file (pepix) on a thread
+// of its own and parses them ahead of an ActivePeptideQueue, so that the
+// search thread that owns the queue does not wait on I/O or protobuf parsing.
+//
+// The reader keeps up to a fixed number of parsed peptides buffered, in file
+// order (non-decreasing mass). The consumer tells it which peptides it will no
+// longer need with SkipLighterThan(): buffered peptides lighter than that are
+// dropped, records lighter than that are discarded after reading only the
+// mass at the start of the record, and if there is a mass directory the reader
+// seeks past them altogether.
+//
+// Usage (from one consumer thread):
+// PeptidePrefetcher prefetcher(reader, mass_directory, capacity);
+// prefetcher.SkipLighterThan(min_mass);
+// while (!prefetcher.Done()) {
+//   prefetcher.Read(&peptide);
+//   ...
+// }
+//
+// Once a PeptidePrefetcher is constructed, reader belongs to its thread until
+// the prefetcher is destroyed.
+
+#ifndef PEPTIDE_PREFETCHER_H
+#define PEPTIDE_PREFETCHER_H
+
+#include <deque>
+#include <string>
+#include <vector>
+#define NO_BOOST_DATE_TIME_INLINE
+#include <boost/thread.hpp>
+#include "peptides.pb.h"
+#include "records.h"
+#include "mass_directory.h"
+
+class PeptidePrefetcher {
+ public:
+  PeptidePrefetcher(RecordReader* reader, const MassDirectory* mass_directory,
+                    int capacity);
+
+  // Stops the reading thread.
+  ~PeptidePrefetcher();
+
+  // Waits until a peptide is available or the file is exhausted, and returns
+  // true in the latter case.
+  bool Done();
+
+  // Moves the next peptide into peptide. Done() must have returned false.
+  void Read(pb::Peptide* peptide);
+
+  // Peptides lighter than min_mass will not be read. min_mass must not
+  // decrease from one call to the next.
+  void SkipLighterThan(double min_mass);
+
+  // Number of records discarded without being parsed so far.
+  int64_t Skipped();
+
+  // Reads the mass of a serialized pb::Peptide without parsing the rest of
+  // it. Relies on id and mass being the first fields of the record, which they
+  // are as written by tide-index; returns false otherwise.
+  static bool PeekMass(const std::string& record, double* mass);
+
+ private:
+  void Run();
+
+  RecordReader* reader_;
+  const MassDirectory* mass_directory_;
+  size_t capacity_;
+
+  // Guarded by mutex_: parsed peptides not yet taken by the consumer, and
+  // peptides returned by the consumer for reuse.
+  std::deque<pb::Peptide*> ready_;
+  std::vector<pb::Peptide*> free_;
+  double min_mass_;
+  bool done_;
+  bool stop_;
+  int64_t skipped_;
+
+  // Only used by the consumer: peptides taken from ready_ in one go, and
+  // read peptides to give back.
+  std::deque<pb::Peptide*> taken_;
+  std::vector<pb::Peptide*> recycled_;
+
+  // Only used by the reading thread: peptides to parse into.
+  std::vector<pb::Peptide*> spare_;
+
+  boost::mutex mutex_;
+  boost::condition_variable not_empty_;
+  boost::condition_variable not_full_;
+  boost::thread thread_;
+};
+
+#endif // PEPTIDE_PREFETCHER_H
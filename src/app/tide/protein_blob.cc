@@ -0,0 +1,216 @@
+// This file contains implementations for classes defined in protein_blob.h.
+// Please see the header file for details.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <fstream>
+#ifdef _MSC_VER
+#include <io.h>
+#include "mman.h"
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "protein_blob.h"
+#include "records.h"
+#include "records_to_vector-inl.h"
+
+using namespace std;
+
+#define CHECK(x) GOOGLE_CHECK((x))
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+namespace {
+
+const char kMagic[8] = "TIDEPRB";
+const uint32_t kVersion = 3;
+
+// Returns the size of a file in bytes, or -1 if it cannot be stat'ed.
+int64_t FileSize(const string& filename) {
+  struct stat info;
+  if (stat(filename.c_str(), &info) != 0) {
+    return -1;
+  }
+  return info.st_size;
+}
+
+}
+
+ProteinBlob::ProteinBlob()
+  : header_(NULL), entries_(NULL), data_(NULL),
+    mapped_(NULL), mapped_size_(0) {
+}
+
+ProteinBlob::~ProteinBlob() {
+  Clear();
+}
+
+void ProteinBlob::Clear() {
+  if (mapped_) {
+    munmap(mapped_, mapped_size_);
+    mapped_ = NULL;
+    mapped_size_ = 0;
+  }
+  vector<char>().swap(storage_);
+  header_ = NULL;
+  entries_ = NULL;
+  data_ = NULL;
+}
+
+bool ProteinBlob::Load(const string& proteins_file) {
+  FileStamp source;
+  if (!source.Read(proteins_file)) {
+    memset(&source, 0, sizeof(source));
+  } else if (Map(BlobFilename(proteins_file), source)) {
+    return true;
+  }
+  carp(CARP_DEBUG, "No current protein blob for %s, reading records",
+       proteins_file.c_str());
+  vector<const pb::Protein*> proteins;
+  pb::Header protein_header;
+  if (!ReadRecordsToVector<pb::Protein, const pb::Protein>(&proteins,
+      proteins_file, &protein_header)) {
+    return false;
+  }
+  Build(proteins, source);
+  for (vector<const pb::Protein*>::iterator i = proteins.begin();
+       i != proteins.end();
+       ++i) {
+    delete *i;
+  }
+  return true;
+}
+
+bool ProteinBlob::Map(const string& blob_file, const FileStamp& source) {
+  Clear();
+  int64_t size = FileSize(blob_file);
+  if (size < (int64_t)sizeof(Header)) {
+    return false;
+  }
+  int fd = open(blob_file.c_str(), O_RDONLY | O_BINARY);
+  if (fd < 0) {
+    return false;
+  }
+  void* p = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED || p == NULL) {
+    carp(CARP_DEBUG, "Could not map %s", blob_file.c_str());
+    return false;
+  }
+  mapped_ = p;
+  mapped_size_ = size;
+  if (!Attach((const char*)p, size, source)) {
+    carp(CARP_WARNING, "Ignoring stale or invalid protein blob %s; reading "
+         "the protein records instead", blob_file.c_str());
+    Clear();
+    return false;
+  }
+  return true;
+}
+
+void ProteinBlob::Build(const vector<const pb::Protein*>& proteins,
+                        const FileStamp& source) {
+  Clear();
+  Serialize(proteins, source, &storage_);
+  bool attached = Attach(&storage_[0], storage_.size(), source);
+  CHECK(attached);
+}
+
+bool ProteinBlob::Write(const string& proteins_file,
+                        const vector<const pb::Protein*>& proteins) {
+  FileStamp source;
+  if (!source.Read(proteins_file)) {
+    return false;
+  }
+  vector<char> blob;
+  Serialize(proteins, source, &blob);
+  ofstream out(BlobFilename(proteins_file).c_str(),
+               ios::out | ios::binary | ios::trunc);
+  out.write(&blob[0], blob.size());
+  return out.good();
+}
+
+bool ProteinBlob::Save(const string& proteins_file) const {
+  FileStamp source;
+  if (header_ == NULL || !source.Read(proteins_file)) {
+    return false;
+  }
+  Header header = *header_;
+  header.source = source;
+  ofstream out(BlobFilename(proteins_file).c_str(),
+               ios::out | ios::binary | ios::trunc);
+  out.write((const char*)&header, sizeof(header));
+  out.write((const char*)entries_, header.num_proteins * sizeof(Entry));
+  out.write(data_, header.data_size);
+  return out.good();
+}
+
+void ProteinBlob::Serialize(const vector<const pb::Protein*>& proteins,
+                            const FileStamp& source, vector<char>* out) {
+  // Proteins are looked up by id, so entries are placed at their id rather
+  // than at their position in the records file.
+  uint32_t num_proteins = 0;
+  uint64_t data_size = 0;
+  for (vector<const pb::Protein*>::const_iterator i = proteins.begin();
+       i != proteins.end();
+       ++i) {
+    CHECK((*i)->id() >= 0);
+    num_proteins = max(num_proteins, (uint32_t)(*i)->id() + 1);
+    data_size += (*i)->name().length() + (*i)->residues().length() + 2;
+  }
+
+  out->assign(sizeof(Header) + num_proteins * sizeof(Entry) + data_size, 0);
+  Header* header = (Header*)&(*out)[0];
+  memcpy(header->magic, kMagic, sizeof(kMagic));
+  header->version = kVersion;
+  header->num_proteins = num_proteins;
+  header->source = source;
+  header->data_size = data_size;
+
+  Entry* entries = (Entry*)(header + 1);
+  for (uint32_t i = 0; i < num_proteins; ++i) {
+    entries[i].target_pos = -1;
+    entries[i].id = i;
+  }
+  char* data = (char*)(entries + num_proteins);
+  uint64_t offset = 0;
+  for (vector<const pb::Protein*>::const_iterator i = proteins.begin();
+       i != proteins.end();
+       ++i) {
+    const pb::Protein& protein = **i;
+    Entry& entry = entries[protein.id()];
+    entry.name_offset = offset;
+    entry.name_length = protein.name().length();
+    memcpy(data + offset, protein.name().data(), entry.name_length);
+    offset += entry.name_length + 1;
+    entry.residues_offset = offset;
+    entry.residues_length = protein.residues().length();
+    memcpy(data + offset, protein.residues().data(), entry.residues_length);
+    offset += entry.residues_length + 1;
+    entry.target_pos = protein.has_target_pos() ? protein.target_pos() : -1;
+  }
+}
+
+bool ProteinBlob::Attach(const char* blob, uint64_t size,
+                         const FileStamp& source) {
+  if (size < sizeof(Header)) {
+    return false;
+  }
+  const Header* header = (const Header*)blob;
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header->version != kVersion ||
+      !(header->source == source) ||
+      size != sizeof(Header) + header->num_proteins * sizeof(Entry) +
+              header->data_size) {
+    return false;
+  }
+  header_ = header;
+  entries_ = (const Entry*)(header + 1);
+  data_ = (const char*)(entries_ + header->num_proteins);
+  return true;
+}
@@ -0,0 +1,130 @@
+// ProteinBlob holds the proteins of a Tide index as one flat, read-only
+// block of memory instead of one heap-allocated pb::Protein per protein.
+//
+// Layout of the blob (native byte order; it is a cache of protix, which
+// remains the canonical record of the proteins):
+//
+//   Header   magic, version, number of proteins, stamp (size and checksum)
+//            of the protix file the blob was made from, size of the
+//            character data
+//   Entry[n] one fixed-size entry per protein, indexed by protein id, giving
+//            the offsets and lengths of its name and residues and its
+//            target_pos (-1 if absent)
+//   char[]   all names and residues, each followed by a '\0'
+//
+// tide-index writes the blob next to protix as protix.blob. At search time
+// the blob is mapped read-only and shared, so every search thread, and every
+// tide-search process running on the same index, reads the same physical
+// pages; no protocol buffer parsing is needed at startup. Indexes without a
+// current blob are handled by reading protix and building the blob in
+// memory.
+//
+// Example usage:
+// ProteinBlob proteins;
+// if (!proteins.Load(FileUtils::Join(index, "protix"))) { ... }
+// ProteinBlob::Protein protein = proteins[peptide->FirstLocProteinId()];
+// const char* residues = protein.residues();
+
+#ifndef PROTEIN_BLOB_H
+#define PROTEIN_BLOB_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "raw_proteins.pb.h"
+#include "file_stamp.h"
+
+class ProteinBlob {
+ private:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_proteins;
+    FileStamp source;
+    uint64_t data_size;
+  };
+
+  struct Entry {
+    uint64_t name_offset;
+    uint64_t residues_offset;
+    uint32_t name_length;
+    uint32_t residues_length;
+    int32_t target_pos;
+    int32_t id;
+  };
+
+ public:
+  // A view of one protein in the blob. Views are cheap to copy and remain
+  // valid for as long as the ProteinBlob they came from.
+  class Protein {
+   public:
+    const char* name() const { return data_ + entry_->name_offset; }
+    int name_length() const { return entry_->name_length; }
+    const char* residues() const { return data_ + entry_->residues_offset; }
+    int residues_length() const { return entry_->residues_length; }
+    int id() const { return entry_->id; }
+    bool has_target_pos() const { return entry_->target_pos >= 0; }
+    int target_pos() const { return entry_->target_pos; }
+
+   private:
+    friend class ProteinBlob;
+    Protein(const Entry* entry, const char* data)
+      : entry_(entry), data_(data) {}
+
+    const Entry* entry_;
+    const char* data_;
+  };
+
+  ProteinBlob();
+  ~ProteinBlob();
+
+  // Makes the proteins of protix available: maps protix.blob if it exists and
+  // was made from this protix, otherwise reads protix and builds the blob in
+  // memory. Returns false if neither could be read.
+  bool Load(const std::string& proteins_file);
+
+  // Maps an existing blob file read-only. Returns false if the file is
+  // missing, malformed, or was not made from the protix file stamped source.
+  bool Map(const std::string& blob_file, const FileStamp& source);
+
+  // Builds the blob in memory from protein records.
+  void Build(const std::vector<const pb::Protein*>& proteins,
+             const FileStamp& source);
+
+  // Writes the blob for proteins_file (a protix file) to
+  // BlobFilename(proteins_file).
+  static bool Write(const std::string& proteins_file,
+                    const std::vector<const pb::Protein*>& proteins);
+
+  // Writes the loaded blob to BlobFilename(proteins_file), where
+  // proteins_file is a copy of the protix file it was loaded for.
+  bool Save(const std::string& proteins_file) const;
+
+  static std::string BlobFilename(const std::string& proteins_file) {
+    return proteins_file + ".blob";
+  }
+
+  int Size() const { return header_ ? header_->num_proteins : 0; }
+
+  Protein operator[](int id) const { return Protein(entries_ + id, data_); }
+
+ private:
+  static void Serialize(const std::vector<const pb::Protein*>& proteins,
+                        const FileStamp& source, std::vector<char>* out);
+  bool Attach(const char* blob, uint64_t size, const FileStamp& source);
+  void Clear();
+
+  const Header* header_;
+  const Entry* entries_;
+  const char* data_;
+
+  std::vector<char> storage_;  // backing memory when built, not mapped
+  void* mapped_;
+  size_t mapped_size_;
+
+  // Not copyable; views point into this object's memory.
+  ProteinBlob(const ProteinBlob&);
+  ProteinBlob& operator=(const ProteinBlob&);
+};
+
+#endif // PROTEIN_BLOB_H
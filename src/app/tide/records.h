@@ -59,6 +59,7 @@
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/io/coded_stream.h>
 #include "header.pb.h"
+#include "peptide_codec.h"
 #include "io/carp.h"
 
 using namespace std;
@@ -68,10 +69,16 @@ using namespace std;
 #endif
 #define MAGIC_NUMBER  0xfead1234ul
 
+#ifdef _MSC_VER
+#define RECORDS_LSEEK _lseeki64
+#else
+#define RECORDS_LSEEK lseek
+#endif
+
 class RecordWriter {
  public:
   explicit RecordWriter(const string& filename, int buf_size = -1)
-    : raw_output_(NULL), coded_output_(NULL) {
+    : raw_output_(NULL), coded_output_(NULL), position_(0), codec_(NULL) {
     if ((fd_ = open(filename.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
       carp(CARP_FATAL, "Couldn't open file %s for write (errno %d: %s).",
 	   filename.c_str(), errno, strerror(errno));
@@ -82,7 +89,7 @@ class RecordWriter {
   }
   
   explicit RecordWriter(google::protobuf::io::ZeroCopyOutputStream* raw_output)
-    : fd_(-1), raw_output_(raw_output) {
+    : fd_(-1), raw_output_(raw_output), position_(0), codec_(NULL) {
     Init();
     raw_output_ = NULL; // we do not own (and will not delete) raw_output
   }
@@ -93,22 +100,57 @@ class RecordWriter {
     delete raw_output_;
     if (fd_ > -1)
       close(fd_);
+    delete codec_;
   }
 
   // client should check once after construction
   bool OK() const { return NULL != coded_output_; }
 
+  // Encodes the pb::Peptide messages written from now on with codec, which
+  // the writer takes over.
+  void SetCodec(PeptideCodec* codec) {
+    delete codec_;
+    codec_ = codec;
+  }
+
   bool Write(const google::protobuf::Message* message) {
-    coded_output_->WriteVarint32(message->ByteSize());
+    if (codec_ != NULL) {
+      const pb::Peptide* peptide = dynamic_cast<const pb::Peptide*>(message);
+      if (peptide == NULL)
+        return false;
+      codec_->Encode(*peptide, position_, &encoded_);
+      return WriteRaw(encoded_);
+    }
+    int size = message->ByteSize();
+    coded_output_->WriteVarint32(size);
     if (coded_output_->HadError()) {
       delete coded_output_;
       coded_output_ = NULL;
       return false;
     }
     message->SerializeWithCachedSizes(coded_output_);
+    position_ += google::protobuf::io::CodedOutputStream::VarintSize32(size) + size;
     return !coded_output_->HadError();
   }
 
+  // Writes a record already serialized, e.g. by RecordReader::ReadRaw(), as
+  // is.
+  bool WriteRaw(const string& bytes) {
+    coded_output_->WriteVarint32(bytes.size());
+    if (coded_output_->HadError()) {
+      delete coded_output_;
+      coded_output_ = NULL;
+      return false;
+    }
+    coded_output_->WriteString(bytes);
+    position_ += google::protobuf::io::CodedOutputStream::VarintSize32(bytes.size()) +
+                 bytes.size();
+    return !coded_output_->HadError();
+  }
+
+  // Offset in the file at which the next record will be written.
+  google::protobuf::uint64 Position() const { return position_; }
+
  private:
   void Init() {
     coded_output_ = new google::protobuf::io::CodedOutputStream(raw_output_);
@@ -117,18 +159,23 @@ class RecordWriter {
       delete coded_output_;
       coded_output_ = NULL;
     }
+    position_ = sizeof(google::protobuf::uint32);
   }
 
   int fd_;
   google::protobuf::io::ZeroCopyOutputStream* raw_output_;
   google::protobuf::io::CodedOutputStream* coded_output_;
+  google::protobuf::uint64 position_;
+  PeptideCodec* codec_;
+  string encoded_;
 };
 
 
 class RecordReader {
  public:
   explicit RecordReader(const string& filename, int buf_size = -1)
-    : raw_input_(NULL), coded_input_(NULL), size_(UINT32_MAX), valid_(false) {
+    : raw_input_(NULL), coded_input_(NULL), size_(UINT32_MAX), valid_(false),
+      buf_size_(buf_size), position_(0), skipped_bytes_(0), codec_(NULL) {
     fd_ = open(filename.c_str(), O_RDONLY);
     if (fd_ < 0)
       return;
@@ -138,6 +185,7 @@ class RecordReader {
     if (coded_input.ReadLittleEndian32(&magic_number) 
         && magic_number == MAGIC_NUMBER)
       valid_ = true;
+    position_ = sizeof(magic_number);
   }
 
   ~RecordReader() {
@@ -146,16 +194,29 @@ class RecordReader {
     delete raw_input_;
     if (fd_ >= 0)
       close(fd_);
+    delete codec_;
   }
 
   bool OK() const { return valid_; }
 
+  // Decodes the pb::Peptide messages read from now on with codec, which the
+  // reader takes over.
+  void SetCodec(PeptideCodec* codec) {
+    delete codec_;
+    codec_ = codec;
+  }
+
+  // The codec of the records, if they are encoded peptides; clients that
+  // read them with ReadRaw() decode them with it. NULL otherwise.
+  PeptideCodec* Codec() const { return codec_; }
+
   bool Done() {
     if (!valid_)
       return true;
     coded_input_ = new google::protobuf::io::CodedInputStream(raw_input_);
     if (!coded_input_->ReadVarint32(&size_))
       return valid_ = false;
+    position_ += google::protobuf::io::CodedOutputStream::VarintSize32(size_);
     return (size_ == 0);
     // TODO 260: there should be an easy way to tell if we're at the end
     // of the file, but I can't seem to find a reliable way to do that
@@ -163,6 +224,14 @@ class RecordReader {
   }
 
   bool Read(google::protobuf::Message* message) {
+    if (codec_ != NULL) {
+      pb::Peptide* peptide = dynamic_cast<pb::Peptide*>(message);
+      double mass;
+      if (peptide == NULL || !ReadRaw(&encoded_) || !codec_->Next(encoded_, &mass) ||
+          !codec_->Decode(encoded_, peptide))
+        return valid_ = false;
+      return true;
+    }
     if (!valid_)
       return false;
     assert(size_ != UINT32_MAX);
@@ -176,16 +245,64 @@ class RecordReader {
     coded_input_->PopLimit(limit); // for completeness; perhaps remove
     delete coded_input_;
     coded_input_ = NULL;
+    position_ += size_;
     size_ = UINT32_MAX;
     return true;
   }
 
+  // Reads the serialized bytes of a record without parsing them. Useful for
+  // copying records unchanged.
+  bool ReadRaw(string* bytes) {
+    if (!valid_)
+      return false;
+    assert(size_ != UINT32_MAX);
+    if (!coded_input_->ReadString(bytes, size_))
+      return valid_ = false;
+    delete coded_input_;
+    coded_input_ = NULL;
+    position_ += size_;
+    size_ = UINT32_MAX;
+    return true;
+  }
+
+  // Offset in the file of the next record to be read.
+  google::protobuf::uint64 Position() const { return position_; }
+
+  // Number of bytes read so far, not counting those skipped by Seek().
+  google::protobuf::uint64 BytesRead() const { return position_ - skipped_bytes_; }
+
+  // Continues reading from offset, which must be the start of a record, e.g.
+  // one given by RecordWriter::Position() when the file was written. For
+  // encoded peptides it must be an offset in the file's MassDirectory.
+  bool Seek(google::protobuf::uint64 offset) {
+    if (!valid_)
+      return false;
+    delete coded_input_;
+    coded_input_ = NULL;
+    delete raw_input_;
+    raw_input_ = NULL;
+    size_ = UINT32_MAX;
+    if (RECORDS_LSEEK(fd_, offset, SEEK_SET) < 0)
+      return valid_ = false;
+    raw_input_ = new google::protobuf::io::FileInputStream(fd_, buf_size_);
+    skipped_bytes_ += offset - position_;  // wraps when seeking back
+    position_ = offset;
+    if (codec_ != NULL)
+      codec_->Seeked();
+    return true;
+  }
+
  private:
   int fd_;
   google::protobuf::io::ZeroCopyInputStream* raw_input_;
   google::protobuf::io::CodedInputStream* coded_input_;
   google::protobuf::uint32 size_;
   bool valid_;
+  int buf_size_;
+  google::protobuf::uint64 position_;
+  google::protobuf::uint64 skipped_bytes_;
+  PeptideCodec* codec_;
+  string encoded_;
 };
 
 class HeadedRecordWriter {
@@ -195,13 +312,13 @@ class HeadedRecordWriter {
     : writer_(filename, buf_size) {
     if (!writer_.OK())
       carp(CARP_FATAL, "Cannot create the file %s\n", filename.c_str());
-    Write(&header);
+    WriteHeader(header);
   }
 
   HeadedRecordWriter(google::protobuf::io::ZeroCopyOutputStream* raw_output,
                      const pb::Header& header) 
     : writer_(raw_output) {
-    Write(&header);
+    WriteHeader(header);
   }
 
   RecordWriter* Writer() { return &writer_; }
@@ -213,7 +330,17 @@ class HeadedRecordWriter {
     return writer_.Write(message);
   }
 
+  bool WriteRaw(const string& bytes) { return writer_.WriteRaw(bytes); }
+  google::protobuf::uint64 Position() const { return writer_.Position(); }
+
  private:
+  // Peptides of files whose header says so are encoded (see peptide_codec.h).
+  void WriteHeader(const pb::Header& header) {
+    Write(&header);
+    if (PeptideCodec::Encoded(header))
+      writer_.SetCodec(new PeptideCodec);
+  }
+
   RecordWriter writer_;
 };
 
@@ -227,6 +354,8 @@ class HeadedRecordReader {
       header_ = new pb::Header;
     if (!Done())
       Read(header_);
+    if (PeptideCodec::Encoded(*header_))
+      reader_.SetCodec(new PeptideCodec);
   }
   ~HeadedRecordReader() { if (del_header_) delete header_; }
 
@@ -237,6 +366,7 @@ class HeadedRecordReader {
   bool Read(google::protobuf::Message* message) { 
     return reader_.Read(message);
   }
+  bool ReadRaw(string* bytes) { return reader_.ReadRaw(bytes); }
   const pb::Header* GetHeader() const { return header_; }
 
  private:
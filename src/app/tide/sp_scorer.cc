@@ -3,11 +3,11 @@
 // This file contains implementations for classes defined in sp_scorer.h.
 // Please see the header file for details.
 
-#include <list>
+#include <algorithm>
 #include "sp_scorer.h"
 #include "peptide.h"
 
-SpScorer::SpScorer(const ProteinVec& proteins, const Spectrum& spectrum,
+SpScorer::SpScorer(const ProteinBlob& proteins, const Spectrum& spectrum,
                    int charge, double max_mz)
   : proteins_(proteins), spectrum_(spectrum), charge_(charge), max_mz_(max_mz),
   sp_spectrum_(spectrum, charge, max_mz) {
@@ -37,11 +37,17 @@ bool SpScorer::IonLookup(double mass, int charge, bool previous_ion_matched,
 
 void SpScorer::Score(const pb::Peptide& pb_peptide, SpScoreData& sp_score_data) {
   Peptide peptide(pb_peptide, proteins_);
-  vector<double> m_z(peptide.Len());
-  string sequence = peptide.Seq();
+  Score(peptide, sp_score_data);
+}
+
+void SpScorer::Score(const Peptide& peptide, SpScoreData& sp_score_data) {
+  const int length = peptide.Len();
+  const char* sequence = peptide.Residues();
+  vector<double>& m_z = m_z_;
+  m_z.resize(length);
 
   // Collect m/z values for each residue
-  for (int i = 0; i < sequence.length(); i++)
+  for (int i = 0; i < length; i++)
     m_z[i] = MassConstants::mono_table[sequence[i]];
 
   // Account for modifications
@@ -63,9 +69,9 @@ void SpScorer::Score(const pb::Peptide& pb_peptide, SpScoreData& sp_score_data)
     double b_ion = MASS_PROTON;
     double y_ion = peptide.Mass() + MASS_PROTON;
 
-    for (int i = 0; i < sequence.length(); i++) {
+    for (int i = 0; i < length; i++) {
       // Calculate and look up b-ions
-      if (i < sequence.length()-1) {
+      if (i < length-1) {
         b_ion += m_z[i];
         previous_b_ion_matched = IonLookup(b_ion, ion_charge,
                                            previous_b_ion_matched,
@@ -94,18 +100,21 @@ void SpScorer::RankSpScores(vector<SpScoreData>& scores,
     *smallest_score = 0.0;
   }
 
-  // We use this list to sort the matches according to sp score, then
-  // use the match id to assign the rankings to the sp scores passed in
-  list<SpScoreMatchPair> sp_score_match_list;
+  // We sort these pairs according to sp score, then use the match id to
+  // assign the rankings to the sp scores passed in. The sort is stable so
+  // that tied scores keep the order of the matches.
+  vector<SpScoreMatchPair> sp_score_match_list;
+  sp_score_match_list.reserve(scores.size());
   for (int match = 0; match < scores.size(); match++) {
     sp_score_match_list.push_back(make_pair(scores[match].sp_score, match));
     if (scores[match].sp_score < *smallest_score)
       *smallest_score = scores[match].sp_score;
   }
-  sp_score_match_list.sort(CompareBySpScore);
+  stable_sort(sp_score_match_list.begin(), sp_score_match_list.end(),
+              CompareBySpScore);
 
   // Assign rankings to the sp scores passed in
-  list<SpScoreMatchPair>::iterator i;
+  vector<SpScoreMatchPair>::iterator i;
   int rank_count = 0;
   for (i=sp_score_match_list.begin(); i != sp_score_match_list.end(); ++i) {
     scores[i->second].sp_rank = ++rank_count;
@@ -114,7 +123,7 @@ void SpScorer::RankSpScores(vector<SpScoreData>& scores,
   if (smallest_score) {
     if (sp_score_match_list.size() > 0) {
       // After we go through the loop that assigns the rankings, i is at
-      // list.end(). If we iterate back one, we'll have the lowest sp score.
+      // the end. If we iterate back one, we'll have the lowest sp score.
       *smallest_score = scores[(--i)->second].sp_score;
     } else {
       *smallest_score = 0.0;
@@ -41,6 +41,9 @@
 typedef vector<const pb::Protein*> ProteinVec;
 typedef vector<const pb::AuxLocation*> AuxLocVec;
 
+class ProteinBlob;
+class Peptide;
+
 
 class SpScorer {
  public:
@@ -70,10 +73,12 @@ class SpScorer {
     }
   };
   
-  SpScorer(const ProteinVec& proteins, const Spectrum& spectrum, 
+  SpScorer(const ProteinBlob& proteins, const Spectrum& spectrum, 
            int charge, double max_mz);
 
   void Score(const pb::Peptide& pb_peptide, SpScoreData& sp_score_data);
+  // Scores a peptide already decoded, e.g. one in an ActivePeptideQueue.
+  void Score(const Peptide& peptide, SpScoreData& sp_score_data);
   void RankSpScores(vector<SpScoreData>& scores, 
                     double* smallest_score = NULL);
   double TotalIonIntensity() {return sp_spectrum_.TotalIonIntensity();}
@@ -81,11 +86,9 @@ class SpScorer {
  private:
   typedef pair<double, int> SpScoreMatchPair;
   
-  static bool CompareBySpScore(SpScoreMatchPair sp_score_1, 
-                               SpScoreMatchPair sp_score_2) {
-    if (sp_score_1.first > sp_score_2.first)
-      return true;
-    return false;
+  static bool CompareBySpScore(const SpScoreMatchPair& sp_score_1,
+                               const SpScoreMatchPair& sp_score_2) {
+    return sp_score_1.first > sp_score_2.first;
   }
 
   int GetBin(double mass, int charge) {
@@ -97,11 +100,14 @@ class SpScorer {
                  SpScoreData& sp_score_data);
 
   
-  const ProteinVec& proteins_;
+  const ProteinBlob& proteins_;
   const Spectrum& spectrum_;
   SpSpectrum sp_spectrum_;
   int charge_;
   double max_mz_;
+
+  // Workspace for Score(): residue masses of the peptide being scored
+  vector<double> m_z_;
 };
 
 #endif // SP_SCORER_H
@@ -0,0 +1,70 @@
+// This file contains implementations for classes defined in spectrum_batch.h.
+// Please see the header file for details.
+
+#include <string.h>
+#include "max_mz.h"
+#include "theoretical_peak_pair.h"
+#include "spectrum_batch.h"
+
+using namespace std;
+
+#define CHECK(x) GOOGLE_CHECK((x))
+
+SpectrumBatch::SpectrumBatch(int capacity)
+  : capacity_(capacity), size_(0),
+    cache_size_(MaxBin::Global().CacheBinEnd() * NUM_PEAK_TYPES) {
+  CHECK(capacity_ > 0 && capacity_ <= kMaxSize);
+  // Unused lanes are summed along with the others, so they must hold numbers.
+  caches_ = new int[cache_size_ * kMaxSize];
+  memset(caches_, 0, sizeof(int) * cache_size_ * kMaxSize);
+}
+
+SpectrumBatch::~SpectrumBatch() {
+  delete[] caches_;
+}
+
+void SpectrumBatch::Add(const ObservedPeakSet& observed, int charge) {
+  CHECK(size_ < capacity_);
+  const int* cache = observed.GetCache();
+  int* lane = caches_ + size_;
+  for (int code = 0; code < cache_size_; ++code) {
+    lane[code * kMaxSize] = cache[code];
+  }
+  charges_[size_++] = charge;
+}
+
+void SpectrumBatch::Score(deque<Peptide*>::const_iterator begin,
+                          deque<Peptide*>::const_iterator end,
+                          vector<int>* scores) const {
+  scores->resize((end - begin) * size_);
+  int* result = scores->empty() ? NULL : &(*scores)[0];
+  for (deque<Peptide*>::const_iterator i = begin; i != end; ++i) {
+    const Peptide* peptide = *i;
+    const int* codes = peptide->PeakCodes();
+    int num_codes1 = peptide->NumPeakCodes(1);
+    int num_codes2 = peptide->NumPeakCodes(3);
+    // Every lane is summed, so that the inner loops have a fixed length and
+    // can be vectorized.
+    int sum1[kMaxSize], sum2[kMaxSize];
+    for (int b = 0; b < kMaxSize; ++b) {
+      sum1[b] = sum2[b] = 0;
+    }
+    for (int j = 0; j < num_codes1; ++j) {
+      const int* entry = caches_ + codes[j] * kMaxSize;
+      for (int b = 0; b < kMaxSize; ++b) {
+        sum1[b] += entry[b];
+      }
+    }
+    for (int j = num_codes1; j < num_codes2; ++j) {
+      const int* entry = caches_ + codes[j] * kMaxSize;
+      for (int b = 0; b < kMaxSize; ++b) {
+        sum2[b] += entry[b];
+      }
+    }
+    // Peptide::Prog() adds the peaks of charge 2 ions for charge 3 and up.
+    for (int b = 0; b < size_; ++b) {
+      result[b] = charges_[b] <= 2 ? sum1[b] : sum1[b] + sum2[b];
+    }
+    result += size_;
+  }
+}
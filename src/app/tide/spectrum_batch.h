@@ -0,0 +1,62 @@
+// A SpectrumBatch scores several preprocessed spectra against the same run of
+// active peptides in one pass over the peptides.
+//
+// Each peptide is normally scored by its compiled program (see compiler.h),
+// one spectrum at a time, so that a window of peptides shared by consecutive
+// spectra is streamed from memory once per spectrum. A SpectrumBatch instead
+// holds the caches of up to kMaxSize spectra interleaved, code by code, and
+// walks the peak codes of each peptide (see Peptide::KeepPeakCodes()) once,
+// adding into one sum per spectrum. The scores are those the programs would
+// give.
+//
+// Usage:
+// SpectrumBatch batch(size);
+// observed.PreprocessSpectrum(spectrum, charge, ...);
+// batch.Add(observed, charge);
+// ... // until batch.Full()
+// batch.Score(queue->iter_, queue->end_, &scores);
+// batch.Clear();
+
+#ifndef SPECTRUM_BATCH_H
+#define SPECTRUM_BATCH_H
+
+#include <deque>
+#include <vector>
+#include "peptide.h"
+#include "spectrum_preprocess.h"
+
+class SpectrumBatch {
+ public:
+  static const int kMaxSize = 8;
+
+  // Holds up to capacity spectra; capacity must be at most kMaxSize.
+  explicit SpectrumBatch(int capacity);
+
+  ~SpectrumBatch();
+
+  int Size() const { return size_; }
+  bool Full() const { return size_ == capacity_; }
+  void Clear() { size_ = 0; }
+
+  // Copies the cache of observed, as last preprocessed for a spectrum of the
+  // given charge.
+  void Add(const ObservedPeakSet& observed, int charge);
+
+  // Scores the peptides in [begin, end), whose peak codes must have been
+  // kept, against each spectrum added since Clear(). The score of the i-th
+  // peptide against the b-th spectrum goes to (*scores)[i * Size() + b].
+  void Score(std::deque<Peptide*>::const_iterator begin,
+             std::deque<Peptide*>::const_iterator end,
+             std::vector<int>* scores) const;
+
+ private:
+  int capacity_;
+  int size_;
+  int cache_size_;
+
+  // Entry code * kMaxSize + b is entry code of the cache of the b-th spectrum.
+  int* caches_;
+  int charges_[kMaxSize];
+};
+
+#endif // SPECTRUM_BATCH_H
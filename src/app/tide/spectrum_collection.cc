@@ -7,6 +7,12 @@
 #include <iostream>
 #include <algorithm>
 #include <functional>
+#include <fstream>
+#include <string.h>
+#define NO_BOOST_DATE_TIME_INLINE
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
 #include "spectrum.pb.h"
 #include "spectrum_collection.h"
 #include "mass_constants.h"
@@ -18,6 +24,9 @@
 
 using namespace std;
 using google::protobuf::uint64;
+using google::protobuf::int64;
+using google::protobuf::uint32;
+using google::protobuf::uint8;
 
 #define CHECK(x) GOOGLE_CHECK((x))
 
@@ -42,6 +51,7 @@ Spectrum::Spectrum(const pb::Spectrum& spec) {
     peak_m_z_.push_back(total / m_z_denom);
     peak_intensity_.push_back(spec.peak_intensity(i) / intensity_denom);
   }
+  UseOwnPeaks();
 }
 
 // A spectrum can have multiple precursor charges assigned.  This
@@ -56,9 +66,9 @@ double Spectrum::MaxPeakInRange( double min_range, double max_range ) const {
   double return_value = 0.0;
 
   for (int i = 0; i < this->Size(); ++i) {
-    double mz = peak_m_z_[i];
+    double mz = m_z_[i];
     if ( (min_range <= mz) && (mz <= max_range) ) {
-      double intensity = peak_intensity_[i];
+      double intensity = intensity_[i];
       if (intensity > return_value) {
         return_value = intensity;
       }
@@ -72,23 +82,23 @@ static inline bool IsInt(double x) {
   return fabs(x - uint64(x+0.5)) < 0.001;
 }
 
-static inline bool CheckDenom(const vector<double>& vals, int denom) {
+static inline bool CheckDenom(const double* vals, int size, int denom) {
   // See whether all vals can be accommodated by denom when rendered as a
   // fraction.
   double d_denom = denom;
-  for (int i = 0; i < vals.size(); ++ i) {
+  for (int i = 0; i < size; ++ i) {
     if (!IsInt(vals[i] * d_denom))
       return false;
   }
   return true;
 }
 
-static inline int GetDenom(const vector<double>& vals) {
+static inline int GetDenom(const double* vals, int size) {
   // See how much precision is given in the vals array. Not especially fast,
   // but fast enough. Used only for converting spectrum input format.
   const int kMaxPrecision = 10000; // store at most 3 digits of precision
   for (int precision = 1; precision < kMaxPrecision; precision *= 10)
-    if (CheckDenom(vals, precision))
+    if (CheckDenom(vals, size, precision))
       return precision;
   return kMaxPrecision;
 }
@@ -101,36 +111,34 @@ void Spectrum::FillPB(pb::Spectrum* spec) {
   spec->set_rtime(rtime_);
   for (int i = 0; i < NumChargeStates(); ++i)
     spec->add_charge_state(ChargeState(i));
-  int size = peak_m_z_.size();
-  CHECK(size == peak_intensity_.size());
-  int m_z_denom = GetDenom(peak_m_z_);
-  int intensity_denom = GetDenom(peak_intensity_);
+  int size = Size();
+  int m_z_denom = GetDenom(m_z_, size);
+  int intensity_denom = GetDenom(intensity_, size);
   spec->set_peak_m_z_denominator(m_z_denom);
   spec->set_peak_intensity_denominator(intensity_denom);
   uint64 last = 0;
   for (int i = 0; i < size; ++i) {
-    uint64 val = uint64(peak_m_z_[i]*m_z_denom + 0.5);
+    uint64 val = uint64(m_z_[i]*m_z_denom + 0.5);
     CHECK(val > last);
     spec->add_peak_m_z(val - last);
     last = val;
-    spec->add_peak_intensity(uint64(peak_intensity_[i]*intensity_denom + 0.5));
+    spec->add_peak_intensity(uint64(intensity_[i]*intensity_denom + 0.5));
   }
 }
 
 void Spectrum::SortIfNecessary() {
-  if (adjacent_find(peak_m_z_.begin(), peak_m_z_.end(), greater<double>())
-      == peak_m_z_.end())
+  int size = Size();
+  if (adjacent_find(m_z_, m_z_ + size, greater<double>()) == m_z_ + size)
     return;
 
   // TODO: eliminate copy operations
-  int size = Size();
-  vector< pair<double, double> > pairs;
+  vector< pair<double, double> > pairs(size);
   for (int i = 0; i < size; ++i)
-    pairs[i] = make_pair(peak_m_z_[i], peak_intensity_[i]);
+    pairs[i] = make_pair(m_z_[i], intensity_[i]);
   sort(pairs.begin(), pairs.begin() + size);
   for (int i = 0; i < size; ++i) {
-    peak_m_z_[i] = pairs[i].first;
-    peak_intensity_[i] = pairs[i].second;
+    m_z_[i] = pairs[i].first;
+    intensity_[i] = pairs[i].second;
   }
 }
 
@@ -444,20 +452,261 @@ void SpectrumCollection::ReadMS(istream& in, bool ms1) {
     spectra_.push_back(spectrum);
 }
 
+namespace {
+
+// The fields of a serialized pb::Spectrum. Repeated fields are given by the
+// bytes of their packed values.
+struct SpectrumRecord {
+  const uint8* m_z;
+  const uint8* m_z_end;
+  const uint8* intensity;
+  const uint8* intensity_end;
+  const uint8* charge;
+  const uint8* charge_end;
+  int m_z_denom;
+  int intensity_denom;
+  int spectrum_number;
+  double precursor_m_z;
+  double rtime;
+};
+
+inline bool ReadVarint(const uint8** p, const uint8* end, uint64* value) {
+  uint64 result = 0;
+  for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+    uint8 byte = *(*p)++;
+    result |= uint64(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+inline bool ReadDouble(const uint8** p, const uint8* end, double* value) {
+  if (end - *p < 8)
+    return false;
+  uint64 bits = 0;
+  for (int i = 7; i >= 0; --i)
+    bits = (bits << 8) | (*p)[i]; // little-endian on the wire
+  memcpy(value, &bits, sizeof(bits));
+  *p += 8;
+  return true;
+}
+
+// Number of varints in the packed bytes [p, end).
+inline int CountVarints(const uint8* p, const uint8* end) {
+  int count = 0;
+  for (; p < end; ++p) {
+    if (!(*p & 0x80))
+      ++count;
+  }
+  return count;
+}
+
+// Finds the fields of the record [p, end), if it is laid out the way
+// Spectrum::FillPB() and SpectrumRecordWriter write it: known fields of the
+// expected wire types, with the repeated ones packed, once each. Anything
+// else is left to the protobuf parser.
+bool ScanSpectrumRecord(const uint8* p, const uint8* end, SpectrumRecord* record) {
+  memset(record, 0, sizeof(*record));
+  while (p < end) {
+    uint64 tag, value;
+    if (!ReadVarint(&p, end, &tag))
+      return false;
+    int field = tag >> 3;
+    int wire_type = tag & 7;
+    switch (field) {
+    case 1: case 2: case 7: {
+      if (wire_type != 2 || !ReadVarint(&p, end, &value) || value > uint64(end - p))
+        return false;
+      const uint8** begin = field == 1 ? &record->m_z :
+                            field == 2 ? &record->intensity : &record->charge;
+      const uint8** stop = field == 1 ? &record->m_z_end :
+                           field == 2 ? &record->intensity_end : &record->charge_end;
+      if (*begin != NULL || (value > 0 && (p[value - 1] & 0x80)))
+        return false;
+      *begin = p;
+      *stop = p + value;
+      p += value;
+      break;
+    }
+    case 3: case 4: case 5:
+      if (wire_type != 0 || !ReadVarint(&p, end, &value))
+        return false;
+      (field == 3 ? record->m_z_denom :
+       field == 4 ? record->intensity_denom : record->spectrum_number) = int(value);
+      break;
+    case 6: case 8:
+      if (wire_type != 1 ||
+          !ReadDouble(&p, end, field == 6 ? &record->precursor_m_z : &record->rtime))
+        return false;
+      break;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+// The spectrum records of a file being read, and what is known of them.
+struct SpectrumRecords {
+  vector<pair<const uint8*, int> > spans; // bytes of each record
+  vector<SpectrumRecord> fields;
+  // -1 for records that ScanSpectrumRecord() leaves to the protobuf parser
+  vector<int> num_peaks;
+  // The peaks of record i go to m_z + offsets[i] and intensity + offsets[i].
+  vector<int64> offsets;
+  double* m_z;
+  double* intensity;
+  Spectrum** spectra;
+  vector<char> ok; // cleared for records that cannot be parsed
+};
+
+// Finds the fields of records [first, last) and counts their peaks.
+void ScanSpectrumRecords(SpectrumRecords* records, size_t first, size_t last) {
+  for (size_t i = first; i < last; ++i) {
+    const uint8* p = records->spans[i].first;
+    SpectrumRecord* record = &records->fields[i];
+    records->num_peaks[i] = -1;
+    if (ScanSpectrumRecord(p, p + records->spans[i].second, record)) {
+      int size = CountVarints(record->m_z, record->m_z_end);
+      // Mismatched arrays are reported by the protobuf path.
+      if (size == CountVarints(record->intensity, record->intensity_end))
+        records->num_peaks[i] = size;
+    }
+  }
+}
+
+// Decodes records [first, last) into spectra.
+void DecodeSpectrumRecords(SpectrumRecords* records, size_t first, size_t last) {
+  for (size_t i = first; i < last; ++i) {
+    if (records->num_peaks[i] < 0) {
+      pb::Spectrum pb_spectrum;
+      if (!pb_spectrum.ParseFromArray(records->spans[i].first, records->spans[i].second)) {
+        records->ok[i] = false;
+        continue;
+      }
+      records->spectra[i] = new Spectrum(pb_spectrum);
+      continue;
+    }
+    const SpectrumRecord& record = records->fields[i];
+    Spectrum* spectrum = new Spectrum(record.spectrum_number, record.precursor_m_z);
+    spectrum->SetRTime(record.rtime);
+    uint64 value;
+    for (const uint8* p = record.charge; p < record.charge_end; ) {
+      ReadVarint(&p, record.charge_end, &value);
+      spectrum->AddChargeState(int(value));
+    }
+    int size = records->num_peaks[i];
+    double* peak_m_z = records->m_z + records->offsets[i];
+    double* peak_intensity = records->intensity + records->offsets[i];
+    double m_z_denom = record.m_z_denom;
+    double intensity_denom = record.intensity_denom;
+    uint64 total = 0;
+    const uint8* p = record.m_z;
+    for (int j = 0; j < size; ++j) {
+      ReadVarint(&p, record.m_z_end, &value);
+      CHECK(int64(value) > 0);
+      total += value; // deltas of m/z are stored
+      peak_m_z[j] = total / m_z_denom;
+    }
+    p = record.intensity;
+    for (int j = 0; j < size; ++j) {
+      ReadVarint(&p, record.intensity_end, &value);
+      peak_intensity[j] = int64(value) / intensity_denom;
+    }
+    spectrum->SetPeaks(peak_m_z, peak_intensity, size);
+    records->spectra[i] = spectrum;
+  }
+}
+
+// Calls f(first, last) on num_threads threads, for consecutive chunks of
+// [0, n).
+void RunOnChunks(size_t n, int num_threads,
+                 const boost::function<void(size_t, size_t)>& f) {
+  size_t chunk = (n + num_threads - 1) / max(num_threads, 1);
+  if (num_threads <= 1 || chunk == 0 || chunk >= n) {
+    f(0, n);
+    return;
+  }
+  boost::thread_group threads;
+  for (size_t first = chunk; first < n; first += chunk) {
+    threads.add_thread(new boost::thread(f, first, min(first + chunk, n)));
+  }
+  f(0, chunk);
+  threads.join_all();
+}
+
+} // namespace
+
 bool SpectrumCollection::ReadSpectrumRecords(const string& filename,
-					     pb::Header* header) {
+					     pb::Header* header,
+					     int num_threads) {
   pb::Header tmp_header;
   if (header == NULL)
     header = &tmp_header;
-  HeadedRecordReader reader(filename, header);
+
+  // The file is read whole: its magic number, then records each prepended by
+  // its length, the first of them the header, and a length of 0 at the end
+  // (see records.h).
+  ifstream in(filename.c_str(), ios::binary);
+  uint8 magic[4];
+  if (!in.read((char*)magic, sizeof(magic)) ||
+      (magic[0] | magic[1] << 8 | magic[2] << 16 | uint32(magic[3]) << 24)
+      != MAGIC_NUMBER)
+    return false;
+  in.seekg(0, ios::end);
+  streamoff file_size = in.tellg();
+  in.seekg(sizeof(magic));
+  vector<uint8> buffer(file_size - sizeof(magic));
+  if (!buffer.empty() && !in.read((char*)&buffer[0], buffer.size()))
+    return false;
+  in.close();
+
+  const uint8* p = buffer.empty() ? NULL : &buffer[0];
+  const uint8* end = p + buffer.size();
+  uint64 size;
+  if (!ReadVarint(&p, end, &size) || size > uint64(end - p) ||
+      !header->ParseFromArray(p, size))
+    return false;
+  p += size;
   if (header->file_type() != pb::Header::SPECTRA)
     return false;
-  pb::Spectrum pb_spectrum;
-  while (!reader.Done()) {
-    reader.Read(&pb_spectrum);
-    spectra_.push_back(new Spectrum(pb_spectrum));
+  SpectrumRecords records;
+  for (;;) {
+    if (!ReadVarint(&p, end, &size) || size > uint64(end - p))
+      return false;
+    if (size == 0)
+      break;
+    records.spans.push_back(make_pair(p, int(size)));
+    p += size;
   }
-  if (!reader.OK()) {
+  size_t n = records.spans.size();
+  if (n == 0)
+    return true;
+
+  // Size the peak array from the records before decoding them into it.
+  records.fields.resize(n);
+  records.num_peaks.resize(n);
+  RunOnChunks(n, num_threads, boost::bind(&ScanSpectrumRecords, &records, _1, _2));
+  records.offsets.resize(n);
+  int64 total_peaks = 0;
+  for (size_t i = 0; i < n; ++i) {
+    records.offsets[i] = total_peaks;
+    total_peaks += max(records.num_peaks[i], 0);
+  }
+  double* arena = new double[2 * total_peaks];
+  peak_arenas_.push_back(arena);
+  records.m_z = arena;
+  records.intensity = arena + total_peaks;
+
+  size_t first_spectrum = spectra_.size();
+  spectra_.resize(first_spectrum + n, NULL);
+  records.spectra = &spectra_[first_spectrum];
+  records.ok.assign(n, true);
+  RunOnChunks(n, num_threads, boost::bind(&DecodeSpectrumRecords, &records, _1, _2));
+  if (find(records.ok.begin(), records.ok.end(), false) != records.ok.end()) {
     for (int i = 0; i < spectra_.size(); ++i)
       delete spectra_[i];
     spectra_.clear();
@@ -34,7 +34,8 @@ class Spectrum {
  public:
   // Manual instantiation and specification
   Spectrum(int spectrum_number, double precursor_m_z)
-    : spectrum_number_(spectrum_number), precursor_m_z_(precursor_m_z) {
+    : spectrum_number_(spectrum_number), precursor_m_z_(precursor_m_z),
+      m_z_(NULL), intensity_(NULL), size_(0) {
   }
   void ReservePeaks(int num) {
     peak_m_z_.reserve(num);
@@ -47,6 +48,15 @@ class Spectrum {
   void AddPeak(double m_z, double intensity) {
     peak_m_z_.push_back(m_z);
     peak_intensity_.push_back(intensity);
+    UseOwnPeaks();
+  }
+  // Uses the size peaks at m_z and intensity instead of peaks of its own.
+  // The arrays belong to the caller (see
+  // SpectrumCollection::ReadSpectrumRecords()) and must outlive the spectrum.
+  void SetPeaks(double* m_z, double* intensity, int size) {
+    m_z_ = m_z;
+    intensity_ = intensity;
+    size_ = size;
   }
   
   explicit Spectrum(const pb::Spectrum& spec); // Instantiation from PB
@@ -59,9 +69,9 @@ class Spectrum {
   int NumChargeStates() const { return charge_states_.size(); }
   int ChargeState(int index) const { return charge_states_[index]; }
 
-  int Size() const { return peak_m_z_.size(); } // number of peaks
-  double M_Z(int index) const { return peak_m_z_[index]; }
-  double Intensity(int index) const { return peak_intensity_[index]; }
+  int Size() const { return size_; } // number of peaks
+  double M_Z(int index) const { return m_z_[index]; }
+  double Intensity(int index) const { return intensity_[index]; }
 
   void SortIfNecessary();
 
@@ -92,13 +102,28 @@ class Spectrum {
   double MaxPeakInRange( double min_range, double max_range ) const;
   
  private:
+  void UseOwnPeaks() {
+    m_z_ = peak_m_z_.empty() ? NULL : &peak_m_z_[0];
+    intensity_ = peak_intensity_.empty() ? NULL : &peak_intensity_[0];
+    size_ = peak_m_z_.size();
+  }
+
   int spectrum_number_;
   double rtime_;
   double precursor_m_z_;
   vector<int> charge_states_;
 
+  // The peaks, either in peak_m_z_ and peak_intensity_ or set by SetPeaks().
+  double* m_z_;
+  double* intensity_;
+  int size_;
+
   vector<double> peak_m_z_;
   vector<double> peak_intensity_;
+
+  // Not copyable; a copy would keep pointing into the original's peaks.
+  Spectrum(const Spectrum&);
+  Spectrum& operator=(const Spectrum&);
 };
 
 class SpectrumCollection {
@@ -106,10 +131,15 @@ class SpectrumCollection {
   ~SpectrumCollection() {
     for (int i = 0; i < spectra_.size(); ++i)
       delete spectra_[i];
+    for (int i = 0; i < peak_arenas_.size(); ++i)
+      delete[] peak_arenas_[i];
   }
 
   void ReadMS(istream& in, bool ms1);
-  bool ReadSpectrumRecords(const string& filename, pb::Header* header = NULL);
+  // Reads the whole file and decodes the spectra on num_threads threads,
+  // with their peaks in one array for the file.
+  bool ReadSpectrumRecords(const string& filename, pb::Header* header = NULL,
+                           int num_threads = 1);
   void Sort();
   int Size() const { return(spectra_.size()); } // number of spectra
 
@@ -146,6 +176,9 @@ class SpectrumCollection {
 
   vector<Spectrum*> spectra_;
   vector<SpecCharge> spec_charges_;
+
+  // Peaks of the spectra read by ReadSpectrumRecords(), one array per file
+  vector<double*> peak_arenas_;
 };
 
 #endif // SPECTRUM_COLLECTION_H
@@ -789,4 +789,16 @@ class TheoreticalPeakSetBIons {
   double binWidth_;
   double binOffset_;
 };
+
+// The b ion peaks of a peptide in an ActivePeptideQueue: a copy of
+// TheoreticalPeakSetBIons::unordered_peak_list_ in the queue's FIFO allocator,
+// which is released along with the peptide.
+struct BIonPeakSpan {
+  const unsigned int* begin() const { return peaks_; }
+  const unsigned int* end() const { return peaks_ + size_; }
+  int size() const { return size_; }
+
+  const unsigned int* peaks_;
+  int size_;
+};
 #endif // THEORETICAL_PEAK_SET_H
@@ -98,6 +98,13 @@ int SelfLoopPeptide::getLinkPos(
   return linked_peptide_.getLinkSite(link_pos_idx_[link_idx]);
 }
 
+/**
+ * \returns the linkable peptide that is looped
+ */
+XLinkablePeptide& SelfLoopPeptide::getXLinkablePeptide() {
+  return linked_peptide_;
+}
+
 /**
  * \returns self-loop candidate
  */
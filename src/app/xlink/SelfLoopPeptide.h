@@ -30,6 +30,11 @@ class SelfLoopPeptide : public XLinkMatch {
     int link_idx ///< link index (0 or 1)
   );
 
+  /**
+   * \returns the linkable peptide that is looped
+   */
+  XLinkablePeptide& getXLinkablePeptide();
+
   /**
    * Default Constructor
    */
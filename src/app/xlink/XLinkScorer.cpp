@@ -11,7 +11,10 @@
 #include "model/IonSeries.h"
 #include "util/Params.h"
 #include "XLinkPeptide.h"
+#include "SelfLoopPeptide.h"
 #include "util/GlobalParams.h"
+#include "util/mass.h"
+#include "util/modifications.h"
 
 
 #include <iostream>
@@ -47,12 +50,23 @@ void XLinkScorer::init(
 
     ion_series_sp_ =
       new IonSeries(ion_constraint_sp_, charge_);
+
+    // preprocess the spectrum once; candidates are scored against it with
+    // Scorer::addXcorrIon() rather than through ion_series_xcorr_
+    if (!scorer_xcorr_->createIntensityArrayXcorr(spectrum_, charge_)) {
+      carp(CARP_FATAL, "failed to produce XCORR");
+    }
+    max_ion_charge_ = min(charge_, ion_constraint_xcorr_->getMaxCharge());
+    h_mass_ = (ion_constraint_xcorr_->getMassType() == MONO) ?
+      MASS_H_MONO : MASS_H_AVERAGE;
   } else {
 
     ion_constraint_xcorr_ = NULL;
     ion_constraint_sp_ = NULL;
     ion_series_xcorr_ = NULL;
     ion_series_sp_ = NULL;
+    max_ion_charge_ = 0;
+    h_mass_ = MASS_H_MONO;
   }
 }
 
@@ -160,8 +174,51 @@ FLOAT_T XLinkScorer::scoreCandidate(
     xcorr = xcorr1+xcorr2;
     candidate->setScore(XCORR, xcorr);
   } else {
-    candidate->predictIons(ion_series_xcorr_, charge_);
-    xcorr = scorer_xcorr_->scoreSpectrumVIonSeries(spectrum_, ion_series_xcorr_);
+    XLINKMATCH_TYPE_T candidate_type = candidate->getCandidateType();
+    Crux::Peptide* peptide = candidate->getPeptide(0);
+    bool fast = canAddXCorrIons();
+    if (fast && (candidate_type == XLINK_INTER_CANDIDATE ||
+                 candidate_type == XLINK_INTRA_CANDIDATE ||
+                 candidate_type == XLINK_INTER_INTRA_CANDIDATE)) {
+      // same ions as XLinkPeptide::predictIons()
+      XLinkPeptide* xpep = (XLinkPeptide*)candidate;
+      XLinkablePeptide& xpep1 = xpep->getXLinkablePeptide(0);
+      XLinkablePeptide& xpep2 = xpep->getXLinkablePeptide(1);
+      MASS_TYPE_T fragment_mass_type = GlobalParams::getFragmentMass();
+      FLOAT_T link_mass = XLinkPeptide::getLinkerMass();
+      FLOAT_T delta_mass0 = xpep1.getMass(fragment_mass_type) + link_mass;
+      FLOAT_T delta_mass1 = xpep2.getMass(fragment_mass_type) + link_mass;
+      scorer_xcorr_->clearXcorrIons();
+      int site1 = xpep1.getLinkSite(xpep->getLinkIdx(0));
+      int site2 = xpep2.getLinkSite(xpep->getLinkIdx(1));
+      addXCorrIons(xpep1.getModifiedSequencePtr(), xpep1.getLength(),
+                   site1, site1, delta_mass1);
+      addXCorrIons(xpep2.getModifiedSequencePtr(), xpep2.getLength(),
+                   site2, site2, delta_mass0);
+      xcorr = scorer_xcorr_->getXcorrIonScore();
+    } else if (fast && candidate_type == SELFLOOP_CANDIDATE) {
+      // same ions as SelfLoopPeptide::predictIons()
+      SelfLoopPeptide* loop = (SelfLoopPeptide*)candidate;
+      XLinkablePeptide& xpep = loop->getXLinkablePeptide();
+      scorer_xcorr_->clearXcorrIons();
+      addXCorrIons(xpep.getModifiedSequencePtr(), xpep.getLength(),
+                   min(loop->getLinkPos(0), loop->getLinkPos(1)),
+                   max(loop->getLinkPos(0), loop->getLinkPos(1)),
+                   XLinkPeptide::getLinkerMass());
+      xcorr = scorer_xcorr_->getXcorrIonScore();
+    } else if (fast && (candidate_type == LINEAR_CANDIDATE ||
+                candidate_type == DEADLINK_CANDIDATE) && peptide != NULL) {
+      // same ions as LinearPeptide::predictIons()
+      MODIFIED_AA_T* mod_seq = peptide->getModifiedAASequence();
+      scorer_xcorr_->clearXcorrIons();
+      addXCorrIons(mod_seq, peptide->getLength(), -1, -1, 0);
+      freeModSeq(mod_seq);
+      xcorr = scorer_xcorr_->getXcorrIonScore();
+    } else {
+      // other ion types and neutral losses need the ion series
+      candidate->predictIons(ion_series_xcorr_, charge_);
+      xcorr = scorer_xcorr_->scoreSpectrumVIonSeries(spectrum_, ion_series_xcorr_);
+    }
     candidate->setScore(XCORR, xcorr);
   }
   
@@ -195,12 +252,104 @@ FLOAT_T XLinkScorer::scoreXLinkablePeptide(
   int link_idx,
   FLOAT_T mod_mass) {
 
-  xlpeptide.predictIons(ion_series_xcorr_, charge_, link_idx, mod_mass);
-  FLOAT_T xcorr = scorer_xcorr_->scoreSpectrumVIonSeries(spectrum_, ion_series_xcorr_);
+  if (!canAddXCorrIons()) {
+    xlpeptide.predictIons(ion_series_xcorr_, charge_, link_idx, mod_mass);
+    return scorer_xcorr_->scoreSpectrumVIonSeries(spectrum_, ion_series_xcorr_);
+  }
+  scorer_xcorr_->clearXcorrIons();
+  int site = xlpeptide.getLinkSite(link_idx);
+  addXCorrIons(xlpeptide.getModifiedSequencePtr(), xlpeptide.getLength(),
+               site, site, mod_mass);
+  FLOAT_T xcorr = scorer_xcorr_->getXcorrIonScore();
   return xcorr;
 
 }
 
+/**
+ * Adds the a, b and y ions of the peptide to scorer_xcorr_
+ */
+void XLinkScorer::addXCorrIons(
+  const MODIFIED_AA_T* mod_seq, ///< modified sequence of the peptide
+  int length, ///< length of the peptide
+  int first_site, ///< sequence index of the first link site, or -1
+  int second_site, ///< sequence index of the second link site, or -1
+  FLOAT_T mod_mass ///< mass added to the ions containing the link sites
+  ) {
+
+  // cumulative masses as in IonSeries::createIonMassMatrix()
+  MASS_TYPE_T mass_type = ion_constraint_xcorr_->getMassType();
+  mass_matrix_.resize(length + 1);
+  mass_matrix_[1] = get_mass_mod_amino_acid(mod_seq[0], mass_type);
+  for (int idx = 2; idx <= length; idx++) {
+    mass_matrix_[idx] = mass_matrix_[idx-1] +
+      get_mass_mod_amino_acid(mod_seq[idx-1], mass_type);
+  }
+  FLOAT_T co_mass = (mass_type == MONO) ? MASS_CO_MONO : MASS_CO_AVERAGE;
+  FLOAT_T h2o_mass = (mass_type == MONO) ? MASS_H2O_MONO : MASS_H2O_AVERAGE;
+  IonConstraint* constraint = ion_constraint_xcorr_;
+  bool by_ions = constraint->getUseIonType(ALL_ION) ||
+    constraint->getUseIonType(BY_ION) || constraint->getUseIonType(BYA_ION);
+  bool a_ions = constraint->getUseIonType(A_ION) ||
+    constraint->getUseIonType(BYA_ION) || constraint->getUseIonType(ALL_ION);
+  bool b_ions = by_ions || constraint->getUseIonType(B_ION);
+  bool y_ions = by_ions || constraint->getUseIonType(Y_ION);
+
+  // a, b and y ions at each cleavage, as IonSeries::generateIonsNoModification()
+  bool linked = first_site >= 0;
+  for (int cleavage_idx = 1; cleavage_idx < length; cleavage_idx++) {
+    bool forward_linked = linked && cleavage_idx > second_site;
+    bool forward_kept = !linked || forward_linked || cleavage_idx <= first_site;
+    bool reverse_linked = linked && cleavage_idx >= length - first_site;
+    bool reverse_kept = !linked || reverse_linked ||
+      cleavage_idx < length - second_site;
+    FLOAT_T mass = mass_matrix_[cleavage_idx];
+    if (a_ions && forward_kept) {
+      addXCorrIonCharges(A_ION, mass - co_mass, forward_linked, mod_mass);
+    }
+    if (b_ions && forward_kept) {
+      addXCorrIonCharges(B_ION, mass, forward_linked, mod_mass);
+    }
+    if (y_ions && reverse_kept) {
+      mass = mass_matrix_[length] - mass_matrix_[length - cleavage_idx];
+      addXCorrIonCharges(Y_ION, mass + h2o_mass, reverse_linked, mod_mass);
+    }
+  }
+}
+
+/**
+ * \returns whether addXCorrIons() makes the ions of the xcorr ion constraint
+ */
+bool XLinkScorer::canAddXCorrIons() {
+  IonConstraint* constraint = ion_constraint_xcorr_;
+  return !constraint->getUseNeutralLosses() &&
+    !constraint->getUseIonType(ALL_ION) &&
+    !constraint->getUseIonType(C_ION) &&
+    !constraint->getUseIonType(X_ION) &&
+    !constraint->getUseIonType(Z_ION);
+}
+
+/**
+ * Adds the ions of one type at one cleavage for each charge
+ */
+void XLinkScorer::addXCorrIonCharges(
+  ION_TYPE_T ion_type, ///< type of the ions
+  FLOAT_T mass, ///< base mass of the ions
+  bool shifted, ///< do the ions contain the link site?
+  FLOAT_T mod_mass ///< mass added to the ions containing the link site
+  ) {
+
+  for (int ion_charge = 1; ion_charge <= max_ion_charge_; ion_charge++) {
+    // Ion::calcMassZWithMass(), then Ion::setMassZFromMass() for linked ions
+    FLOAT_T charge = ion_charge;
+    FLOAT_T mass_z = (mass + (h_mass_*charge))/charge;
+    if (shifted) {
+      FLOAT_T linked_mass = (mass_z - MASS_PROTON) * charge + mod_mass;
+      mass_z = (linked_mass + MASS_PROTON * charge) / charge;
+    }
+    scorer_xcorr_->addXcorrIon(ion_type, ion_charge, mass_z);
+  }
+}
+
 /*                                                                                                                                                                                                                          
  * Local Variables:                                                                                                                                                                                                         
  * mode: c                                                                                                                                                                                                                  
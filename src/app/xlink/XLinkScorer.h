@@ -9,6 +9,7 @@
 #define XLINKSCORER_H_
 #include "model/objects.h"
 #include "XLinkMatch.h"
+#include <vector>
 
 class XLinkScorer {
  protected:
@@ -22,6 +23,9 @@ class XLinkScorer {
   IonSeries* ion_series_xcorr_; ///< current ion series xcorr
   IonSeries* ion_series_sp_; ///< current ion series sp
   bool compute_sp_; ///< calculate sp score
+  int max_ion_charge_; ///< highest charge of the xcorr ions
+  FLOAT_T h_mass_; ///< hydrogen mass for the xcorr ion m/z
+  std::vector<FLOAT_T> mass_matrix_; ///< cumulative residue masses, reused
  
   /**
    * initializes the object with the spectrum
@@ -33,6 +37,39 @@ class XLinkScorer {
     bool compute_sp ///< are we scoring sp?
     );
 
+  /**
+   * Adds the xcorr ions of a peptide to scorer_xcorr_ straight from its
+   * residue masses, in the order IonSeries::predictIons() would make them.
+   * Ions that contain the link sites are shifted by mod_mass, as in
+   * XLinkablePeptide::predictIons(), and ions that contain only one site of
+   * a self loop are left out, as in SelfLoopPeptide::predictIons(). A cross
+   * link passes its site twice; an unlinked peptide passes -1 twice.
+   */
+  void addXCorrIons(
+    const MODIFIED_AA_T* mod_seq, ///< modified sequence of the peptide
+    int length, ///< length of the peptide
+    int first_site, ///< sequence index of the first link site, or -1
+    int second_site, ///< sequence index of the second link site, or -1
+    FLOAT_T mod_mass ///< mass added to the ions containing the link sites
+    );
+
+  /**
+   * \returns whether the xcorr ion constraint asks for no ions other than a,
+   * b and y ions without neutral losses, which addXCorrIons() can make
+   */
+  bool canAddXCorrIons();
+
+  /**
+   * Adds the ions of one type at one cleavage to scorer_xcorr_, for charges
+   * 1 to max_ion_charge_
+   */
+  void addXCorrIonCharges(
+    ION_TYPE_T ion_type, ///< type of the ions
+    FLOAT_T mass, ///< base mass of the ions
+    bool shifted, ///< do the ions contain the link site?
+    FLOAT_T mod_mass ///< mass added to the ions containing the link site
+    );
+
  public:
   /**
    * default constructor
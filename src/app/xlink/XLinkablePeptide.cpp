@@ -370,6 +370,16 @@ int XLinkablePeptide::getMissedCleavageSites(
   return peptide -> getMissedCleavageSites();
 }
 
+/**
+ * \returns the length of the peptide
+ */
+int XLinkablePeptide::getLength() {
+  if (peptide_) {
+    return peptide_->getLength();
+  }
+  return strlen(sequence_);
+}
+
 /**
  * \returns the sequence index of a link site
  */
@@ -703,12 +713,7 @@ void XLinkablePeptide::predictIons(
     cached_ions->predictIons();
   }
   int link_pos = link_sites_.at(link_idx);
-  int seq_len;
-  if (peptide_) {
-    seq_len = peptide_->getLength();
-  } else {
-    seq_len = strlen(sequence_);
-  }
+  int seq_len = getLength();
   if (clear) {
     ion_series->clear();
   }
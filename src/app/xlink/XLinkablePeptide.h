@@ -214,6 +214,12 @@ class XLinkablePeptide : public CacheableMass {
   MODIFIED_AA_T* getModifiedSequence();
 
   const MODIFIED_AA_T* getModifiedSequencePtr();
+
+  /**
+   * \returns the length of the peptide
+   */
+  int getLength();
+
   /**
    * \returns the modified sequence string of the xlinkable peptide
    */
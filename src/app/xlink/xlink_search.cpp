@@ -18,6 +18,7 @@
 #include "model/FilteredSpectrumChargeIterator.h"
 #include "io/OutputFiles.h"
 #include "io/SpectrumCollectionFactory.h"
+#include "util/Metrics.h"
 #include "util/Params.h"
 #include "XLinkDatabase.h"
 
@@ -145,6 +146,7 @@ int SearchForXLinks::xlinkSearchMain() {
     string ms2_file = *ms2_file_iter;
     
     carp(CARP_INFO, "Loading spectra %s.", ms2_file.c_str());
+    Metrics::Timer read_timer("search-for-xlinks.read-spectra");
     Crux::Spectrum* spectrum = NULL;
     Crux::SpectrumCollection* spectra =
       SpectrumCollectionFactory::create(ms2_file);
@@ -152,6 +154,7 @@ int SearchForXLinks::xlinkSearchMain() {
 
     FilteredSpectrumChargeIterator* spectrum_iterator =
       new FilteredSpectrumChargeIterator(spectra);
+    read_timer.Stop();
 
 
     // main loop over spectra in ms2 file
@@ -165,6 +168,7 @@ int SearchForXLinks::xlinkSearchMain() {
   
     // for every observed spectrum 
     carp(CARP_INFO, "Beginning search.");
+    Metrics::Timer search_timer("search-for-xlinks.search");
     int print_interval = Params::GetInt("print-search-progress");
 
     while (spectrum_iterator->hasNext()) {
@@ -336,6 +340,9 @@ int SearchForXLinks::xlinkSearchMain() {
       carp(CARP_DEBUG, "Done with spectrum %d.", scan_num);
       carp(CARP_DEBUG, "=====================================");
     } // get next spectrum
+    search_timer.Stop();
+    Metrics::Add("search-for-xlinks.spectrum-charges", search_count);
+    Metrics::Add("search-for-xlinks.skipped-no-candidates", skipped_no_candidates);
 
     carp(CARP_INFO, "Skipped %d (%g%%) spectra with 0 candidates.", 
 	 skipped_no_candidates, skipped_no_candidates / num_spectra * 100);
@@ -59,7 +59,7 @@ bool MSToolkitSpectrumCollection::parse() {
     carp(CARP_FATAL, "MSToolkit: Error reading spectra file: %s", filename_.c_str());
   }
 
-  while(mst_spectrum->getScanNumber() != 0) {
+  while(mst_spectrum->getScanNumber() != 0 && !stop_parsing_) {
     // is this a scan to include? if not skip it
     if( mst_spectrum->getScanNumber() < first_scan ) {
       mst_reader->readFile(NULL, *mst_spectrum);
@@ -71,8 +71,10 @@ bool MSToolkitSpectrumCollection::parse() {
     }
     Crux::Spectrum* parsed_spectrum = new Crux::Spectrum();
     if (parsed_spectrum->parseMstoolkitSpectrum(mst_spectrum, filename_.c_str())) {
+      if (handler_ == NULL) {
+        spectraByScan_[first_scan] = parsed_spectrum;
+      }
       addSpectrumToEnd(parsed_spectrum);
-      spectraByScan_[first_scan] = parsed_spectrum;
     } else {
       delete parsed_spectrum;
     }
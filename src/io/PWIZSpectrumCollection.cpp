@@ -147,7 +147,7 @@ bool PWIZSpectrumCollection::parse() {
   carp(CARP_DEBUG, "PWIZ:Number of spectra:%i", num_spec);
   bool assign_new_scans = false;
   int scan_counter = 0;
-  for (int spec_idx = 0; spec_idx < num_spec; spec_idx++) {
+  for (int spec_idx = 0; spec_idx < num_spec && !stop_parsing_; spec_idx++) {
     carp(CARP_DETAILED_DEBUG, "Parsing spectrum index %d.", spec_idx);
     pwiz::msdata::SpectrumPtr spectrum;
     try {
@@ -211,8 +211,10 @@ bool PWIZSpectrumCollection::parse() {
 
     Crux::Spectrum* crux_spectrum = new Crux::Spectrum();
     if (crux_spectrum->parsePwizSpecInfo(spectrum, scan_number_begin, scan_number_end)) {
+      if (handler_ == NULL) {
+        spectraByScan_[scan_number_begin] = crux_spectrum;
+      }
       addSpectrumToEnd(crux_spectrum);
-      spectraByScan_[scan_number_begin] = crux_spectrum;
     } else {
       delete crux_spectrum;
     }
@@ -32,6 +32,8 @@ using namespace Crux;
 
 PinWriter::PinWriter():
   out_(NULL),
+  owns_out_(false),
+  match_ids_(NULL),
   enzyme_(get_enzyme_type_parameter("enzyme")),
   precision_(Params::GetInt("precision")),
   mass_precision_(Params::GetInt("mass-precision")) {
@@ -78,6 +80,17 @@ void PinWriter::openFile(const string& filename, const string& output_dir, bool
   if (!(out_ = create_stream_in_path(filename.c_str(), output_dir.c_str(), overwrite))) {
     carp(CARP_FATAL, "Can't open file '%s'", filename.c_str());
   }
+  owns_out_ = true;
+}
+
+void PinWriter::openStream(ostream* out) {
+  closeFile();
+  out_ = out;
+  owns_out_ = false;
+}
+
+void PinWriter::setMatchIdTable(map<string, Match*>* matches) {
+  match_ids_ = matches;
 }
 
 void PinWriter::openFile(CruxApplication* application, string filename, MATCH_FILE_TYPE type) {
@@ -108,10 +121,11 @@ void PinWriter::setEnabledStatus(const string& name, bool enabled) {
  * Close the file, if open.
  */
 void PinWriter::closeFile() {
-  if (out_) {
+  if (out_ && owns_out_) {
     delete out_;
-    out_ = NULL;
   }
+  out_ = NULL;
+  owns_out_ = false;
 }
 
 void PinWriter::write( 
@@ -306,6 +320,18 @@ string PinWriter::getId(Match* match, int scan_number) {
   }
   psm_id << '_' << scan_number << '_' << match->getCharge() << '_'
          << match->getRank(XCORR);
+
+  if (match_ids_ != NULL) {
+    pair<map<string, Match*>::iterator, bool> inserted =
+      match_ids_->insert(make_pair(psm_id.str(), match));
+    if (inserted.second) {
+      match->incrementPointerCount();
+    } else if (inserted.first->second != NULL) {
+      // An id shared by several PSMs is left to be resolved by parsing it
+      Match::freeMatch(inserted.first->second);
+      inserted.first->second = NULL;
+    }
+  }
   return psm_id.str();   
 }
 
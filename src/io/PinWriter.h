@@ -5,6 +5,7 @@
 #ifndef PINWRITER_H
 #define PINWRITER_H
 
+#include <map>
 #include <set>
 #include <string>
 #include <vector>
@@ -52,13 +53,32 @@ class PinWriter : public PSMWriter {
     MATCH_FILE_TYPE type ///< type of file to be written
   );
 
+  /**
+   * Writes to a caller-owned stream instead of a file.
+   */
+  void openStream(
+    std::ostream* out ///< stream to write the pin to
+  );
+
+  /**
+   * Records the match of each PSM in matches under the SpecId it is written
+   * with, holding a reference to it, so that the pin can be consumed
+   * in-process without parsing ids back into matches. An id shared by
+   * several PSMs maps to NULL.
+   */
+  void setMatchIdTable(
+    std::map<std::string, Crux::Match*>* matches ///< matches by SpecId -out
+  );
+
   bool getEnabledStatus(const std::string& name) const;
   void setEnabledStatus(const std::string& name, bool enabled);
 
  protected:
   std::vector< std::pair<std::string, bool> > features_;
   std::vector<std::string> enabledFeatures_;
-  std::ofstream* out_;
+  std::ostream* out_;
+  bool owns_out_;
+  std::map<std::string, Crux::Match*>* match_ids_;
   ENZYME_T enzyme_; 
   int precision_;
   int mass_precision_;
@@ -30,7 +30,8 @@ namespace Crux {
 SpectrumCollection::SpectrumCollection (
   const string& filename ///< The spectrum collection filename. 
   ) 
-: filename_(filename), is_parsed_(false), num_charged_spectra_(0) {
+: filename_(filename), is_parsed_(false), num_charged_spectra_(0),
+  handler_(NULL), stop_parsing_(false) {
 #if DARWIN
   char path_buffer[PATH_MAX];
   char* absolute_path_file =  realpath(filename.c_str(), path_buffer);
@@ -60,7 +61,8 @@ SpectrumCollection::SpectrumCollection(
   SpectrumCollection& old_collection
   ) : filename_(old_collection.filename_),
       is_parsed_(old_collection.is_parsed_),
-      num_charged_spectra_(old_collection.num_charged_spectra_) {
+      num_charged_spectra_(old_collection.num_charged_spectra_),
+      handler_(NULL), stop_parsing_(false) {
   // copy spectra
   for (SpectrumIterator spectrum_iterator = old_collection.begin();
     spectrum_iterator != old_collection.end();
@@ -154,6 +156,15 @@ bool SpectrumCollection::getSpectrum(
 void SpectrumCollection::addSpectrumToEnd(
   Spectrum* spectrum ///< spectrum to add to spectrum_collection -in
   ) {
+  // hand the spectrum straight to a streaming handler
+  if (handler_ != NULL) {
+    if (stop_parsing_) {
+      delete spectrum;
+    } else if (!handler_->handle(spectrum)) {
+      stop_parsing_ = true;
+    }
+    return;
+  }
   // set spectrum
   spectra_.push_back(spectrum);
   num_charged_spectra_ += spectrum->getNumZStates();
@@ -236,6 +247,37 @@ int SpectrumCollection::getNumChargedSpectra() {
 }
 
 
+/**
+ * Parses the file, handing each spectrum to the handler as it is read.
+ * Spectra that the parser stored in the collection anyway (because it
+ * sorts them) are handed over in order afterwards.  The collection is
+ * left empty and unparsed.
+ * \returns True if the spectra are parsed successfully.
+ */
+bool SpectrumCollection::parseStream(
+  SpectrumHandler* handler ///< receives the spectra -in
+  ) {
+  if (is_parsed_) {
+    return false;
+  }
+  handler_ = handler;
+  stop_parsing_ = false;
+  bool success = parse();
+  handler_ = NULL;
+  for (SpectrumIterator i = spectra_.begin(); i != spectra_.end(); ++i) {
+    if (stop_parsing_) {
+      delete *i;
+    } else if (!handler->handle(*i)) {
+      stop_parsing_ = true;
+    }
+  }
+  spectra_.clear();
+  spectraByScan_.clear();
+  num_charged_spectra_ = 0;
+  is_parsed_ = false;
+  return success;
+}
+
 /**
  * \returns True if the spectrum_collection file has been parsed.
  */
@@ -23,12 +23,29 @@ class SpectrumCollection {
 
   friend class ::FilteredSpectrumChargeIterator;
 
+ public:
+  /**
+   * \class SpectrumHandler
+   * \brief Receives spectra one at a time from parseStream().
+   */
+  class SpectrumHandler {
+   public:
+    virtual ~SpectrumHandler() {}
+    /**
+     * Takes ownership of the spectrum.
+     * \returns False to ask the parser to stop.
+     */
+    virtual bool handle(Crux::Spectrum* spectrum) = 0;
+  };
+
  protected:
   std::deque<Crux::Spectrum*> spectra_;  ///< spectra from the file
   std::map<int, Crux::Spectrum*> spectraByScan_;
   std::string filename_;                  ///< filename
   bool is_parsed_;      ///< file has been read and spectra_ populated 
   int num_charged_spectra_;  ///< sum of all charge states from all spectra
+  SpectrumHandler* handler_; ///< receives spectra during parseStream()
+  bool stop_parsing_;        ///< handler asked parseStream() to stop
   
   /**
    * Base class constructor is protected.  Sets filename and
@@ -88,6 +105,18 @@ class SpectrumCollection {
    */
   virtual bool parse() = 0;
 
+  /**
+   * Parses the file as parse() does, but hands each spectrum to the
+   * handler as soon as it is read instead of keeping it in the
+   * collection, so memory use does not grow with the file.  Parsers
+   * that add spectra out of order still collect them first and hand
+   * them over once parsing is done.
+   * \returns TRUE if the spectra are parsed successfully. FALSE if otherwise.
+   */
+  bool parseStream(
+    SpectrumHandler* handler ///< receives the spectra -in
+  );
+
   /**
    * Parses a single spectrum from a spectrum_collection with first scan
    * number equal to first_scan.
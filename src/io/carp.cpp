@@ -5,6 +5,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <signal.h>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include "carp.h"
 #include "util/crux-utils.h"
 #include "parameter.h"
@@ -21,6 +25,206 @@ static FILE* log_file = NULL;
 
 unsigned int hash_size_ = 1000;
 
+/**
+ * Messages are formatted by the calling thread into its own buffer and
+ * appended, as whole lines, to a queue that a background thread writes to
+ * stderr and the log file. Lines from different threads therefore never
+ * interleave, and callers do not wait for the write and flush. Warnings,
+ * errors and fatal messages, and every message at DEBUG verbosity or above,
+ * are written before carp returns; anything still queued is written at exit
+ * and when the program is killed by a fatal signal, such as the abort of a
+ * failed CHECK.
+ */
+namespace {
+
+const long FLUSH_INTERVAL_MS = 100;
+const size_t MAX_PENDING = 1 << 16; // wake the flusher early past this size
+
+class CarpQueue {
+ public:
+  CarpQueue()
+    : stopped_(false), start_(boost::posix_time::microsec_clock::universal_time()) {
+  }
+
+  void push(const string& line, bool flush_now) {
+    bool full;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      pending_ += line;
+      full = pending_.size() >= MAX_PENDING;
+    }
+    if (flush_now) {
+      flush();
+    } else if (full) {
+      ready_.notify_one();
+    }
+  }
+
+  // Writes all queued lines now
+  void flush() {
+    boost::mutex::scoped_lock output_lock(output_mutex_);
+    string lines;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      lines.swap(pending_);
+    }
+    if (!lines.empty()) {
+      fwrite(lines.data(), 1, lines.size(), stderr);
+      fflush(stderr);
+      if (log_file != NULL) {
+        fwrite(lines.data(), 1, lines.size(), log_file);
+        fflush(log_file);
+      }
+    }
+  }
+
+  // Writes text to the log file only, after everything queued before it
+  void writeLog(const string& text) {
+    flush();
+    boost::mutex::scoped_lock output_lock(output_mutex_);
+    if (log_file != NULL) {
+      fwrite(text.data(), 1, text.size(), log_file);
+      fflush(log_file);
+    }
+  }
+
+  void setLogFile(FILE* file) {
+    flush();
+    boost::mutex::scoped_lock output_lock(output_mutex_);
+    log_file = file;
+  }
+
+  // Flusher thread
+  void run() {
+    while (true) {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (!stopped_ && pending_.size() < MAX_PENDING) {
+          ready_.timed_wait(lock, boost::posix_time::milliseconds(FLUSH_INTERVAL_MS));
+        }
+        if (stopped_) {
+          return;
+        }
+      }
+      flush();
+    }
+  }
+
+  // Writes the queued lines from a fatal signal handler. The thread that
+  // faulted may hold the locks, in which case the lines are lost.
+  void flushFromSignal() {
+    if (!output_mutex_.try_lock()) {
+      return;
+    }
+    if (mutex_.try_lock()) {
+      fwrite(pending_.data(), 1, pending_.size(), stderr);
+      fflush(stderr);
+      if (log_file != NULL) {
+        fwrite(pending_.data(), 1, pending_.size(), log_file);
+        fflush(log_file);
+      }
+      pending_.clear();
+      mutex_.unlock();
+    }
+    output_mutex_.unlock();
+  }
+
+  void stop() {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stopped_ = true;
+    }
+    ready_.notify_one();
+    flush();
+  }
+
+  // Whether a message limited to one per interval seconds, last printed at
+  // *last, is due; if so, sets *last to now
+  bool due(double* last, double interval) {
+    boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    double seconds = (now - start_).total_microseconds() / 1e6;
+    boost::mutex::scoped_lock lock(mutex_);
+    if (*last >= 0 && seconds - *last < interval) {
+      return false;
+    }
+    *last = seconds;
+    return true;
+  }
+
+ private:
+  boost::mutex mutex_;         // guards pending_ and stopped_
+  boost::mutex output_mutex_;  // serializes writes to stderr and log_file
+  boost::condition_variable ready_;
+  string pending_;
+  bool stopped_;
+  boost::posix_time::ptime start_;
+};
+
+// Formatting buffers of the calling thread
+struct CarpBuffer {
+  vector<char> chars;
+  string line;
+  CarpBuffer() : chars(256) {}
+};
+
+// Never destroyed, so that other threads and exit handlers can still use them
+CarpQueue* carp_queue = NULL;
+boost::thread_specific_ptr<CarpBuffer>* carp_buffers = NULL;
+boost::once_flag carp_queue_once = BOOST_ONCE_INIT;
+
+// Signals that end the program without running exit handlers
+const int FATAL_SIGNALS[] = {
+  SIGABRT, SIGSEGV, SIGFPE, SIGILL,
+#ifdef SIGBUS
+  SIGBUS,
+#endif
+};
+const int NUM_FATAL_SIGNALS = sizeof(FATAL_SIGNALS) / sizeof(FATAL_SIGNALS[0]);
+void (*previous_handlers[NUM_FATAL_SIGNALS])(int);
+
+void flush_on_fatal_signal(int sig) {
+  carp_queue->flushFromSignal();
+  for (int i = 0; i < NUM_FATAL_SIGNALS; i++) {
+    if (FATAL_SIGNALS[i] == sig) {
+      signal(sig, previous_handlers[i] == SIG_ERR ? SIG_DFL : previous_handlers[i]);
+      break;
+    }
+  }
+  raise(sig);
+}
+
+void stop_carp_queue() {
+  carp_queue->stop();
+}
+
+void start_carp_queue() {
+  carp_queue = new CarpQueue();
+  carp_buffers = new boost::thread_specific_ptr<CarpBuffer>();
+  boost::thread flusher(boost::bind(&CarpQueue::run, carp_queue));
+  flusher.detach();
+  atexit(stop_carp_queue);
+  for (int i = 0; i < NUM_FATAL_SIGNALS; i++) {
+    previous_handlers[i] = signal(FATAL_SIGNALS[i], flush_on_fatal_signal);
+  }
+}
+
+CarpQueue* get_carp_queue() {
+  boost::call_once(start_carp_queue, carp_queue_once);
+  return carp_queue;
+}
+
+CarpBuffer* get_carp_buffer() {
+  get_carp_queue();
+  CarpBuffer* buffer = carp_buffers->get();
+  if (buffer == NULL) {
+    buffer = new CarpBuffer();
+    carp_buffers->reset(buffer);
+  }
+  return buffer;
+}
+
+}
+
 void set_verbosity_level(int verbosity) {
   G_verbosity = verbosity;
 }
@@ -38,7 +242,8 @@ void open_log_file(string log_file_name) {
   string output_dir = Params::GetString("output-dir");
   bool overwrite = Params::GetBool("overwrite");
   log_file_name = prefix_fileroot_to_name(log_file_name);
-  log_file = create_file_in_path(log_file_name, output_dir.c_str(), overwrite);
+  get_carp_queue()->setLogFile(
+    create_file_in_path(log_file_name, output_dir.c_str(), overwrite));
 }
 
 /**
@@ -50,20 +255,20 @@ void log_command_line(int argc, char *argv[]) {
   // Command line arguments were shifted, shift back.
   ++argc;
   --argv;
-  if (log_file != NULL) {
-    fprintf(log_file, "COMMAND LINE: ");
-    int i = 0;
-    for (i = 0; i < argc; ++i) {
-      fprintf(log_file, "%s%c", argv[i], i < (argc - 1) ? ' ' : '\n');
-    }
+  string line = "COMMAND LINE: ";
+  for (int i = 0; i < argc; ++i) {
+    line += argv[i];
+    line += i < (argc - 1) ? ' ' : '\n';
   }
+  get_carp_queue()->writeLog(line);
 }
 
-static void carp_print(const char *string) {
-  fprintf(stderr, "%s", string);
-  if (log_file != NULL) {
-    fprintf(log_file, "%s", string);
-  }
+void carp_flush() {
+  get_carp_queue()->flush();
+}
+
+bool carp_due(double* last, double interval) {
+  return get_carp_queue()->due(last, interval);
 }
 
 /**
@@ -80,38 +285,43 @@ static void carp_print(const char *string) {
 void carp( int verbosity, const char* format, ...) {
   if (verbosity <= G_verbosity) {
     va_list  argp;
+    CarpBuffer* buffer = get_carp_buffer();
+    string& line = buffer->line;
 
     if (verbosity == CARP_WARNING) {
-      carp_print("WARNING: ");
+      line = "WARNING: ";
     } else if (verbosity == CARP_ERROR) {
-      carp_print("ERROR: ");
+      line = "ERROR: ";
     } else if (verbosity == CARP_FATAL) {
-      carp_print("FATAL: ");
+      line = "FATAL: ";
     } else if (verbosity == CARP_INFO) {
-      carp_print("INFO: ");
+      line = "INFO: ";
     } else if (verbosity == CARP_DETAILED_INFO) {
-      carp_print("DETAILED INFO: ");
+      line = "DETAILED INFO: ";
     } else if (verbosity == CARP_DEBUG) {
-      carp_print("DEBUG: ");
+      line = "DEBUG: ";
     } else if (verbosity == CARP_DETAILED_DEBUG) {
-      carp_print("DETAILED DEBUG: ");
+      line = "DETAILED DEBUG: ";
     } else {
-      carp_print("UNKNOWN: ");
+      line = "UNKNOWN: ";
     }
 
     va_start(argp, format);
-    vfprintf(stderr, format, argp);
+    int length = vsnprintf(&buffer->chars[0], buffer->chars.size(), format, argp);
     va_end(argp);
-    if (log_file != NULL) { 
-      va_start(argp, format); //BF: added to fix segfault
-      vfprintf(log_file, format, argp);
+    if (length >= (int)buffer->chars.size()) {
+      buffer->chars.resize(length + 1);
+      va_start(argp, format);
+      vsnprintf(&buffer->chars[0], buffer->chars.size(), format, argp);
       va_end(argp);
     }
-    carp_print("\n");
-    fflush(stderr);
-    if (log_file != NULL) {
-      fflush(log_file);
+    if (length > 0) {
+      line.append(&buffer->chars[0], length);
     }
+    line += '\n';
+    // Debugging output is written at once, so that none of it is lost if
+    // the program crashes
+    get_carp_queue()->push(line, verbosity <= CARP_WARNING || G_verbosity >= CARP_DEBUG);
   } 
   if (verbosity == CARP_FATAL) {
     // Fatal carps cause the program to exit
@@ -128,6 +128,21 @@ void carp(
   std::string& msg
 );
 
+/**
+ * Writes all carp messages still waiting for the background writer.
+ * Messages of CARP_WARNING and above, and all messages at a verbosity of
+ * CARP_DEBUG or more, are written before carp returns, and everything else is
+ * written at exit or on a fatal signal; call this before writing to stderr
+ * directly, or before handing control to code that does.
+ */
+void carp_flush();
+
+/**
+ * \returns whether a message limited to one per interval seconds, last
+ * printed at time *last (negative if never), is due, and if so sets *last.
+ */
+bool carp_due(double* last, double interval);
+
 /**
  * \def carp_once( verbosity, msg, ...)
  *
@@ -142,6 +157,21 @@ void carp(
   _carp_ = 1;\
 }
 
+/**
+ * \def carp_every( seconds, verbosity, msg, ...)
+ *
+ * \brief Print message to log file, at most once every seconds seconds.
+ *
+ * For progress messages of loops, which may otherwise be printed faster
+ * than anyone can read them.
+ */
+#define carp_every( seconds, verbosity, msg, ... ) \
+{ \
+  static double _carp_last_ = -1; \
+  if (get_verbosity_level() >= verbosity && carp_due(&_carp_last_, seconds)) \
+    carp(verbosity, msg, ## __VA_ARGS__); \
+}
+
 /*
  * Local Variables:
  * mode: c
@@ -21,60 +21,107 @@
 #include "util/WinCrux.h"
 #endif
 
-#include <stack>
+#include <vector>
+#define NO_BOOST_DATE_TIME_INLINE
+#include <boost/thread.hpp>
 
 using namespace Crux;
 using namespace std;
 
-
-class IonCache {
+/**
+ * Ions shared by all threads. Ions are allocated ION_BLOCK_SIZE at a time
+ * in contiguous blocks that are never freed, so an ion can be freed on a
+ * thread other than the one that made it. Threads take and return ions in
+ * batches through an IonCache of their own.
+ */
+class IonPool {
+ public:
+  static const size_t ION_BLOCK_SIZE = 256;
  protected:
-  stack<Ion*> cache_;
-  #ifdef DEBUG
-  int ncheckin;
-  int ncheckout;
-  #endif
+  vector<Ion*> spare_;
+  boost::mutex mutex_;
  public:
-  IonCache() {
-    #ifdef DEBUG
-    ncheckin = 0;
-    ncheckout = 0;
-    #endif
+  /**
+   * Moves up to ION_BLOCK_SIZE ions to ions, allocating a block if there are
+   * none to spare.
+   */
+  void take(vector<Ion*>& ions) {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (spare_.empty()) {
+      Ion* block = new Ion[ION_BLOCK_SIZE];
+      // in reverse so that they are checked out in address order
+      for (size_t idx = ION_BLOCK_SIZE; idx > 0; idx--) {
+        spare_.push_back(block + idx - 1);
+      }
+    }
+    size_t num_ions = min(ION_BLOCK_SIZE, spare_.size());
+    ions.insert(ions.end(), spare_.end() - num_ions, spare_.end());
+    spare_.resize(spare_.size() - num_ions);
+  }
+
+  /**
+   * Moves the last num_ions of ions back to the pool.
+   */
+  void give(vector<Ion*>& ions, size_t num_ions) {
+    boost::mutex::scoped_lock lock(mutex_);
+    num_ions = min(num_ions, ions.size());
+    spare_.insert(spare_.end(), ions.end() - num_ions, ions.end());
+    ions.resize(ions.size() - num_ions);
   }
+};
+
+// Allocated once and never deleted, so that ions can still be freed while
+// static objects are destroyed.
+static IonPool* ion_pool_ = new IonPool();
 
+/**
+ * Free ions of one thread. Checking ions out and in takes no lock; the
+ * cache goes to the IonPool only when it runs dry or holds more than
+ * ION_CACHE_LIMIT ions, and returns its ions to the pool when the thread
+ * ends. The limit keeps a thread that frees the ions made by other threads
+ * from hoarding them.
+ */
+class IonCache {
+ protected:
+  static const size_t ION_CACHE_LIMIT = 4 * IonPool::ION_BLOCK_SIZE;
+  vector<Ion*> cache_;
+ public:
   ~IonCache() {
-    while(!cache_.empty()) {
-      Ion* ion = cache_.top();
-      cache_.pop();
-      delete ion;
-    }
-    #ifdef DEBUG
-    carp(CARP_INFO, "Ion cache check in: %d check out:%d", ncheckin, ncheckout);
-    #endif
+    ion_pool_->give(cache_, cache_.size());
   }
 
   Ion* checkout() {
-    #ifdef DEBUG
-    ncheckout++;
-    #endif
     if (cache_.empty()) {
-      return (new Ion());
-    } else {
-      Ion* ion = cache_.top();
-      cache_.pop();
-      return(ion);
+      ion_pool_->take(cache_);
     }
+    Ion* ion = cache_.back();
+    cache_.pop_back();
+    return ion;
   }
   void checkin(Ion* ion) {
-    #ifdef DEBUG
-    ncheckin++;
-    #endif
-    cache_.push(ion);
+    cache_.push_back(ion);
+    // keep half, so that a thread near the limit does not go to the pool
+    // on every other checkin
+    if (cache_.size() > ION_CACHE_LIMIT) {
+      ion_pool_->give(cache_, cache_.size() - ION_CACHE_LIMIT / 2);
+    }
   }
 };
 
+static boost::thread_specific_ptr<IonCache>* ion_caches_ =
+  new boost::thread_specific_ptr<IonCache>();
 
-IonCache ion_cache_;
+/**
+ * \returns the ion cache of the calling thread
+ */
+static IonCache& getIonCache() {
+  IonCache* cache = ion_caches_->get();
+  if (cache == NULL) {
+    cache = new IonCache();
+    ion_caches_->reset(cache);
+  }
+  return *cache;
+}
 
 
 // At one point I need to reverse the endianness for pfile_create to work
@@ -302,12 +349,12 @@ void Ion::freeIon(
   ion->pointer_count_--;
 
   if (ion->pointer_count_ <= 0) {
-    ion_cache_.checkin(ion);//delete ion;
+    getIonCache().checkin(ion);
   }
 }
 
 Ion* Ion::newIon() {
-  Ion* ion = ion_cache_.checkout();
+  Ion* ion = getIonCache().checkout();
   ion->init();
   return(ion);
 }
@@ -110,6 +110,10 @@ void Scorer::init() {
   bin_offset_ = 0;
   observed_ = NULL;
   theoretical_ = NULL;
+  max_bin_ = 0;
+  ion_b_y_sum_ = 0;
+  ion_flank_sum_ = 0;
+  ion_loss_sum_ = 0;
 }
 
 /**
@@ -1044,6 +1048,58 @@ FLOAT_T Scorer::scoreIntensityIonSeries(
   return ans / 10000.0;
 }
 
+/**
+ * Starts a new theoretical spectrum for addXcorrIon()
+ */
+void Scorer::clearXcorrIons() {
+  max_bin_ = getMaxBin();
+  ion_b_y_sum_ = 0.0;
+  ion_flank_sum_ = 0.0;
+  ion_loss_sum_ = 0.0;
+}
+
+/**
+ * Adds the observed intensity matched by one ion, as
+ * scoreIntensityIonSeries() does for each ion of the series
+ */
+void Scorer::addXcorrIon(
+  ION_TYPE_T ion_type, ///< B_ION, Y_ION or A_ION -in
+  int ion_charge, ///< charge of the ion -in
+  FLOAT_T ion_mass_z ///< m/z of the ion -in
+  ) {
+
+  int intensity_array_idx = INTEGERIZE(ion_mass_z, bin_width_, bin_offset_);
+  if (intensity_array_idx >= max_bin_) {
+    return;
+  }
+  if (ion_type == A_ION) {
+    ion_loss_sum_ += observed_[intensity_array_idx];
+    return;
+  }
+  ion_b_y_sum_ += observed_[intensity_array_idx];
+  if (use_flanks_) {
+    ion_flank_sum_ += observed_[intensity_array_idx-1];
+    if ((intensity_array_idx + 1) < max_bin_) {
+      ion_flank_sum_ += observed_[intensity_array_idx+1];
+    }
+  }
+  if (ion_type == B_ION) {
+    ion_loss_sum_ += observed_[INTEGERIZE((ion_mass_z - (MASS_H2O_MONO/ion_charge)),
+                                          bin_width_, bin_offset_)];
+  }
+  ion_loss_sum_ += observed_[INTEGERIZE((ion_mass_z - (MASS_NH3_MONO/ion_charge)),
+                                        bin_width_, bin_offset_)];
+}
+
+/**
+ * \returns the xcorr of the ions added since clearXcorrIons()
+ */
+FLOAT_T Scorer::getXcorrIonScore() {
+  FLOAT_T ans = ion_b_y_sum_ * B_Y_HEIGHT + ion_flank_sum_ * FLANK_HEIGHT +
+    ion_loss_sum_ * LOSS_HEIGHT;
+  return ans / 10000.0;
+}
+
 /**
  * create the intensity arrays for both observed and theoretical spectrum
  * SCORER must have been created for XCORR type
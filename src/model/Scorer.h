@@ -54,6 +54,10 @@ class Scorer {
   /// used for xcorr
   FLOAT_T* observed_; ///< used for Xcorr: observed spectrum intensity array
   FLOAT_T* theoretical_; ///< used for Xcorr: theoretical spectrum intensity array
+  int max_bin_; ///< used for Xcorr: getMaxBin(), cached while adding ions
+  FLOAT_T ion_b_y_sum_; ///< used for Xcorr: b, y intensity of added ions
+  FLOAT_T ion_flank_sum_; ///< used for Xcorr: flanking intensity of added ions
+  FLOAT_T ion_loss_sum_; ///< used for Xcorr: a ion and neutral loss intensity
 
   /**
    * Initializes an empty scorer object
@@ -414,6 +418,24 @@ class Scorer {
     FLOAT_T intensity
   );
 
+  /**
+   * XCorr of ions given by type, charge and m/z instead of as Ion objects
+   * of an IonSeries. After clearXcorrIons(), add the ions with
+   * addXcorrIon() in the order the IonSeries would hold them; then
+   * getXcorrIonScore() is what scoreSpectrumVIonSeries() would return for
+   * that series. The observed spectrum must have been preprocessed with
+   * createIntensityArrayXcorr().
+   */
+  void clearXcorrIons();
+
+  void addXcorrIon(
+    ION_TYPE_T ion_type, ///< B_ION, Y_ION or A_ION -in
+    int ion_charge, ///< charge of the ion -in
+    FLOAT_T ion_mass_z ///< m/z of the ion -in
+    );
+
+  FLOAT_T getXcorrIonScore();
+
 };
 
 
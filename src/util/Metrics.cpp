@@ -0,0 +1,116 @@
+#include "Metrics.h"
+#include "crux-utils.h"
+#include "Params.h"
+#include "StringUtils.h"
+#include "utils.h"
+#include "boost/date_time/posix_time/posix_time.hpp"
+#include "boost/thread/mutex.hpp"
+#include <cstdio>
+#include <fstream>
+#include <map>
+
+using namespace std;
+
+namespace {
+
+struct TimerTotal {
+  double seconds;
+  int64_t calls;
+  TimerTotal() : seconds(0), calls(0) {}
+};
+
+// Never destroyed, so that metrics can be recorded until the process exits
+boost::mutex* metrics_mutex = new boost::mutex();
+map<string, int64_t>* counters = new map<string, int64_t>();
+map<string, TimerTotal>* timers = new map<string, TimerTotal>();
+const boost::posix_time::ptime start_time =
+  boost::posix_time::microsec_clock::universal_time();
+
+string jsonString(const string& s) {
+  string quoted = "\"";
+  for (string::const_iterator i = s.begin(); i != s.end(); i++) {
+    if ((unsigned char)*i < 0x20) {
+      char escaped[7];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*i);
+      quoted += escaped;
+      continue;
+    } else if (*i == '"' || *i == '\\') {
+      quoted += '\\';
+    }
+    quoted += *i;
+  }
+  return quoted + '"';
+}
+
+}
+
+void Metrics::Add(const string& name, int64_t n) {
+  boost::mutex::scoped_lock lock(*metrics_mutex);
+  (*counters)[name] += n;
+}
+
+void Metrics::AddTime(const string& name, double seconds) {
+  boost::mutex::scoped_lock lock(*metrics_mutex);
+  TimerTotal& total = (*timers)[name];
+  total.seconds += seconds;
+  ++total.calls;
+}
+
+int64_t Metrics::Get(const string& name) {
+  boost::mutex::scoped_lock lock(*metrics_mutex);
+  map<string, int64_t>::const_iterator i = counters->find(name);
+  return i != counters->end() ? i->second : 0;
+}
+
+double Metrics::Now() {
+  return (boost::posix_time::microsec_clock::universal_time() - start_time)
+    .total_microseconds() / 1e6;
+}
+
+bool Metrics::Write(const string& path, const string& command) {
+  ofstream* file = create_stream_in_path(path.c_str(), NULL,
+                                         Params::GetBool("overwrite"));
+  if (!file->good()) {
+    delete file;
+    return false;
+  }
+  ofstream& out = *file;
+  boost::mutex::scoped_lock lock(*metrics_mutex);
+  out << "{" << endl
+      << "  \"command\": " << jsonString(command) << "," << endl
+      << "  \"elapsed_seconds\": " << StringUtils::ToString(wall_clock() / 1e6, 6) << ","
+      << endl
+      << "  \"timers\": {";
+  for (map<string, TimerTotal>::const_iterator i = timers->begin(); i != timers->end(); i++) {
+    out << (i == timers->begin() ? "" : ",") << endl
+        << "    " << jsonString(i->first) << ": {\"seconds\": "
+        << StringUtils::ToString(i->second.seconds, 6) << ", \"calls\": "
+        << i->second.calls << "}";
+  }
+  out << (timers->empty() ? "" : "\n  ") << "}," << endl
+      << "  \"counters\": {";
+  for (map<string, int64_t>::const_iterator i = counters->begin(); i != counters->end(); i++) {
+    out << (i == counters->begin() ? "" : ",") << endl
+        << "    " << jsonString(i->first) << ": " << i->second;
+  }
+  out << (counters->empty() ? "" : "\n  ") << "}" << endl
+      << "}" << endl;
+  bool ok = out.good();
+  delete file;
+  return ok;
+}
+
+Metrics::Timer::Timer(const string& name)
+  : name_(name), start_(Now()), running_(true) {
+}
+
+Metrics::Timer::~Timer() {
+  Stop();
+}
+
+void Metrics::Timer::Stop() {
+  if (running_) {
+    AddTime(name_, Now() - start_);
+    running_ = false;
+  }
+}
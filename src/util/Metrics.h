@@ -0,0 +1,60 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <string>
+
+/**
+ * Named timers and counters for the stages of a command, e.g. the time spent
+ * reading the index or the number of candidate peptides scored. When a
+ * command that writes to an output directory finishes, they are written as
+ * JSON to <command>.metrics.json next to its parameter file.
+ *
+ * Names are prefixed by the command, e.g. "tide-search.search". Updates take
+ * a lock, so loops should count locally and add their totals when done.
+ *
+ * Example usage:
+ * {
+ *   Metrics::Timer timer("tide-search.search");
+ *   ...
+ *   Metrics::Add("tide-search.candidates-scored", candidates);
+ * }
+ */
+class Metrics {
+ public:
+  // Adds n to counter name
+  static void Add(const std::string& name, int64_t n = 1);
+
+  // Adds seconds to the time of timer name, and one to its number of calls
+  static void AddTime(const std::string& name, double seconds);
+
+  // Current value of counter name
+  static int64_t Get(const std::string& name);
+
+  // Seconds since an arbitrary point, for timing
+  static double Now();
+
+  // Writes all timers and counters recorded so far as JSON, with the command
+  // line they were recorded for. An existing file is only replaced if
+  // --overwrite is set.
+  static bool Write(const std::string& path, const std::string& command);
+
+  // Times the scope it is declared in, or until Stop()
+  class Timer {
+   public:
+    explicit Timer(const std::string& name);
+    ~Timer();
+    void Stop();
+
+   private:
+    std::string name_;
+    double start_;
+    bool running_;
+  };
+
+ private:
+  Metrics();
+  ~Metrics();
+};
+
+#endif
@@ -189,11 +189,11 @@ Params::Params() : finalized_(false) {
   InitDoubleParam("min-mass", 200, 0, BILLION,
     "The minimum mass (in Da) of peptides to consider.",
     "Available from command line or parameter file for "
-    "crux-generate-peptides and crux tide-index. ", true);
+    "crux-generate-peptides, crux tide-index and crux read-tide-index. ", true);
   InitDoubleParam("max-mass", 7200, 1, BILLION,
     "The maximum mass (in Da) of peptides to consider.",
     "Available from command line or parameter file for "
-    "crux-generate-peptides and crux tide-index. ", true);
+    "crux-generate-peptides, crux tide-index and crux read-tide-index. ", true);
   InitIntParam("min-peaks", 20, 0, BILLION,
     "The minimum number of peaks a spectrum must have for it to be searched.",
     "Available for tide-search.", true);
@@ -316,8 +316,10 @@ Params::Params() : finalized_(false) {
     "Output an mzIdentML results file to the output directory.",
     "Available for tide-search, percolator.", true);
   InitBoolParam("pin-output", false,
-    "Output a Percolator input (PIN) file to the output directory.",
-    "Available for tide-search.", true);
+    "Output a Percolator input (PIN) file to the output directory. When "
+    "percolator converts its input itself, the PIN is otherwise passed to it "
+    "in memory.",
+    "Available for tide-search, percolator.", true);
   InitBoolParam("pout-output", false,
     "Output a Percolator [[html:<a href=\""
     "https://github.com/percolator/percolator/blob/master/src/xml/percolator_out.xsd\">]]"
@@ -410,6 +412,17 @@ Params::Params() : finalized_(false) {
     "The name of the directory where temporary files will be created. If this "
     "parameter is blank, then the system temporary directory will be used",
     "Available for tide-index.", true);
+  InitIntParam("max-index-memory", 0, 0, BILLION,
+    "Approximate amount of memory, in megabytes, used to hold peptides while "
+    "they are sorted. Peptides beyond this amount are sorted in runs that are "
+    "written to temp-dir and merged, allowing databases whose peptides do not "
+    "fit in memory to be indexed. 0 = no limit.",
+    "Available for tide-index.", true);
+  InitBoolParam("compact-index", false,
+    "Store the peptides of the index in a compact encoding, which takes less "
+    "disk space and is read faster by tide-search. Indexes written this way "
+    "cannot be read by older versions of Crux.",
+    "Available for tide-index.", true);
   // coder options regarding decoys
   InitIntParam("num-decoy-files", 1, 0, 10,
     "Replaces number-decoy-set.  Determined by decoy-location"
@@ -529,8 +542,8 @@ Params::Params() : finalized_(false) {
     "Set the precision for masses and m/z written to sqt and text files.",
     "Available for all commands.", true);
   InitIntParam("print-search-progress", 1000, 0, BILLION,
-    "Show search progress by printing every n spectra searched. Set to 0 to show no "
-    "search progress.",
+    "Show search progress by printing every n spectra searched, at most once per "
+    "second. Set to 0 to show no search progress.",
     "Available for tide-search", true);
   // Sp scoring params
   InitDoubleParam("max-mz", 4000, 0, BILLION,
@@ -908,7 +921,43 @@ Params::Params() : finalized_(false) {
                   "Available for tide-search", true);
   InitIntParam("num-threads", 0, 0, 64,
                "0=poll CPU to set num threads; else specify num threads directly.",
-               "Available for tide-search tab-delimited files only.", true);
+               "Available for tide-search tab-delimited files only and for tide-index, "
+               "barista, spectral-counts and param-medic.", true);
+  InitIntParam("peptide-prefetch", 4096, 0, 1000000,
+               "Number of peptides to read and parse ahead of each search thread, on "
+               "a thread of its own. 0 reads peptides on the search thread.",
+               "Available for tide-search.", true);
+  InitIntParam("spectrum-batch-size", 1, 1, 8,
+               "Number of spectra each search thread scores together against the "
+               "peptides within any of their precursor windows, reading the peaks of "
+               "each peptide once for all of them. Pays off when consecutive spectra "
+               "have wide, overlapping windows, as in open modification searches. "
+               "Only used for XCorr scoring without exact p-values or "
+               "peptide-centric search; 1 scores spectra one at a time.",
+               "Available for tide-search.", true);
+  InitIntParam("num-shards", 1, 1, 1024,
+               "Split the search into this many worker processes, each searching a "
+               "contiguous precursor mass range of the spectra and reading only the "
+               "matching part of the index. Unless shard is set, tide-search launches "
+               "the workers itself, divides num-threads among them, and merges their "
+               "results into the same output a single process would write.",
+               "Available for tide-search. Not available with peptide-centric-search "
+               "or store-spectra.", true);
+  InitIntParam("shard", -1, -1, 1023,
+               "When num-shards > 1, run only the worker for this shard (numbered from 0) "
+               "and write its partial results to tide-search.shard-<n>.* in the output "
+               "directory. -1 runs all of the shards locally.",
+               "Available for tide-search. Used to run shards on separate machines; "
+               "combine the results with merge-shards.", true);
+  InitBoolParam("merge-shards", false,
+                "Merge the partial results of num-shards shards, previously written to "
+                "the output directory by tide-search with shard set, without searching.",
+                "Available for tide-search.", true);
+  InitStringParam("shard-spectrumrecords", "",
+                  "Comma-separated spectrumrecords files holding the spectra of the "
+                  "spectrum files, in order, as converted by tide-search for its "
+                  "shard workers.",
+                  "Used internally by tide-search with num-shards.", false);
   /*
    * Comet parameters
    */
@@ -1890,6 +1939,11 @@ Params::Params() : finalized_(false) {
     "Minimum number of peak pairs (for precursor or fragment) that must be "
     "successfully paired in order to attempt to estimate measurement error distribution.",
     "Available for param-medic and tide-search and comet", true);
+  InitBoolParam("pm-early-stop", false,
+    "Stop reading spectra once the estimated precursor and fragment error "
+    "distributions no longer change as more spectra are added. Modification "
+    "detection then only sees the spectra read up to that point.",
+    "Available for param-medic and tide-search and comet", true);
   // localize-modification
   InitDoubleParam("min-mod-mass", 0, 0, BILLION,
     "Ignore implied modifications where the absolute value of its mass is "
@@ -2055,6 +2109,11 @@ void Params::Categorize() {
   items.clear();
   items.insert("num-threads");
   items.insert("num_threads");
+  items.insert("num-shards");
+  items.insert("peptide-prefetch");
+  items.insert("spectrum-batch-size");
+  items.insert("shard");
+  items.insert("merge-shards");
   AddCategory("CPU threads", items);
 
   items.clear();
@@ -2168,6 +2227,7 @@ void Params::Categorize() {
 
   items.clear();
   items.insert("pm-charges");
+  items.insert("pm-early-stop");
   items.insert("pm-max-frag-mz");
   items.insert("pm-max-precursor-delta-ppm");
   items.insert("pm-max-precursor-mz");
@@ -2221,6 +2281,8 @@ void Params::Categorize() {
   items.insert("store-index");
   items.insert("store-spectra");
   items.insert("temp-dir");
+  items.insert("max-index-memory");
+  items.insert("compact-index");
   items.insert("top-match");
   items.insert("txt-output");
   items.insert("use-z-line");
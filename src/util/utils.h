@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <cmath>
 #include <limits>
+#include "boost/random/mersenne_twister.hpp"
 
 /*#ifndef linux
 #include <ieeefp.h>
@@ -243,5 +244,11 @@ int myrandom();
 int myrandom_limit(int max);
 void mysrandom(unsigned seed);
 
+/**
+ * The generator behind myrandom(), for callers that draw from a copy of it
+ * and later write the copy back.
+ */
+boost::mt19937& get_mt19937();
+
 #endif
 
@@ -0,0 +1,408 @@
+/**
+ * \file TideBenchmark.cpp
+ * \brief Micro-benchmarks of the kernels of tide-search.
+ *
+ * Usage: tide-benchmark [--seed N] [--proteins N] [--spectra N]
+ *
+ * Proteins, peptides and spectra are generated from the seed, so runs with the
+ * same arguments time the same work on any machine. For each kernel the time
+ * per item and the number of items per second are printed:
+ *
+ *   record-reader        peptide records read from a peptide file
+ *   preprocess-spectrum  spectrum-charges through ObservedPeakSet
+ *   set-active-range     peptides decoded and compiled by ActivePeptideQueue
+ *   score-compiled       candidates scored by the compiled dot products
+ *   report-matches       spectrum-charges reported by TideMatchSet
+ *   score-count-dp       exact p-value score count tables computed
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "app/TideSearchApplication.h"
+#include "app/TideMatchSet.h"
+#include "app/tide/active_peptide_queue.h"
+#include "app/tide/mass_constants.h"
+#include "app/tide/max_mz.h"
+#include "app/tide/protein_blob.h"
+#include "app/tide/records.h"
+#include "app/tide/spectrum_collection.h"
+#include "app/tide/spectrum_preprocess.h"
+#include "util/FileUtils.h"
+#include "util/Metrics.h"
+#include "util/Params.h"
+#include "util/StringUtils.h"
+#include "util/utils.h"
+
+using namespace std;
+
+namespace {
+
+const char kResidues[] = "ACDEFGHIKLMNPQRSTVWY";
+const int kProteinLength = 400;
+const int kPeptidesPerProtein = 50;
+const int kMinPeptideLength = 7;
+const int kMaxPeptideLength = 25;
+const int kPeaksPerSpectrum = 200;
+const int kTopMatches = 5;
+const double kPrecursorWindow = 3.0; // Da
+const string kPeptidesFile = "tide-benchmark.pepix.tmp";
+const string kResultsFile = "tide-benchmark.txt.tmp";
+
+double uniform(double min, double max) {
+  return min + (max - min) * myrandom() / UNIFORM_INT_DISTRIBUTION_MAX;
+}
+
+double peptideMass(const string& residues, int pos, int length) {
+  double mass = MassConstants::mono_h2o;
+  for (int i = pos; i < pos + length; ++i) {
+    mass += MassConstants::mono_table[residues[i]];
+  }
+  return mass;
+}
+
+bool byMass(const pb::Peptide* x, const pb::Peptide* y) {
+  return x->mass() < y->mass();
+}
+
+/**
+ * Exposes the protected scoring kernel of tide-search.
+ */
+class BenchmarkSearch : public TideSearchApplication {
+ public:
+  void scoreCompiled(ActivePeptideQueue* queue, const Spectrum* spectrum,
+                     const ObservedPeakSet& observed,
+                     TideMatchSet::Arr2* match_arr, int queue_size, int charge) {
+    collectScoresCompiled(queue, spectrum, observed, match_arr, queue_size, charge);
+  }
+};
+
+class Benchmarks {
+ public:
+  Benchmarks(int num_proteins, int num_spectra)
+    : num_proteins_(num_proteins), num_spectra_(num_spectra) {
+  }
+
+  ~Benchmarks() {
+    for (vector<const pb::Protein*>::iterator i = proteins_.begin();
+         i != proteins_.end();
+         ++i) {
+      delete *i;
+    }
+    for (vector<Spectrum*>::iterator i = spectra_.begin(); i != spectra_.end(); ++i) {
+      delete *i;
+    }
+    FileUtils::Remove(kPeptidesFile);
+    FileUtils::Remove(kResultsFile);
+  }
+
+  void generate();
+  void run();
+
+ private:
+  void report(const string& name, int64_t items, double seconds) const;
+  void benchmarkRecordReader();
+  void benchmarkSearch();
+  void benchmarkScoreCountDP();
+
+  int num_proteins_;
+  int num_spectra_;
+  double highest_mz_;
+  vector<const pb::Protein*> proteins_;
+  ProteinBlob protein_blob_;
+  vector<Spectrum*> spectra_;
+  vector<SpectrumCollection::SpecCharge> spec_charges_;
+};
+
+/**
+ * Writes a file of random peptides of random proteins in order of mass, and
+ * makes one spectrum-charge for a random peptide of every spectrum, with its
+ * b and y ions among random noise peaks.
+ */
+void Benchmarks::generate() {
+  for (int i = 0; i < num_proteins_; ++i) {
+    pb::Protein* protein = new pb::Protein;
+    protein->set_id(i);
+    protein->set_name("protein_" + StringUtils::ToString(i));
+    string residues(kProteinLength, 'A');
+    for (int j = 0; j < kProteinLength; ++j) {
+      residues[j] = kResidues[myrandom_limit(sizeof(kResidues) - 1)];
+    }
+    protein->set_residues(residues);
+    proteins_.push_back(protein);
+  }
+  protein_blob_.Build(proteins_);
+
+  vector<pb::Peptide*> peptides;
+  for (int i = 0; i < num_proteins_; ++i) {
+    const string& residues = proteins_[i]->residues();
+    for (int j = 0; j < kPeptidesPerProtein; ++j) {
+      int length = kMinPeptideLength +
+        myrandom_limit(kMaxPeptideLength - kMinPeptideLength + 1);
+      int pos = myrandom_limit(residues.length() - length + 1);
+      pb::Peptide* peptide = new pb::Peptide;
+      peptide->set_mass(peptideMass(residues, pos, length));
+      peptide->set_length(length);
+      peptide->mutable_first_location()->set_protein_id(i);
+      peptide->mutable_first_location()->set_pos(pos);
+      peptides.push_back(peptide);
+    }
+  }
+  sort(peptides.begin(), peptides.end(), byMass);
+
+  highest_mz_ = 0;
+  {
+    RecordWriter writer(kPeptidesFile);
+    for (size_t i = 0; i < peptides.size(); ++i) {
+      peptides[i]->set_id(i);
+      writer.Write(peptides[i]);
+    }
+  }
+
+  for (int i = 0; i < num_spectra_; ++i) {
+    const pb::Peptide* peptide = peptides[myrandom_limit(peptides.size())];
+    const char* residues = proteins_[peptide->first_location().protein_id()]
+      ->residues().data() + peptide->first_location().pos();
+    int charge = 2 + myrandom_limit(2);
+    Spectrum* spectrum = new Spectrum(i + 1,
+      (peptide->mass() + charge * MASS_PROTON) / charge);
+    spectrum->AddChargeState(charge);
+
+    vector<pair<double, double> > peaks;
+    double b = MASS_PROTON;
+    for (int j = 0; j < peptide->length() - 1; ++j) {
+      b += MassConstants::mono_table[residues[j]];
+      peaks.push_back(make_pair(b, uniform(100, 1000)));
+      peaks.push_back(make_pair(peptide->mass() + 2 * MASS_PROTON - b,
+                                uniform(100, 1000)));
+    }
+    while ((int)peaks.size() < kPeaksPerSpectrum) {
+      peaks.push_back(make_pair(uniform(100, peptide->mass()), uniform(1, 300)));
+    }
+    sort(peaks.begin(), peaks.end());
+    spectrum->ReservePeaks(peaks.size());
+    for (size_t j = 0; j < peaks.size(); ++j) {
+      spectrum->AddPeak(peaks[j].first, peaks[j].second);
+    }
+    highest_mz_ = max(highest_mz_, max(peaks.back().first, peptide->mass()));
+
+    spectra_.push_back(spectrum);
+    spec_charges_.push_back(SpectrumCollection::SpecCharge(
+      peptide->mass(), charge, spectrum, i));
+  }
+  sort(spec_charges_.begin(), spec_charges_.end());
+
+  for (vector<pb::Peptide*>::iterator i = peptides.begin(); i != peptides.end(); ++i) {
+    delete *i;
+  }
+  MaxBin::SetGlobalMax(highest_mz_);
+}
+
+void Benchmarks::run() {
+  cout << left << setw(22) << "benchmark" << right << setw(12) << "items"
+       << setw(14) << "ns/item" << setw(14) << "items/s" << endl;
+  benchmarkRecordReader();
+  benchmarkSearch();
+  benchmarkScoreCountDP();
+}
+
+void Benchmarks::report(const string& name, int64_t items, double seconds) const {
+  cout << left << setw(22) << name << right << setw(12) << items
+       << fixed << setprecision(1)
+       << setw(14) << (items > 0 ? seconds * 1e9 / items : 0.0)
+       << setprecision(0)
+       << setw(14) << (seconds > 0 ? items / seconds : 0.0) << endl;
+}
+
+void Benchmarks::benchmarkRecordReader() {
+  RecordReader reader(kPeptidesFile);
+  pb::Peptide peptide;
+  int64_t items = 0;
+  double start = Metrics::Now();
+  while (!reader.Done()) {
+    reader.Read(&peptide);
+    ++items;
+  }
+  report("record-reader", items, Metrics::Now() - start);
+}
+
+/**
+ * Times the kernels of a spectrum-centric XCorr search separately, in the
+ * order in which tide-search runs them for each spectrum-charge.
+ */
+void Benchmarks::benchmarkSearch() {
+  BenchmarkSearch search;
+  RecordReader reader(kPeptidesFile);
+  ActivePeptideQueue queue(&reader, protein_blob_);
+  queue.SetBinSize(MassConstants::bin_width_, MassConstants::bin_offset_);
+  ObservedPeakSet observed(MassConstants::bin_width_, MassConstants::bin_offset_,
+                           Params::GetBool("use-neutral-loss-peaks"),
+                           Params::GetBool("use-flanking-peaks"));
+  vector<const pb::AuxLocation*> locations;
+  ofstream results(kResultsFile.c_str());
+  boost::mutex lock;
+
+  double preprocess_time = 0, range_time = 0, score_time = 0, report_time = 0;
+  int64_t candidates = 0;
+  int reported = 0;
+  for (vector<SpectrumCollection::SpecCharge>::const_iterator sc = spec_charges_.begin();
+       sc != spec_charges_.end();
+       ++sc) {
+    double start = Metrics::Now();
+    observed.PreprocessSpectrum(*sc->spectrum, sc->charge);
+    double end = Metrics::Now();
+    preprocess_time += end - start;
+
+    vector<double> min_mass(1, sc->neutral_mass - kPrecursorWindow);
+    vector<double> max_mass(1, sc->neutral_mass + kPrecursorWindow);
+    start = Metrics::Now();
+    int num_candidates = queue.SetActiveRange(&min_mass, &max_mass,
+      min_mass[0], max_mass[0]);
+    end = Metrics::Now();
+    range_time += end - start;
+    if (num_candidates == 0) {
+      continue;
+    }
+
+    int queue_size = queue.end_ - queue.iter_;
+    TideMatchSet::Arr2 match_arr2(num_candidates);
+    start = Metrics::Now();
+    search.scoreCompiled(&queue, sc->spectrum, observed, &match_arr2,
+                         queue_size, sc->charge);
+    end = Metrics::Now();
+    score_time += end - start;
+    candidates += num_candidates;
+
+    start = Metrics::Now();
+    TideMatchSet::Arr match_arr(num_candidates);
+    for (TideMatchSet::Arr2::iterator i = match_arr2.begin(); i != match_arr2.end(); ++i) {
+      TideMatchSet::Scores score;
+      score.xcorr_score = (double)(i->first / TideSearchApplication::XCORR_SCALING);
+      score.rank = i->second;
+      match_arr.push_back(score);
+    }
+    TideMatchSet matches(&match_arr, highest_mz_);
+    matches.report(&results, &results, kTopMatches, 0, kPeptidesFile,
+                   sc->spectrum, sc->charge, &queue, protein_blob_, locations,
+                   false, true, &lock);
+    end = Metrics::Now();
+    report_time += end - start;
+    ++reported;
+  }
+
+  report("preprocess-spectrum", spec_charges_.size(), preprocess_time);
+  report("set-active-range", queue.PeptidesDecoded(), range_time);
+  report("score-compiled", candidates, score_time);
+  report("report-matches", reported, report_time);
+}
+
+/**
+ * Times the dynamic program that counts the peptides of each score for the
+ * exact p-value of XCorr, on the evidence vector of each spectrum-charge.
+ */
+void Benchmarks::benchmarkScoreCountDP() {
+  BenchmarkSearch search;
+  double* aa_freq_n = NULL;
+  double* aa_freq_i = NULL;
+  double* aa_freq_c = NULL;
+  int* aa_mass = NULL;
+  int num_aa;
+  {
+    RecordReader reader(kPeptidesFile);
+    ActivePeptideQueue queue(&reader, protein_blob_);
+    num_aa = queue.CountAAFrequency(MassConstants::bin_width_, MassConstants::bin_offset_,
+                                    &aa_freq_n, &aa_freq_i, &aa_freq_c, &aa_mass);
+  }
+  int max_precursor_bin = floor(MaxBin::Global().CacheBinEnd() + 50.0);
+
+  double seconds = 0;
+  int64_t items = 0;
+  for (vector<SpectrumCollection::SpecCharge>::const_iterator sc = spec_charges_.begin();
+       sc != spec_charges_.end();
+       ++sc) {
+    int mass_bin = MassConstants::mass2bin(sc->neutral_mass);
+    double mean_mass = (mass_bin - 0.5 + MassConstants::bin_offset_) * MassConstants::bin_width_;
+    vector<int> evidence = sc->spectrum->CreateEvidenceVectorDiscretized(
+      MassConstants::bin_width_, MassConstants::bin_offset_, sc->charge,
+      mean_mass, max_precursor_bin);
+    int max_evidence = *max_element(evidence.begin(), evidence.end());
+    int min_evidence = *min_element(evidence.begin(), evidence.end());
+    int max_residues = (int)floor((double)mass_bin / (double)aa_mass[0]);
+    vector<int> sorted(evidence.begin(), evidence.end());
+    sort(sorted.begin(), sorted.end(), greater<int>());
+    int max_score = 0;
+    int min_score = 0;
+    for (int i = 0; i < max_residues; ++i) {
+      max_score += sorted[i];
+      min_score += sorted[max_precursor_bin - 1 - i];
+    }
+    vector<double> score_counts(
+      max_evidence + 1 - min_score + 1 + max_score - min_evidence);
+
+    double start = Metrics::Now();
+    search.calcScoreCount(max_precursor_bin, &evidence[0], mass_bin,
+                          max_evidence, min_evidence, max_score, min_score,
+                          num_aa, aa_freq_n, aa_freq_i, aa_freq_c, aa_mass,
+                          &score_counts[0]);
+    seconds += Metrics::Now() - start;
+    ++items;
+  }
+  report("score-count-dp", items, seconds);
+
+  delete[] aa_freq_n;
+  delete[] aa_freq_i;
+  delete[] aa_freq_c;
+  delete[] aa_mass;
+}
+
+}
+
+int main(int argc, char** argv) {
+  unsigned int seed = 1;
+  int num_proteins = 2000;
+  int num_spectra = 2000;
+  for (int i = 1; i < argc; i += 2) {
+    string option = argv[i];
+    if (i + 1 >= argc) {
+      cerr << "Missing value for " << option << endl;
+      return 1;
+    } else if (option == "--seed") {
+      seed = atoi(argv[i + 1]);
+    } else if (option == "--proteins") {
+      num_proteins = atoi(argv[i + 1]);
+    } else if (option == "--spectra") {
+      num_spectra = atoi(argv[i + 1]);
+    } else {
+      cerr << "Usage: " << argv[0]
+           << " [--seed N] [--proteins N] [--spectra N]" << endl;
+      return 1;
+    }
+  }
+  if (num_proteins <= 0 || num_spectra <= 0) {
+    cerr << "--proteins and --spectra must be positive" << endl;
+    return 1;
+  }
+
+  set_verbosity_level(CARP_ERROR);
+  mysrandom(seed);
+  pb::ModTable mods;
+  MassConstants::Init(&mods, &mods, &mods,
+                      Params::GetDouble("mz-bin-width"),
+                      Params::GetDouble("mz-bin-offset"));
+
+  cout << "seed " << seed << ", " << num_proteins << " proteins, "
+       << num_spectra << " spectra" << endl;
+  Benchmarks benchmarks(num_proteins, num_spectra);
+  benchmarks.generate();
+  benchmarks.run();
+  return 0;
+}
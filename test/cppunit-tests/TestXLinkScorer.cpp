@@ -0,0 +1,101 @@
+#include <cppunit/config/SourcePrefix.h>
+#include "TestXLinkScorer.h"
+#include "XLinkPeptide.h"
+#include "SelfLoopPeptide.h"
+#include "XLinkablePeptide.h"
+#include "model/IonConstraint.h"
+#include "model/IonSeries.h"
+#include "model/Peptide.h"
+#include "model/Scorer.h"
+#include "model/Spectrum.h"
+#include "util/GlobalParams.h"
+#include "util/mass.h"
+#include "parameter.h"
+
+using namespace std;
+using namespace Crux;
+
+CPPUNIT_TEST_SUITE_REGISTRATION( TestXLinkScorer );
+
+void TestXLinkScorer::setUp(){
+  initialize_parameters();
+  GlobalParams::set();
+  XLinkPeptide::setLinkerMass(138.0680796);
+
+  pep1 = new Peptide("VAKLSEDR");
+  pep2 = new Peptide("GSKYEAPR");
+  loop_pep = new Peptide("AKDLSKVEPR");
+}
+
+void TestXLinkScorer::tearDown(){
+  delete pep1;
+  delete pep2;
+  delete loop_pep;
+}
+
+FLOAT_T TestXLinkScorer::ionSeriesXCorr(Spectrum* spectrum,
+                                        IonSeries* ion_series){
+  Scorer scorer(XCORR);
+  return scorer.scoreSpectrumVIonSeries(spectrum, ion_series);
+}
+
+Spectrum* TestXLinkScorer::makeSpectrum(FLOAT_T mass){
+  vector<int> possible_z(1, charge);
+  Spectrum* spectrum = new Spectrum(1, 1, (mass + charge*MASS_PROTON)/charge,
+                                    possible_z, "");
+  for (int i = 0; i < 2000; i++) {
+    spectrum->addPeak(1 + (i*37) % 101, 150 + i*0.7);
+  }
+  return spectrum;
+}
+
+void TestXLinkScorer::crossLinkMatchesIonSeries(){
+  vector<int> sites(1, 2);
+  XLinkablePeptide xpep1(pep1, sites);
+  XLinkablePeptide xpep2(pep2, sites);
+  XLinkPeptide candidate(xpep1, xpep2, 0, 0);
+  MASS_TYPE_T mass_type = GlobalParams::getIsotopicMass();
+  Spectrum* spectrum = makeSpectrum(candidate.getMass(mass_type));
+
+  // XLinkScorer::scoreCandidate() scores each peptide with the other one as
+  // a mass shift on its link site
+  IonConstraint* constraint = IonConstraint::newIonConstraintSmart(XCORR, charge);
+  IonSeries ion_series(constraint, charge);
+  FLOAT_T expected = 0;
+  for (int i = 0; i < 2; i++) {
+    XLinkablePeptide& xpep = candidate.getXLinkablePeptide(i);
+    XLinkablePeptide& other = candidate.getXLinkablePeptide(1 - i);
+    xpep.predictIons(&ion_series, charge, candidate.getLinkIdx(i),
+                     other.getMass(mass_type) + XLinkPeptide::getLinkerMass());
+    expected += ionSeriesXCorr(spectrum, &ion_series);
+  }
+
+  XLinkScorer scorer(spectrum, charge, false);
+  FLOAT_T xcorr = scorer.scoreCandidate(&candidate);
+  CPPUNIT_ASSERT(expected > 0);
+  CPPUNIT_ASSERT_EQUAL(expected, xcorr);
+
+  delete constraint;
+  delete spectrum;
+}
+
+void TestXLinkScorer::selfLoopMatchesIonSeries(){
+  vector<int> sites;
+  XLinkablePeptide xpep(loop_pep, sites);
+  SelfLoopPeptide candidate(xpep, 1, 5);
+  Spectrum* spectrum = makeSpectrum(
+    candidate.getMass(GlobalParams::getIsotopicMass()));
+
+  IonConstraint* constraint = IonConstraint::newIonConstraintSmart(XCORR, charge);
+  IonSeries ion_series(constraint, charge);
+  candidate.predictIons(&ion_series, charge);
+  FLOAT_T expected = ionSeriesXCorr(spectrum, &ion_series);
+
+  XLinkScorer scorer(spectrum, charge, false);
+  FLOAT_T xcorr = scorer.scoreCandidate(&candidate);
+  CPPUNIT_ASSERT(expected > 0);
+  CPPUNIT_ASSERT_EQUAL(expected, xcorr);
+
+  delete constraint;
+  delete spectrum;
+}
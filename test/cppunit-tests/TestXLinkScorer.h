@@ -0,0 +1,35 @@
+#ifndef CPP_UNIT_XLINKSCORER_H
+#define CPP_UNIT_XLINKSCORER_H
+
+#include <cppunit/extensions/HelperMacros.h>
+#include "XLinkScorer.h"
+
+class TestXLinkScorer : public CPPUNIT_NS::TestFixture
+{
+  CPPUNIT_TEST_SUITE( TestXLinkScorer );
+  CPPUNIT_TEST( crossLinkMatchesIonSeries );
+  CPPUNIT_TEST( selfLoopMatchesIonSeries );
+  CPPUNIT_TEST_SUITE_END();
+  
+ protected:
+  // variables to use in testing
+  static const int charge = 3;
+  Crux::Peptide* pep1;
+  Crux::Peptide* pep2;
+  Crux::Peptide* loop_pep;
+
+  // scores the ions of a candidate the way the ion series path does
+  FLOAT_T ionSeriesXCorr(Crux::Spectrum* spectrum, IonSeries* ion_series);
+  // a dense spectrum, so that most ions of the candidate match a peak
+  Crux::Spectrum* makeSpectrum(FLOAT_T mass);
+
+ public:
+  void setUp();
+  void tearDown();
+
+ protected:
+  void crossLinkMatchesIonSeries();
+  void selfLoopMatchesIonSeries();
+};
+
+#endif //CPP_UNIT_XLINKSCORER_H
@@ -0,0 +1,235 @@
+#!/usr/bin/env python
+# This script measures the throughput of the main crux pipeline and how it
+# scales with the number of threads. It generates a random proteome and
+# spectra of random peptides from them (or uses given FASTA and MS2 files),
+# then runs
+#
+#   tide-index
+#   tide-search with XCorr, with exact p-values and with residue evidence
+#   assign-confidence and percolator on the XCorr results
+#
+# once for each value of --threads (for the commands that are threaded), and
+# appends one line per run to a CSV file: wall, user and system time, peak
+# resident set size, spectra per second and the bytes read and written.
+# Runs of the same arguments on the same machine are comparable, so the CSV
+# files of successive releases can be concatenated and plotted.
+#
+# Example:
+#   ./run-scaling-test.py --proteins 20000 --spectra 50000 \
+#     --mods "C+57.02146,2M+15.9949" --threads 1,2,4,8,16 --label 4.0
+import argparse
+import csv
+import os
+import random
+import shutil
+import subprocess
+import sys
+import time
+
+# Masses used to generate spectra.
+PROTON = 1.00727646688
+WATER = 18.0105646863
+RESIDUES = {
+  "A": 71.03711, "C": 103.00919 + 57.02146, "D": 115.02694, "E": 129.04259,
+  "F": 147.06841, "G": 57.02146, "H": 137.05891, "I": 113.08406,
+  "K": 128.09496, "L": 113.08406, "M": 131.04049, "N": 114.04293,
+  "P": 97.05276, "Q": 128.05858, "R": 156.10111, "S": 87.03203,
+  "T": 101.04768, "V": 99.06841, "W": 186.07931, "Y": 163.06333
+}
+AMINO_ACIDS = "".join(sorted(RESIDUES.keys()))
+
+COLUMNS = ["label", "command", "variant", "threads", "proteins", "spectra",
+           "mods", "precursor_window", "wall_seconds", "user_seconds",
+           "system_seconds", "peak_rss_mb", "spectra_per_second",
+           "input_bytes", "output_bytes"]
+
+#############################################################################
+def makeProteome(fileName, numProteins, length, rng):
+  proteins = []
+  with open(fileName, "w") as fasta:
+    for i in range(numProteins):
+      residues = "".join(rng.choice(AMINO_ACIDS) for j in range(length))
+      proteins.append(residues)
+      fasta.write(">protein_%d\n" % i)
+      for j in range(0, length, 60):
+        fasta.write(residues[j:j + 60] + "\n")
+  return proteins
+
+#############################################################################
+# Writes spectra of tryptic peptides of the proteins: their b and y ions
+# among noise peaks.
+def makeSpectra(fileName, proteins, numSpectra, rng):
+  with open(fileName, "w") as ms2:
+    ms2.write("H\tCreationDate\t%s\n" % time.strftime("%Y-%m-%d"))
+    ms2.write("H\tExtractor\trun-scaling-test.py\n")
+    for scan in range(1, numSpectra + 1):
+      protein = rng.choice(proteins)
+      sites = [i + 1 for i, aa in enumerate(protein[:-1]) if aa in "KR"]
+      start = rng.choice([0] + sites)
+      end = min([s for s in sites if s > start + 6] + [len(protein)])
+      peptide = protein[start:min(end, start + 40)]
+      mass = sum(RESIDUES[aa] for aa in peptide) + WATER
+      charge = rng.choice([2, 3])
+      peaks = []
+      b = PROTON
+      for aa in peptide[:-1]:
+        b += RESIDUES[aa]
+        peaks.append((b, rng.uniform(100, 1000)))
+        peaks.append((mass + 2 * PROTON - b, rng.uniform(100, 1000)))
+      for i in range(100):
+        peaks.append((rng.uniform(100, mass), rng.uniform(1, 300)))
+      ms2.write("S\t%d\t%d\t%.5f\n" % (scan, scan, (mass + charge * PROTON) / charge))
+      ms2.write("Z\t%d\t%.5f\n" % (charge, mass + PROTON))
+      for mz, intensity in sorted(peaks):
+        ms2.write("%.4f %.1f\n" % (mz, intensity))
+
+#############################################################################
+def pathSize(path):
+  if os.path.isfile(path):
+    return os.path.getsize(path)
+  total = 0
+  for root, dirs, files in os.walk(path):
+    for name in files:
+      total += os.path.getsize(os.path.join(root, name))
+  return total
+
+#############################################################################
+# Runs a command and returns its wall time and resource usage. os.wait4
+# gives the usage of this child alone, so peak RSS is per command.
+def runCommand(command):
+  sys.stderr.write("RUN: %s\n" % " ".join(command))
+  start = time.time()
+  try:
+    child = subprocess.Popen(command)
+  except OSError as e:
+    sys.stderr.write("Execution failed: %s\n" % e)
+    sys.exit(1)
+  pid, status, usage = os.wait4(child.pid, 0)
+  wall = time.time() - start
+  child.returncode = 0 # already reaped
+  if status != 0:
+    sys.stderr.write("Command failed with status %d\n" % status)
+    sys.exit(1)
+  return wall, usage
+
+#############################################################################
+def main():
+  parser = argparse.ArgumentParser(
+    description="Measure crux throughput as a function of threads.")
+  parser.add_argument("--crux", default="../../src/crux")
+  parser.add_argument("--fasta", help="Use this FASTA instead of a random one.")
+  parser.add_argument("--ms2", help="Use these spectra instead of random ones.")
+  parser.add_argument("--proteins", type=int, default=5000)
+  parser.add_argument("--protein-length", type=int, default=400)
+  parser.add_argument("--spectra", type=int, default=10000)
+  parser.add_argument("--mods", default="C+57.02146",
+                      help="mods-spec for tide-index")
+  parser.add_argument("--max-mods", type=int, default=255)
+  parser.add_argument("--precursor-window", type=float, default=10.0)
+  parser.add_argument("--precursor-window-type", default="ppm")
+  parser.add_argument("--threads", default="1,2,4,8",
+                      help="Comma-separated thread counts to sweep.")
+  parser.add_argument("--searches", default="xcorr,exact-p-value,res-ev",
+                      help="Comma-separated subset of xcorr,exact-p-value,res-ev.")
+  parser.add_argument("--seed", type=int, default=1)
+  parser.add_argument("--label", default="",
+                      help="Label for the rows, e.g. the release. Defaults to "
+                           "the crux version.")
+  parser.add_argument("--work-dir", default="scaling-test")
+  parser.add_argument("--output", default="scaling-test.csv",
+                      help="CSV file to append to.")
+  args = parser.parse_args()
+
+  crux = os.path.abspath(args.crux)
+  threads = [int(t) for t in args.threads.split(",")]
+  searches = args.searches.split(",")
+  label = args.label
+  if label == "":
+    label = subprocess.check_output([crux, "version"]).decode().strip().split()[-1]
+
+  if not os.path.exists(args.work_dir):
+    os.makedirs(args.work_dir)
+  rng = random.Random(args.seed)
+  fasta = args.fasta
+  numProteins = args.proteins
+  if fasta is None:
+    fasta = os.path.join(args.work_dir, "proteins.fasta")
+    proteins = makeProteome(fasta, args.proteins, args.protein_length, rng)
+  else:
+    proteins = []
+    numProteins = sum(1 for line in open(fasta) if line.startswith(">"))
+  ms2 = args.ms2
+  numSpectra = args.spectra
+  if ms2 is None:
+    if not proteins:
+      sys.stderr.write("--ms2 is required with --fasta\n")
+      sys.exit(1)
+    ms2 = os.path.join(args.work_dir, "spectra.ms2")
+    makeSpectra(ms2, proteins, args.spectra, rng)
+  else:
+    numSpectra = sum(1 for line in open(ms2) if line.startswith("S"))
+
+  newFile = not os.path.exists(args.output)
+  out = open(args.output, "a")
+  writer = csv.DictWriter(out, COLUMNS)
+  if newFile:
+    writer.writeheader()
+
+  def record(command, variant, numThreads, wall, usage, inputs, outputDir,
+             spectra):
+    writer.writerow({
+      "label": label, "command": command, "variant": variant,
+      "threads": numThreads, "proteins": numProteins, "spectra": numSpectra,
+      "mods": args.mods, "precursor_window": "%g %s" % (
+        args.precursor_window, args.precursor_window_type),
+      "wall_seconds": "%.3f" % wall,
+      "user_seconds": "%.3f" % usage.ru_utime,
+      "system_seconds": "%.3f" % usage.ru_stime,
+      # ru_maxrss is in kilobytes on Linux and bytes on OS X.
+      "peak_rss_mb": "%.1f" % (usage.ru_maxrss /
+        (1024.0 * 1024.0 if sys.platform == "darwin" else 1024.0)),
+      "spectra_per_second": "%.1f" % (spectra / wall) if spectra else "",
+      "input_bytes": sum(pathSize(p) for p in inputs),
+      "output_bytes": pathSize(outputDir)})
+    out.flush()
+
+  index = os.path.join(args.work_dir, "index")
+  searchVariants = {
+    "xcorr": [],
+    "exact-p-value": ["--exact-p-value", "T", "--mz-bin-width", "1.0005079"],
+    "res-ev": ["--score-function", "residue-evidence"]
+  }
+  lastXcorr = None
+  for numThreads in threads:
+    outputDir = os.path.join(args.work_dir, "tide-index.%d" % numThreads)
+    wall, usage = runCommand([crux, "tide-index", "--overwrite", "T",
+      "--output-dir", outputDir, "--num-threads", str(numThreads),
+      "--mods-spec", args.mods, "--max-mods", str(args.max_mods),
+      fasta, index])
+    record("tide-index", "", numThreads, wall, usage, [fasta], index, 0)
+
+    for search in searches:
+      outputDir = os.path.join(args.work_dir, "tide-search.%s.%d" % (search, numThreads))
+      wall, usage = runCommand([crux, "tide-search", "--overwrite", "T",
+        "--output-dir", outputDir, "--num-threads", str(numThreads),
+        "--precursor-window", str(args.precursor_window),
+        "--precursor-window-type", args.precursor_window_type] +
+        searchVariants[search] + [ms2, index])
+      record("tide-search", search, numThreads, wall, usage, [ms2, index],
+             outputDir, numSpectra)
+      if search == "xcorr":
+        lastXcorr = os.path.join(outputDir, "tide-search.target.txt")
+
+  # Post-processing is single-threaded, so it is run once.
+  if lastXcorr is not None:
+    for command in ["assign-confidence", "percolator"]:
+      outputDir = os.path.join(args.work_dir, command)
+      wall, usage = runCommand([crux, command, "--overwrite", "T",
+        "--output-dir", outputDir, lastXcorr])
+      record(command, "", 1, wall, usage, [lastXcorr], outputDir, numSpectra)
+
+  out.close()
+  shutil.rmtree(index, ignore_errors=True)
+
+if __name__ == "__main__":
+  main()
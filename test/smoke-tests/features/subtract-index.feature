@@ -0,0 +1,22 @@
+Feature: tide-index / subtract-index
+  subtract-index should create an index of the peptides in one index that are
+    not in another, along with the decoys made from them
+
+Scenario Outline: User runs tide-index / subtract-index
+  Given the path to Crux is ../../src/crux
+  And I want to run a test named <test_name>
+  And I pass the arguments --overwrite T --peptide-list T --output-dir <index1> <index1_args> small-yeast.fasta <index1>
+  When I run tide-index as an intermediate step
+  Then the return value should be 0
+  And I pass the arguments --overwrite T <index2_args> small-yeast.fasta <index2>
+  When I run tide-index as an intermediate step
+  Then the return value should be 0
+  And I pass the arguments --overwrite T --peptide-list T <index1> <index2> <output_index>
+  When I run subtract-index
+  Then the return value should be 0
+  And crux-output/<actual_targets> should contain the same lines as good_results/<expected_targets>
+  And crux-output/<actual_decoys> should contain the same lines as good_results/<expected_decoys>
+
+Examples:
+  |test_name      |index1_args               |index1          |index2_args   |index2          |output_index     |actual_targets                    |expected_targets          |actual_decoys                    |expected_decoys          |
+  |subtract-minlen|--num-decoys-per-target 5 |subtract_index_1|--min-length 7|subtract_index_2|subtract_index_out|subtract-index.peptides.target.txt|subtract-minlen.target.txt|subtract-index.peptides.decoy.txt|subtract-minlen.decoy.txt|
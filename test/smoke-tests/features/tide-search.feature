@@ -33,6 +33,7 @@ Examples:
   |tide-misscleave|--missed-cleavages 2                                         |--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-misscleave.txt|
   |tide-reverse   |--decoy-format peptide-reverse                               |--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-reverse.txt   |
   |tide-multidecoy|--num-decoys-per-target 5                                    |--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.decoy.txt |tide-5decoys.txt   |
+  |tide-compact   |--compact-index T                                            |--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
 
   # Tests that vary tide-search options
   |tide-masswin   |                                                             |--precursor-window 5 --precursor-window-type mass --mz-bin-width 1.0005079     |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-masswin.txt   |
@@ -50,6 +51,9 @@ Examples:
   |tide-exact-pval|                                                             |--precursor-window 3 --precursor-window-type mass --exact-p-value T --mz-bin-width 1.0005079                                      |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-exact-pval.txt|
   |tide-1thread   |                                                             |--precursor-window 3 --precursor-window-type mass --num-threads 1 --mz-bin-width 1.0005079                                        |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
   |tide-7thread   |                                                             |--precursor-window 3 --precursor-window-type mass --num-threads 7 --mz-bin-width 1.0005079                                        |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
+  |tide-2shards   |                                                             |--precursor-window 3 --precursor-window-type mass --num-shards 2 --mz-bin-width 1.0005079                                         |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
+  |tide-batch8-masswin|                                                         |--precursor-window 5 --precursor-window-type mass --spectrum-batch-size 8 --mz-bin-width 1.0005079                               |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-masswin.txt   |
+  |tide-batch8-mzwin|                                                           |--precursor-window 5 --precursor-window-type mz   --spectrum-batch-size 8 --mz-bin-width 1.0005079                               |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-mzwin.txt     |
   |tide-exact-pval-1thread|                                                     |--precursor-window 3 --precursor-window-type mass --exact-p-value T --num-threads 1 --mz-bin-width 1.0005079                      |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-exact-pval.txt|
   |tide-exact-pval-7thread|                                                     |--precursor-window 3 --precursor-window-type mass --exact-p-value T --num-threads 7 --mz-bin-width 1.0005079                      |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-exact-pval.txt|
   |tide-concat    |                                                             |--precursor-window 3 --precursor-window-type mass --concat T --mz-bin-width 1.0005079                                             |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.txt       |tide-concat.txt    |
@@ -61,3 +65,23 @@ Examples:
   |tide-resEv-pval-7thread|                                                     |--precursor-window 3 --precursor-window-type mass --score-function residue-evidence --exact-p-value T --num-threads 7 --use-neutral-loss-peaks F --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-resEv.txt   |
   |tide-deiso     |                                                             |--precursor-window 3 --precursor-window-type mass --deisotope 10 --mz-bin-width 1.0005079                                         |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-deiso.txt     |
   |tide-deiso-pval|                                                             |--precursor-window 3 --precursor-window-type mass --deisotope 10 --exact-p-value t --mz-bin-width 1.0005079                       |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-deiso-pval.txt|
+
+Scenario Outline: User runs tide-search on spectra stored by an earlier search
+  Given the path to Crux is ../../src/crux
+  And I want to run a test named <test_name>
+  And I pass the arguments --overwrite T --seed 7 small-yeast.fasta tide_test_index
+  When I run tide-index as an intermediate step
+  Then the return value should be 0
+  And I pass the arguments --overwrite T --file-column F --store-spectra <stored> <search_args> demo.ms2 tide_test_index
+  When I run tide-search as an intermediate step
+  Then the return value should be 0
+  And I pass the arguments --overwrite T --file-column F --num-threads <threads> <search_args> <stored> tide_test_index
+  When I run tide-search
+  Then the return value should be 0
+  And crux-output/tide-search.target.txt should contain the same lines as good_results/tide-default.txt
+
+Examples:
+  |test_name          |stored              |threads|search_args                                                               |
+  |tide-stored-1thread|demo.spectrumrecords|1      |--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079|
+  |tide-stored-4thread|demo.spectrumrecords|4      |--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079|
+  |tide-stored-64thread|demo.spectrumrecords|64    |--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079|